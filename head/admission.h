@@ -0,0 +1,58 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <cstddef>
+#include "netio.h"
+
+// Admission control: turning work away, quickly and explicitly, once the
+// server has more than it can get through, so that overload shows up as
+// SERVER_BUSY_STATUS responses instead of ever longer queues and timeouts.
+//
+// There are three limits. Connections past a cap are answered busy and closed
+// as soon as they're accepted. A request that's already waited longer than it
+// may to be run is answered busy instead of being run. And every queue of
+// work waiting to be run is bounded, with a bound for each class of request:
+// a request that would go over it is answered busy right away.
+
+// The defaults for AdmissionLimits.
+const size_t ADMISSION_DEFAULT_QUEUE_CHEAP = 4096;
+const size_t ADMISSION_DEFAULT_QUEUE_EXPENSIVE = 64;
+const int ADMISSION_DEFAULT_MAX_WAIT_MS = 1000;
+
+struct AdmissionLimits {
+  // The most connections open at once, or 0 for no limit.
+  size_t maxConnections = 0;
+  // The most requests of each class one work queue holds.
+  size_t maxQueued[REQUEST_CLASS_COUNT] = {ADMISSION_DEFAULT_QUEUE_CHEAP,
+                                           ADMISSION_DEFAULT_QUEUE_EXPENSIVE};
+  // How long, in milliseconds, a request may wait to be run, or 0 for no
+  // limit.
+  int maxWaitMs = ADMISSION_DEFAULT_MAX_WAIT_MS;
+};
+
+// Set the limits. Call it before serving anything.
+void setAdmissionLimits(const AdmissionLimits &limits);
+
+const AdmissionLimits &admissionLimits();
+
+// Count a connection just accepted on `fd`, or, if there are already as many
+// as there may be, answer it busy and close it. Returns whether it was let in.
+bool admitConnection(int fd);
+
+// Uncount an admitted connection once it's closed.
+void releaseConnection();
+
+// Whether a request received at `received` has waited too long to be run.
+bool waitedTooLong(Clock::time_point received);
+
+// Whether a queue already holding `queued` requests has room for one more of
+// class `cls`.
+bool queueHasRoom(RequestClass cls, size_t queued);
+
+// Answer a request busy on `conn`, and count it.
+void answerBusy(Connection &conn);
+
+// Count a request answered busy somewhere else.
+void countBusy();
+
+#endif
@@ -0,0 +1,34 @@
+// Batch mode for the command-line clients: operations are read one per line,
+// sent down one connection with up to BATCH_WINDOW of them in flight at once
+// (using version 2 framing, see protocol.h), and their results written one
+// per line, in the order the operations came in, as soon as each one and all
+// those before it are done. So a bulk load goes at the server's speed, rather
+// than at the speed processes can be started.
+
+#include <stddef.h>
+
+// The most operations in flight at once.
+#define BATCH_WINDOW 128
+
+// The longest line of input.
+#define BATCH_MAX_LINE 4096
+
+// Encode the operation on `line`, which has had its newline taken off, into
+// `out`, which has room for `capacity` bytes. Returns the request's length,
+// or 0 if the line doesn't make sense, with `error` pointed at why.
+typedef size_t (*BatchEncoder)(const char *line, int SecretKey, char *out,
+        size_t capacity, const char **error, void *context);
+
+// Print the result of the operation on line `line` of the input: its status,
+// and the `length` bytes of data at `data` it came back with.
+typedef void (*BatchPrinter)(int line, int status, const char *data,
+        int length);
+
+// Read operations from `inputFd` until it runs out, encoding each with
+// `encode`, send them to the server at MachineName:port, and print each one's
+// result with `print`. A line that doesn't make sense is reported on stderr,
+// and printed as failed. Returns how many operations failed, or -1, with the
+// reason on stderr, if the server couldn't be reached, the connection was
+// lost, or the input couldn't be read.
+int runBatch(char *MachineName, int port, int SecretKey, int inputFd,
+        BatchEncoder encode, void *context, BatchPrinter print);
@@ -0,0 +1,73 @@
+// Cluster mode: one keyspace spread over several smalld nodes, each variable
+// living on exactly one of them.
+//
+// Variables are placed with a consistent-hash ring. Each node puts
+// CLUSTER_POINTS_PER_WEIGHT points on the ring for each unit of its weight,
+// at hashes of its address and the point's number, and a variable lives on
+// the node owning the first point at or after the hash of its name. So a
+// node's share of the keyspace goes with its weight, and adding or removing a
+// node only moves the variables on the arcs it gains or loses, about 1/n of
+// them, rather than nearly all of them as a hash modulo n would.
+//
+// Single variables are read and written with the ordinary calls on their
+// node, so they get the near cache (see nearcache.h) if it's on. Calls on
+// many variables are scattered: each node gets its share of the requests at
+// once, pipelined on a version 2 connection (see protocol.h), and then the
+// responses are gathered from each in turn. Every node works on its share at
+// the same time, so a call takes about as long as its slowest node's share,
+// not the sum of them all. The connections only last for the call: a node on
+// the blocking backend serves nothing else while one is open.
+
+// How many points on the ring a node gets for each unit of its weight.
+#define CLUSTER_POINTS_PER_WEIGHT 160
+
+// The most requests a scatter has in flight to one node at once. Responses
+// are gathered before any more are sent, so neither side's socket buffers
+// ever fill up with the other waiting on them.
+#define CLUSTER_WINDOW 64
+
+// The most nodes a cluster can have.
+#define CLUSTER_MAX_NODES 64
+
+typedef struct SmallCluster SmallCluster;
+
+// Make a cluster of the `count` nodes in `nodes`, each "host:port" or
+// "host:port=weight", where the weight is a positive integer, 1 if it's left
+// off. The port is after the last colon, so the host can be a Unix socket
+// address (see resolver.h). Returns NULL if a node doesn't make sense.
+SmallCluster *smallClusterOpen(char **nodes, int count);
+
+// Close the cluster's connections and free it.
+void smallClusterClose(SmallCluster *cluster);
+
+// The index, in the `nodes` the cluster was made with, of the node
+// `variableName` lives on.
+int smallClusterNode(const SmallCluster *cluster, const char *variableName);
+
+// The host and port of node `node`.
+char *smallClusterHost(const SmallCluster *cluster, int node);
+int smallClusterPort(const SmallCluster *cluster, int node);
+
+// Like smallSet() and smallGet() (see sserver.h), on the node the variable
+// lives on. They can be called from any thread.
+int smallClusterSet(SmallCluster *cluster, int SecretKey, char *variableName,
+        char *value, short dataLength);
+int smallClusterGet(SmallCluster *cluster, int SecretKey, char *variableName,
+        char *value, int *resultLength);
+
+// Set each of the `count` variables in `variableNames` to the
+// `dataLengths[i]` bytes at `values[i]`, scattered across the nodes. Each
+// one's status, as smallSet() would return it, is written to `statuses`.
+// Returns 0 if they were all set, or -1 if any weren't. Calls on many
+// variables take turns on the cluster's connections.
+int smallClusterSetMany(SmallCluster *cluster, int SecretKey,
+        char **variableNames, char **values, short *dataLengths, int count,
+        int *statuses);
+
+// Get each of the `count` variables in `variableNames`, scattered across the
+// nodes, writing each one's value to `values[i]`, which has room for
+// MAX_VALUE_LENGTH bytes, its length to `resultLengths[i]`, and its status to
+// `statuses[i]`. Returns 0 if they were all read, or -1 if any weren't.
+int smallClusterGetMany(SmallCluster *cluster, int SecretKey,
+        char **variableNames, int count, char **values, int *resultLengths,
+        int *statuses);
@@ -1,8 +1,14 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stddef.h>
+
 // The maximum length of a value stored in a variable.
 #define MAX_VALUE_LENGTH 100
 
-// The maximum length of one of the client's requests.
-#define MAX_REQUEST_SIZE 150
+// The maximum length of one of the client's requests. A cas request, with two
+// values, is the longest.
+#define MAX_REQUEST_SIZE 256
 
 // The maximum length of the server's response to a command.
 #define MAX_RESPONSE_SIZE 150
@@ -16,6 +22,18 @@
 // The maximum length of the data in the server's response to a request.
 #define MAX_SERVER_DATA_LENGTH 100
 
+// The maximum length of the data in the server's response to a stats request.
+// Stats responses are much bigger than any other kind, but still fit in a
+// length specifier.
+#define MAX_STATS_LENGTH 16384
+
+// The most names a scan request gets back at once.
+#define MAX_SCAN_COUNT 64
+
+// The maximum length of the data in the server's response to a scan request:
+// the cursor and the names, each null-terminated.
+#define MAX_SCAN_LENGTH ((MAX_SCAN_COUNT + 1) * (MAX_VARNAME_LENGTH + 1))
+
 // Maximum length of a run request, including the terminating null.
 #define MAX_RUNREQ_LENGTH 8
 
@@ -32,14 +50,49 @@
 // 1 for the return code and 3 of padding).
 #define SERVER_PREAMBLE_SIZE 4
 
+// Version 2 framing: a request ID and a length on every frame, so responses
+// can come back in any order. The version byte sits where version 1 frames
+// have padding, which version 1 clients always send as zeros.
+#define FRAME_VERSION_2 2
+
+// Size in bytes of a version 2 request's header: the preamble's key and type,
+// the version, a byte of flags, the request ID and the body's length.
+#define FRAME_V2_HEADER_SIZE 16
+
+// Size in bytes of a version 2 response's header: the status, the version, 2
+// bytes of padding, the request ID and the data's length.
+#define FRAME_V2_RESPONSE_HEADER_SIZE 12
+
 // The different types of messages we can send and receive.
 typedef enum {
   SSERVER_MSG_SET = 0,
   SSERVER_MSG_GET = 1,
   SSERVER_MSG_DIGEST = 2,
-  SSERVER_MSG_RUN = 3
+  SSERVER_MSG_RUN = 3,
+  SSERVER_MSG_STATS = 4,
+  SSERVER_MSG_SET_TTL = 5,
+  SSERVER_MSG_INCR = 6,
+  SSERVER_MSG_CAS = 7,
+  SSERVER_MSG_SCAN = 8,
+  SSERVER_MSG_WATCH = 9
 } MessageType;
 
+// The number of distinct message types.
+#define MESSAGE_TYPE_COUNT 10
+
+// The status of a frame the server pushes to a watching connection when a
+// watched variable changes, rather than sending in response to a request.
+// Responses' statuses are always 0 or negative.
+#define SERVER_PUSH_STATUS 1
+
+// The status of a response from a server too busy to take the request, or a
+// connection, on right now. Nothing was done, so it's safe to try again later.
+#define SERVER_BUSY_STATUS -2
+
+// Human-readable names for each message type, indexed by MessageType. Shared
+// by the server's request log and smallBench's report.
+extern const char *requestTypeNames[MESSAGE_TYPE_COUNT];
+
 typedef struct {
   unsigned int secretKey;
   unsigned short msgType;
@@ -53,11 +106,52 @@ typedef struct {
   char value[MAX_VALUE_LENGTH];
 } ClientSet;
 
+// A set whose variable expires `ttlMs` milliseconds later.
+typedef struct {
+  ClientPreamble pre;
+  char varName[MAX_VARNAME_LENGTH + 1];
+  unsigned int ttlMs;
+  unsigned short length;
+  char value[MAX_VALUE_LENGTH];
+} ClientSetTtl;
+
 typedef struct {
   ClientPreamble pre;
   char varName[MAX_VARNAME_LENGTH + 1];
 } ClientGet;
 
+// Add `delta`, which may be negative, to a variable holding a decimal integer.
+typedef struct {
+  ClientPreamble pre;
+  char varName[MAX_VARNAME_LENGTH + 1];
+  long long delta;
+} ClientIncr;
+
+// Set a variable to `value`, but only if it currently holds `expected`.
+typedef struct {
+  ClientPreamble pre;
+  char varName[MAX_VARNAME_LENGTH + 1];
+  unsigned short expectedLength;
+  char expected[MAX_VALUE_LENGTH];
+  unsigned short length;
+  char value[MAX_VALUE_LENGTH];
+} ClientCas;
+
+// List up to `count` variable names starting with `prefix`, in order, after
+// `cursor` (from the start if it's empty).
+typedef struct {
+  ClientPreamble pre;
+  char prefix[MAX_VARNAME_LENGTH + 1];
+  char cursor[MAX_VARNAME_LENGTH + 1];
+  unsigned short count;
+} ClientScan;
+
+// Have the server push every change to a variable down this connection.
+typedef struct {
+  ClientPreamble pre;
+  char varName[MAX_VARNAME_LENGTH + 1];
+} ClientWatch;
+
 typedef struct {
   ClientPreamble pre;
   unsigned short length;
@@ -78,3 +172,15 @@ typedef struct {
 
 int parseIntWithError(char *toParse, const char *errorMsg);
 int isValidRunRequest(char *runRequest);
+
+// What the clients print when a request fails with `status`: "busy" if the
+// server turned it away, and "failed" otherwise.
+const char *failureMessage(int status);
+
+// Write all `length` bytes at `buf` to the socket `fd`. Unlike rio_writen(),
+// a server that's closed the connection makes it fail rather than raise
+// SIGPIPE, which would kill the client. Returns 0, or -1 if they couldn't all
+// be written.
+int sendAll(int fd, const void *buf, size_t length);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef COMPUTE_H
+#define COMPUTE_H
+
+#include <cstddef>
+#include <vector>
+#include "connection.h"
+#include "netio.h"
+#include "protocol.h"
+
+// The compute pool: where expensive requests (see RequestClass) are run, so
+// that a burst of digests can't hold up the gets and sets behind it. Cheap
+// requests are still run inline on the I/O thread they arrive on.
+//
+// The pool is a fixed set of worker threads, which is also its concurrency
+// limit: no more expensive requests run at once than there are workers. Each
+// worker has a queue of its own, and each I/O thread hands its requests to
+// one worker, so I/O threads rarely contend with each other for a queue. A
+// worker takes the oldest request off its own queue, and once that's empty
+// steals the newest off another's, so no worker idles while there's work
+// anywhere. Every queue together holds at most the expensive class's
+// AdmissionLimits::maxQueued requests; past that they're answered busy.
+//
+// The workers can also be given a niceness, which the kernel's scheduler
+// weights their share of the CPU by when the I/O threads want it too: at 5,
+// say, a worker gets about a third of what an I/O thread does.
+//
+// The request is copied, since the buffer it was decoded from moves on, and
+// its response is deferred. When it's done, the response is posted to the
+// I/O thread's mailbox, an eventfd and a queue (see mailbox.h) like the one
+// watches use, and the thread completes it there. Threads without a mailbox,
+// like the blocking backend's, wait for the response instead.
+
+// The defaults for ComputeLimits.
+const int COMPUTE_DEFAULT_NICENESS = 0;
+
+struct ComputeLimits {
+  // How many workers, or 0 to run expensive requests inline too. Negative
+  // means one for every CPU this process may run on.
+  int threads = -1;
+  // The workers' niceness, from -20 to 19. Going below 0 takes privileges.
+  int niceness = COMPUTE_DEFAULT_NICENESS;
+};
+
+// Start the workers, which run requests with `runner`. Call it before serving
+// anything.
+void startComputePool(const ComputeLimits &limits, RequestRunner runner);
+
+// How many workers there are, and how many requests are waiting for one.
+int computeThreads();
+size_t computeQueued();
+
+// Give the calling thread a mailbox, if it hasn't one yet, and return its
+// eventfd. The thread's event loop should call deliverComputed() whenever
+// it's readable.
+int openComputeMailbox();
+
+// Complete the responses waiting in the calling thread's mailbox, adding each
+// connection given output to `touched`, once.
+void deliverComputed(std::vector<Connection *> &touched);
+
+// Run `request`, which arrived on `conn` at `received`, on the pool, and
+// answer it on `conn`. Returns false, having done nothing, if there's no pool.
+bool computeRequest(Connection &conn, const Request &request,
+                    Clock::time_point received);
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "protocol.h"
+
+// The size of a connection's receive buffer. It holds several maximal
+// requests, so a client that pipelines them can have them all parsed after a
+// single read.
+const size_t RECEIVE_BUFFER_SIZE = 4096;
+
+// One client connection's buffered input and output, independent of how the
+// bytes actually get read and written.
+//
+// Received bytes go straight into the receive buffer, and complete requests
+// are decoded in place: the Request's name and value point into the buffer, so
+// nothing is copied until the store copies the value it keeps. A partial
+// request at the end of the buffer stays there until the rest arrives.
+//
+// A response can also be deferred, when the request has to be answered
+// somewhere else: it gets a place in line, and responses queued after it wait
+// behind it until it's completed, so they still go out in request order.
+// Responses to version 2 requests (see protocol.h) carry their request's ID,
+// so they never wait: each goes out as soon as it's ready.
+class Connection {
+public:
+  explicit Connection(int fd);
+  ~Connection();
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  // Find a connection by its id. Only connections created by the calling
+  // thread are found, and only until they're destroyed.
+  static Connection *find(uint64_t id);
+
+  // Where the next bytes received should be written, and how many fit there.
+  // Requests already handled are discarded first, which invalidates any
+  // Request decoded from the buffer.
+  char *receiveSpace(size_t &space);
+
+  // Note that `length` bytes were written at receiveSpace().
+  void received(size_t length);
+
+  // Decode the next complete request in the buffer. Returns 1 if there was
+  // one, 0 if more bytes are needed, or -1 if the input is malformed.
+  int nextRequest(Request &request);
+
+  // Whether bytes of a request that hasn't arrived completely are waiting.
+  bool hasPartialRequest() const { return start != end; }
+
+  // How many more bytes the waiting partial request needs, at least: either
+  // the rest of it, or enough to tell how long it is. Returns 0 if nothing's
+  // waiting, or -1 if what is waiting is malformed.
+  int bytesWanted() const;
+
+  // Note that `request` is the one the responses queued or deferred from now
+  // on answer, so they're framed the way it was. Call it before handling each
+  // request.
+  void startRequest(const Request &request);
+
+  // Encode a response onto the end of the output buffer, or behind the
+  // deferred responses still outstanding.
+  void queueResponse(char status, bool withData, const char *data,
+                     size_t dataLength);
+
+  // Hold a place in line for a response that will come later. Returns the
+  // ticket to complete it with.
+  uint64_t deferResponse();
+
+  // Fill in a deferred response, releasing any responses waiting on it to
+  // the output buffer.
+  void completeResponse(uint64_t ticket, char status, bool withData,
+                        const char *data, size_t dataLength);
+
+  // Whether any deferred responses haven't been completed yet.
+  bool awaitingResponses() const {
+    return !held.empty() || v2Outstanding > 0;
+  }
+
+  // Add the push `push`, encoded by encodePush(), to the output buffer,
+  // reframed as version 2 if the client's sent a version 2 request.
+  void queuePush(const std::string &push);
+
+  // Responses waiting to be sent. Whoever sends them clears it.
+  std::vector<char> output;
+
+  const int fd;
+
+  // Unique among the connections the creating thread has made.
+  const uint64_t id;
+
+  // Whatever the backend serving the connection needs to get from it back to
+  // its own state for it.
+  void *owner = nullptr;
+
+  // The deadline the connection's under (see deadlines.h): its DeadlineKind,
+  // the tick it's due at, and the tick of the earliest timer set for it, or 0
+  // if there isn't one.
+  int deadlineKind = 0;
+  uint64_t deadlineTick = 0;
+  uint64_t timerTick = 0;
+
+private:
+  // A response queued behind a deferred one, or the deferred one itself.
+  struct HeldResponse {
+    bool ready = false;
+    std::vector<char> bytes;
+  };
+
+  // Encode a response onto the end of `out`, framed as `version`, and for
+  // version 2, tagged with `requestId`.
+  static void encode(std::vector<char> &out, uint8_t version,
+                     uint32_t requestId, char status, bool withData,
+                     const char *data, size_t dataLength);
+
+  std::vector<char> input;
+  // The unparsed bytes are input[start, end).
+  size_t start = 0;
+  size_t end = 0;
+
+  // Held responses, in order; the first one has ticket heldBase.
+  std::deque<HeldResponse> held;
+  uint64_t heldBase = 0;
+
+  // How to frame the response to the request being handled.
+  uint8_t replyVersion = 1;
+  uint32_t replyId = 0;
+  // Whether the client's ever sent a version 2 request.
+  bool speaksV2 = false;
+  // Deferred version 2 responses not yet completed.
+  size_t v2Outstanding = 0;
+};
+
+#endif
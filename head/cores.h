@@ -0,0 +1,56 @@
+#ifndef CORES_H
+#define CORES_H
+
+#include <cstddef>
+#include "netio.h"
+#include "protocol.h"
+#include "store.h"
+
+// The shared-nothing server mode: one thread per core, pinned to it, with its
+// own SO_REUSEPORT listener, its own epoll loop and its own unlocked slice of
+// the variables. Every variable belongs to exactly one core, chosen by a hash
+// of its name. Cores share nothing but queues: a request for a variable
+// another core owns is copied onto a single-producer, single-consumer queue to
+// that core, which runs it and queues the response back, and the connection
+// it came in on answers it in order with a deferred response. A scan asks
+// every core for its part, and merges them.
+
+// How many messages each queue from one core to another holds. Messages that
+// don't fit wait on the sending core until there's room.
+const size_t CORE_QUEUE_SIZE = 256;
+
+// Record a request as handled, when its response was put together some other
+// way than by running it.
+typedef void (*RequestRecorder)(const Request &request,
+                                Clock::time_point received,
+                                const Response &response);
+
+// Serve `port` forever with `cores` pinned threads, or one for every CPU this
+// process may run on if `cores` is 0. If `localfd` isn't -1, it's a listener
+// every core accepts connections from as well. The cores' stores split
+// `memoryLimit` evenly between them, if it isn't 0. Requests go to `handler`
+// on the core they arrive at; those it forwards are run with `runner` on their
+// owner. Scans, which every core has a part in, are recorded with `recorder`
+// once their parts are put together. Returns false if the listeners can't be
+// opened, with errno set.
+bool serveCores(int port, int localfd, int cores, size_t memoryLimit,
+                RequestHandler handler, RequestRunner runner,
+                RequestRecorder recorder);
+
+// The number of cores serving, or 0 outside the shared-nothing mode.
+int coreCount();
+
+// The variables core `core` owns.
+VarStore &coreStore(int core);
+
+// The calling thread's core, or -1 if it isn't one.
+int currentCore();
+
+// For handlers: if `request` is for a variable another core owns, send it
+// there, defer its response on `conn` and return true. A scan is sent to every
+// core, and answered once they've all replied. Otherwise return false; the
+// request is the caller's to run.
+bool forwardRequest(Connection &conn, const Request &request,
+                    Clock::time_point received);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef DEADLINES_H
+#define DEADLINES_H
+
+#include <cstddef>
+#include <cstdint>
+#include "netio.h"
+#include "timerwheel.h"
+
+// Deadlines for connections, so a client that stalls gets closed instead of
+// holding on to its connection forever.
+//
+// A connection is under at most one deadline at a time, chosen by what it's
+// doing, and it starts over whenever the connection gets anywhere:
+//   read:  part of a request has arrived; more has to arrive in time.
+//   write: responses are backed up; the client has to take some in time.
+//   idle:  nothing's going on; the client has to send something in time.
+// A read deadline is much shorter than an idle one, so a client that sends a
+// preamble and stalls is soon closed.
+// A connection waiting on deferred responses, or watching variables, is
+// waiting on the server, and is under none.
+//
+// The epoll and io_uring loops keep their connections' deadlines in a
+// TimerWheel, so each one costs O(1) however many connections there are, and
+// a stalled connection costs nothing until it's closed. Timers can't be
+// cancelled, so each connection remembers its own deadline, and a timer that
+// fires for a deadline that's since moved later is set again for the new one.
+// So the usual request, which just moves the idle deadline along, doesn't
+// touch the wheel at all.
+
+// The wheel's resolution, in milliseconds.
+const int DEADLINE_TICK_MS = 100;
+
+// The defaults for DeadlineLimits.
+const int DEADLINE_DEFAULT_IO_MS = 10000;
+const int DEADLINE_DEFAULT_IDLE_MS = 300000;
+
+// The most connections one expire() call closes, so a mass of stalled clients
+// can't stall the loop in turn.
+const size_t DEADLINE_EXPIRY_BUDGET = 256;
+
+struct DeadlineLimits {
+  // How long, in milliseconds, a read or write deadline is, or 0 for none.
+  int ioMs = DEADLINE_DEFAULT_IO_MS;
+  // How long an idle deadline is, or 0 for none.
+  int idleMs = DEADLINE_DEFAULT_IDLE_MS;
+};
+
+// Set the limits. Call it before serving anything.
+void setDeadlineLimits(const DeadlineLimits &limits);
+
+const DeadlineLimits &deadlineLimits();
+
+enum DeadlineKind {
+  DEADLINE_NONE,
+  DEADLINE_READ,
+  DEADLINE_WRITE,
+  DEADLINE_IDLE
+};
+
+const char *deadlineKindName(DeadlineKind kind);
+
+// The deadline `conn` should be under. `backedUp` says whether it has output
+// it's waiting to send.
+DeadlineKind deadlineFor(const Connection &conn, bool backedUp);
+
+// How long a deadline of kind `kind` is, in milliseconds, or 0 if there's no
+// limit.
+int deadlineLength(DeadlineKind kind);
+
+// One thread's connections' deadlines.
+class DeadlineTimers {
+public:
+  DeadlineTimers();
+
+  // Put `conn` under the deadline for what it's doing now, at `now`.
+  // `progressed` says whether it's read or written anything since it was last
+  // updated, which starts its deadline over.
+  void update(Connection &conn, bool backedUp, bool progressed,
+              Clock::time_point now);
+
+  // Call `expire(conn, kind)` for each of the calling thread's connections
+  // whose deadline has passed at `now`. It should close them.
+  template <typename Expire> void expire(Clock::time_point now, Expire expire);
+
+  // How long, in milliseconds, until expire() should next be called, or -1 if
+  // there are no deadlines.
+  int timeout() const;
+
+private:
+  TimerWheel<uint64_t> wheel;
+};
+
+uint64_t deadlineTick(Clock::time_point at);
+
+template <typename Expire>
+void DeadlineTimers::expire(Clock::time_point now, Expire expire) {
+  wheel.advance(deadlineTick(now), DEADLINE_EXPIRY_BUDGET,
+                [&](uint64_t when, uint64_t id) {
+                  Connection *conn = Connection::find(id);
+                  if (conn == nullptr || conn->timerTick != when)
+                    return;
+                  conn->timerTick = 0;
+                  if (conn->deadlineKind == DEADLINE_NONE)
+                    return;
+                  if (conn->deadlineTick > when) {
+                    conn->timerTick = conn->deadlineTick;
+                    wheel.schedule(conn->timerTick, id);
+                    return;
+                  }
+                  expire(*conn, (DeadlineKind)conn->deadlineKind);
+                });
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <cstddef>
+#include <string>
+
+// The size of a SHA-256 hash, in bytes.
+const size_t SHA256_SIZE = 32;
+
+// The ways the server can compute a digest. Both give the same answer: the
+// line `echo <value> | sha256sum` would print, minus the newline.
+enum DigestBackend {
+  // Hash the value in-process.
+  DIGEST_BUILTIN,
+  // Pipe the value through /bin/sha256sum, as the server originally did.
+  DIGEST_SHA256SUM
+};
+
+// Look up a backend by the name used on the command line ("builtin" or
+// "sha256sum"). Returns whether the name was recognized.
+bool parseDigestBackend(const std::string &name, DigestBackend &backend);
+
+// Get the command-line name of a backend.
+const char *digestBackendName(DigestBackend backend);
+
+// The number of recent digests remembered. The cache is direct-mapped, so
+// this is also the number of independently locked slots.
+const size_t DIGEST_CACHE_SLOTS = 256;
+
+// Compute the digest of `value`, which is treated as a string: it ends at the
+// first null byte or after `valueLength` bytes, whichever comes first. Recent
+// results are cached; if `cached` is non-null, it's set to whether this one
+// came from the cache.
+std::string digest(DigestBackend backend, const char *value,
+                   size_t valueLength, bool *cached = nullptr);
+
+// Compute a digest like digest() does, but always with the backend.
+std::string computeDigest(DigestBackend backend, const char *value,
+                          size_t valueLength);
+
+// Compute the raw SHA-256 hash of `length` bytes of `data`.
+void sha256(const void *data, size_t length, unsigned char out[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// A latency histogram in the style of HdrHistogram: values are grouped into
+// power-of-two magnitudes, and each magnitude is split into
+// HISTOGRAM_SUB_BUCKETS / 2 linear sub-buckets, so any recorded value is
+// reported to within 1/64th of its true value. Recording is a handful of
+// integer operations and never allocates.
+//
+// Values are plain integers; the callers use nanoseconds.
+
+// Linear sub-buckets per magnitude. Must be a power of two.
+#define HISTOGRAM_SUB_BUCKETS 128
+
+// log2(HISTOGRAM_SUB_BUCKETS).
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+
+// The number of magnitudes tracked above the first HISTOGRAM_SUB_BUCKETS
+// values. Values of 2^(HISTOGRAM_MAGNITUDES + 7) and up (about 73 minutes, in
+// nanoseconds) are clamped into the top bucket.
+#define HISTOGRAM_MAGNITUDES 35
+
+// Total number of buckets.
+#define HISTOGRAM_BUCKETS                                                      \
+  ((HISTOGRAM_MAGNITUDES + 2) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+} Histogram;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Get the index of the bucket `value` is counted in.
+int histogramBucket(uint64_t value);
+
+// Get the largest value counted in bucket `index`.
+uint64_t histogramBucketValue(int index);
+
+// Reset a histogram to empty.
+void histogramInit(Histogram *h);
+
+// Record a single value.
+void histogramRecord(Histogram *h, uint64_t value);
+
+// Add every value recorded in `src` into `dst`.
+void histogramMerge(Histogram *dst, const Histogram *src);
+
+// Get the value at `percentile` (0-100). Returns 0 for an empty histogram.
+uint64_t histogramPercentile(const Histogram *h, double percentile);
+
+// Get the mean of the recorded values. Returns 0 for an empty histogram.
+double histogramMean(const Histogram *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <cstddef>
+#include <string>
+extern "C" {
+#include "common.h"
+}
+
+// The server's logger.
+//
+// Logging a line never does I/O on the calling thread. Each thread writes
+// fixed-size binary records into its own lock-free ring buffer, and a
+// background thread drains every ring, formats the records, and writes them
+// to stderr in batches. A record that doesn't fit (the ring is full, or the
+// thread is over its rate limit) is dropped and counted, and the drain thread
+// reports how many were lost.
+
+enum LogLevel { LOG_DEBUG = 0, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// The number of records each thread's ring buffer holds.
+const size_t LOG_RING_SIZE = 1024;
+
+// How often the background thread drains the rings, in milliseconds.
+const int LOG_DRAIN_INTERVAL_MS = 10;
+
+// The default limit on records per second per thread. Errors are never
+// rate-limited.
+const unsigned int LOG_DEFAULT_RATE = 10000;
+
+// Look up a level by name ("debug", "info", "warn" or "error"). Returns
+// whether the name was recognized.
+bool parseLogLevel(const std::string &name, LogLevel &level);
+
+// Start the background thread. Records logged before this are kept in the
+// rings until it starts. `maxPerSecond` limits each thread's record rate.
+void logStart(LogLevel level, unsigned int maxPerSecond = LOG_DEFAULT_RATE);
+
+// Change the level while running.
+void logSetLevel(LogLevel level);
+
+// Whether records at `level` are currently being kept.
+bool logEnabled(LogLevel level);
+
+// Make SIGUSR1 lower the level (more output) and SIGUSR2 raise it (less), so
+// the level can be changed on a running server.
+void logInstallSignalHandlers();
+
+// Log a message. The message is formatted on the calling thread, but only if
+// `level` is enabled, and is truncated to fit in one record.
+void logMessage(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Log the audit record for one finished request, at LOG_INFO. `detail` is
+// copied as-is (truncated to fit) and only formatted by the background thread.
+void logAudit(unsigned int secretKey, MessageType type, const char *detail,
+              size_t detailLength, bool success);
+
+// Write out everything logged so far, on the calling thread.
+void logFlush();
+
+#endif
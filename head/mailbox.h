@@ -0,0 +1,60 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+#include "log.h"
+
+// An event loop thread's mailbox: a queue other threads post items to, and an
+// eventfd the loop polls, readable once there's something to take. Watches
+// (see watch.h) and the compute pool (see compute.h) each give a thread one.
+// Mailboxes last as long as the process, like the threads that own them.
+template <typename T> class Mailbox {
+public:
+  // `what` names the mailbox in log messages.
+  explicit Mailbox(const char *what)
+      : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), what(what) {}
+
+  // Queue an item, waking the thread if the mailbox was empty; if it wasn't,
+  // the thread's already been woken and hasn't emptied it yet.
+  void post(T item) {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      wake = items.empty();
+      items.push_back(std::move(item));
+    }
+    if (wake) {
+      uint64_t one = 1;
+      if (write(fd, &one, sizeof(one)) < 0)
+        logMessage(LOG_WARN, "waking a %s mailbox failed: %s", what,
+                   strerror(errno));
+    }
+  }
+
+  // Owning thread only: take everything posted so far.
+  std::vector<T> take() {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      logMessage(LOG_WARN, "reading the %s mailbox failed: %s", what,
+                 strerror(errno));
+    std::vector<T> taken;
+    std::lock_guard<std::mutex> guard(lock);
+    taken.swap(items);
+    return taken;
+  }
+
+  const int fd;
+
+private:
+  const char *what;
+  std::mutex lock;
+  std::vector<T> items;
+};
+
+#endif
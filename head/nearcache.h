@@ -0,0 +1,62 @@
+// The near cache: copies, in the client's own memory, of the variables
+// smallGet() has read, so that rereading a hot one never leaves the process.
+// It's off until smallCacheEnable() (see sserver.h) turns it on.
+//
+// A copy stays right because the server says when it goes stale. The first
+// time a variable's read from a server, the library watches it on a
+// connection it keeps open to that server, one for each server and secret
+// key, and a thread of its own reads the pushes off it; each push drops the
+// copy of the variable it's about. The watch is in place before the variable
+// is read, so no change after the read goes unheard. Each push also bumps a
+// generation count, one of NEAR_CACHE_GENERATIONS picked by name, and a read
+// only fills the cache if that count hasn't moved since before the read went
+// out, so a push that overtakes the response it makes stale still wins. A
+// process's own writes drop its copy as soon as they're answered, so it
+// always reads what it wrote.
+//
+// If the connection's lost, every copy from that server is dropped, and the
+// next read opens another. Servers push changes, not expiries or evictions,
+// so copies of variables that can expire are only as fresh as the maximum age
+// given to smallCacheEnable(). The shared-memory transport can't carry
+// watches, so reads through it are never cached, and nor are reads from a
+// server that refuses watches, like one on the blocking backend.
+
+// How many generation counts each server has.
+#define NEAR_CACHE_GENERATIONS 256
+
+// How many servers the cache can hold copies from at once.
+#define NEAR_CACHE_SERVERS 16
+
+// The most watches one connection can have, for each entry the cache can
+// hold. Past that, the connection's closed and a new one started, so the
+// server isn't left watching every variable the process ever read.
+#define NEAR_CACHE_WATCHES_PER_ENTRY 2
+
+// What a read needs to fill the cache when it's answered.
+typedef struct {
+  int server;
+  unsigned long long connection;
+  unsigned long long generation;
+} NearCacheTicket;
+
+// If the cache has a copy of `name` from the server at machineName:port under
+// `secretKey`, copy it to `value`, if it isn't null, with its length written
+// to `length`, if that isn't null. Returns 1 if it had one, or 0 if the
+// server has to be asked.
+int nearCacheGet(const char *machineName, int port, int secretKey,
+                 const char *name, char *value, int *length);
+
+// Get ready to read `name` from the server, watching it first if it isn't
+// already. Returns 0, filling in `ticket`, if the value read can be cached,
+// or -1 if it can't.
+int nearCacheBeginFill(const char *machineName, int port, int secretKey,
+                       const char *name, NearCacheTicket *ticket);
+
+// Cache the `length` bytes at `value` that the server answered a read of
+// `name` with, unless the variable's changed since `ticket` was filled in.
+void nearCacheFill(const NearCacheTicket *ticket, const char *name,
+                   const char *value, int length);
+
+// Drop any copy of `name` from the server, which the caller just changed.
+void nearCacheInvalidate(const char *machineName, int port, int secretKey,
+                         const char *name);
@@ -0,0 +1,94 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "connection.h"
+
+// The server's networking backends: how connections are accepted, and how
+// bytes get from the sockets into Connections and back out.
+//
+//   blocking: one connection at a time, with blocking reads and writes.
+//   epoll:    every connection at once, from a level-triggered epoll loop.
+//   io_uring: every connection at once, with a multishot accept, multishot
+//             receives into a ring of provided buffers, and sends linked to
+//             the close that follows them. Falls back to epoll if the kernel
+//             can't do all that.
+enum IoBackend { IO_BLOCKING, IO_EPOLL, IO_URING };
+
+using Clock = std::chrono::steady_clock;
+
+// Handle one decoded request, queueing any response on `conn`. `received` is
+// when the read that completed the request returned. Returns false if the
+// connection should be closed once the responses queued so far are sent.
+typedef bool (*RequestHandler)(Connection &conn, const Request &request,
+                               Clock::time_point received);
+
+// Run a request, filling in its response and recording it as handled.
+// `received` is when the request arrived, on whichever thread that was.
+typedef void (*RequestRunner)(const Request &request,
+                              Clock::time_point received, Response &response);
+
+// Look up a backend by name. Returns whether the name was recognized.
+bool parseIoBackend(const std::string &name, IoBackend &backend);
+const char *ioBackendName(IoBackend backend);
+
+// Hand every complete request in the connection's receive buffer to
+// `handler`. Returns 1 if the connection should stay open, 0 if the handler
+// asked for it to be closed, or -1 if the input was malformed.
+int handleBuffered(Connection &conn, RequestHandler handler,
+                   Clock::time_point received);
+
+// Like handleBuffered(), for `length` bytes received into memory the
+// connection doesn't own. Requests are decoded straight from `data` where they
+// lie; only the bytes of a request split across receives are copied into the
+// connection's buffer.
+int handleReceived(Connection &conn, const char *data, size_t length,
+                   RequestHandler handler, Clock::time_point received);
+
+// Open a listening socket on `port` with SO_REUSEPORT set, so that several of
+// them can share the port and the kernel spreads incoming connections across
+// them. Returns -1, with errno set, on failure.
+int openReusePortListener(int port);
+
+// Open a listening Unix domain socket at `path`, for clients on the same
+// host; they skip the TCP stack altogether. A socket left at `path` by a
+// server that's gone is replaced, but one a server is still listening on, or
+// anything that isn't a socket, isn't. Returns -1, with errno set, on failure.
+int openUnixListener(const std::string &path);
+
+// Something besides sockets for the epoll backend to wait on, for requests
+// that are answered with deferred responses.
+struct EpollSource {
+  // Readable when there's work for ready().
+  int fd;
+  // Do that work, adding every connection it completed a response on to
+  // `touched`.
+  void (*ready)(std::vector<Connection *> &touched);
+  // Called after every batch of events. Returns how long, in milliseconds,
+  // the loop may wait for the next batch, or -1 to wait as long as it takes.
+  int (*batchDone)();
+};
+
+// Serve connections on every one of `listenfds` forever. A listener may be
+// shared with other threads serving it too; each connection goes to just one
+// of them. The epoll and io_uring backends also deliver the calling thread's
+// watch events (see watch.h) and computed responses (see compute.h); the
+// blocking backend serves a connection at a time, so it can't take watches,
+// and waits for its computed responses.
+void serveBlocking(const std::vector<int> &listenfds, RequestHandler handler);
+void serveEpoll(const std::vector<int> &listenfds, RequestHandler handler,
+                const EpollSource *source = nullptr);
+
+// Serve connections on `listenfds` forever with io_uring. Returns false,
+// without having accepted anything, if io_uring isn't usable here.
+bool serveUring(const std::vector<int> &listenfds, RequestHandler handler);
+
+// Accept shared-memory sessions (see shm.h) on `listenfd`, a Unix domain
+// socket, forever, serving each on a thread of its own. Those threads have no
+// watch mailbox, so watches over shared memory are refused.
+void serveShm(int listenfd, RequestHandler handler);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+extern "C" {
+#include "common.h"
+}
+
+// Decoding and encoding of the server side of the protocol, kept apart from
+// the socket code so it can be benchmarked (and later reused) on plain
+// buffers. The layouts themselves are described in wire.h.
+//
+// On the wire, after the 8-byte preamble:
+//   set:    15-byte name, 2-byte value length, value
+//   get:    15-byte name
+//   digest: 2-byte data length, data
+//   run:    8-byte request
+//   stats:  nothing
+//   set_ttl: 15-byte name, 4-byte time to live in milliseconds, 2-byte value
+//            length, value
+//   incr:   15-byte name, 8-byte signed amount to add
+//   cas:    15-byte name, 2-byte expected value length, 2-byte length of both
+//           values together, expected value, new value
+//   scan:   15-byte name prefix, 15-byte cursor, 2-byte count
+//   watch:  15-byte name
+// and the response is a status byte, 3 bytes of padding, and for responses
+// that carry data, a 2-byte length followed by the data. Every multi-byte
+// integer is in network byte order.
+//
+// A connection watching a variable is also sent a push each time it changes:
+// status SERVER_PUSH_STATUS, 3 bytes of padding, the 15-byte name, an 8-byte
+// version, a 2-byte value length and the value.
+//
+// A client can instead send version 2 frames, which carry a request ID so the
+// server can answer them in whatever order they finish: a digest queued on
+// the compute pool needn't hold up the gets sent after it. A version 2 request
+// has the key and type, then the version byte, 2, where version 1 has padding
+// (which version 1 clients always send as zeros), a byte of flags, a 4-byte
+// request ID and a 4-byte body length, then the body, laid out as it is after
+// a version 1 preamble. The response is the status, the version, 2 bytes of
+// padding, the request ID, a 4-byte data length and the data. A connection
+// that's sent a version 2 frame has its pushes sent as version 2 frames too,
+// with request ID 0, and the push's name, version and value as their data.
+
+// The number of bytes of a variable name actually sent on the wire.
+const size_t WIRE_VARNAME_LENGTH = MAX_VARNAME_LENGTH;
+
+// A request decoded in place. The pointers point into the buffer the request
+// was decoded from, so it's only valid as long as that buffer is.
+struct Request {
+  // The framing the request came in, 1 or FRAME_VERSION_2, and for version
+  // 2, its request ID.
+  uint8_t version;
+  uint32_t requestId;
+  unsigned int secretKey;
+  MessageType type;
+  const char *name;
+  size_t nameLength;
+  const char *value;
+  size_t valueLength;
+  // For set_ttl, how long the variable lives, in milliseconds.
+  unsigned int ttlMs;
+  // For incr, the amount to add.
+  int64_t delta;
+  // For cas, the value the variable has to hold for `value` to replace it.
+  const char *expected;
+  size_t expectedLength;
+  // For scan, the name to list from (the name is the prefix), and how many
+  // names to list, from 1 to MAX_SCAN_COUNT.
+  const char *cursor;
+  size_t cursorLength;
+  unsigned int count;
+};
+
+// What the server sends back for a request: whether it succeeded, and if it
+// carries any, the data.
+struct Response {
+  bool success = true;
+  bool withData = false;
+  std::string data;
+};
+
+// The classes of requests, by how much work one is. Cheap ones touch a
+// variable or two, and are run right where they arrive; expensive ones
+// compute something, and are run on the compute pool (see compute.h).
+enum RequestClass { REQUEST_CHEAP, REQUEST_EXPENSIVE, REQUEST_CLASS_COUNT };
+
+RequestClass requestClass(MessageType type);
+
+const char *requestClassName(RequestClass cls);
+
+// Read the preamble of a client's request into a struct, in host order.
+ClientPreamble readPreamble(const char clientRequest[]);
+
+// Work out how long the request starting at `buf` is, given the first `len`
+// bytes of it. If `len` isn't enough to tell yet, returns the number of bytes
+// needed to find out; reading that many and asking again eventually yields the
+// full length. Returns -1 if the request is malformed.
+int frameLength(const char *buf, size_t len);
+
+// Decode a complete request from `buf`. Returns the number of bytes it took
+// up, 0 if `len` bytes aren't a complete request yet, or -1 if it's malformed.
+int decodeRequest(const char *buf, size_t len, Request &request);
+
+// Encode a response into `out`, which must have room for
+// SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + dataLength bytes. The length
+// and data are only written if `withData` is set. Returns the number of bytes
+// written.
+size_t encodeResponse(char status, bool withData, const char *data,
+                      size_t dataLength, char *out);
+
+// Encode a version 2 response to request `requestId` into `out`, which must
+// have room for FRAME_V2_RESPONSE_HEADER_SIZE + dataLength bytes. Returns the
+// number of bytes written.
+size_t encodeResponseV2(uint32_t requestId, char status, bool withData,
+                        const char *data, size_t dataLength, char *out);
+
+// Encode a page of a scan's results as its response data: the cursor to ask
+// for the next page with, empty if there isn't one, then the names on this
+// page, each null-terminated. `names` holds the matches in order, up to
+// `count` of them and one more to show there's another page.
+std::string encodeScanPage(const std::vector<std::string> &names,
+                           size_t count);
+
+// Encode the push telling watchers `name` now holds the `length` bytes at
+// `value`, as of `version`.
+std::string encodePush(const std::string &name, uint64_t version,
+                       const char *value, size_t length);
+
+#endif
@@ -0,0 +1,522 @@
+#ifndef RADIXTREE_H
+#define RADIXTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// An adaptive radix tree (ART) over short string keys, for visiting them in
+// order. Each inner node branches on one byte of the key, and comes in one of
+// four sizes, for up to 4, 16, 48 or 256 children, grown and shrunk as
+// children come and go; so a sparse node stays small, and a dense one is a
+// plain array. A run of bytes every key below a node shares is kept in the
+// node instead of as a chain of one-child nodes.
+//
+// The tree doesn't own what it indexes. Each leaf points to a `Leaf`, which
+// must have a std::string `first` as its key (a map's value_type, say) and
+// must stay put and outlive its place in the tree. Keys may be at most
+// MAX_KEY bytes, and mustn't contain nulls: each is taken to end with one,
+// which keeps any key from being a prefix of another, and sorts a key before
+// every longer key it's a prefix of.
+template <typename Leaf> class RadixTree {
+public:
+  static const size_t MAX_KEY = 15;
+
+  RadixTree() = default;
+  ~RadixTree() { destroy(root); }
+  RadixTree(const RadixTree &) = delete;
+  RadixTree &operator=(const RadixTree &) = delete;
+
+  // Add `leaf`, whose key mustn't be in the tree already.
+  void insert(const Leaf *leaf) { insertAt(root, leaf, 0); }
+
+  // Remove the leaf with key `key`, if there is one.
+  void remove(const std::string &key) { removeAt(root, key, 0); }
+
+  // Call `visit(leaf)` for each leaf whose key starts with `prefix` and comes
+  // after `after` (or for all of them, if `after` is empty), in key order,
+  // until it returns false.
+  template <typename Visit>
+  void scan(const std::string &prefix, const std::string &after,
+            Visit visit) const {
+    if (root != 0)
+      walk(root, 0, !after.empty(), Bounds{prefix, after}, visit);
+  }
+
+private:
+  // A child: a Node pointer, or a Leaf pointer with its low bit set.
+  typedef uintptr_t Ref;
+
+  enum Type : uint8_t { NODE4, NODE16, NODE48, NODE256 };
+
+  struct Node {
+    explicit Node(Type type) : type(type) {}
+    Type type;
+    uint16_t count = 0;
+    // The bytes every key below shares, after the byte that led here.
+    uint8_t prefixLength = 0;
+    uint8_t prefix[MAX_KEY + 1];
+  };
+
+  // Children sorted by their byte.
+  struct Node4 : Node {
+    Node4() : Node(NODE4) {}
+    uint8_t bytes[4];
+    Ref children[4];
+  };
+  struct Node16 : Node {
+    Node16() : Node(NODE16) {}
+    uint8_t bytes[16];
+    Ref children[16];
+  };
+  // Indexed by byte: the child's slot plus one, or 0 for none.
+  struct Node48 : Node {
+    Node48() : Node(NODE48) { memset(slots, 0, sizeof(slots)); }
+    uint8_t slots[256];
+    Ref children[48];
+  };
+  struct Node256 : Node {
+    Node256() : Node(NODE256) { memset(children, 0, sizeof(children)); }
+    Ref children[256];
+  };
+
+  struct Bounds {
+    const std::string &prefix;
+    const std::string &after;
+  };
+
+  static bool isLeaf(Ref ref) { return ref & 1; }
+  static const Leaf *leafOf(Ref ref) { return (const Leaf *)(ref & ~(Ref)1); }
+  static Ref refTo(const Leaf *leaf) { return (Ref)leaf | 1; }
+  static Node *nodeOf(Ref ref) { return (Node *)ref; }
+  static const std::string &keyOf(Ref ref) { return leafOf(ref)->first; }
+
+  // The key's byte at `depth`, counting its implicit terminating null.
+  static uint8_t byteAt(const std::string &key, size_t depth) {
+    return depth < key.size() ? key[depth] : 0;
+  }
+
+  static Ref *findChild(Node *node, uint8_t byte) {
+    switch (node->type) {
+    case NODE4: {
+      Node4 *n = (Node4 *)node;
+      for (int i = 0; i < n->count; i++) {
+        if (n->bytes[i] == byte)
+          return &n->children[i];
+      }
+      return nullptr;
+    }
+    case NODE16: {
+      Node16 *n = (Node16 *)node;
+#ifdef __SSE2__
+      __m128i matches =
+          _mm_cmpeq_epi8(_mm_set1_epi8(byte),
+                         _mm_loadu_si128((const __m128i *)n->bytes));
+      int mask = _mm_movemask_epi8(matches) & ((1 << n->count) - 1);
+      return mask != 0 ? &n->children[__builtin_ctz(mask)] : nullptr;
+#else
+      for (int i = 0; i < n->count; i++) {
+        if (n->bytes[i] == byte)
+          return &n->children[i];
+      }
+      return nullptr;
+#endif
+    }
+    case NODE48: {
+      Node48 *n = (Node48 *)node;
+      return n->slots[byte] != 0 ? &n->children[n->slots[byte] - 1] : nullptr;
+    }
+    case NODE256: {
+      Node256 *n = (Node256 *)node;
+      return n->children[byte] != 0 ? &n->children[byte] : nullptr;
+    }
+    }
+    return nullptr;
+  }
+
+  // Insert into a sorted node, which must have room.
+  template <typename Sorted>
+  static void addSorted(Sorted *node, uint8_t byte, Ref child) {
+    int i = node->count;
+    while (i > 0 && node->bytes[i - 1] > byte) {
+      node->bytes[i] = node->bytes[i - 1];
+      node->children[i] = node->children[i - 1];
+      i--;
+    }
+    node->bytes[i] = byte;
+    node->children[i] = child;
+    node->count++;
+  }
+
+  // Copy the header from `from` to its replacement, and free it.
+  static Node *replace(Node *from, Node *to) {
+    to->count = from->count;
+    to->prefixLength = from->prefixLength;
+    memcpy(to->prefix, from->prefix, from->prefixLength);
+    destroyNode(from);
+    return to;
+  }
+
+  // Add a child to the node at `ref`, growing it into the next size up if
+  // it's full.
+  static void addChild(Ref &ref, uint8_t byte, Ref child) {
+    Node *node = nodeOf(ref);
+    switch (node->type) {
+    case NODE4: {
+      Node4 *n = (Node4 *)node;
+      if (n->count < 4)
+        return addSorted(n, byte, child);
+      Node16 *grown = new Node16();
+      memcpy(grown->bytes, n->bytes, sizeof(n->bytes));
+      memcpy(grown->children, n->children, sizeof(n->children));
+      ref = (Ref)replace(n, grown);
+      return addSorted(grown, byte, child);
+    }
+    case NODE16: {
+      Node16 *n = (Node16 *)node;
+      if (n->count < 16)
+        return addSorted(n, byte, child);
+      Node48 *grown = new Node48();
+      for (int i = 0; i < 16; i++) {
+        grown->slots[n->bytes[i]] = i + 1;
+        grown->children[i] = n->children[i];
+      }
+      ref = (Ref)replace(n, grown);
+      return addChild(ref, byte, child);
+    }
+    case NODE48: {
+      Node48 *n = (Node48 *)node;
+      if (n->count < 48) {
+        // Slots are only freed from the end, so the first free one is here.
+        n->children[n->count] = child;
+        n->slots[byte] = ++n->count;
+        return;
+      }
+      Node256 *grown = new Node256();
+      for (int b = 0; b < 256; b++) {
+        if (n->slots[b] != 0)
+          grown->children[b] = n->children[n->slots[b] - 1];
+      }
+      ref = (Ref)replace(n, grown);
+      return addChild(ref, byte, child);
+    }
+    case NODE256: {
+      Node256 *n = (Node256 *)node;
+      n->children[byte] = child;
+      n->count++;
+      return;
+    }
+    }
+  }
+
+  // Take a child out of a sorted node.
+  template <typename Sorted> static void removeSorted(Sorted *node, Ref *slot) {
+    int i = slot - node->children;
+    memmove(&node->bytes[i], &node->bytes[i + 1], node->count - i - 1);
+    memmove(&node->children[i], &node->children[i + 1],
+            (node->count - i - 1) * sizeof(Ref));
+    node->count--;
+  }
+
+  // Remove the child for `byte` from the node at `ref`, shrinking it into the
+  // next size down once it's well under the size it is. A node left with one
+  // child merges into it.
+  static void removeChild(Ref &ref, uint8_t byte, Ref *slot) {
+    Node *node = nodeOf(ref);
+    switch (node->type) {
+    case NODE4: {
+      Node4 *n = (Node4 *)node;
+      removeSorted(n, slot);
+      if (n->count == 1)
+        ref = collapse(n);
+      return;
+    }
+    case NODE16: {
+      Node16 *n = (Node16 *)node;
+      removeSorted(n, slot);
+      if (n->count > 3)
+        return;
+      Node4 *shrunk = new Node4();
+      memcpy(shrunk->bytes, n->bytes, n->count);
+      memcpy(shrunk->children, n->children, n->count * sizeof(Ref));
+      ref = (Ref)replace(n, shrunk);
+      return;
+    }
+    case NODE48: {
+      Node48 *n = (Node48 *)node;
+      // Fill the hole with the last slot, so the used slots stay together.
+      int hole = n->slots[byte] - 1;
+      n->slots[byte] = 0;
+      n->count--;
+      if (hole != n->count) {
+        n->children[hole] = n->children[n->count];
+        for (int b = 0; b < 256; b++) {
+          if (n->slots[b] == n->count + 1) {
+            n->slots[b] = hole + 1;
+            break;
+          }
+        }
+      }
+      if (n->count > 12)
+        return;
+      Node16 *shrunk = new Node16();
+      int count = 0;
+      for (int b = 0; b < 256; b++) {
+        if (n->slots[b] != 0) {
+          shrunk->bytes[count] = b;
+          shrunk->children[count++] = n->children[n->slots[b] - 1];
+        }
+      }
+      ref = (Ref)replace(n, shrunk);
+      return;
+    }
+    case NODE256: {
+      Node256 *n = (Node256 *)node;
+      n->children[byte] = 0;
+      n->count--;
+      if (n->count > 40)
+        return;
+      Node48 *shrunk = new Node48();
+      int count = 0;
+      for (int b = 0; b < 256; b++) {
+        if (n->children[b] != 0) {
+          shrunk->children[count] = n->children[b];
+          shrunk->slots[b] = ++count;
+        }
+      }
+      ref = (Ref)replace(n, shrunk);
+      return;
+    }
+    }
+  }
+
+  // Replace a node with its only child, moving its prefix and the byte that
+  // led to the child onto the front of the child's own prefix.
+  static Ref collapse(Node4 *node) {
+    Ref only = node->children[0];
+    if (!isLeaf(only)) {
+      Node *child = nodeOf(only);
+      size_t moved = node->prefixLength + 1;
+      memmove(&child->prefix[moved], child->prefix, child->prefixLength);
+      memcpy(child->prefix, node->prefix, node->prefixLength);
+      child->prefix[node->prefixLength] = node->bytes[0];
+      child->prefixLength += moved;
+    }
+    destroyNode(node);
+    return only;
+  }
+
+  static void insertAt(Ref &ref, const Leaf *leaf, size_t depth) {
+    const std::string &key = leaf->first;
+    if (ref == 0) {
+      ref = refTo(leaf);
+      return;
+    }
+
+    // Two leaves: a new node over both, holding what they share.
+    if (isLeaf(ref)) {
+      const std::string &other = keyOf(ref);
+      if (other == key)
+        return;
+      Node4 *node = new Node4();
+      size_t shared = 0;
+      while (byteAt(key, depth + shared) == byteAt(other, depth + shared)) {
+        node->prefix[shared] = byteAt(key, depth + shared);
+        shared++;
+      }
+      node->prefixLength = shared;
+      addSorted(node, byteAt(key, depth + shared), refTo(leaf));
+      addSorted(node, byteAt(other, depth + shared), ref);
+      ref = (Ref)node;
+      return;
+    }
+
+    // The key leaves the node's prefix partway: split the prefix there.
+    Node *node = nodeOf(ref);
+    size_t matched = 0;
+    while (matched < node->prefixLength &&
+           node->prefix[matched] == byteAt(key, depth + matched))
+      matched++;
+    if (matched < node->prefixLength) {
+      Node4 *parent = new Node4();
+      parent->prefixLength = matched;
+      memcpy(parent->prefix, node->prefix, matched);
+      uint8_t branch = node->prefix[matched];
+      node->prefixLength -= matched + 1;
+      memmove(node->prefix, &node->prefix[matched + 1], node->prefixLength);
+      addSorted(parent, branch, ref);
+      addSorted(parent, byteAt(key, depth + matched), refTo(leaf));
+      ref = (Ref)parent;
+      return;
+    }
+
+    depth += node->prefixLength;
+    Ref *child = findChild(node, byteAt(key, depth));
+    if (child != nullptr)
+      insertAt(*child, leaf, depth + 1);
+    else
+      addChild(ref, byteAt(key, depth), refTo(leaf));
+  }
+
+  static void removeAt(Ref &ref, const std::string &key, size_t depth) {
+    if (ref == 0)
+      return;
+    if (isLeaf(ref)) {
+      if (keyOf(ref) == key)
+        ref = 0;
+      return;
+    }
+
+    Node *node = nodeOf(ref);
+    for (size_t i = 0; i < node->prefixLength; i++) {
+      if (node->prefix[i] != byteAt(key, depth + i))
+        return;
+    }
+    depth += node->prefixLength;
+    uint8_t byte = byteAt(key, depth);
+    Ref *child = findChild(node, byte);
+    if (child == nullptr)
+      return;
+    if (!isLeaf(*child))
+      return removeAt(*child, key, depth + 1);
+    if (keyOf(*child) == key)
+      removeChild(ref, byte, child);
+  }
+
+  // Visit what's below `ref`, at `depth` bytes into the key. While `tight`,
+  // the bytes so far are the same as the start of bounds.after, so anything
+  // with a smaller next byte comes before it and is skipped. Returns false
+  // once `visit` does.
+  template <typename Visit>
+  static bool walk(Ref ref, size_t depth, bool tight, const Bounds &bounds,
+                   Visit &visit) {
+    if (isLeaf(ref)) {
+      const std::string &key = keyOf(ref);
+      if (key.compare(0, bounds.prefix.size(), bounds.prefix) != 0 ||
+          (!bounds.after.empty() && key <= bounds.after))
+        return true;
+      return visit(*leafOf(ref));
+    }
+
+    Node *node = nodeOf(ref);
+    for (size_t i = 0; i < node->prefixLength; i++, depth++) {
+      if (!follows(node->prefix[i], depth, tight, bounds))
+        return true;
+    }
+
+    // Still inside the prefix asked for, there's only one child to look at.
+    if (depth < bounds.prefix.size()) {
+      uint8_t byte = bounds.prefix[depth];
+      Ref *child = findChild(node, byte);
+      return child == nullptr || !follows(byte, depth, tight, bounds) ||
+             walk(*child, depth + 1, tight, bounds, visit);
+    }
+
+    auto step = [&](uint8_t byte, Ref child) {
+      bool childTight = tight;
+      return !follows(byte, depth, childTight, bounds) ||
+             walk(child, depth + 1, childTight, bounds, visit);
+    };
+    switch (node->type) {
+    case NODE4: {
+      Node4 *n = (Node4 *)node;
+      for (int i = 0; i < n->count; i++) {
+        if (!step(n->bytes[i], n->children[i]))
+          return false;
+      }
+      break;
+    }
+    case NODE16: {
+      Node16 *n = (Node16 *)node;
+      for (int i = 0; i < n->count; i++) {
+        if (!step(n->bytes[i], n->children[i]))
+          return false;
+      }
+      break;
+    }
+    case NODE48: {
+      Node48 *n = (Node48 *)node;
+      for (int b = 0; b < 256; b++) {
+        if (n->slots[b] != 0 && !step(b, n->children[n->slots[b] - 1]))
+          return false;
+      }
+      break;
+    }
+    case NODE256: {
+      Node256 *n = (Node256 *)node;
+      for (int b = 0; b < 256; b++) {
+        if (n->children[b] != 0 && !step(b, n->children[b]))
+          return false;
+      }
+      break;
+    }
+    }
+    return true;
+  }
+
+  // Whether keys with `byte` at `depth` can be in bounds, given the bytes
+  // before it were. Clears `tight` once they've passed bounds.after.
+  static bool follows(uint8_t byte, size_t depth, bool &tight,
+                      const Bounds &bounds) {
+    if (depth < bounds.prefix.size() && byte != (uint8_t)bounds.prefix[depth])
+      return false;
+    if (tight) {
+      uint8_t bound = byteAt(bounds.after, depth);
+      if (byte < bound)
+        return false;
+      tight = byte == bound;
+    }
+    return true;
+  }
+
+  static void destroyNode(Node *node) {
+    switch (node->type) {
+    case NODE4:
+      delete (Node4 *)node;
+      break;
+    case NODE16:
+      delete (Node16 *)node;
+      break;
+    case NODE48:
+      delete (Node48 *)node;
+      break;
+    case NODE256:
+      delete (Node256 *)node;
+      break;
+    }
+  }
+
+  // Free every node below `ref`, and it.
+  static void destroy(Ref ref) {
+    if (ref == 0 || isLeaf(ref))
+      return;
+    Node *node = nodeOf(ref);
+    switch (node->type) {
+    case NODE4:
+      for (int i = 0; i < node->count; i++)
+        destroy(((Node4 *)node)->children[i]);
+      break;
+    case NODE16:
+      for (int i = 0; i < node->count; i++)
+        destroy(((Node16 *)node)->children[i]);
+      break;
+    case NODE48:
+      for (int i = 0; i < node->count; i++)
+        destroy(((Node48 *)node)->children[i]);
+      break;
+    case NODE256:
+      for (int b = 0; b < 256; b++)
+        destroy(((Node256 *)node)->children[b]);
+      break;
+    }
+    destroyNode(node);
+  }
+
+  Ref root = 0;
+};
+
+#endif
@@ -0,0 +1,26 @@
+// How long, in seconds, a resolved host stays fresh in the resolver cache.
+// Stale entries keep being served while a background thread re-resolves them.
+#define RESOLVER_TTL_SECONDS 60
+
+// The number of hosts the resolver cache can remember at once.
+#define RESOLVER_CACHE_SLOTS 64
+
+// The maximum number of addresses remembered for a single host.
+#define RESOLVER_MAX_ADDRS 8
+
+// A machine name starting with this names a Unix domain socket on this host
+// instead: "unix:/run/smalld.sock", say.
+#define UNIX_ADDRESS_PREFIX "unix:"
+
+// Open a TCP connection to MachineName:port, looking the host up in the
+// resolver cache first. Only the first call for a given host (or a call after
+// every cached address failed) goes to getaddrinfo(); after that the addresses
+// come straight out of the cache, and each one is tried in turn until a
+// connect() succeeds. If MachineName starts with UNIX_ADDRESS_PREFIX, connect
+// to the Unix domain socket at the path after it instead, ignoring the port.
+// Returns the connected descriptor, -1 on a connection error, or -2 if the
+// host could not be resolved.
+int openCachedClientfd(char *MachineName, int port);
+
+// Drop every entry in the resolver cache.
+void resolverCacheFlush(void);
@@ -0,0 +1,152 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// The shared-memory transport, for clients on the same host that can't spare
+// even a Unix domain socket's system calls.
+//
+// The client makes a segment holding two rings of bytes, one for requests and
+// one for responses, and hands the server its file descriptor over the
+// server's shared-memory socket. From then on the same framed messages that
+// would go down a socket are copied into the rings instead. Each ring has one
+// producer and one consumer, so moving bytes takes a couple of loads and a
+// store, and no locks. A consumer with nothing to read spins for a while, then
+// sleeps on a futex; a producer only makes the system call to wake it if it
+// said it was going to sleep. So a busy session makes no system calls at all.
+//
+// The layout is shared by the client library (C) and the server (C++), so
+// this header is plain C, and uses the compiler's atomic builtins on plain
+// fields.
+
+// Says that a segment is one of ours, and which layout it has.
+#define SHM_MAGIC 0x736d6c64
+#define SHM_VERSION 1
+
+// The size of each ring's data, a power of two.
+#define SHM_RING_SIZE 65536
+
+// How many times a consumer checks an empty ring before going to sleep: some
+// tens of microseconds. On a single CPU it doesn't spin at all, since the
+// producer it's waiting for can't run until it stops.
+#define SHM_SPIN_LIMIT 20000
+
+// One direction of a session. `head` and `tail` count bytes from the start of
+// the session; the data between them, taken mod SHM_RING_SIZE, is unread.
+// Only the consumer writes `head` and `sleeping`, and only the producer
+// writes `tail`. Each is on its own cache line. Neither side trusts the
+// other's position further than it has to: a broken peer can garble the data,
+// but can't make a copy run outside the ring.
+typedef struct {
+  uint32_t head;
+  char headPadding[60];
+  uint32_t tail;
+  char tailPadding[60];
+  // Set while the consumer is asleep, or about to be, on `tail`.
+  uint32_t sleeping;
+  char sleepingPadding[60];
+  char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  char padding[56];
+  ShmRing requests;
+  ShmRing responses;
+} ShmSegment;
+
+static inline void shmPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Copy as much of `length` bytes at `data` into the ring as fits, waking the
+// consumer if it's asleep. Returns how much was copied.
+static inline size_t shmRingWrite(ShmRing *ring, const char *data,
+                                  size_t length) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t used = tail - head;
+  size_t room = used < SHM_RING_SIZE ? SHM_RING_SIZE - used : 0;
+  if (length > room)
+    length = room;
+  if (length == 0)
+    return 0;
+
+  size_t at = tail & (SHM_RING_SIZE - 1);
+  size_t first = length < SHM_RING_SIZE - at ? length : SHM_RING_SIZE - at;
+  memcpy(&ring->data[at], data, first);
+  memcpy(ring->data, &data[first], length - first);
+
+  // Publishing the tail and then checking for a sleeper, each sequentially
+  // consistent, pairs with shmRingWait(): either it sees the new tail before
+  // sleeping, or we see that it's sleeping.
+  __atomic_store_n(&ring->tail, tail + (uint32_t)length, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+  return length;
+}
+
+// Copy up to `max` unread bytes out of the ring into `out`. Returns how many
+// were copied.
+static inline size_t shmRingRead(ShmRing *ring, char *out, size_t max) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t length = tail - head;
+  if (length > SHM_RING_SIZE)
+    length = SHM_RING_SIZE;
+  if (length > max)
+    length = max;
+  if (length == 0)
+    return 0;
+
+  size_t at = head & (SHM_RING_SIZE - 1);
+  size_t first = length < SHM_RING_SIZE - at ? length : SHM_RING_SIZE - at;
+  memcpy(out, &ring->data[at], first);
+  memcpy(&out[first], ring->data, length - first);
+  __atomic_store_n(&ring->head, head + (uint32_t)length, __ATOMIC_RELEASE);
+  return length;
+}
+
+// Whether the ring has anything to read.
+static inline int shmRingReady(ShmRing *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+static inline int shmSpinLimit(void) {
+  static int limit = -1;
+  if (limit < 0)
+    limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_LIMIT : 0;
+  return limit;
+}
+
+// Wait for the ring to have something to read, spinning first and then
+// sleeping for at most `timeoutMs`. Returns whether it has.
+static inline int shmRingWait(ShmRing *ring, int timeoutMs) {
+  int spins = shmSpinLimit();
+  for (int i = 0; i < spins; i++) {
+    if (shmRingReady(ring))
+      return 1;
+    shmPause();
+  }
+
+  __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+  if (tail == ring->head) {
+    struct timespec timeout = {timeoutMs / 1000,
+                               (long)(timeoutMs % 1000) * 1000000};
+    syscall(SYS_futex, &ring->tail, FUTEX_WAIT, tail, &timeout, NULL, 0);
+  }
+  __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+  return shmRingReady(ring);
+}
+
+#endif
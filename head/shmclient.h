@@ -0,0 +1,15 @@
+#include <stddef.h>
+
+// A machine name starting with this names a server's shared-memory socket on
+// this host: "shm:/run/smalld-shm.sock", say. Requests to it go through the
+// shared-memory transport (see shm.h) instead of a socket.
+#define SHM_ADDRESS_PREFIX "shm:"
+
+// Send the `requestLength` bytes of a framed request to the server whose
+// shared-memory socket is at `path`, and read its response into `response`,
+// which has room for `capacity` bytes. `expectData` is as for
+// responseFrameLength(). Each thread keeps a session open with the last server
+// it used, so only its first request to a server sets one up. Returns the
+// length of the response, or -1 if we couldn't talk to the server.
+int shmExchange(const char *path, const char *request, size_t requestLength,
+                int expectData, char *response, int capacity);
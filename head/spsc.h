@@ -0,0 +1,61 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A bounded queue between exactly one producer thread and one consumer thread,
+// with no locks and no locked instructions: each side publishes its position
+// with a release store, and reads the other's with an acquire load.
+//
+// Each side also keeps its own copy of the other's position, and only reloads
+// the real one when its copy says the queue is full (or empty). So in the
+// common case a push or pop touches no cache line the other thread is writing.
+//
+// Size must be a power of two. Instances are cache line aligned, so allocate
+// them with something that honours that.
+template <typename T, size_t Size> class SpscQueue {
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0,
+                "SpscQueue size must be a power of two");
+
+public:
+  // Producer only. Returns false, leaving the queue alone, if it's full.
+  bool push(const T &item) {
+    uint64_t head = this->head.load(std::memory_order_relaxed);
+    if (head - tailSeen >= Size) {
+      tailSeen = tail.load(std::memory_order_acquire);
+      if (head - tailSeen >= Size)
+        return false;
+    }
+    items[head & (Size - 1)] = item;
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue's empty.
+  bool pop(T &item) {
+    uint64_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail == headSeen) {
+      headSeen = head.load(std::memory_order_acquire);
+      if (tail == headSeen)
+        return false;
+    }
+    item = items[tail & (Size - 1)];
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  // Written by the producer.
+  alignas(64) std::atomic<uint64_t> head{0};
+  uint64_t tailSeen = 0;
+
+  // Written by the consumer.
+  alignas(64) std::atomic<uint64_t> tail{0};
+  uint64_t headSeen = 0;
+
+  alignas(64) T items[Size];
+};
+
+#endif
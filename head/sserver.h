@@ -1,14 +1,80 @@
+// Every request returns 0 if it succeeded, SERVER_BUSY_STATUS if the server
+// was too busy to take it on (it can be tried again later), and -1 otherwise.
+
 // Set the value of variable `variableName` to value on the server at
 // MachineName:port, where value is some data of length `dataLength`.
 int smallSet(char *MachineName, int port, int SecretKey,
         char *variableName, char *value, short dataLength);
 
+// Like smallSet(), but the variable expires `ttlMs` milliseconds after it's
+// set. A `ttlMs` of 0 means it never expires.
+int smallSetTtl(char *MachineName, int port, int SecretKey,
+        char *variableName, char *value, short dataLength, unsigned int ttlMs);
+
 // Get the value of variable `variableName` on the server at MachineName:port,
 // writing the result to `value` and storing the length of the result into the
 // int pointed to by `resultLength`.
 int smallGet(char *MachineName, int port, int SecretKey,
         char *variableName, char *value, int *resultLength);
 
+// Atomically add `delta`, which may be negative, to the variable
+// `variableName` on the server at MachineName:port, which must hold a decimal
+// integer; one that doesn't exist counts as 0. The sum is written to `result`.
+int smallIncr(char *MachineName, int port, int SecretKey,
+        char *variableName, long long delta, long long *result);
+
+// Atomically set the variable `variableName` on the server at
+// MachineName:port to `value`, some data of length `dataLength`, but only if
+// it currently holds exactly the `expectedLength` bytes at `expected`. Returns
+// 0 if it was set.
+int smallCas(char *MachineName, int port, int SecretKey,
+        char *variableName, char *expected, short expectedLength,
+        char *value, short dataLength);
+
+// List, in order, up to `count` variable names starting with `prefix` on the
+// server at MachineName:port, beginning after `cursor` (or from the start, if
+// it's empty). The names are written to `names`, one after another, each
+// null-terminated, with their total length in `namesLength`; `names` must have
+// room for MAX_SCAN_LENGTH bytes. The cursor for the next page is written to
+// `nextCursor`, which must have room for MAX_VARNAME_LENGTH + 1 bytes; it's
+// empty if there are no more names.
+int smallScan(char *MachineName, int port, int SecretKey, char *prefix,
+        char *cursor, int count, char *names, int *namesLength,
+        char *nextCursor);
+
+// Called by smallWatch() with each change to a watched variable: its name, its
+// new value, some data of length `dataLength`, and its version, which goes up
+// with every change. Returns nonzero to stop watching.
+typedef int (*WatchCallback)(const char *variableName, const char *value,
+        int dataLength, unsigned long long version, void *context);
+
+// Watch the `count` variables named in `variableNames` on the server at
+// MachineName:port, calling `callback` with `context` for every change to any
+// of them from the time the server takes the watch. Returns 0 once the
+// callback asks to stop, SERVER_BUSY_STATUS if the server's too busy, or -1 if
+// a watch is refused (the blocking backend refuses them all) or the
+// connection's lost.
+int smallWatch(char *MachineName, int port, int SecretKey,
+        char **variableNames, int count, WatchCallback callback,
+        void *context);
+
+// Keep copies of the variables smallGet() reads in a near cache (see
+// nearcache.h), so rereading a hot one doesn't reach the network, until the
+// server says it's changed. It holds at most `maxEntries` variables and
+// `maxBytes` bytes of them, dropping the least recently read to make room;
+// either may be 0 for no limit, but not both. If `maxAgeMs` isn't 0, copies
+// older than that are read again, which bounds how stale a copy of a variable
+// that's expired can get. Calling it again changes the limits, and drops
+// every copy. Returns 0, or -1 if the limits don't make sense.
+int smallCacheEnable(int maxEntries, long maxBytes, int maxAgeMs);
+
+// Turn the near cache off, dropping every copy.
+void smallCacheDisable(void);
+
+// How many smallGet() calls the near cache has answered, and how many it had
+// to send on to the server.
+void smallCacheStats(unsigned long long *hits, unsigned long long *misses);
+
 // Get the SHA256 checksum of `data` on the server at MachineName:port and
 // write the response to the memory pointed to by `result`, with length written
 // to `resultLength`. The result will be at most 100 bytes long.
@@ -20,3 +86,35 @@ int smallDigest(char *MachineName, int port, int SecretKey,
 // to `resultLength`. The result will be at most 100 bytes long.
 int smallRun(char *MachineName, int port, int SecretKey,
         char *request, char *result, int *resultLength);
+
+// Get a snapshot of the server's internal counters from the server at
+// MachineName:port, as text with one `name value` pair per line. The text is
+// written to `result`, which must have room for MAX_STATS_LENGTH bytes, and
+// its length is written to `resultLength`.
+int smallStats(char *MachineName, int port, int SecretKey, char *result,
+        int *resultLength);
+
+// Pipelining: several requests in flight at once on one connection, each
+// tagged with an ID of the caller's choosing, using the version 2 framing (see
+// protocol.h). The server answers each as soon as it's done, so the responses
+// can come back in any order, and are matched up by their IDs. Only sockets
+// are supported, not the shared-memory transport.
+
+// Open a connection to the server at MachineName:port. Returns its file
+// descriptor, to be closed with close() when done, or -1 if it can't be made.
+int smallConnect(char *MachineName, int port);
+
+// Send the `length`-byte request at `request`, encoded by one of the
+// functions in wire.h, on `connection`, as request `requestId`. Returns 0 if
+// it was sent, or -1 if it couldn't be.
+int smallSend(int connection, unsigned int requestId, const char *request,
+        int length);
+
+// Wait for the next response on `connection`. Its request's ID is written to
+// `requestId`, its status to `status`, and any data it carries to `result`,
+// with its length written to `resultLength`. A push has status
+// SERVER_PUSH_STATUS, ID 0, and the data described in wire.h. Returns 0 once
+// a response is read, or -1 if the connection's lost or the data doesn't fit
+// in `maxResultLength` bytes.
+int smallReceive(int connection, unsigned int *requestId, int *status,
+        char *result, int *resultLength, int maxResultLength);
@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+extern "C" {
+#include "common.h"
+#include "histogram.h"
+}
+
+// Live server counters, reported by STATS requests.
+//
+// Every thread that records anything gets its own ThreadStats, found through
+// a thread_local pointer. Only the owning thread ever writes to it, so an
+// update is a plain load and store with no locked instruction and no shared
+// cache line; the fields are atomics only so that a STATS request on another
+// thread can read them safely. Nothing is added up until someone asks.
+
+// A counter with a single writer.
+class Counter {
+public:
+  void add(uint64_t n = 1) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+  void raiseTo(uint64_t n) {
+    if (n > value.load(std::memory_order_relaxed))
+      value.store(n, std::memory_order_relaxed);
+  }
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value{0};
+};
+
+// One thread's share of the counters.
+struct ThreadStats {
+  Counter requests[MESSAGE_TYPE_COUNT];
+  Counter errors[MESSAGE_TYPE_COUNT];
+  Counter latencyBuckets[MESSAGE_TYPE_COUNT][HISTOGRAM_BUCKETS];
+  Counter latencySum[MESSAGE_TYPE_COUNT];
+  Counter latencyMax[MESSAGE_TYPE_COUNT];
+  Counter connectionsOpened;
+  Counter connectionsClosed;
+  Counter connectionsRejected;
+  Counter connectionsTimedOut;
+  Counter bytesIn;
+  Counter bytesOut;
+  Counter digestCacheHits;
+  Counter digestCacheMisses;
+  Counter watchPushes;
+  Counter watchPushesDropped;
+  Counter requestsBusy;
+
+  // Record one finished request.
+  void recordRequest(MessageType type, bool success, uint64_t latencyNs);
+};
+
+// Get the calling thread's counters, creating them the first time.
+ThreadStats &threadStats();
+
+// Things the counters don't track themselves, filled in by the server when a
+// snapshot is taken.
+struct StatsExtras {
+  uint64_t keys;
+  uint64_t storeBytes;
+  uint64_t keysExpired;
+  uint64_t keysEvicted;
+  // The store's memory limit, or 0 if there isn't one.
+  uint64_t storeLimit;
+  // The compute pool's workers, and the requests waiting for them.
+  uint64_t computeThreads;
+  uint64_t computeQueued;
+  // More `name value` lines, each ending in a newline, to put after the
+  // counters, if they fit.
+  std::string lines;
+};
+
+// Add up every thread's counters and format them as text, one `name value`
+// pair per line. Latencies are given for each request type, and for each
+// request class, across its types. Latency histograms are given as their percentiles and as a
+// sparse list of `upper bound:count` pairs for the non-empty buckets.
+std::string formatStats(const StatsExtras &extras);
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "radixtree.h"
+#include "timerwheel.h"
+
+// The number of independently locked shards in a VarStore, unless asked
+// otherwise. Requests for different variables usually land in different
+// shards, so they don't wait on each other.
+const size_t DEFAULT_STORE_SHARDS = 16;
+
+// A rough count of the bytes a stored variable costs beyond its name and
+// value: the hash table node, the two string headers, its slot on the
+// eviction clock and its share of the name index.
+const size_t STORE_ENTRY_OVERHEAD = 136;
+
+// The same for a variable's expiry timer, beyond the copy of the name it
+// holds.
+const size_t STORE_TIMER_OVERHEAD = 40;
+
+// The most expired variables a set or get removes from its shard on the way
+// past, and the most expire() removes from each shard per call.
+const size_t STORE_EXPIRE_PER_ACCESS = 4;
+const size_t STORE_EXPIRE_PER_PASS = 256;
+
+// How often the server calls expire(), in milliseconds.
+const int STORE_EXPIRY_INTERVAL_MS = 10;
+
+// The least a store's memory limit can be; anything lower couldn't hold a
+// variable per shard.
+const size_t STORE_MIN_MEMORY_LIMIT = 64 * 1024;
+
+// Parse a size in bytes, optionally followed by k, m or g for kibibytes,
+// mebibytes or gibibytes.
+bool parseMemorySize(const char *text, size_t &bytes);
+
+// The server's variable storage: a hash table of names to values, split into
+// shards that each have their own lock. Values are arbitrary bytes.
+//
+// A variable can be given a time to live. Each shard keeps a timer wheel of
+// its variables' expiry times, and removes a few that are due on every access,
+// and more on each expire(); a variable that's outlived its time but not been
+// removed yet is treated as gone, and removed when it's next looked up. So
+// expiry never scans the table, and never does much at once.
+//
+// Each shard also indexes its names in a radix tree, so they can be listed in
+// order, by prefix, without going through the whole table.
+//
+// A store can also be given a memory limit, which each shard gets an equal
+// share of. A shard that goes over its share evicts variables by CLOCK, an
+// approximation of least recently used: its variables sit on a ring, each with
+// a bit set whenever it's used, and a hand sweeps the ring clearing the bits,
+// evicting the first variable it finds without one. That costs a bit and a
+// ring slot per variable, and O(1) amortized work per set.
+//
+// Each operation on a variable happens entirely under its shard's lock, so
+// read-modify-writes like increment() and compareAndSet() are atomic, and
+// need no locked instructions on top of the lock itself.
+//
+// Every change to a variable gives it a new version, from a counter its shard
+// keeps, so a variable's versions only ever go up, even across its being
+// removed and set again. A change listener, if there is one, hears about each
+// change with its version, under the shard's lock, so it hears about the
+// changes to any one variable in order.
+//
+// A store that only one thread ever touches can be made unlocked, and then
+// skips the locks altogether. The counts and sizes may be read from any thread
+// either way.
+class VarStore {
+public:
+  // Told that `name`, in the store for `keyspace`, now holds the `length`
+  // bytes at `value`, as of `version`.
+  typedef void (*ChangeListener)(uint32_t keyspace, const std::string &name,
+                                 uint64_t version, const char *value,
+                                 size_t length);
+
+  explicit VarStore(size_t shardCount = DEFAULT_STORE_SHARDS,
+                    bool locked = true);
+
+  // Have every store tell `listener` about every change to its variables.
+  // Call it before any store's shared.
+  static void setChangeListener(ChangeListener listener);
+
+  // Set `name` to the `length` bytes at `value`. If `ttlMs` isn't 0, the
+  // variable expires that many milliseconds from now.
+  void set(const std::string &name, const char *value, size_t length,
+           uint32_t ttlMs = 0);
+
+  // Look up `name`, copying its value into `value`. Returns whether the
+  // variable exists.
+  bool get(const std::string &name, std::string &value);
+
+  // Add `delta` to `name`, which must hold a decimal integer (optionally
+  // null-terminated, as the clients send strings), and write the sum to
+  // `result`. The sum is stored as null-terminated text. A variable that
+  // doesn't exist counts as 0. Returns false, changing nothing, if the value
+  // isn't an integer or the sum overflows.
+  bool increment(const std::string &name, int64_t delta, int64_t &result);
+
+  // Set `name` to the `length` bytes at `value`, but only if it exists and
+  // holds exactly the `expectedLength` bytes at `expected`. Returns whether it
+  // did.
+  bool compareAndSet(const std::string &name, const char *expected,
+                     size_t expectedLength, const char *value, size_t length);
+
+  // Append to `names` the first `limit` names, in order, that start with
+  // `prefix` and come after `after` (or the first of all, if `after` is
+  // empty). Each shard is locked only while its own names are read.
+  void scan(const std::string &prefix, const std::string &after, size_t limit,
+            std::vector<std::string> &names);
+
+  // Limit the memory the variables may use to about `bytes`, or take the
+  // limit away if it's 0. Call it before the store's shared.
+  void setMemoryLimit(size_t bytes);
+
+  // The memory limit, or 0 if there isn't one.
+  size_t memoryLimit() const { return shardLimit * shardCount; }
+
+  // Say which tenant's keyspace (see tenants.h) the store holds, for the
+  // change listener. Call it before the store's shared.
+  void setKeyspace(uint32_t id) { keyspace = id; }
+
+  // Remove some of the variables whose time is up. The server calls this
+  // every STORE_EXPIRY_INTERVAL_MS, so they go even if nothing touches
+  // their shard.
+  void expire();
+
+  // The number of variables stored.
+  size_t size() const;
+
+  // Approximately how much memory the stored variables take up, in bytes.
+  size_t memoryUsed() const;
+
+  // The number of variables that have expired so far.
+  size_t expired() const;
+
+  // The number of variables evicted to stay under the memory limit so far.
+  size_t evicted() const;
+
+private:
+  struct Entry {
+    std::string value;
+    // When it expires, in milliseconds on the monotonic clock, or 0 if never.
+    uint64_t expiresAt = 0;
+    // When its timer's due, or 0 if it hasn't one pending. A variable has at
+    // most one timer that counts: one set again to expire later keeps its
+    // timer, which sets itself again for the new time when it fires. Only one
+    // brought forward gets a new timer; its old one isn't charged for, and
+    // does nothing when it fires.
+    uint64_t timerAt = 0;
+    // Where it is on the clock, and whether it's been used since the hand
+    // last passed it.
+    uint32_t clockSlot = 0;
+    bool referenced = false;
+    uint64_t version = 0;
+  };
+
+  typedef std::unordered_map<std::string, Entry> Table;
+  typedef Table::iterator Iterator;
+  // Table nodes stay put when the table grows, unlike its iterators.
+  typedef Table::value_type Node;
+
+  struct Shard {
+    mutable std::mutex lock;
+    Table vars;
+    // Every variable, in no particular order, and the hand sweeping them.
+    std::vector<Node *> clock;
+    size_t hand = 0;
+    // The last version given to a change in this shard.
+    uint64_t versions = 0;
+    // Every variable, by name.
+    RadixTree<Node> names;
+    // Fired with the variable's name at its expiry time.
+    TimerWheel<std::string> timers;
+    // Only changed by whoever holds the lock, but read without it.
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<size_t> expired{0};
+    std::atomic<size_t> evicted{0};
+  };
+
+  Shard &shardFor(const std::string &name) const;
+  std::unique_lock<std::mutex> lockShard(Shard &shard) const;
+  uint64_t expireSome(Shard &shard, bool needTime);
+  Iterator findLive(Shard &shard, const std::string &name, uint64_t now);
+  void insert(Shard &shard, const std::string &name, const char *value,
+              size_t length, uint32_t ttlMs, uint64_t now);
+  void update(Shard &shard, Node &node, const char *value, size_t length);
+  void changed(Shard &shard, Node &node);
+  void remove(Shard &shard, Iterator it);
+  void expireDue(Shard &shard, uint64_t now, size_t budget);
+  void evict(Shard &shard, const Node *keep);
+  void scanShard(Shard &shard, const std::string &prefix,
+                 const std::string &after, size_t limit,
+                 std::vector<std::string> &names);
+
+  size_t shardCount;
+  bool locked;
+  // Each shard's share of the memory limit, or 0 if there isn't one.
+  size_t shardLimit = 0;
+  std::unique_ptr<Shard[]> shards;
+  uint32_t keyspace = 0;
+
+  static ChangeListener changeListener;
+};
+
+#endif
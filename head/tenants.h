@@ -0,0 +1,76 @@
+#ifndef TENANTS_H
+#define TENANTS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "store.h"
+
+// Tenants: the secret keys the server accepts, each with a keyspace of its
+// own, so one process can serve many clients that mustn't see each other's
+// variables.
+//
+// The key given on the command line belongs to the default tenant, whose
+// store is the server's own. More can be loaded from a file, one per line:
+//
+//   name  key  [memory limit[k|m|g]]  [requests per second]
+//
+// with `-` or nothing for no limit, and `#` starting a comment. Each gets a
+// store of its own, with the memory limit, and its requests past the rate are
+// answered busy. The tenants are all known before the server starts serving,
+// and never change after, so finding a request's is a lookup in a hash table
+// nobody writes to: no locks, and O(1) however many there are.
+
+// Lets requests through at no more than a set rate, on average, with bursts
+// of up to a second's worth. It's the generic cell rate algorithm: it keeps
+// the time the next request would be due at if they came in evenly, and each
+// request admitted pushes that back by the interval between them. That's one
+// compare-and-swap per request, from any thread.
+class RateLimit {
+public:
+  // Allow `perSecond` requests a second, or any number if it's 0.
+  void setRate(uint64_t perSecond);
+
+  uint64_t rate() const { return perSecond; }
+
+  // Whether a request arriving at `nowNs`, in nanoseconds on the monotonic
+  // clock, may go ahead. If it may, it's counted.
+  bool admit(uint64_t nowNs);
+
+private:
+  uint64_t perSecond = 0;
+  uint64_t intervalNs = 0;
+  std::atomic<uint64_t> dueNs{0};
+};
+
+struct Tenant {
+  std::string name;
+  unsigned int secretKey;
+  // The default tenant's is 0, and the rest are numbered from 1 in the order
+  // they were loaded.
+  uint32_t keyspace;
+  VarStore *store;
+  // The store, unless it's the server's own.
+  std::unique_ptr<VarStore> ownStore;
+  RateLimit rate;
+  // Requests answered busy for going over the rate.
+  std::atomic<uint64_t> throttled{0};
+};
+
+// Make the default tenant, with `secretKey` and `store`. Call it, and
+// loadTenants() if there are more, before serving anything.
+void addDefaultTenant(unsigned int secretKey, VarStore &store);
+
+// Load the tenants in the file at `path`. Returns false, with `error` saying
+// what was wrong, if it can't be read or a line doesn't make sense.
+bool loadTenants(const std::string &path, std::string &error);
+
+// The tenant with `secretKey`, or nullptr if there isn't one.
+Tenant *findTenant(unsigned int secretKey);
+
+// Every tenant, the default one first.
+const std::vector<std::unique_ptr<Tenant>> &allTenants();
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A hierarchical timing wheel: timers scheduled for a tick, fired as the wheel
+// is advanced past it, in O(1) amortized time per timer however many are
+// pending.
+//
+// There are four levels of 256 slots. Level 0 has a slot for each of the next
+// 256 ticks; a slot on level n covers 256^n ticks, and when the wheel reaches
+// it its timers are placed again, a level or more further down. So a timer is
+// moved at most three times before it fires. Timers more than 2^32 ticks out
+// wait in the top level until they come into reach.
+//
+// Timers can't be cancelled. Whoever fires them checks that they're still
+// wanted, which is usually cheaper than finding them to take them out.
+template <typename T> class TimerWheel {
+public:
+  explicit TimerWheel(uint64_t now = 0) : current(now) {}
+
+  // Schedule `item` to fire at tick `when`. If that's already passed, it fires
+  // on the next advance().
+  void schedule(uint64_t when, T item) {
+    place(Timer{when, std::move(item)});
+    pending++;
+  }
+
+  // Advance the wheel to tick `now`, calling `fire(when, item)` for each timer
+  // that's due. At most `budget` timers fire per call; if more are due, the
+  // wheel stops short and the rest fire on later calls, so no one call does
+  // an unbounded amount of work. Returns the number fired.
+  template <typename Fire>
+  size_t advance(uint64_t now, size_t budget, Fire fire) {
+    size_t fired = 0;
+    while (fired < budget) {
+      if (!due.empty()) {
+        Timer timer = std::move(due.back());
+        due.pop_back();
+        pending--;
+        fired++;
+        fire(timer.when, timer.item);
+        continue;
+      }
+      skipIdle(now);
+      if (current >= now)
+        break;
+      tick();
+    }
+    return fired;
+  }
+
+  // The number of timers that haven't fired yet.
+  size_t size() const { return pending; }
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 8;
+  static const uint64_t SLOTS = 1 << SLOT_BITS;
+  static const uint64_t SLOT_MASK = SLOTS - 1;
+
+  struct Timer {
+    uint64_t when;
+    T item;
+  };
+
+  // Put a timer in the lowest level that can hold it, or on the list of
+  // timers due now.
+  void place(Timer &&timer) {
+    if (timer.when <= current) {
+      due.push_back(std::move(timer));
+      return;
+    }
+    for (int level = 0; level < LEVELS; level++) {
+      int shift = level * SLOT_BITS;
+      if ((timer.when >> shift) - (current >> shift) < SLOTS) {
+        insert(level, (timer.when >> shift) & SLOT_MASK, std::move(timer));
+        return;
+      }
+    }
+    // Out of reach: wait in the furthest slot of the top level, and be placed
+    // again when the wheel gets there.
+    int shift = (LEVELS - 1) * SLOT_BITS;
+    insert(LEVELS - 1, ((current >> shift) + SLOTS - 1) & SLOT_MASK,
+           std::move(timer));
+  }
+
+  void insert(int level, uint64_t slot, Timer &&timer) {
+    slots[level][slot].push_back(std::move(timer));
+    counts[level]++;
+  }
+
+  // Move on one tick. Each level whose slot changes has that slot's timers
+  // placed again, the highest level first so they can land in the lower
+  // slots about to be emptied.
+  void tick() {
+    current++;
+    int top = 0;
+    while (top + 1 < LEVELS &&
+           (current & ((1ULL << ((top + 1) * SLOT_BITS)) - 1)) == 0)
+      top++;
+    for (int level = top; level >= 0; level--) {
+      std::vector<Timer> timers;
+      timers.swap(slots[level][(current >> (level * SLOT_BITS)) & SLOT_MASK]);
+      counts[level] -= timers.size();
+      for (Timer &timer : timers)
+        place(std::move(timer));
+    }
+  }
+
+  // Jump over ticks on which nothing can happen. If the bottom levels are
+  // empty, nothing fires until the lowest level with timers moves on to its
+  // next slot, so go straight to the tick before that.
+  void skipIdle(uint64_t now) {
+    int level = 0;
+    while (level < LEVELS && counts[level] == 0)
+      level++;
+    if (level == 0 || now <= current)
+      return;
+    if (level == LEVELS) {
+      current = now;
+      return;
+    }
+    int shift = level * SLOT_BITS;
+    uint64_t next = ((current >> shift) + 1) << shift;
+    current = std::min(now, next - 1);
+  }
+
+  uint64_t current;
+  size_t pending = 0;
+  size_t counts[LEVELS] = {};
+  std::vector<Timer> slots[LEVELS][SLOTS];
+  std::vector<Timer> due;
+};
+
+#endif
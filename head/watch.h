@@ -0,0 +1,58 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "connection.h"
+
+// Watches: connections that have asked to be told about every change to a
+// variable, and the pushes that tell them.
+//
+// Each event loop thread has a mailbox: a queue of changes, and an eventfd
+// that's readable while the queue isn't empty. A registry, split into locked
+// shards by name, lists the mailboxes with a watcher of each name, and each
+// mailbox keeps its own thread's watchers. So a change is encoded as a push
+// once, and posted once to each thread with a watcher of it, however many
+// watchers that thread has; the thread then copies the push onto each of
+// their connections. A change to a variable nobody's watching costs a load.
+//
+// Each tenant's variables (see tenants.h) are watched separately, so a
+// tenant only hears about changes to its own.
+//
+// Threads without a mailbox, like the blocking backend's, which serve one
+// connection at a time, can't take watches.
+
+// The most output a watching connection can have backed up before pushes to
+// it are dropped, so a watcher that stops reading can't run the server out of
+// memory.
+const size_t WATCH_MAX_BACKLOG = 256 * 1024;
+
+// Give the calling thread a mailbox, if it hasn't one yet, and return its
+// eventfd. The thread's event loop should call deliverWatchEvents() whenever
+// it's readable.
+int openWatchMailbox();
+
+// Have `conn`, one of the calling thread's connections, watch `name` in
+// `keyspace`. Returns false if the thread has no mailbox.
+bool watchVariable(Connection &conn, uint32_t keyspace,
+                   const std::string &name);
+
+// Whether connection `id` on the calling thread is watching anything.
+bool hasWatches(uint64_t id);
+
+// Drop every watch connection `id` on the calling thread has. Connections do
+// this themselves when they're destroyed.
+void forgetWatches(uint64_t id);
+
+// Push the changes waiting in the calling thread's mailbox to its watchers,
+// adding each connection given output to `touched`, once.
+void deliverWatchEvents(std::vector<Connection *> &touched);
+
+// Tell the watchers of `name` in `keyspace` it now holds the `length` bytes
+// at `value`, as of `version`. Meant for VarStore::setChangeListener().
+void publishChange(uint32_t keyspace, const std::string &name,
+                   uint64_t version, const char *value, size_t length);
+
+#endif
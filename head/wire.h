@@ -0,0 +1,443 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "common.h"
+
+// The wire format of every message, shared by the client library and the
+// server.
+//
+// Each message is described once, in the C++ section below, as a list of
+// fields; encoding, decoding and framing are all generated from that list.
+// Multi-byte integers (the secret key, the message type, and every length) are
+// sent in network byte order. The structs in common.h hold them in host
+// order; the codec does the swapping, so nothing else has to.
+//
+// The C functions here are the client library's view of the codec.
+
+// Encode a client message into `out`, which has room for `capacity` bytes.
+// Returns the number of bytes written, or 0 if the message doesn't fit or one
+// of its fields is too long (a name of MAX_VARNAME_LENGTH or more characters
+// isn't null-terminated within its array, for example).
+size_t encodeClientSet(const ClientSet *message, char *out, size_t capacity);
+size_t encodeClientSetTtl(const ClientSetTtl *message, char *out,
+                          size_t capacity);
+size_t encodeClientGet(const ClientGet *message, char *out, size_t capacity);
+size_t encodeClientIncr(const ClientIncr *message, char *out, size_t capacity);
+size_t encodeClientCas(const ClientCas *message, char *out, size_t capacity);
+size_t encodeClientScan(const ClientScan *message, char *out, size_t capacity);
+size_t encodeClientWatch(const ClientWatch *message, char *out,
+                         size_t capacity);
+size_t encodeClientDigest(const ClientDigest *message, char *out,
+                          size_t capacity);
+size_t encodeClientRun(const ClientRun *message, char *out, size_t capacity);
+size_t encodeClientPreamble(const ClientPreamble *message, char *out,
+                            size_t capacity);
+
+// Work out how long the server's response starting at `buf` is, given the
+// first `len` bytes of it. `withData` says whether a successful response to
+// this request carries data. If `len` isn't enough to tell yet, returns the
+// number of bytes needed to find out; reading that many and asking again
+// eventually yields the full length. Returns -1 if the response is malformed.
+int responseFrameLength(const char *buf, size_t len, int withData);
+
+// Decode a complete response from `buf`. The status is written to `status`;
+// for a successful response with data, `data` is pointed at the data in `buf`
+// and its length written to `dataLength`, and otherwise the length is 0.
+// Returns the number of bytes the response took up, 0 if `len` bytes aren't a
+// complete response yet, or -1 if it's malformed.
+int decodeResponse(const char *buf, size_t len, int withData, char *status,
+                   const char **data, size_t *dataLength);
+
+// Wrap the `length`-byte request at `request`, encoded by one of the functions
+// above, in a version 2 frame tagged with `requestId`, written to `out`, which
+// has room for `capacity` bytes. Returns the number of bytes written, or 0 if
+// the request is malformed or doesn't fit.
+size_t encodeFrameV2(unsigned int requestId, const char *request,
+                     size_t length, char *out, size_t capacity);
+
+// Like responseFrameLength(), for the frames sent back on a connection that
+// speaks version 2. They all say how long they are. A connection the server
+// turns away before it's sent anything is answered with a version 1 status
+// frame, which is told apart by its version byte.
+int responseV2FrameLength(const char *buf, size_t len);
+
+// Decode a complete version 2 frame from `buf`: its status is written to
+// `status`, its request ID to `requestId`, and `data` is pointed at its data in
+// `buf`, with the length written to `dataLength`. A push's data is its
+// PushBodyCodec body. Returns the number of bytes the frame took up, 0 if `len`
+// bytes aren't a complete frame yet, or -1 if it's malformed.
+int decodeResponseV2(const char *buf, size_t len, char *status,
+                     unsigned int *requestId, const char **data,
+                     size_t *dataLength);
+
+// Like responseFrameLength(), for a connection with watches on it, where each
+// frame from the server is either a response without data or a push.
+int watchFrameLength(const char *buf, size_t len);
+
+// Decode a complete push from `buf`: the variable's name is written to `name`,
+// which must have room for MAX_VARNAME_LENGTH + 1 bytes, its version to
+// `version`, and `value` is pointed at its new value in `buf`, with the length
+// written to `valueLength`. Returns the number of bytes the push took up, 0 if
+// `len` bytes aren't a complete push yet, or -1 if it's malformed.
+int decodePush(const char *buf, size_t len, char *name,
+               unsigned long long *version, const char **value,
+               size_t *valueLength);
+
+#ifdef __cplusplus
+}
+
+#include <cstdint>
+#include <cstring>
+
+namespace wire {
+
+// A view of some bytes in a buffer.
+struct Bytes {
+  const char *data;
+  size_t length;
+};
+
+// View a null-terminated string held in an `N`-byte array. If there's no null
+// the view covers the whole array, which the codec then rejects as too long
+// for a field that leaves room for one.
+template <size_t N> inline Bytes text(const char (&array)[N]) {
+  return Bytes{array, strnlen(array, N)};
+}
+
+//=================
+// Field encodings.
+//=================
+
+// One-byte integers.
+struct Int8 {};
+struct Uint8 {};
+// Unsigned integers, in network byte order.
+struct Uint16 {};
+struct Uint32 {};
+// A two's complement eight-byte signed integer, in network byte order.
+struct Int64 {};
+// `N` bytes of zeros, ignored when decoding. Padding takes no value.
+template <size_t N> struct Padding {};
+// A string of up to `N` bytes, padded with nulls to exactly `N`.
+template <size_t N> struct Text {};
+// A Uint16 length followed by that many bytes, at most `Max`. A message can
+// only have one of these, and it must come last.
+template <size_t Max> struct Counted {};
+
+// How each encoding is written and read. `size` is the part of the field whose
+// length is fixed; `put` and `get` never check bounds, since by the time
+// they're called the codec has already checked the message as a whole.
+template <typename Encoding> struct Field;
+
+template <> struct Field<Int8> {
+  typedef signed char Value;
+  static constexpr size_t size = 1, maxExtra = 0;
+  static bool valid(Value) { return true; }
+  static size_t extra(Value) { return 0; }
+  static void put(char *out, Value value) { out[0] = value; }
+  static void get(const char *in, Value &value) { value = in[0]; }
+};
+
+template <> struct Field<Uint8> {
+  typedef uint8_t Value;
+  static constexpr size_t size = 1, maxExtra = 0;
+  static bool valid(Value) { return true; }
+  static size_t extra(Value) { return 0; }
+  static void put(char *out, Value value) { out[0] = value; }
+  static void get(const char *in, Value &value) { value = in[0]; }
+};
+
+template <> struct Field<Uint16> {
+  typedef uint16_t Value;
+  static constexpr size_t size = 2, maxExtra = 0;
+  static bool valid(Value) { return true; }
+  static size_t extra(Value) { return 0; }
+  static void put(char *out, Value value) {
+    out[0] = value >> 8;
+    out[1] = value;
+  }
+  static void get(const char *in, Value &value) {
+    const unsigned char *bytes = (const unsigned char *)in;
+    value = bytes[0] << 8 | bytes[1];
+  }
+};
+
+template <> struct Field<Uint32> {
+  typedef uint32_t Value;
+  static constexpr size_t size = 4, maxExtra = 0;
+  static bool valid(Value) { return true; }
+  static size_t extra(Value) { return 0; }
+  static void put(char *out, Value value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+  }
+  static void get(const char *in, Value &value) {
+    const unsigned char *bytes = (const unsigned char *)in;
+    value = (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 |
+            (uint32_t)bytes[2] << 8 | bytes[3];
+  }
+};
+
+template <> struct Field<Int64> {
+  typedef int64_t Value;
+  static constexpr size_t size = 8, maxExtra = 0;
+  static bool valid(Value) { return true; }
+  static size_t extra(Value) { return 0; }
+  static void put(char *out, Value value) {
+    Field<Uint32>::put(out, (uint64_t)value >> 32);
+    Field<Uint32>::put(&out[4], (uint64_t)value);
+  }
+  static void get(const char *in, Value &value) {
+    uint32_t high, low;
+    Field<Uint32>::get(in, high);
+    Field<Uint32>::get(&in[4], low);
+    value = (int64_t)((uint64_t)high << 32 | low);
+  }
+};
+
+template <size_t N> struct Field<Text<N>> {
+  typedef Bytes Value;
+  static constexpr size_t size = N, maxExtra = 0;
+  static bool valid(const Value &value) { return value.length <= N; }
+  static size_t extra(const Value &) { return 0; }
+  static void put(char *out, const Value &value) {
+    memcpy(out, value.data, value.length);
+    memset(&out[value.length], 0, N - value.length);
+  }
+  static void get(const char *in, Value &value) {
+    value.data = in;
+    value.length = strnlen(in, N);
+  }
+};
+
+template <size_t Max> struct Field<Counted<Max>> {
+  typedef Bytes Value;
+  static constexpr size_t size = Field<Uint16>::size, maxExtra = Max;
+  static bool valid(const Value &value) { return value.length <= Max; }
+  static size_t extra(const Value &value) { return value.length; }
+  static void put(char *out, const Value &value) {
+    Field<Uint16>::put(out, value.length);
+    memcpy(&out[size], value.data, value.length);
+  }
+  static void get(const char *in, Value &value) {
+    uint16_t length;
+    Field<Uint16>::get(in, length);
+    value.data = &in[size];
+    value.length = length;
+  }
+};
+
+//=========
+// Layout.
+//=========
+
+// The fields of a message, in order. Each operation walks the list at compile
+// time, so a codec compiles down to straight-line loads and stores.
+template <typename... Encodings> struct Layout;
+
+template <> struct Layout<> {
+  static constexpr size_t fixedSize = 0, maxExtra = 0;
+  static bool valid() { return true; }
+  static size_t extra() { return 0; }
+  static void put(char *) {}
+  static void get(const char *) {}
+  // The length of the variable part of a message, read from its fixed part.
+  static size_t wireExtra(const char *) { return 0; }
+};
+
+template <size_t N, typename... Rest> struct Layout<Padding<N>, Rest...> {
+  typedef Layout<Rest...> Next;
+  static constexpr size_t fixedSize = N + Next::fixedSize;
+  static constexpr size_t maxExtra = Next::maxExtra;
+
+  template <typename... Values> static bool valid(const Values &... values) {
+    return Next::valid(values...);
+  }
+  template <typename... Values> static size_t extra(const Values &... values) {
+    return Next::extra(values...);
+  }
+  template <typename... Values>
+  static void put(char *out, const Values &... values) {
+    memset(out, 0, N);
+    Next::put(&out[N], values...);
+  }
+  template <typename... Values>
+  static void get(const char *in, Values &... values) {
+    Next::get(&in[N], values...);
+  }
+  static size_t wireExtra(const char *in) { return Next::wireExtra(&in[N]); }
+};
+
+template <typename Encoding, typename... Rest>
+struct Layout<Encoding, Rest...> {
+  typedef Field<Encoding> This;
+  typedef Layout<Rest...> Next;
+  typedef typename This::Value Value;
+  static constexpr size_t fixedSize = This::size + Next::fixedSize;
+  static constexpr size_t maxExtra = This::maxExtra + Next::maxExtra;
+  static_assert(This::maxExtra == 0 || sizeof...(Rest) == 0,
+                "only the last field of a message can vary in length");
+
+  // Every field is checked, and the results combined without branching.
+  template <typename... Values>
+  static bool valid(const Value &value, const Values &... rest) {
+    return This::valid(value) & Next::valid(rest...);
+  }
+  template <typename... Values>
+  static size_t extra(const Value &value, const Values &... rest) {
+    return This::extra(value) + Next::extra(rest...);
+  }
+  template <typename... Values>
+  static void put(char *out, const Value &value, const Values &... rest) {
+    This::put(out, value);
+    Next::put(&out[This::size], rest...);
+  }
+  template <typename... Values>
+  static void get(const char *in, Value &value, Values &... rest) {
+    This::get(in, value);
+    Next::get(&in[This::size], rest...);
+  }
+  static size_t wireExtra(const char *in) {
+    if (This::maxExtra == 0)
+      return Next::wireExtra(&in[This::size]);
+    uint16_t length;
+    Field<Uint16>::get(in, length);
+    return length;
+  }
+};
+
+//========
+// Codec.
+//========
+
+// Encoding, decoding and framing for one kind of message. Values are passed in
+// field order, one per field except padding.
+template <typename... Encodings> struct Codec {
+  typedef Layout<Encodings...> Fields;
+
+  // The length of the message's fixed part, and the most it can be in all.
+  static constexpr size_t fixedSize = Fields::fixedSize;
+  static constexpr size_t maxSize = Fields::fixedSize + Fields::maxExtra;
+
+  // Encode `values` into `out`, which has room for `capacity` bytes. Returns
+  // the number of bytes written, or 0 if a value is out of range or the
+  // message doesn't fit.
+  template <typename... Values>
+  static size_t encode(char *out, size_t capacity, const Values &... values) {
+    size_t total = fixedSize + Fields::extra(values...);
+    if (!Fields::valid(values...) || total > capacity)
+      return 0;
+    Fields::put(out, values...);
+    return total;
+  }
+
+  // Work out how long the message starting at `buf` is, given the first
+  // `len` bytes of it: the number of bytes needed to tell if `len` isn't
+  // enough, the whole length if it is, or -1 if the message is malformed.
+  static int frameLength(const char *buf, size_t len) {
+    if (len < fixedSize)
+      return fixedSize;
+    size_t extra = Fields::wireExtra(buf);
+    if (extra > Fields::maxExtra)
+      return -1;
+    return fixedSize + extra;
+  }
+
+  // Decode a message into `values`. Returns the number of bytes it took up, 0
+  // if `len` bytes aren't a complete message yet, or -1 if it's malformed.
+  // Bytes values point into `buf`.
+  template <typename... Values>
+  static int decode(const char *buf, size_t len, Values &... values) {
+    int total = frameLength(buf, len);
+    if (total < 0)
+      return -1;
+    if (len < (size_t)total)
+      return 0;
+    Fields::get(buf, values...);
+    return total;
+  }
+};
+
+//===========
+// Messages.
+//===========
+
+// Every request starts with the secret key and message type, then two unused
+// bytes; the body that follows depends on the type.
+template <typename... Body>
+using ClientMessage = Codec<Uint32, Uint16, Padding<2>, Body...>;
+
+typedef ClientMessage<> PreambleCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>, Counted<MAX_VALUE_LENGTH>>
+    SetCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>> GetCodec;
+typedef ClientMessage<Counted<MAX_DIGEST_LENGTH>> DigestCodec;
+typedef ClientMessage<Text<MAX_RUNREQ_LENGTH>> RunCodec;
+typedef PreambleCodec StatsCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>, Uint32,
+                      Counted<MAX_VALUE_LENGTH>>
+    SetTtlCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>, Int64> IncrCodec;
+// Only the last field can vary in length, so a cas request sends the expected
+// value's length up front, and then both values, expected first, as one
+// counted field.
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>, Uint16,
+                      Counted<2 * MAX_VALUE_LENGTH>>
+    CasCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>, Text<MAX_VARNAME_LENGTH>,
+                      Uint16>
+    ScanCodec;
+typedef ClientMessage<Text<MAX_VARNAME_LENGTH>> WatchCodec;
+
+// Every response starts with a status and three bytes of padding. Successful
+// responses to requests that return something follow that with the data.
+typedef Codec<Int8, Padding<3>> StatusCodec;
+template <size_t Max>
+using DataResponseCodec = Codec<Int8, Padding<3>, Counted<Max>>;
+
+// The largest data response either side will handle.
+typedef DataResponseCodec<MAX_STATS_LENGTH> ResponseCodec;
+
+// A change to a watched variable, pushed with status SERVER_PUSH_STATUS: its
+// name, its version, which goes up with every change, and its new value.
+typedef Codec<Int8, Padding<3>, Text<MAX_VARNAME_LENGTH>, Int64,
+              Counted<MAX_VALUE_LENGTH>>
+    PushCodec;
+
+// A version 2 request: the key and type, the version byte where version 1 has
+// padding, a byte of flags (none are defined yet, so it's 0), the request ID,
+// and the length of the body that follows, which is what a version 1 request
+// of the same type has after its preamble.
+typedef Codec<Uint32, Uint16, Uint8, Padding<1>, Uint32, Uint32> FrameV2Codec;
+
+// A version 2 response: the status, the version, the ID of the request it
+// answers, and the length of the data that follows, which is sent bare. A
+// push has request ID 0, and its data is the rest of a version 1 push.
+typedef Codec<Int8, Uint8, Padding<2>, Uint32, Uint32> ResponseV2Codec;
+typedef Codec<Text<MAX_VARNAME_LENGTH>, Int64, Counted<MAX_VALUE_LENGTH>>
+    PushBodyCodec;
+
+static_assert(PreambleCodec::fixedSize == CLIENT_PREAMBLE_SIZE,
+              "the preamble should match CLIENT_PREAMBLE_SIZE");
+static_assert(StatusCodec::fixedSize == SERVER_PREAMBLE_SIZE,
+              "the response status should match SERVER_PREAMBLE_SIZE");
+static_assert(FrameV2Codec::fixedSize == FRAME_V2_HEADER_SIZE &&
+                  ResponseV2Codec::fixedSize == FRAME_V2_RESPONSE_HEADER_SIZE,
+              "the version 2 headers should match their sizes");
+static_assert(SetCodec::maxSize <= MAX_REQUEST_SIZE &&
+                  SetTtlCodec::maxSize <= MAX_REQUEST_SIZE &&
+                  CasCodec::maxSize <= MAX_REQUEST_SIZE &&
+                  DigestCodec::maxSize <= MAX_REQUEST_SIZE,
+              "requests should fit in MAX_REQUEST_SIZE");
+
+} // namespace wire
+
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#include "admission.h"
+#include <atomic>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+#include "stats.h"
+
+static AdmissionLimits limits;
+
+// Connections admitted and not yet released, across every thread.
+static std::atomic<size_t> openConnections{0};
+
+void setAdmissionLimits(const AdmissionLimits &to) { limits = to; }
+
+const AdmissionLimits &admissionLimits() { return limits; }
+
+bool admitConnection(int fd) {
+  if (limits.maxConnections == 0 ||
+      openConnections.fetch_add(1) < limits.maxConnections) {
+    threadStats().connectionsOpened.add();
+    return true;
+  }
+  openConnections.fetch_sub(1);
+
+  // The client hears why before the connection closes. A client that hasn't
+  // read its busy response yet can still do so after the close, since it's
+  // already arrived; the send can't block, since nothing else has been sent.
+  threadStats().connectionsRejected.add();
+  char busy[SERVER_PREAMBLE_SIZE] = {SERVER_BUSY_STATUS};
+  if (send(fd, busy, sizeof(busy), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+    logMessage(LOG_DEBUG, "couldn't tell a rejected connection it's busy");
+  close(fd);
+  return false;
+}
+
+void releaseConnection() {
+  if (limits.maxConnections != 0)
+    openConnections.fetch_sub(1);
+  threadStats().connectionsClosed.add();
+}
+
+bool waitedTooLong(Clock::time_point received) {
+  return limits.maxWaitMs > 0 &&
+         Clock::now() - received > std::chrono::milliseconds(limits.maxWaitMs);
+}
+
+bool queueHasRoom(RequestClass cls, size_t queued) {
+  return queued < limits.maxQueued[cls];
+}
+
+void answerBusy(Connection &conn) {
+  countBusy();
+  conn.queueResponse(SERVER_BUSY_STATUS, false, nullptr, 0);
+}
+
+void countBusy() { threadStats().requestsBusy.add(); }
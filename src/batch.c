@@ -0,0 +1,198 @@
+#include "batch.h"
+#include "common.h"
+#include "sserver.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// An operation in the window: the line it came from, and once it's done, its
+// result.
+typedef struct {
+  int line;
+  int done;
+  int status;
+  int length;
+  char data[MAX_RESPONSE_SIZE];
+} Slot;
+
+typedef struct {
+  int fd;
+  // Operations are numbered in the order they're read, and operation n sits in
+  // slots[n % BATCH_WINDOW] and is sent with request ID n. Those from `head`
+  // up to `next` are in the window; the rest have been printed or not read.
+  Slot slots[BATCH_WINDOW];
+  unsigned int head, next;
+  int failures;
+  // Input read but not yet taken apart into lines, from input[start] up to
+  // input[end].
+  char input[BATCH_MAX_LINE + 1];
+  size_t start, end;
+  int lines;
+  int eof;
+} Batch;
+
+// Print the operations at the head of the window that are done, taking them
+// out of it.
+static void printDone(Batch *batch, BatchPrinter print) {
+  while (batch->head != batch->next) {
+    Slot *slot = &batch->slots[batch->head % BATCH_WINDOW];
+    if (!slot->done)
+      break;
+    print(slot->line, slot->status, slot->data, slot->length);
+    if (slot->status != 0)
+      batch->failures++;
+    batch->head++;
+  }
+}
+
+// Send the operation on `line`, or if it doesn't make sense, put it in the
+// window as already failed. Returns 0, or -1 if the connection was lost.
+static int sendLine(Batch *batch, const char *line, int SecretKey,
+                    BatchEncoder encode, void *context) {
+  Slot *slot = &batch->slots[batch->next % BATCH_WINDOW];
+  slot->line = ++batch->lines;
+  slot->done = 0;
+  char request[MAX_REQUEST_SIZE];
+  const char *error = "Malformed line";
+  size_t length =
+      encode(line, SecretKey, request, sizeof(request), &error, context);
+  if (length == 0) {
+    fprintf(stderr, "Line %d: %s.\n", slot->line, error);
+    slot->done = 1;
+    slot->status = -1;
+    slot->length = 0;
+  } else if (smallSend(batch->fd, batch->next, request, length) != 0) {
+    return -1;
+  }
+  batch->next++;
+  return 0;
+}
+
+// Read a response, and file its result in the window. Returns 0, or -1 if the
+// connection was lost or the server answered something that wasn't asked.
+static int receiveOne(Batch *batch) {
+  unsigned int id;
+  int status;
+  char data[MAX_STATS_LENGTH];
+  int length;
+  if (smallReceive(batch->fd, &id, &status, data, &length, sizeof(data)) != 0)
+    return -1;
+  if (status == SERVER_PUSH_STATUS)
+    return 0;
+  // It has to answer an operation in the window that's still waiting.
+  Slot *slot = &batch->slots[id % BATCH_WINDOW];
+  if (id - batch->head >= batch->next - batch->head || slot->done ||
+      length > (int)sizeof(slot->data))
+    return -1;
+  slot->done = 1;
+  slot->status = status;
+  slot->length = length;
+  memcpy(slot->data, data, length);
+  return 0;
+}
+
+// Read more input, or note that there isn't any. Returns 0, or -1 if it
+// couldn't be read or a line is too long.
+static int readInput(Batch *batch, int inputFd) {
+  memmove(batch->input, &batch->input[batch->start],
+          batch->end - batch->start);
+  batch->end -= batch->start;
+  batch->start = 0;
+  if (batch->end == BATCH_MAX_LINE) {
+    fprintf(stderr, "Error: Line %d is longer than %d bytes.\n",
+            batch->lines + 1, BATCH_MAX_LINE);
+    return -1;
+  }
+  ssize_t got;
+  do {
+    got = read(inputFd, &batch->input[batch->end],
+               BATCH_MAX_LINE - batch->end);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    perror("Error: Couldn't read input");
+    return -1;
+  }
+  if (got == 0) {
+    // A last line without a newline still counts.
+    batch->eof = 1;
+    if (batch->end > 0)
+      batch->input[batch->end++] = '\n';
+  }
+  batch->end += got;
+  return 0;
+}
+
+int runBatch(char *MachineName, int port, int SecretKey, int inputFd,
+             BatchEncoder encode, void *context, BatchPrinter print) {
+  Batch *batch = (Batch *)calloc(1, sizeof(Batch));
+  if (batch == NULL)
+    return -1;
+  if ((batch->fd = smallConnect(MachineName, port)) < 0) {
+    fprintf(stderr, "Error: Couldn't connect to the server.\n");
+    free(batch);
+    return -1;
+  }
+
+  int result = 0;
+  for (;;) {
+    printDone(batch, print);
+    int room = batch->next - batch->head < BATCH_WINDOW;
+    char *newline =
+        room ? (char *)memchr(&batch->input[batch->start], '\n',
+                              batch->end - batch->start)
+             : NULL;
+    if (newline != NULL) {
+      *newline = '\0';
+      if (newline > &batch->input[batch->start] && newline[-1] == '\r')
+        newline[-1] = '\0';
+      const char *line = &batch->input[batch->start];
+      batch->start = newline + 1 - batch->input;
+      if (sendLine(batch, line, SecretKey, encode, context) != 0) {
+        fprintf(stderr, "Error: Lost the connection to the server.\n");
+        result = -1;
+        break;
+      }
+      continue;
+    }
+    if (batch->eof && batch->head == batch->next)
+      break;
+
+    // Nothing more can go until there's more input or room in the window, so
+    // let the results so far out, and wait for whichever comes first.
+    fflush(stdout);
+    struct pollfd fds[2];
+    int count = 0;
+    int waiting = batch->head != batch->next;
+    if (waiting)
+      fds[count++] = (struct pollfd){batch->fd, POLLIN, 0};
+    if (room && !batch->eof)
+      fds[count++] = (struct pollfd){inputFd, POLLIN, 0};
+    if (poll(fds, count, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error: poll");
+      result = -1;
+      break;
+    }
+    if (waiting && fds[0].revents != 0 && receiveOne(batch) != 0) {
+      fprintf(stderr, "Error: Lost the connection to the server.\n");
+      result = -1;
+      break;
+    }
+    if (fds[count - 1].fd == inputFd && fds[count - 1].revents != 0 &&
+        readInput(batch, inputFd) != 0) {
+      result = -1;
+      break;
+    }
+  }
+
+  fflush(stdout);
+  close(batch->fd);
+  if (result == 0)
+    result = batch->failures;
+  free(batch);
+  return result;
+}
@@ -0,0 +1,422 @@
+#include "cluster.h"
+#include "common.h"
+#include "nearcache.h"
+#include "sserver.h"
+#include "wire.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  char *host;
+  int port;
+  int weight;
+  // The pipelined connection the scatter in progress is using, or -1 if it
+  // hasn't one, and how many windows it's carried.
+  int fd;
+  int windows;
+} Node;
+
+// A point on the ring, and the node that owns it.
+typedef struct {
+  unsigned long long hash;
+  int node;
+} Point;
+
+struct SmallCluster {
+  int nodeCount;
+  Node nodes[CLUSTER_MAX_NODES];
+  // Sorted by hash.
+  Point *points;
+  int pointCount;
+  // Held by a scatter, for the nodes' connections.
+  pthread_mutex_t lock;
+};
+
+// One request of a scatter.
+typedef struct {
+  int node;
+  size_t length;
+  char request[MAX_REQUEST_SIZE];
+} Op;
+
+// Called with each response a scatter gathers: the index of its request, and
+// the data it carries.
+typedef void (*Gathered)(int index, const char *data, int length,
+                         void *context);
+
+// FNV-1a, then MurmurHash3's finalizer, since FNV-1a alone leaves the short,
+// similar strings we hash bunched together on the ring.
+static unsigned long long hashBytes(const char *data, size_t length) {
+  unsigned long long hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int comparePoints(const void *a, const void *b) {
+  const Point *left = (const Point *)a, *right = (const Point *)b;
+  if (left->hash != right->hash)
+    return left->hash < right->hash ? -1 : 1;
+  return left->node - right->node;
+}
+
+// Parse "host:port" or "host:port=weight" into `node`. Returns 0, or -1 if
+// it doesn't make sense.
+static int parseNode(const char *spec, Node *node) {
+  const char *colon = strrchr(spec, ':');
+  if (colon == NULL || colon == spec)
+    return -1;
+  char *end;
+  long port = strtol(colon + 1, &end, 10);
+  long weight = 1;
+  if (end == colon + 1 || port < 0 || port > 65535)
+    return -1;
+  if (*end == '=') {
+    const char *start = end + 1;
+    weight = strtol(start, &end, 10);
+    if (end == start || weight < 1 || weight > 1000)
+      return -1;
+  }
+  if (*end != '\0')
+    return -1;
+
+  node->host = strndup(spec, colon - spec);
+  node->port = port;
+  node->weight = weight;
+  node->fd = -1;
+  return node->host != NULL ? 0 : -1;
+}
+
+SmallCluster *smallClusterOpen(char **nodes, int count) {
+  if (count < 1 || count > CLUSTER_MAX_NODES)
+    return NULL;
+  SmallCluster *cluster = (SmallCluster *)calloc(1, sizeof(SmallCluster));
+  if (cluster == NULL)
+    return NULL;
+  pthread_mutex_init(&cluster->lock, NULL);
+
+  int points = 0;
+  for (int i = 0; i < count; i++) {
+    if (parseNode(nodes[i], &cluster->nodes[i]) != 0) {
+      smallClusterClose(cluster);
+      return NULL;
+    }
+    cluster->nodeCount++;
+    points += cluster->nodes[i].weight * CLUSTER_POINTS_PER_WEIGHT;
+  }
+
+  cluster->points = (Point *)malloc(points * sizeof(Point));
+  if (cluster->points == NULL) {
+    smallClusterClose(cluster);
+    return NULL;
+  }
+  for (int i = 0; i < count; i++) {
+    Node *node = &cluster->nodes[i];
+    for (int j = 0; j < node->weight * CLUSTER_POINTS_PER_WEIGHT; j++) {
+      char label[300];
+      int length = snprintf(label, sizeof(label), "%.255s:%d-%d", node->host,
+                            node->port, j);
+      Point *point = &cluster->points[cluster->pointCount++];
+      point->hash = hashBytes(label, length);
+      point->node = i;
+    }
+  }
+  qsort(cluster->points, cluster->pointCount, sizeof(Point), comparePoints);
+  return cluster;
+}
+
+void smallClusterClose(SmallCluster *cluster) {
+  for (int i = 0; i < cluster->nodeCount; i++) {
+    if (cluster->nodes[i].fd >= 0)
+      close(cluster->nodes[i].fd);
+    free(cluster->nodes[i].host);
+  }
+  free(cluster->points);
+  pthread_mutex_destroy(&cluster->lock);
+  free(cluster);
+}
+
+int smallClusterNode(const SmallCluster *cluster, const char *variableName) {
+  unsigned long long hash = hashBytes(variableName, strlen(variableName));
+  // The first point at or after the hash, wrapping around past the last.
+  int low = 0, high = cluster->pointCount;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (cluster->points[middle].hash < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return cluster->points[low == cluster->pointCount ? 0 : low].node;
+}
+
+char *smallClusterHost(const SmallCluster *cluster, int node) {
+  return cluster->nodes[node].host;
+}
+
+int smallClusterPort(const SmallCluster *cluster, int node) {
+  return cluster->nodes[node].port;
+}
+
+int smallClusterSet(SmallCluster *cluster, int SecretKey, char *variableName,
+                    char *value, short dataLength) {
+  Node *node = &cluster->nodes[smallClusterNode(cluster, variableName)];
+  return smallSet(node->host, node->port, SecretKey, variableName, value,
+                  dataLength);
+}
+
+int smallClusterGet(SmallCluster *cluster, int SecretKey, char *variableName,
+                    char *value, int *resultLength) {
+  Node *node = &cluster->nodes[smallClusterNode(cluster, variableName)];
+  return smallGet(node->host, node->port, SecretKey, variableName, value,
+                  resultLength);
+}
+
+//===========
+// Scatters.
+//===========
+
+// Close a node's connection, after it failed or once the scatter's done, so
+// the next window opens another.
+static void dropNode(Node *node) {
+  close(node->fd);
+  node->fd = -1;
+}
+
+// Send up to CLUSTER_WINDOW of a node's requests, from `order[first]` on.
+// Returns how many were sent; if that's fewer than there were to send, the
+// node's connection failed.
+static int sendWindow(Node *node, const Op *ops, const int *order, int first,
+                      int last) {
+  if (node->fd < 0) {
+    if ((node->fd = smallConnect(node->host, node->port)) < 0)
+      return 0;
+    node->windows = 0;
+  }
+  node->windows++;
+  int sent = 0;
+  while (first + sent < last && sent < CLUSTER_WINDOW) {
+    const Op *op = &ops[order[first + sent]];
+    if (smallSend(node->fd, order[first + sent], op->request, op->length) !=
+        0) {
+      dropNode(node);
+      break;
+    }
+    sent++;
+  }
+  return sent;
+}
+
+// Gather the responses to the `sent` requests sent from `order[first]` on.
+// Returns how many were gathered; if that's fewer than `sent`, the node's
+// connection failed.
+static int gatherWindow(Node *node, const int *order, int first, int sent,
+                        int *statuses, Gathered gathered, void *context) {
+  int received = 0;
+  while (received < sent) {
+    unsigned int index;
+    int status;
+    char data[MAX_STATS_LENGTH];
+    int length;
+    if (smallReceive(node->fd, &index, &status, data, &length,
+                     sizeof(data)) != 0) {
+      dropNode(node);
+      break;
+    }
+    if (status == SERVER_PUSH_STATUS)
+      continue;
+    // It has to answer one of this window's requests that's still waiting.
+    int found = 0;
+    for (int i = first; i < first + sent && !found; i++)
+      found = order[i] == (int)index;
+    if (!found || statuses[index] != SERVER_PUSH_STATUS) {
+      dropNode(node);
+      break;
+    }
+    statuses[index] = status;
+    if (status == 0 && gathered != NULL)
+      gathered(index, data, length, context);
+    received++;
+  }
+  return received;
+}
+
+// Send each of the `count` requests in `ops` to its node, and gather the
+// responses, writing each one's status to `statuses` and handing its data to
+// `gathered`. Returns 0 if they all succeeded, or -1 if any didn't.
+static int scatter(SmallCluster *cluster, const Op *ops, int count,
+                   int *statuses, Gathered gathered, void *context) {
+  // Group the requests by node, keeping their order within each node.
+  int *order = (int *)malloc((count + 1) * sizeof(int));
+  int start[CLUSTER_MAX_NODES + 1] = {0};
+  int next[CLUSTER_MAX_NODES];
+  int sent[CLUSTER_MAX_NODES];
+  if (order == NULL)
+    return -1;
+  // Nothing's been answered yet; a push's status stands for that, since no
+  // request is ever answered with it. Requests that couldn't be encoded fail
+  // without being sent.
+  int remaining = 0;
+  for (int i = 0; i < count; i++) {
+    statuses[i] = ops[i].length > 0 ? SERVER_PUSH_STATUS : -1;
+    if (ops[i].length > 0) {
+      start[ops[i].node + 1]++;
+      remaining++;
+    }
+  }
+  for (int node = 0; node < cluster->nodeCount; node++) {
+    start[node + 1] += start[node];
+    next[node] = start[node];
+  }
+  for (int i = 0; i < count; i++) {
+    if (ops[i].length > 0)
+      order[next[ops[i].node]++] = i;
+  }
+
+  pthread_mutex_lock(&cluster->lock);
+  for (int node = 0; node < cluster->nodeCount; node++)
+    next[node] = start[node];
+  while (remaining > 0) {
+    // Scatter a window to every node, then gather them, so all the nodes are
+    // working at once.
+    for (int node = 0; node < cluster->nodeCount; node++)
+      sent[node] = next[node] < start[node + 1]
+                       ? sendWindow(&cluster->nodes[node], ops, order,
+                                    next[node], start[node + 1])
+                       : 0;
+    for (int node = 0; node < cluster->nodeCount; node++) {
+      Node *at = &cluster->nodes[node];
+      int first = next[node], last = start[node + 1];
+      if (first == last)
+        continue;
+      int wanted =
+          last - first < CLUSTER_WINDOW ? last - first : CLUSTER_WINDOW;
+      int reused = at->windows > 1;
+      int answered = sent[node] == wanted
+                         ? gatherWindow(at, order, first, sent[node], statuses,
+                                        gathered, context)
+                         : 0;
+      // The server may have closed a connection that carried earlier
+      // windows in between, at a deadline, say. If it failed before anything
+      // was answered, nothing's lost by trying the window once more on a new
+      // one.
+      if (answered == 0 && reused) {
+        if (at->fd >= 0)
+          dropNode(at);
+        sent[node] = sendWindow(at, ops, order, first, last);
+        answered = sent[node] == wanted
+                       ? gatherWindow(at, order, first, sent[node], statuses,
+                                      gathered, context)
+                       : 0;
+      }
+      if (answered < wanted) {
+        // Whatever this node hadn't answered fails with it.
+        for (int i = first; i < last; i++) {
+          if (statuses[order[i]] == SERVER_PUSH_STATUS)
+            statuses[order[i]] = -1;
+        }
+        remaining -= last - first;
+        next[node] = last;
+      } else {
+        remaining -= wanted;
+        next[node] += wanted;
+      }
+    }
+  }
+  // Don't keep the connections: a node on the blocking backend would serve
+  // nothing else while one was open, and the server would close it anyway
+  // once it had been idle long enough.
+  for (int node = 0; node < cluster->nodeCount; node++) {
+    if (cluster->nodes[node].fd >= 0)
+      dropNode(&cluster->nodes[node]);
+  }
+  pthread_mutex_unlock(&cluster->lock);
+  free(order);
+
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    if (statuses[i] != 0)
+      result = -1;
+  }
+  return result;
+}
+
+int smallClusterSetMany(SmallCluster *cluster, int SecretKey,
+                        char **variableNames, char **values,
+                        short *dataLengths, int count, int *statuses) {
+  if (count < 1)
+    return 0;
+  Op *ops = (Op *)malloc(count * sizeof(Op));
+  if (ops == NULL)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    ClientSet message = {
+        {SecretKey, SSERVER_MSG_SET, {0, 0}}, {0}, dataLengths[i]};
+    ops[i].length = 0;
+    if (strlen(variableNames[i]) <= MAX_VARNAME_LENGTH &&
+        dataLengths[i] >= 0 && dataLengths[i] <= MAX_VALUE_LENGTH) {
+      strcpy(message.varName, variableNames[i]);
+      memcpy(message.value, values[i], dataLengths[i]);
+      ops[i].length =
+          encodeClientSet(&message, ops[i].request, sizeof(ops[i].request));
+    }
+    ops[i].node = smallClusterNode(cluster, variableNames[i]);
+  }
+  int result = scatter(cluster, ops, count, statuses, NULL, NULL);
+  for (int i = 0; i < count; i++) {
+    Node *node = &cluster->nodes[ops[i].node];
+    nearCacheInvalidate(node->host, node->port, SecretKey, variableNames[i]);
+  }
+  free(ops);
+  return result;
+}
+
+// Where a gathered get's value goes.
+typedef struct {
+  char **values;
+  int *resultLengths;
+} GetResults;
+
+static void gatheredGet(int index, const char *data, int length,
+                        void *context) {
+  GetResults *results = (GetResults *)context;
+  if (length > MAX_VALUE_LENGTH)
+    length = MAX_VALUE_LENGTH;
+  memcpy(results->values[index], data, length);
+  results->resultLengths[index] = length;
+}
+
+int smallClusterGetMany(SmallCluster *cluster, int SecretKey,
+                        char **variableNames, int count, char **values,
+                        int *resultLengths, int *statuses) {
+  if (count < 1)
+    return 0;
+  Op *ops = (Op *)malloc(count * sizeof(Op));
+  if (ops == NULL)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    ClientGet message = {{SecretKey, SSERVER_MSG_GET, {0, 0}}, {0}};
+    ops[i].length = 0;
+    if (strlen(variableNames[i]) <= MAX_VARNAME_LENGTH) {
+      strcpy(message.varName, variableNames[i]);
+      ops[i].length =
+          encodeClientGet(&message, ops[i].request, sizeof(ops[i].request));
+    }
+    ops[i].node = smallClusterNode(cluster, variableNames[i]);
+    resultLengths[i] = 0;
+  }
+  GetResults results = {values, resultLengths};
+  int result = scatter(cluster, ops, count, statuses, gatheredGet, &results);
+  free(ops);
+  return result;
+}
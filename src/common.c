@@ -3,9 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #define BASE 10
 
+const char *requestTypeNames[MESSAGE_TYPE_COUNT] = {
+    "set", "get", "digest", "run", "stats", "set_ttl", "incr", "cas",
+    "scan", "watch"};
+
 int parseIntWithError(char *toParse, const char *errorMsg) {
   // Try to parse the string as an integer, then print the error if it fails.
   int parsed = strtol(toParse, NULL, BASE);
@@ -44,3 +49,20 @@ int isValidRunRequest(char *runRequest) {
   return isValid;
 }
 
+const char *failureMessage(int status) {
+  return status == SERVER_BUSY_STATUS ? "busy" : "failed";
+}
+
+int sendAll(int fd, const void *buf, size_t length) {
+  const char *next = (const char *)buf;
+  while (length > 0) {
+    ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return -1;
+    next += sent;
+    length -= sent;
+  }
+  return 0;
+}
@@ -0,0 +1,263 @@
+#include "compute.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include "admission.h"
+#include "log.h"
+#include "mailbox.h"
+
+using std::condition_variable;
+using std::deque;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+// A finished request's response, on its way back to the connection.
+struct Completion {
+  uint64_t connId;
+  uint64_t ticket;
+  char status;
+  bool withData;
+  string data;
+};
+
+// Where a thread without a mailbox waits for its response.
+struct Waiter {
+  mutex lock;
+  condition_variable done;
+  bool finished = false;
+  char status = 0;
+  Response response;
+};
+
+// A request waiting for a worker, with its own copy of every field it points
+// to. It's never moved once they're pointed at.
+struct Job {
+  Job(const Request &from, Clock::time_point at)
+      : request(from), name(from.name, from.nameLength),
+        value(from.value, from.valueLength),
+        expected(from.expected, from.expectedLength),
+        cursor(from.cursor, from.cursorLength), received(at) {
+    request.name = name.data();
+    request.value = value.data();
+    request.expected = expected.data();
+    request.cursor = cursor.data();
+  }
+
+  Request request;
+  string name;
+  string value;
+  string expected;
+  string cursor;
+  Clock::time_point received;
+
+  // Where the response goes: a connection's mailbox and ticket, or a waiter.
+  Mailbox<Completion> *mailbox = nullptr;
+  uint64_t connId = 0;
+  uint64_t ticket = 0;
+  Waiter *waiter = nullptr;
+};
+
+struct Worker {
+  mutex lock;
+  deque<unique_ptr<Job>> jobs;
+};
+
+static RequestRunner runner;
+static vector<unique_ptr<Worker>> workers;
+
+// Requests in every worker's queue. Idle workers sleep until it's non-zero.
+static std::atomic<size_t> queued{0};
+static mutex idleLock;
+static condition_variable idle;
+
+// The worker each I/O thread hands its requests to, given out in turn.
+static std::atomic<size_t> nextHome{0};
+static thread_local Worker *home = nullptr;
+
+static thread_local Mailbox<Completion> *mailbox = nullptr;
+
+//==========
+// Workers.
+//==========
+
+// Take a job: the oldest of the worker's own, or else the newest of anyone
+// else's.
+static unique_ptr<Job> take(size_t self) {
+  unique_ptr<Job> job;
+  for (size_t i = 0; i < workers.size() && !job; i++) {
+    Worker &from = *workers[(self + i) % workers.size()];
+    lock_guard<mutex> guard(from.lock);
+    if (from.jobs.empty())
+      continue;
+    if (i == 0) {
+      job = std::move(from.jobs.front());
+      from.jobs.pop_front();
+    } else {
+      job = std::move(from.jobs.back());
+      from.jobs.pop_back();
+    }
+  }
+  if (job)
+    queued.fetch_sub(1);
+  return job;
+}
+
+// Run a job, unless it's waited too long already, and send its response
+// wherever it goes.
+static void run(Job &job) {
+  Response response;
+  char status;
+  if (waitedTooLong(job.received)) {
+    countBusy();
+    status = SERVER_BUSY_STATUS;
+  } else {
+    runner(job.request, job.received, response);
+    status = response.success ? 0 : -1;
+  }
+
+  if (job.waiter != nullptr) {
+    Waiter &waiter = *job.waiter;
+    lock_guard<mutex> guard(waiter.lock);
+    waiter.status = status;
+    waiter.response = std::move(response);
+    waiter.finished = true;
+    waiter.done.notify_one();
+    return;
+  }
+  job.mailbox->post(Completion{job.connId, job.ticket, status,
+                               status == 0 && response.withData,
+                               std::move(response.data)});
+}
+
+static void work(size_t self, int niceness) {
+  // Niceness is per thread on Linux, whatever POSIX says.
+  if (niceness != 0 &&
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceness) != 0)
+    logMessage(LOG_WARN, "can't set compute worker niceness to %d: %s",
+               niceness, strerror(errno));
+
+  while (true) {
+    unique_ptr<Job> job = take(self);
+    if (job) {
+      run(*job);
+      continue;
+    }
+    unique_lock<mutex> guard(idleLock);
+    idle.wait(guard, [] { return queued.load() != 0; });
+  }
+}
+
+// Hand a job to the calling thread's worker, and wake a worker for it. The
+// count goes up first, so a worker that finds it non-zero looks until it
+// finds the job.
+static void submit(unique_ptr<Job> job) {
+  if (home == nullptr)
+    home = workers[nextHome.fetch_add(1) % workers.size()].get();
+  {
+    lock_guard<mutex> guard(idleLock);
+    queued.fetch_add(1);
+  }
+  {
+    lock_guard<mutex> guard(home->lock);
+    home->jobs.push_back(std::move(job));
+  }
+  idle.notify_one();
+}
+
+//=============
+// Public API.
+//=============
+
+void startComputePool(const ComputeLimits &limits, RequestRunner run) {
+  runner = run;
+  int threads = limits.threads;
+  if (threads < 0) {
+    cpu_set_t allowed;
+    threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+                  ? CPU_COUNT(&allowed)
+                  : 1;
+  }
+  for (int i = 0; i < threads; i++)
+    workers.emplace_back(new Worker);
+  for (int i = 0; i < threads; i++)
+    std::thread(work, i, limits.niceness).detach();
+  if (threads > 0)
+    logMessage(LOG_INFO, "compute pool of %d %s at niceness %d", threads,
+               threads == 1 ? "worker" : "workers", limits.niceness);
+}
+
+int computeThreads() { return workers.size(); }
+
+size_t computeQueued() { return queued.load(); }
+
+int openComputeMailbox() {
+  if (mailbox == nullptr)
+    mailbox = new Mailbox<Completion>("compute");
+  return mailbox->fd;
+}
+
+void deliverComputed(vector<Connection *> &touched) {
+  if (mailbox == nullptr)
+    return;
+  vector<Completion> completions = mailbox->take();
+
+  size_t first = touched.size();
+  for (const Completion &done : completions) {
+    // The connection may have gone while its request was running.
+    Connection *conn = Connection::find(done.connId);
+    if (conn == nullptr)
+      continue;
+    conn->completeResponse(done.ticket, done.status, done.withData,
+                           done.data.data(), done.data.size());
+    touched.push_back(conn);
+  }
+
+  std::sort(touched.begin() + first, touched.end());
+  touched.erase(std::unique(touched.begin() + first, touched.end()),
+                touched.end());
+}
+
+bool computeRequest(Connection &conn, const Request &request,
+                    Clock::time_point received) {
+  if (workers.empty())
+    return false;
+  if (!queueHasRoom(REQUEST_EXPENSIVE, queued.load())) {
+    answerBusy(conn);
+    return true;
+  }
+
+  unique_ptr<Job> job(new Job(request, received));
+  if (mailbox != nullptr) {
+    job->mailbox = mailbox;
+    job->connId = conn.id;
+    job->ticket = conn.deferResponse();
+    submit(std::move(job));
+    return true;
+  }
+
+  // No mailbox: wait here for the response.
+  Waiter waiter;
+  job->waiter = &waiter;
+  submit(std::move(job));
+  unique_lock<mutex> guard(waiter.lock);
+  waiter.done.wait(guard, [&] { return waiter.finished; });
+  const Response &response = waiter.response;
+  conn.queueResponse(waiter.status, waiter.status == 0 && response.withData,
+                     response.data.data(), response.data.size());
+  return true;
+}
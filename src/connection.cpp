@@ -0,0 +1,139 @@
+#include "connection.h"
+#include <cstring>
+#include <unordered_map>
+#include "watch.h"
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+// The calling thread's live connections, by id.
+static thread_local unordered_map<uint64_t, Connection *> liveConnections;
+static thread_local uint64_t nextId = 0;
+
+// Tickets for deferred version 2 responses have this bit set, and the request
+// ID in the low bits. Held responses' tickets never get near it.
+static const uint64_t V2_TICKET = 1ull << 63;
+
+Connection::Connection(int fd)
+    : fd(fd), id(nextId++), input(RECEIVE_BUFFER_SIZE) {
+  liveConnections[id] = this;
+}
+
+Connection::~Connection() {
+  forgetWatches(id);
+  liveConnections.erase(id);
+}
+
+Connection *Connection::find(uint64_t id) {
+  auto found = liveConnections.find(id);
+  return found == liveConnections.end() ? nullptr : found->second;
+}
+
+char *Connection::receiveSpace(size_t &space) {
+  // Move whatever's left of a partial request to the front, so there's always
+  // room for the rest of it. Requests are much smaller than the buffer, so
+  // this is at most a few bytes.
+  if (start > 0) {
+    memmove(&input[0], &input[start], end - start);
+    end -= start;
+    start = 0;
+  }
+  space = input.size() - end;
+  return &input[end];
+}
+
+void Connection::received(size_t length) { end += length; }
+
+int Connection::bytesWanted() const {
+  if (start == end)
+    return 0;
+  int length = frameLength(&input[start], end - start);
+  if (length < 0)
+    return -1;
+  return (size_t)length > end - start ? length - (end - start) : 0;
+}
+
+int Connection::nextRequest(Request &request) {
+  int length = decodeRequest(&input[start], end - start, request);
+  if (length > 0)
+    start += length;
+  return length > 0 ? 1 : length;
+}
+
+void Connection::startRequest(const Request &request) {
+  replyVersion = request.version;
+  replyId = request.requestId;
+  if (request.version == FRAME_VERSION_2)
+    speaksV2 = true;
+}
+
+void Connection::encode(vector<char> &out, uint8_t version,
+                        uint32_t requestId, char status, bool withData,
+                        const char *data, size_t dataLength) {
+  size_t at = out.size();
+  if (version == FRAME_VERSION_2) {
+    out.resize(at + FRAME_V2_RESPONSE_HEADER_SIZE + dataLength);
+    out.resize(at + encodeResponseV2(requestId, status, withData, data,
+                                     dataLength, &out[at]));
+    return;
+  }
+  out.resize(at + SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + dataLength);
+  out.resize(at + encodeResponse(status, withData, data, dataLength, &out[at]));
+}
+
+void Connection::queueResponse(char status, bool withData, const char *data,
+                               size_t dataLength) {
+  if (held.empty() || replyVersion == FRAME_VERSION_2) {
+    encode(output, replyVersion, replyId, status, withData, data, dataLength);
+    return;
+  }
+  held.emplace_back();
+  held.back().ready = true;
+  encode(held.back().bytes, replyVersion, replyId, status, withData, data,
+         dataLength);
+}
+
+uint64_t Connection::deferResponse() {
+  if (replyVersion == FRAME_VERSION_2) {
+    v2Outstanding++;
+    return V2_TICKET | replyId;
+  }
+  held.emplace_back();
+  return heldBase + held.size() - 1;
+}
+
+void Connection::completeResponse(uint64_t ticket, char status, bool withData,
+                                  const char *data, size_t dataLength) {
+  if (ticket & V2_TICKET) {
+    encode(output, FRAME_VERSION_2, (uint32_t)ticket, status, withData, data,
+           dataLength);
+    v2Outstanding--;
+    return;
+  }
+
+  HeldResponse &response = held[ticket - heldBase];
+  encode(response.bytes, 1, 0, status, withData, data, dataLength);
+  response.ready = true;
+
+  while (!held.empty() && held.front().ready) {
+    output.insert(output.end(), held.front().bytes.begin(),
+                  held.front().bytes.end());
+    held.pop_front();
+    heldBase++;
+  }
+}
+
+void Connection::queuePush(const string &push) {
+  if (!speaksV2) {
+    output.insert(output.end(), push.begin(), push.end());
+    return;
+  }
+  // The push's status and padding make way for a version 2 header, and the
+  // rest is its data.
+  size_t at = output.size();
+  size_t dataLength = push.size() - SERVER_PREAMBLE_SIZE;
+  output.resize(at + FRAME_V2_RESPONSE_HEADER_SIZE + dataLength);
+  encodeResponseV2(0, SERVER_PUSH_STATUS, true, &push[SERVER_PREAMBLE_SIZE],
+                   dataLength, &output[at]);
+}
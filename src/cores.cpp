@@ -0,0 +1,469 @@
+#include "cores.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "admission.h"
+#include "log.h"
+#include "spsc.h"
+
+using std::deque;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+// What goes from one core to another: a forwarded request, or the response to
+// one, or a request for a core's part of a scan, or that part. Everything the
+// other core needs is copied in, since the request's connection buffer may be
+// reused before it's run.
+struct CoreMessage {
+  enum Kind : uint8_t {
+    FORWARD_REQUEST,
+    FORWARD_RESPONSE,
+    SCAN_REQUEST,
+    SCAN_RESPONSE
+  };
+  uint8_t kind;
+  uint8_t type;
+  int8_t status;
+  uint8_t withData;
+  uint16_t nameLength;
+  // The length of the value in a request, or of the data in a response.
+  uint16_t length;
+  uint32_t secretKey;
+  uint32_t ttlMs;
+  int64_t delta;
+  // For a cas, the data holds the expected value and then the new one.
+  uint16_t expectedLength;
+  // For a scan, how many names to find, and which of the sending core's
+  // scans it's part of. The prefix is the name, and the cursor the data.
+  uint16_t count;
+  uint64_t gather;
+  // A scan's part: names the receiver takes over, and frees.
+  vector<string> *names;
+  // The connection the request came in on, on the forwarding core, and the
+  // ticket its response was deferred with.
+  uint64_t connection;
+  uint64_t ticket;
+  Clock::rep received;
+  char name[MAX_VARNAME_LENGTH];
+  char data[2 * MAX_VALUE_LENGTH];
+};
+
+typedef SpscQueue<CoreMessage, CORE_QUEUE_SIZE> CoreQueue;
+
+// A scan whose parts are still coming in from the other cores.
+struct Gather {
+  uint64_t connection;
+  uint64_t ticket;
+  Clock::time_point received;
+  unsigned int secretKey;
+  string prefix;
+  unsigned int count;
+  int waiting;
+  // Every part so far, in no particular order.
+  vector<string> names;
+};
+
+struct Core {
+  explicit Core(int index, int cores)
+      : index(index), store(1, false), backlog(cores), wake(cores) {}
+
+  int index;
+  int listenfd = -1;
+  // An eventfd other cores write to after queueing messages here.
+  int wakefd = -1;
+  VarStore store;
+
+  // Only touched by the core's own thread.
+  //
+  // Messages for each core that didn't fit in its queue, oldest first.
+  vector<deque<CoreMessage>> backlog;
+  // Which cores have been sent messages since they were last woken.
+  vector<bool> wake;
+  // When the store should next expire variables.
+  Clock::time_point nextExpiry;
+  // Scans started here, by id.
+  unordered_map<uint64_t, Gather> gathers;
+  uint64_t nextGather = 0;
+};
+
+static int cores = 0;
+static vector<unique_ptr<Core>> allCores;
+// The queue from core i to core j is queues[i * cores + j].
+static vector<CoreQueue *> queues;
+static RequestRunner runner;
+static RequestRecorder recorder;
+// The Unix domain socket listener every core shares, or -1 if there isn't one.
+static int localListenfd = -1;
+
+static thread_local Core *current = nullptr;
+
+int coreCount() { return cores; }
+
+VarStore &coreStore(int core) { return allCores[core]->store; }
+
+int currentCore() { return current == nullptr ? -1 : current->index; }
+
+static CoreQueue &queueBetween(int from, int to) {
+  return *queues[from * cores + to];
+}
+
+// Which core owns the variable `name`, by an FNV-1a hash of the name.
+static int ownerOf(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  return hash % cores;
+}
+
+// Whether core `to`'s queue from `from` has room for another request. The
+// queue itself is bounded, so only once it's full, and a backlog is building
+// up behind it, can there be too many.
+static bool hasRoom(Core &from, int to, const Request &request) {
+  const deque<CoreMessage> &backlog = from.backlog[to];
+  return backlog.empty() || queueHasRoom(requestClass(request.type),
+                                         CORE_QUEUE_SIZE + backlog.size());
+}
+
+// Send `message` to core `to`, behind anything already waiting for it.
+static void sendTo(Core &from, int to, const CoreMessage &message) {
+  deque<CoreMessage> &backlog = from.backlog[to];
+  if (!backlog.empty() || !queueBetween(from.index, to).push(message))
+    backlog.push_back(message);
+  from.wake[to] = true;
+}
+
+// Start a scan: take this core's part now, and ask every other core for
+// theirs.
+static void startScan(Core &core, Connection &conn, const Request &request,
+                      Clock::time_point received) {
+  uint64_t id = core.nextGather++;
+  Gather &gather = core.gathers[id];
+  gather.connection = conn.id;
+  gather.ticket = conn.deferResponse();
+  gather.received = received;
+  gather.secretKey = request.secretKey;
+  gather.prefix.assign(request.name, request.nameLength);
+  gather.count = request.count;
+  gather.waiting = cores - 1;
+  core.store.scan(gather.prefix, string(request.cursor, request.cursorLength),
+                  request.count + 1, gather.names);
+
+  CoreMessage message;
+  message.kind = CoreMessage::SCAN_REQUEST;
+  message.gather = id;
+  message.count = request.count;
+  message.nameLength = request.nameLength;
+  memcpy(message.name, request.name, request.nameLength);
+  message.length = request.cursorLength;
+  memcpy(message.data, request.cursor, request.cursorLength);
+  for (int to = 0; to < cores; to++) {
+    if (to != core.index)
+      sendTo(core, to, message);
+  }
+}
+
+bool forwardRequest(Connection &conn, const Request &request,
+                    Clock::time_point received) {
+  Core *core = current;
+  if (core == nullptr || cores == 1)
+    return false;
+  if (request.type == SSERVER_MSG_SCAN) {
+    for (int to = 0; to < cores; to++) {
+      if (to != core->index && !hasRoom(*core, to, request)) {
+        answerBusy(conn);
+        return true;
+      }
+    }
+    startScan(*core, conn, request, received);
+    return true;
+  }
+  switch (request.type) {
+  case SSERVER_MSG_SET:
+  case SSERVER_MSG_GET:
+  case SSERVER_MSG_SET_TTL:
+  case SSERVER_MSG_INCR:
+  case SSERVER_MSG_CAS:
+    break;
+  default:
+    return false;
+  }
+  int owner = ownerOf(request.name, request.nameLength);
+  if (owner == core->index)
+    return false;
+  if (!hasRoom(*core, owner, request)) {
+    answerBusy(conn);
+    return true;
+  }
+
+  CoreMessage message;
+  message.kind = CoreMessage::FORWARD_REQUEST;
+  message.type = request.type;
+  message.secretKey = request.secretKey;
+  message.ttlMs = request.ttlMs;
+  message.delta = request.delta;
+  message.nameLength = request.nameLength;
+  memcpy(message.name, request.name, request.nameLength);
+  message.expectedLength = request.expectedLength;
+  if (request.expectedLength > 0)
+    memcpy(message.data, request.expected, request.expectedLength);
+  message.length = request.valueLength;
+  if (request.valueLength > 0)
+    memcpy(&message.data[request.expectedLength], request.value,
+           request.valueLength);
+  message.received = received.time_since_epoch().count();
+  message.connection = conn.id;
+  message.ticket = conn.deferResponse();
+  sendTo(*core, owner, message);
+  return true;
+}
+
+// Run a request forwarded from core `from`, and send the response back.
+static void runForwarded(Core &core, int from, const CoreMessage &message) {
+  Request request = Request();
+  request.secretKey = message.secretKey;
+  request.type = (MessageType)message.type;
+  request.name = message.name;
+  request.nameLength = message.nameLength;
+  request.expected = message.data;
+  request.expectedLength = message.expectedLength;
+  request.value = &message.data[message.expectedLength];
+  request.valueLength = message.length;
+  request.ttlMs = message.ttlMs;
+  request.delta = message.delta;
+
+  // A request that spent too long in the queue isn't worth running any more.
+  Clock::time_point received(Clock::duration(message.received));
+  Response response;
+  bool busy = waitedTooLong(received);
+  if (busy)
+    countBusy();
+  else
+    runner(request, received, response);
+
+  CoreMessage reply;
+  reply.kind = CoreMessage::FORWARD_RESPONSE;
+  reply.connection = message.connection;
+  reply.ticket = message.ticket;
+  reply.status = busy ? SERVER_BUSY_STATUS : response.success ? 0 : -1;
+  reply.withData = response.withData;
+  reply.length = 0;
+  reply.expectedLength = 0;
+  if (response.data.size() <= sizeof(reply.data)) {
+    reply.length = response.data.size();
+    memcpy(reply.data, response.data.data(), reply.length);
+  } else {
+    reply.status = -1;
+    reply.withData = false;
+  }
+  sendTo(core, from, reply);
+}
+
+// Find this core's part of a scan started on core `from`, and send it back.
+static void scanForCore(Core &core, int from, const CoreMessage &message) {
+  CoreMessage reply;
+  reply.kind = CoreMessage::SCAN_RESPONSE;
+  reply.gather = message.gather;
+  reply.names = new vector<string>();
+  core.store.scan(string(message.name, message.nameLength),
+                  string(message.data, message.length), message.count + 1,
+                  *reply.names);
+  sendTo(core, from, reply);
+}
+
+// Add another core's part to a scan, and answer it if that was the last.
+// Returns the connection answered, if it's still open.
+static Connection *gatherScan(Core &core, const CoreMessage &message) {
+  auto found = core.gathers.find(message.gather);
+  Gather &gather = found->second;
+  gather.names.insert(gather.names.end(), message.names->begin(),
+                      message.names->end());
+  delete message.names;
+  if (--gather.waiting > 0)
+    return nullptr;
+
+  // Every core sent its first count + 1 matches, so the first count + 1 of
+  // them all are the first of the lot.
+  std::sort(gather.names.begin(), gather.names.end());
+  if (gather.names.size() > gather.count + 1)
+    gather.names.resize(gather.count + 1);
+  Response response;
+  response.withData = true;
+  response.data = encodeScanPage(gather.names, gather.count);
+
+  Request request = Request();
+  request.secretKey = gather.secretKey;
+  request.type = SSERVER_MSG_SCAN;
+  request.name = gather.prefix.data();
+  request.nameLength = gather.prefix.size();
+  recorder(request, gather.received, response);
+
+  Connection *conn = Connection::find(gather.connection);
+  if (conn != nullptr)
+    conn->completeResponse(gather.ticket, 0, true, response.data.data(),
+                           response.data.size());
+  core.gathers.erase(found);
+  return conn;
+}
+
+// Handle every message waiting in the calling core's queues.
+static void drainQueues(vector<Connection *> &touched) {
+  Core &core = *current;
+  uint64_t count;
+  if (read(core.wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    logMessage(LOG_WARN, "reading core %d's eventfd failed: %s", core.index,
+               strerror(errno));
+
+  CoreMessage message;
+  for (int from = 0; from < cores; from++) {
+    CoreQueue &queue = queueBetween(from, core.index);
+    while (queue.pop(message)) {
+      if (message.kind == CoreMessage::FORWARD_REQUEST) {
+        runForwarded(core, from, message);
+        continue;
+      }
+      if (message.kind == CoreMessage::SCAN_REQUEST) {
+        scanForCore(core, from, message);
+        continue;
+      }
+      if (message.kind == CoreMessage::SCAN_RESPONSE) {
+        Connection *conn = gatherScan(core, message);
+        if (conn != nullptr)
+          touched.push_back(conn);
+        continue;
+      }
+      // The client may have hung up while its request was away.
+      Connection *conn = Connection::find(message.connection);
+      if (conn == nullptr)
+        continue;
+      conn->completeResponse(message.ticket, message.status, message.withData,
+                             message.data, message.length);
+      touched.push_back(conn);
+    }
+  }
+}
+
+// At the end of each batch of events, expire variables if it's time, move what
+// we can of the backlogs onto the queues, and wake every core that was sent
+// something. Each core is woken at most once a batch, however much it was sent.
+static int finishBatch() {
+  Core &core = *current;
+  Clock::time_point now = Clock::now();
+  if (now >= core.nextExpiry) {
+    core.store.expire();
+    core.nextExpiry =
+        now + std::chrono::milliseconds(STORE_EXPIRY_INTERVAL_MS);
+  }
+
+  bool backedUp = false;
+  for (int to = 0; to < cores; to++) {
+    deque<CoreMessage> &backlog = core.backlog[to];
+    CoreQueue &queue = queueBetween(core.index, to);
+    while (!backlog.empty() && queue.push(backlog.front())) {
+      backlog.pop_front();
+      core.wake[to] = true;
+    }
+    backedUp |= !backlog.empty();
+
+    if (core.wake[to]) {
+      uint64_t one = 1;
+      if (write(allCores[to]->wakefd, &one, sizeof(one)) < 0)
+        logMessage(LOG_WARN, "waking core %d failed: %s", to, strerror(errno));
+      core.wake[to] = false;
+    }
+  }
+  // A full queue only drains when its core gets to it; check back shortly.
+  return backedUp ? 1 : STORE_EXPIRY_INTERVAL_MS;
+}
+
+// The CPUs this process may run on.
+static vector<int> allowedCpus() {
+  vector<int> cpus;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty())
+    cpus.push_back(0);
+  return cpus;
+}
+
+static void runCore(Core *core, int cpu, RequestHandler handler) {
+  cpu_set_t mine;
+  CPU_ZERO(&mine);
+  CPU_SET(cpu, &mine);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+  if (error != 0)
+    logMessage(LOG_WARN, "can't pin core %d to cpu %d: %s", core->index, cpu,
+               strerror(error));
+  else
+    logMessage(LOG_DEBUG, "core %d pinned to cpu %d", core->index, cpu);
+
+  current = core;
+  EpollSource source = {core->wakefd, drainQueues, finishBatch};
+  vector<int> listenfds = {core->listenfd};
+  if (localListenfd >= 0)
+    listenfds.push_back(localListenfd);
+  serveEpoll(listenfds, handler, &source);
+}
+
+bool serveCores(int port, int localfd, int coresWanted, size_t memoryLimit,
+                RequestHandler handler, RequestRunner run,
+                RequestRecorder record) {
+  // Read the CPUs before pinning anything, since threads inherit the pinning
+  // of the thread that starts them.
+  vector<int> cpus = allowedCpus();
+  cores = coresWanted > 0 ? coresWanted : cpus.size();
+  runner = run;
+  recorder = record;
+  localListenfd = localfd;
+
+  for (int i = 0; i < cores; i++) {
+    allCores.emplace_back(new Core(i, cores));
+    Core &core = *allCores.back();
+    core.store.setMemoryLimit(memoryLimit / cores);
+    core.listenfd = openReusePortListener(port);
+    if (core.listenfd < 0)
+      return false;
+    core.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (core.wakefd < 0)
+      return false;
+  }
+
+  for (int i = 0; i < cores * cores; i++) {
+    // Plain new doesn't honour CoreQueue's cache line alignment before C++17.
+    void *memory;
+    if (posix_memalign(&memory, alignof(CoreQueue), sizeof(CoreQueue)) != 0)
+      abort();
+    queues.push_back(new (memory) CoreQueue());
+  }
+
+  logMessage(LOG_INFO, "shared-nothing mode on %d cores", cores);
+
+  vector<thread> threads;
+  for (int i = 1; i < cores; i++)
+    threads.emplace_back(runCore, allCores[i].get(), cpus[i % cpus.size()],
+                         handler);
+  runCore(allCores[0].get(), cpus[0], handler);
+
+  for (thread &t : threads)
+    t.join();
+  return true;
+}
@@ -0,0 +1,71 @@
+#include "deadlines.h"
+#include "watch.h"
+
+static DeadlineLimits limits;
+
+void setDeadlineLimits(const DeadlineLimits &to) { limits = to; }
+
+const DeadlineLimits &deadlineLimits() { return limits; }
+
+const char *deadlineKindName(DeadlineKind kind) {
+  static const char *names[] = {"none", "read", "write", "idle"};
+  return names[kind];
+}
+
+DeadlineKind deadlineFor(const Connection &conn, bool backedUp) {
+  if (backedUp)
+    return DEADLINE_WRITE;
+  if (conn.awaitingResponses())
+    return DEADLINE_NONE;
+  if (conn.hasPartialRequest())
+    return DEADLINE_READ;
+  if (hasWatches(conn.id))
+    return DEADLINE_NONE;
+  return DEADLINE_IDLE;
+}
+
+int deadlineLength(DeadlineKind kind) {
+  switch (kind) {
+  case DEADLINE_READ:
+  case DEADLINE_WRITE:
+    return limits.ioMs;
+  case DEADLINE_IDLE:
+    return limits.idleMs;
+  default:
+    return 0;
+  }
+}
+
+uint64_t deadlineTick(Clock::time_point at) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             at.time_since_epoch())
+             .count() /
+         DEADLINE_TICK_MS;
+}
+
+DeadlineTimers::DeadlineTimers() : wheel(deadlineTick(Clock::now())) {}
+
+void DeadlineTimers::update(Connection &conn, bool backedUp, bool progressed,
+                            Clock::time_point now) {
+  DeadlineKind kind = deadlineFor(conn, backedUp);
+  int length = deadlineLength(kind);
+  if (length == 0) {
+    conn.deadlineKind = DEADLINE_NONE;
+    return;
+  }
+  if (kind == conn.deadlineKind && !progressed)
+    return;
+
+  // Round up, so a deadline never comes early.
+  conn.deadlineKind = kind;
+  conn.deadlineTick =
+      deadlineTick(now + std::chrono::milliseconds(length)) + 1;
+  if (conn.timerTick == 0 || conn.deadlineTick < conn.timerTick) {
+    conn.timerTick = conn.deadlineTick;
+    wheel.schedule(conn.timerTick, conn.id);
+  }
+}
+
+int DeadlineTimers::timeout() const {
+  return wheel.size() == 0 ? -1 : DEADLINE_TICK_MS;
+}
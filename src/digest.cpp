@@ -0,0 +1,247 @@
+#include "digest.h"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::string;
+
+// The program the sha256sum backend runs.
+static const char *SHA256SUM_PATH = "/bin/sha256sum";
+
+// What sha256sum prints after the hash when reading stdin.
+static const char *STDIN_SUFFIX = "  -";
+
+//==========
+// SHA-256.
+//==========
+
+static const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// Mix one 64-byte block into the hash state.
+static void compressBlock(uint32_t state[8], const unsigned char block[64]) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + ROUND_CONSTANTS[i] + w[i];
+    uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void sha256(const void *data, size_t length, unsigned char out[SHA256_SIZE]) {
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  const unsigned char *bytes = (const unsigned char *)data;
+
+  size_t whole = length / 64 * 64;
+  for (size_t i = 0; i < whole; i += 64)
+    compressBlock(state, &bytes[i]);
+
+  // Pad the tail: a 1 bit, zeros, then the length in bits. That takes one or
+  // two more blocks depending on how much is left over.
+  unsigned char tail[128] = {0};
+  size_t left = length - whole;
+  memcpy(tail, &bytes[whole], left);
+  tail[left] = 0x80;
+  size_t tailLength = left < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t)length * 8;
+  for (int i = 0; i < 8; i++)
+    tail[tailLength - 1 - i] = (unsigned char)(bits >> (i * 8));
+  for (size_t i = 0; i < tailLength; i += 64)
+    compressBlock(state, &tail[i]);
+
+  for (int i = 0; i < 8; i++) {
+    out[i * 4] = (unsigned char)(state[i] >> 24);
+    out[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+    out[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+    out[i * 4 + 3] = (unsigned char)state[i];
+  }
+}
+
+//============
+// Backends.
+//============
+
+// Hash the value plus the newline echo would have added, and format it the
+// way sha256sum does.
+static string builtinDigest(const char *value, size_t valueLength) {
+  string input(value, valueLength);
+  input += '\n';
+
+  unsigned char hash[SHA256_SIZE];
+  sha256(input.data(), input.size(), hash);
+
+  static const char hexDigits[] = "0123456789abcdef";
+  string out(SHA256_SIZE * 2, '0');
+  for (size_t i = 0; i < SHA256_SIZE; i++) {
+    out[i * 2] = hexDigits[hash[i] >> 4];
+    out[i * 2 + 1] = hexDigits[hash[i] & 0xf];
+  }
+  return out + STDIN_SUFFIX;
+}
+
+// Feed the value to sha256sum on its stdin and read back what it prints. The
+// value never goes near a shell.
+static string sha256sumDigest(const char *value, size_t valueLength) {
+  // NOTE: According to man 2 pipe, [0] is the read end, [1] is write end.
+  int childIn[2], childOut[2];
+  if (pipe(childIn) != 0)
+    return "";
+  if (pipe(childOut) != 0) {
+    close(childIn[0]);
+    close(childIn[1]);
+    return "";
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(childIn[0], STDIN_FILENO);
+    dup2(childOut[1], STDOUT_FILENO);
+    close(childIn[0]);
+    close(childIn[1]);
+    close(childOut[0]);
+    close(childOut[1]);
+    execl(SHA256SUM_PATH, SHA256SUM_PATH, (char *)NULL);
+    _exit(127);
+  }
+
+  close(childIn[0]);
+  close(childOut[1]);
+
+  string out;
+  if (pid > 0) {
+    // The value is far smaller than a pipe buffer, so this can't block.
+    ssize_t ignored = write(childIn[1], value, valueLength);
+    ignored = write(childIn[1], "\n", 1);
+    (void)ignored;
+    close(childIn[1]);
+
+    char buf[128];
+    ssize_t n;
+    while ((n = read(childOut[0], buf, sizeof(buf))) > 0)
+      out.append(buf, n);
+    waitpid(pid, NULL, 0);
+  } else {
+    close(childIn[1]);
+  }
+  close(childOut[0]);
+
+  // Remove the trailing newline if there is one.
+  if (!out.empty() && out.back() == '\n')
+    out.pop_back();
+  return out;
+}
+
+bool parseDigestBackend(const string &name, DigestBackend &backend) {
+  if (name == "builtin")
+    backend = DIGEST_BUILTIN;
+  else if (name == "sha256sum")
+    backend = DIGEST_SHA256SUM;
+  else
+    return false;
+  return true;
+}
+
+const char *digestBackendName(DigestBackend backend) {
+  return backend == DIGEST_SHA256SUM ? "sha256sum" : "builtin";
+}
+
+string computeDigest(DigestBackend backend, const char *value,
+                     size_t valueLength) {
+  valueLength = strnlen(value, valueLength);
+  if (backend == DIGEST_SHA256SUM)
+    return sha256sumDigest(value, valueLength);
+  return builtinDigest(value, valueLength);
+}
+
+//================
+// Digest cache.
+//================
+
+struct DigestCacheSlot {
+  std::mutex lock;
+  bool used = false;
+  DigestBackend backend;
+  string input;
+  string output;
+};
+
+static DigestCacheSlot digestCache[DIGEST_CACHE_SLOTS];
+
+string digest(DigestBackend backend, const char *value, size_t valueLength,
+              bool *cached) {
+  string input(value, strnlen(value, valueLength));
+  DigestCacheSlot &slot =
+      digestCache[std::hash<string>()(input) % DIGEST_CACHE_SLOTS];
+
+  {
+    std::lock_guard<std::mutex> guard(slot.lock);
+    if (slot.used && slot.backend == backend && slot.input == input) {
+      if (cached != nullptr)
+        *cached = true;
+      return slot.output;
+    }
+  }
+
+  // Compute outside the lock; the sha256sum backend takes a while.
+  string output = computeDigest(backend, input.data(), input.size());
+  {
+    std::lock_guard<std::mutex> guard(slot.lock);
+    slot.used = true;
+    slot.backend = backend;
+    slot.input = input;
+    slot.output = output;
+  }
+
+  if (cached != nullptr)
+    *cached = false;
+  return output;
+}
@@ -0,0 +1,81 @@
+#include "histogram.h"
+#include <string.h>
+
+// Index of the highest set bit of a non-zero value.
+static int highestBit(uint64_t value) { return 63 - __builtin_clzll(value); }
+
+// Map a value to its bucket. Values below HISTOGRAM_SUB_BUCKETS get a bucket
+// each; above that, the magnitude picks a group of HISTOGRAM_SUB_BUCKETS / 2
+// buckets and the next HISTOGRAM_SUB_BUCKET_BITS - 1 bits pick one of them.
+int histogramBucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (int)value;
+
+  int magnitude = highestBit(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+  if (magnitude > HISTOGRAM_MAGNITUDES)
+    return HISTOGRAM_BUCKETS - 1;
+
+  int subBucket = (int)(value >> magnitude);
+  return magnitude * (HISTOGRAM_SUB_BUCKETS / 2) + subBucket;
+}
+
+// The largest value that lands in bucket `index`.
+uint64_t histogramBucketValue(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return (uint64_t)index;
+
+  int magnitude = index / (HISTOGRAM_SUB_BUCKETS / 2) - 1;
+  uint64_t subBucket = index - magnitude * (HISTOGRAM_SUB_BUCKETS / 2);
+  return ((subBucket + 1) << magnitude) - 1;
+}
+
+void histogramInit(Histogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void histogramRecord(Histogram *h, uint64_t value) {
+  h->counts[histogramBucket(value)]++;
+  h->total++;
+  h->sum += value;
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+void histogramMerge(Histogram *dst, const Histogram *src) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+uint64_t histogramPercentile(const Histogram *h, double percentile) {
+  if (h->total == 0)
+    return 0;
+
+  // The rank of the value we want, counting from 1.
+  uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      // Don't report more than we actually saw.
+      uint64_t value = histogramBucketValue(i);
+      return value > h->max ? h->max : value;
+    }
+  }
+  return h->max;
+}
+
+double histogramMean(const Histogram *h) {
+  return h->total == 0 ? 0.0 : (double)h->sum / h->total;
+}
@@ -0,0 +1,298 @@
+#include "log.h"
+#include <atomic>
+#include <csignal>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+using std::atomic;
+using std::lock_guard;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::mutex;
+using std::string;
+using std::vector;
+
+// What a record holds.
+enum RecordKind : uint8_t { RECORD_MESSAGE, RECORD_AUDIT };
+
+// The space left in a record for text.
+const size_t LOG_TEXT_SIZE = 104;
+
+// One log record, exactly two cache lines long.
+struct LogRecord {
+  uint64_t timeNs;
+  uint32_t secretKey;
+  uint8_t level;
+  uint8_t kind;
+  uint8_t requestType;
+  uint8_t success;
+  uint16_t length;
+  char text[LOG_TEXT_SIZE];
+};
+static_assert(sizeof(LogRecord) == 128, "log records should be 128 bytes");
+
+// A single-producer, single-consumer ring of records. The owning thread is the
+// only producer; whoever holds drainLock is the only consumer.
+struct LogRing {
+  alignas(64) atomic<uint64_t> head{0};
+  alignas(64) atomic<uint64_t> tail{0};
+
+  // Producer-only rate limiting state.
+  alignas(64) uint64_t tokens = 0;
+  uint64_t lastRefillNs = 0;
+
+  // Written by the producer, read and reset by the consumer.
+  atomic<uint64_t> droppedFull{0};
+  atomic<uint64_t> droppedRate{0};
+
+  LogRecord records[LOG_RING_SIZE];
+};
+
+static atomic<int> currentLevel{LOG_INFO};
+static atomic<unsigned int> ratePerSecond{LOG_DEFAULT_RATE};
+
+static mutex registryLock;
+static vector<LogRing *> registry;
+
+// Held while draining, so logFlush() and the background thread don't both
+// consume from the same ring.
+static mutex drainLock;
+
+static const char *levelNames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static uint64_t clockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static LogRing &threadRing() {
+  static thread_local LogRing *mine = nullptr;
+  if (mine == nullptr) {
+    // Plain new doesn't honour LogRing's cache line alignment before C++17.
+    void *memory;
+    if (posix_memalign(&memory, alignof(LogRing), sizeof(LogRing)) != 0)
+      abort();
+    mine = new (memory) LogRing();
+    lock_guard<mutex> guard(registryLock);
+    registry.push_back(mine);
+  }
+  return *mine;
+}
+
+// Claim the next free record in this thread's ring, or return null (and count
+// the drop) if the ring is full or the thread is over its rate limit. The
+// record isn't visible to the consumer until commit().
+static LogRecord *reserve(LogRing &ring, LogLevel level) {
+  if (level < LOG_ERROR) {
+    // Coarse clocks are a few nanoseconds to read, and plenty for this.
+    uint64_t now = clockNs(CLOCK_MONOTONIC_COARSE);
+    uint64_t rate = ratePerSecond.load(memory_order_relaxed);
+    if (now - ring.lastRefillNs >= 1000000ULL) {
+      ring.tokens += (now - ring.lastRefillNs) * rate / 1000000000ULL;
+      if (ring.tokens > rate)
+        ring.tokens = rate;
+      ring.lastRefillNs = now;
+    }
+    if (ring.tokens == 0) {
+      ring.droppedRate.fetch_add(1, memory_order_relaxed);
+      return nullptr;
+    }
+    ring.tokens--;
+  }
+
+  uint64_t head = ring.head.load(memory_order_relaxed);
+  if (head - ring.tail.load(memory_order_acquire) >= LOG_RING_SIZE) {
+    ring.droppedFull.fetch_add(1, memory_order_relaxed);
+    return nullptr;
+  }
+
+  LogRecord *record = &ring.records[head % LOG_RING_SIZE];
+  record->timeNs = clockNs(CLOCK_REALTIME_COARSE);
+  record->level = level;
+  return record;
+}
+
+static void commit(LogRing &ring) {
+  ring.head.store(ring.head.load(memory_order_relaxed) + 1,
+                  memory_order_release);
+}
+
+bool parseLogLevel(const string &name, LogLevel &level) {
+  for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+    if (strcasecmp(name.c_str(), levelNames[i]) == 0) {
+      level = (LogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void logSetLevel(LogLevel level) { currentLevel.store(level); }
+
+bool logEnabled(LogLevel level) {
+  return level >= currentLevel.load(memory_order_relaxed);
+}
+
+void logMessage(LogLevel level, const char *format, ...) {
+  if (!logEnabled(level))
+    return;
+
+  LogRing &ring = threadRing();
+  LogRecord *record = reserve(ring, level);
+  if (record == nullptr)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(record->text, LOG_TEXT_SIZE, format, args);
+  va_end(args);
+
+  record->kind = RECORD_MESSAGE;
+  record->length = length < 0 ? 0
+                   : (size_t)length >= LOG_TEXT_SIZE ? LOG_TEXT_SIZE - 1
+                                                     : length;
+  commit(ring);
+}
+
+void logAudit(unsigned int secretKey, MessageType type, const char *detail,
+              size_t detailLength, bool success) {
+  if (!logEnabled(LOG_INFO))
+    return;
+
+  LogRing &ring = threadRing();
+  LogRecord *record = reserve(ring, LOG_INFO);
+  if (record == nullptr)
+    return;
+
+  record->kind = RECORD_AUDIT;
+  record->secretKey = secretKey;
+  record->requestType = type;
+  record->success = success;
+  record->length = detailLength < LOG_TEXT_SIZE ? detailLength : LOG_TEXT_SIZE;
+  if (record->length > 0)
+    memcpy(record->text, detail, record->length);
+  commit(ring);
+}
+
+//===========
+// Draining.
+//===========
+
+// Append `length` bytes of `text`, escaping anything unprintable so the log
+// stays one record per line.
+static void appendEscaped(string &out, const char *text, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c >= 0x20 && c < 0x7f) {
+      out += c;
+    } else {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "\\x%02x", c);
+      out += hex;
+    }
+  }
+}
+
+static void formatRecord(string &out, const LogRecord &record) {
+  time_t seconds = record.timeNs / 1000000000ULL;
+  struct tm parts;
+  localtime_r(&seconds, &parts);
+  char stamp[48];
+  size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &parts);
+  snprintf(&stamp[n], sizeof(stamp) - n, ".%03u %-5s ",
+           (unsigned)(record.timeNs / 1000000ULL % 1000),
+           levelNames[record.level]);
+  out += stamp;
+
+  if (record.kind == RECORD_AUDIT) {
+    const char *typeName = record.requestType < MESSAGE_TYPE_COUNT
+                               ? requestTypeNames[record.requestType]
+                               : "unknown";
+    char fields[96];
+    snprintf(fields, sizeof(fields), "secret_key=%u request_type=%s detail=\"",
+             record.secretKey, typeName);
+    out += fields;
+    appendEscaped(out, record.text, record.length);
+    out += record.success ? "\" completion=success\n"
+                          : "\" completion=failure\n";
+  } else {
+    out.append(record.text, record.length);
+    out += '\n';
+  }
+}
+
+// Consume everything currently in every ring and write it out.
+static void drainAll() {
+  lock_guard<mutex> drainGuard(drainLock);
+
+  vector<LogRing *> rings;
+  {
+    lock_guard<mutex> guard(registryLock);
+    rings = registry;
+  }
+
+  string out;
+  for (LogRing *ring : rings) {
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    uint64_t head = ring->head.load(memory_order_acquire);
+    for (; tail != head; tail++)
+      formatRecord(out, ring->records[tail % LOG_RING_SIZE]);
+    ring->tail.store(tail, memory_order_release);
+
+    uint64_t full = ring->droppedFull.exchange(0, memory_order_relaxed);
+    uint64_t rate = ring->droppedRate.exchange(0, memory_order_relaxed);
+    if (full != 0 || rate != 0) {
+      char note[128];
+      snprintf(note, sizeof(note),
+               "log: dropped %llu records (ring full) and %llu (rate limit)\n",
+               (unsigned long long)full, (unsigned long long)rate);
+      out += note;
+    }
+  }
+
+  if (!out.empty()) {
+    fwrite(out.data(), 1, out.size(), stderr);
+    fflush(stderr);
+  }
+}
+
+void logFlush() { drainAll(); }
+
+void logStart(LogLevel level, unsigned int maxPerSecond) {
+  logSetLevel(level);
+  ratePerSecond.store(maxPerSecond);
+
+  std::thread([] {
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(LOG_DRAIN_INTERVAL_MS));
+      drainAll();
+    }
+  }).detach();
+}
+
+static void onLevelSignal(int signal) {
+  int level = currentLevel.load(memory_order_relaxed);
+  if (signal == SIGUSR1 && level > LOG_DEBUG)
+    currentLevel.store(level - 1);
+  else if (signal == SIGUSR2 && level < LOG_ERROR)
+    currentLevel.store(level + 1);
+}
+
+void logInstallSignalHandlers() {
+  std::signal(SIGUSR1, onLevelSignal);
+  std::signal(SIGUSR2, onLevelSignal);
+}
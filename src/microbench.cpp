@@ -0,0 +1,353 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+#include "common.h"
+}
+#include "digest.h"
+#include "protocol.h"
+#include "spsc.h"
+#include "store.h"
+#include "wire.h"
+
+using std::function;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+
+// In-process microbenchmarks for the server's hot paths. Each benchmark
+// prints one JSON object per line, so results can be diffed or loaded into a
+// spreadsheet without scraping:
+//
+//   {"benchmark": ..., "variant": ..., "threads": ..., "keys": ...,
+//    "iterations": ..., "ns_per_op": ..., "ops_per_sec": ...}
+//
+// ns_per_op is the time one thread spends on one operation; ops_per_sec is the
+// total across all threads.
+
+// Run each benchmark for at least this long.
+const double MIN_SECONDS = 0.2;
+
+// Somewhere to put results so the compiler can't optimize the work away.
+volatile size_t sink;
+
+static void report(const char *benchmark, const string &variant, int threads,
+                   size_t keys, size_t iterations, double seconds) {
+  double nsPerOp = seconds * 1e9 * threads / iterations;
+  printf("{\"benchmark\": \"%s\", \"variant\": \"%s\", \"threads\": %d, "
+         "\"keys\": %zu, \"iterations\": %zu, \"ns_per_op\": %.1f, "
+         "\"ops_per_sec\": %.0f}\n",
+         benchmark, variant.c_str(), threads, keys, iterations, nsPerOp,
+         iterations / seconds);
+  fflush(stdout);
+}
+
+// Time `body(n)`, which should do n operations, doubling n until the run
+// takes at least MIN_SECONDS. Returns the elapsed time of the final run and
+// stores its n in `iterations`.
+static double timeLoop(const function<void(size_t)> &body, size_t &iterations) {
+  iterations = 64;
+  while (true) {
+    auto start = Clock::now();
+    body(iterations);
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (seconds >= MIN_SECONDS)
+      return seconds;
+    iterations *= 2;
+  }
+}
+
+//===========================
+// Request building helpers.
+//===========================
+
+static size_t buildSet(char *buf, const char *name, const string &value) {
+  return wire::SetCodec::encode(buf, MAX_REQUEST_SIZE, 42, SSERVER_MSG_SET,
+                                wire::Bytes{name, strlen(name)},
+                                wire::Bytes{value.data(), value.size()});
+}
+
+static size_t buildGet(char *buf, const char *name) {
+  return wire::GetCodec::encode(buf, MAX_REQUEST_SIZE, 42, SSERVER_MSG_GET,
+                                wire::Bytes{name, strlen(name)});
+}
+
+static size_t buildDigest(char *buf, const string &value) {
+  return wire::DigestCodec::encode(buf, MAX_REQUEST_SIZE, 42,
+                                   SSERVER_MSG_DIGEST,
+                                   wire::Bytes{value.data(), value.size()});
+}
+
+//=============
+// Benchmarks.
+//=============
+
+static void benchPreamble() {
+  char buf[MAX_REQUEST_SIZE];
+  buildGet(buf, "counter");
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+          buf[0] = (char)i;
+          ClientPreamble pre = readPreamble(buf);
+          sink = sink + pre.secretKey + pre.msgType;
+        }
+      },
+      iterations);
+  report("preamble_parse", "v1", 1, 0, iterations, seconds);
+}
+
+static void benchDecode() {
+  string value(32, 'v');
+  struct {
+    const char *variant;
+    char buf[MAX_REQUEST_SIZE];
+    size_t length;
+  } frames[3];
+  frames[0].variant = "set";
+  frames[0].length = buildSet(frames[0].buf, "counter", value);
+  frames[1].variant = "get";
+  frames[1].length = buildGet(frames[1].buf, "counter");
+  frames[2].variant = "digest";
+  frames[2].length = buildDigest(frames[2].buf, value);
+
+  for (auto &frame : frames) {
+    size_t iterations;
+    double seconds = timeLoop(
+        [&](size_t n) {
+          Request request;
+          for (size_t i = 0; i < n; i++)
+            sink = sink + decodeRequest(frame.buf, frame.length, request) +
+                   request.valueLength;
+        },
+        iterations);
+    report("frame_decode", frame.variant, 1, 0, iterations, seconds);
+  }
+}
+
+static string keyName(size_t i) {
+  char name[32];
+  snprintf(name, sizeof(name), "k%zu", i);
+  return name;
+}
+
+// Run `perThread(thread, n)` on `threads` threads at once, each doing n
+// operations, and report the total.
+static void benchThreads(const char *benchmark, const string &variant,
+                         int threads, size_t keys,
+                         const function<void(int, size_t)> &perThread) {
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        vector<std::thread> workers;
+        for (int t = 0; t < threads; t++)
+          workers.emplace_back(perThread, t, n);
+        for (auto &worker : workers)
+          worker.join();
+      },
+      iterations);
+  report(benchmark, variant, threads, keys, iterations * threads, seconds);
+}
+
+static void benchStore() {
+  const size_t keyCounts[] = {1000, 100000};
+  const int threadCounts[] = {1, 2, 4, 8};
+  string value(32, 'v');
+
+  for (size_t keys : keyCounts) {
+    VarStore store;
+    vector<string> names;
+    for (size_t i = 0; i < keys; i++) {
+      names.push_back(keyName(i));
+      store.set(names.back(), value.data(), value.size());
+    }
+
+    for (int threads : threadCounts) {
+      benchThreads("store_get", "sharded", threads, keys,
+                   [&](int t, size_t n) {
+                     string out;
+                     size_t k = t * 7919;
+                     for (size_t i = 0; i < n; i++, k += 104729)
+                       sink = sink + store.get(names[k % keys], out);
+                   });
+      benchThreads("store_set", "sharded", threads, keys,
+                   [&](int t, size_t n) {
+                     size_t k = t * 7919;
+                     for (size_t i = 0; i < n; i++, k += 104729)
+                       store.set(names[k % keys], value.data(), value.size());
+                   });
+
+      // The shared-nothing mode's layout: each thread owns an unlocked store
+      // with its share of the keys, and only asks for those.
+      vector<unique_ptr<VarStore>> owned;
+      for (int t = 0; t < threads; t++)
+        owned.emplace_back(new VarStore(1, false));
+      for (size_t i = 0; i < keys; i++)
+        owned[i % threads]->set(names[i], value.data(), value.size());
+      size_t share = keys / threads;
+      benchThreads("store_get", "owned", threads, keys,
+                   [&](int t, size_t n) {
+                     VarStore &mine = *owned[t];
+                     string out;
+                     size_t k = 0;
+                     for (size_t i = 0; i < n; i++, k += 104729)
+                       sink = sink + mine.get(names[k % share * threads + t],
+                                              out);
+                   });
+      benchThreads("store_set", "owned", threads, keys,
+                   [&](int t, size_t n) {
+                     VarStore &mine = *owned[t];
+                     size_t k = 0;
+                     for (size_t i = 0; i < n; i++, k += 104729)
+                       mine.set(names[k % share * threads + t], value.data(),
+                                value.size());
+                   });
+    }
+
+    // A page of a scan, from wherever the cursor happens to be.
+    benchThreads("store_scan", "page", 1, keys, [&](int, size_t n) {
+      vector<string> page;
+      size_t k = 0;
+      for (size_t i = 0; i < n; i++, k += 104729) {
+        page.clear();
+        store.scan("", names[k % keys], MAX_SCAN_COUNT + 1, page);
+        sink = sink + page.size();
+      }
+    });
+  }
+}
+
+// Set one variable over and over with a long time to live, under a memory
+// limit. A set mustn't leave another timer charged against the limit each
+// time, so the store has to stay within it. Returns false if it didn't.
+static bool benchTtlReset() {
+  const size_t limit = 64 * 1024;
+  VarStore store;
+  store.setMemoryLimit(limit);
+  string value(32, 'v');
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+          store.set("hot", value.data(), value.size(), 3600000);
+      },
+      iterations);
+  report("store_set", "ttl_reset", 1, 1, iterations, seconds);
+  if (store.memoryUsed() > store.memoryLimit()) {
+    fprintf(stderr, "store_set ttl_reset: %zu bytes used, over the limit of "
+                    "%zu\n",
+            store.memoryUsed(), store.memoryLimit());
+    return false;
+  }
+  return true;
+}
+
+// About the size of the messages the shared-nothing mode's cores exchange.
+struct QueueItem {
+  char bytes[152];
+};
+typedef SpscQueue<QueueItem, 256> BenchQueue;
+
+// Stream messages from one thread to another through an SpscQueue. The
+// consumer yields when the queue's empty and the producer when it's full, so
+// this still makes progress with fewer CPUs than threads.
+static void benchQueue() {
+  void *memory;
+  if (posix_memalign(&memory, alignof(BenchQueue), sizeof(BenchQueue)) != 0)
+    abort();
+  BenchQueue *queue = new (memory) BenchQueue();
+
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        std::thread consumer([&] {
+          QueueItem item;
+          for (size_t i = 0; i < n; i++) {
+            while (!queue->pop(item))
+              std::this_thread::yield();
+            sink = sink + item.bytes[0];
+          }
+        });
+        QueueItem item = {};
+        for (size_t i = 0; i < n; i++) {
+          item.bytes[0] = i;
+          while (!queue->push(item))
+            std::this_thread::yield();
+        }
+        consumer.join();
+      },
+      iterations);
+  report("spsc_queue", "stream", 2, 0, iterations, seconds);
+
+  queue->~BenchQueue();
+  free(memory);
+}
+
+static void benchDigest() {
+  string value(32, 'v');
+  const DigestBackend backends[] = {DIGEST_BUILTIN, DIGEST_SHA256SUM};
+  for (DigestBackend backend : backends) {
+    size_t iterations;
+    double seconds = timeLoop(
+        [&](size_t n) {
+          for (size_t i = 0; i < n; i++)
+            sink = sink +
+                   computeDigest(backend, value.data(), value.size()).size();
+        },
+        iterations);
+    report("sha256", digestBackendName(backend), 1, 0, iterations, seconds);
+  }
+
+  // The same value every time, so every lookup after the first is a hit.
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+          sink = sink +
+                 digest(DIGEST_SHA256SUM, value.data(), value.size()).size();
+      },
+      iterations);
+  report("sha256", "cache_hit", 1, 0, iterations, seconds);
+}
+
+static void benchEncode() {
+  string data(32, 'd');
+  char out[SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + MAX_RESPONSE_SIZE];
+  size_t iterations;
+  double seconds = timeLoop(
+      [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+          sink = sink + encodeResponse(0, true, data.data(), data.size(), out);
+      },
+      iterations);
+  report("response_encode", "with_data", 1, 0, iterations, seconds);
+
+  seconds = timeLoop(
+      [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+          sink = sink + encodeResponse(0, false, nullptr, 0, out);
+      },
+      iterations);
+  report("response_encode", "status_only", 1, 0, iterations, seconds);
+}
+
+int main() {
+  benchPreamble();
+  benchDecode();
+  benchStore();
+  bool withinLimit = benchTtlReset();
+  benchQueue();
+  benchDigest();
+  benchEncode();
+  return withinLimit ? 0 : 1;
+}
@@ -0,0 +1,576 @@
+#include "nearcache.h"
+#include "common.h"
+#include "csapp.h"
+#include "resolver.h"
+#include "shmclient.h"
+#include "sserver.h"
+#include "wire.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// The longest host name we'll cache copies from.
+#define NEAR_CACHE_HOST_LENGTH 256
+
+// How many buckets each server's table of watched names has.
+#define NEAR_CACHE_WATCH_BUCKETS 1024
+
+// The fewest and most buckets the table of copies can have.
+#define NEAR_CACHE_MIN_BUCKETS 64
+#define NEAR_CACHE_MAX_BUCKETS (1 << 20)
+
+// One cached copy. It's in its bucket's chain, and in the LRU list, whose
+// head is the most recently read.
+typedef struct Entry {
+  struct Entry *next;
+  struct Entry *newer;
+  struct Entry *older;
+  int server;
+  unsigned int hash;
+  long long filledMs;
+  char name[MAX_VARNAME_LENGTH + 1];
+  int length;
+  char value[];
+} Entry;
+
+// A name watched on a server's connection. Until the server answers the
+// watch, it's also in the queue of watches waiting for an answer.
+typedef struct Watched {
+  struct Watched *next;
+  struct Watched *nextPending;
+  int active;
+  unsigned long long ticket;
+  char name[MAX_VARNAME_LENGTH + 1];
+} Watched;
+
+typedef struct {
+  int used;
+  char host[NEAR_CACHE_HOST_LENGTH];
+  int port;
+  int secretKey;
+  // Whether the server refused a watch, so nothing from it can be cached.
+  int refused;
+  // The watch connection, or -1 if there isn't one, and how many there have
+  // been, counting it.
+  int fd;
+  unsigned long long connection;
+  Watched *watched[NEAR_CACHE_WATCH_BUCKETS];
+  size_t watchCount;
+  Watched *pendingHead;
+  Watched *pendingTail;
+  unsigned long long watchesSent;
+  unsigned long long watchesAnswered;
+  unsigned long long generations[NEAR_CACHE_GENERATIONS];
+} Server;
+
+// What a watch connection's reader thread needs.
+typedef struct {
+  int server;
+  int fd;
+  unsigned long long connection;
+} Reader;
+
+// Everything is under one lock. Hits hold it for a lookup and a copy.
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled whenever a watch is answered, or a connection's lost.
+static pthread_cond_t watchAnswered = PTHREAD_COND_INITIALIZER;
+
+static int enabled;
+static size_t maxEntries, maxBytes;
+static long long maxAgeMs;
+static Entry **buckets;
+static size_t bucketCount;
+static Entry *newest, *oldest;
+static size_t entryCount, byteCount;
+static unsigned long long hits, misses;
+static Server servers[NEAR_CACHE_SERVERS];
+
+static long long nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a over a variable name.
+static unsigned int hashName(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (const char *c = name; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Whether reads from `machineName` can be cached at all.
+static int cacheable(const char *machineName) {
+  return strncmp(machineName, SHM_ADDRESS_PREFIX,
+                 strlen(SHM_ADDRESS_PREFIX)) != 0 &&
+         strlen(machineName) < NEAR_CACHE_HOST_LENGTH;
+}
+
+// Find the server slot for machineName:port under `secretKey`, claiming a
+// free one if `create` is set and there isn't one. Returns -1 if there isn't
+// one and can't be. The caller must hold cacheLock.
+static int findServer(const char *machineName, int port, int secretKey,
+                      int create) {
+  for (int i = 0; i < NEAR_CACHE_SERVERS; i++) {
+    Server *server = &servers[i];
+    if (!server->used) {
+      if (!create)
+        return -1;
+      server->used = 1;
+      strcpy(server->host, machineName);
+      server->port = port;
+      server->secretKey = secretKey;
+      server->fd = -1;
+      return i;
+    }
+    if (server->port == port && server->secretKey == secretKey &&
+        strcmp(server->host, machineName) == 0)
+      return i;
+  }
+  return -1;
+}
+
+//=========
+// Copies.
+//=========
+
+// The caller must hold cacheLock for all of these.
+
+static Entry **bucketFor(int server, unsigned int hash) {
+  return &buckets[(hash ^ (unsigned int)server * 2654435761u) &
+                  (bucketCount - 1)];
+}
+
+static Entry *findEntry(int server, const char *name, unsigned int hash) {
+  for (Entry *entry = *bucketFor(server, hash); entry != NULL;
+       entry = entry->next) {
+    if (entry->server == server && entry->hash == hash &&
+        strcmp(entry->name, name) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static void unlinkLru(Entry *entry) {
+  if (entry->newer != NULL)
+    entry->newer->older = entry->older;
+  else
+    newest = entry->older;
+  if (entry->older != NULL)
+    entry->older->newer = entry->newer;
+  else
+    oldest = entry->newer;
+}
+
+static void pushLru(Entry *entry) {
+  entry->newer = NULL;
+  entry->older = newest;
+  if (newest != NULL)
+    newest->newer = entry;
+  newest = entry;
+  if (oldest == NULL)
+    oldest = entry;
+}
+
+static size_t entrySize(const Entry *entry) {
+  return sizeof(Entry) + entry->length;
+}
+
+static void removeEntry(Entry *entry) {
+  Entry **link = bucketFor(entry->server, entry->hash);
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+  unlinkLru(entry);
+  entryCount--;
+  byteCount -= entrySize(entry);
+  free(entry);
+}
+
+// Drop the copy of `name` from `server`, if there is one, and bump its
+// generation so that reads already on their way don't fill it back in.
+static void invalidate(int server, const char *name) {
+  unsigned int hash = hashName(name);
+  servers[server].generations[hash % NEAR_CACHE_GENERATIONS]++;
+  if (!enabled)
+    return;
+  Entry *entry = findEntry(server, name, hash);
+  if (entry != NULL)
+    removeEntry(entry);
+}
+
+static void dropEntries(int server) {
+  Entry *entry = oldest;
+  while (entry != NULL) {
+    Entry *newer = entry->newer;
+    if (server < 0 || entry->server == server)
+      removeEntry(entry);
+    entry = newer;
+  }
+}
+
+//====================
+// Watch connections.
+//====================
+
+// The caller must hold cacheLock for all of these but the reader thread.
+
+static Watched *findWatched(Server *server, const char *name) {
+  for (Watched *watched =
+           server->watched[hashName(name) % NEAR_CACHE_WATCH_BUCKETS];
+       watched != NULL; watched = watched->next) {
+    if (strcmp(watched->name, name) == 0)
+      return watched;
+  }
+  return NULL;
+}
+
+static void removeWatched(Server *server, Watched *watched) {
+  Watched **link =
+      &server->watched[hashName(watched->name) % NEAR_CACHE_WATCH_BUCKETS];
+  while (*link != watched)
+    link = &(*link)->next;
+  *link = watched->next;
+  server->watchCount--;
+  free(watched);
+}
+
+// Forget a server's connection, its watches, and every copy that relied on
+// them. Waiting reads are woken to find it gone.
+static void dropConnection(int slot) {
+  Server *server = &servers[slot];
+  if (enabled)
+    dropEntries(slot);
+  for (int i = 0; i < NEAR_CACHE_WATCH_BUCKETS; i++) {
+    while (server->watched[i] != NULL)
+      removeWatched(server, server->watched[i]);
+  }
+  server->pendingHead = server->pendingTail = NULL;
+  for (int i = 0; i < NEAR_CACHE_GENERATIONS; i++)
+    server->generations[i]++;
+  server->fd = -1;
+  server->connection++;
+  server->watchesAnswered = server->watchesSent;
+  pthread_cond_broadcast(&watchAnswered);
+}
+
+// Take the server's answer to the oldest watch still waiting for one.
+static void answerWatch(Server *server, char status) {
+  Watched *watched = server->pendingHead;
+  if (watched == NULL)
+    return;
+  server->pendingHead = watched->nextPending;
+  if (server->pendingHead == NULL)
+    server->pendingTail = NULL;
+  server->watchesAnswered++;
+  if (status == 0) {
+    watched->active = 1;
+  } else {
+    // Busy servers may take the watch later; others never will, so there's
+    // no use keeping the connection. The blocking backend would even serve
+    // nothing else while it was open.
+    if (status != SERVER_BUSY_STATUS) {
+      server->refused = 1;
+      shutdown(server->fd, SHUT_RDWR);
+    }
+    removeWatched(server, watched);
+  }
+  pthread_cond_broadcast(&watchAnswered);
+}
+
+// Read the answers to watches, and pushes, off a watch connection until it's
+// lost.
+static void *readerThread(void *arg) {
+  Reader reader = *(Reader *)arg;
+  free(arg);
+  Server *server = &servers[reader.server];
+  rio_t rio;
+  rio_readinitb(&rio, reader.fd);
+
+  while (1) {
+    char frame[SERVER_PREAMBLE_SIZE + MAX_VARNAME_LENGTH + 8 +
+               LENGTH_SPECIFIER_SIZE + MAX_VALUE_LENGTH];
+    int frameLength = 0;
+    int needed;
+    while ((needed = watchFrameLength(frame, frameLength)) > frameLength) {
+      ssize_t got =
+          rio_readnb(&rio, &frame[frameLength], needed - frameLength);
+      if (got <= 0)
+        goto lost;
+      frameLength += got;
+    }
+    if (needed < 0)
+      goto lost;
+
+    char name[MAX_VARNAME_LENGTH + 1];
+    unsigned long long version;
+    const char *value;
+    size_t valueLength;
+    if (frame[0] == SERVER_PUSH_STATUS &&
+        decodePush(frame, frameLength, name, &version, &value,
+                   &valueLength) <= 0)
+      goto lost;
+
+    pthread_mutex_lock(&cacheLock);
+    if (server->connection == reader.connection) {
+      if (frame[0] == SERVER_PUSH_STATUS)
+        invalidate(reader.server, name);
+      else
+        answerWatch(server, frame[0]);
+    }
+    pthread_mutex_unlock(&cacheLock);
+  }
+
+lost:
+  pthread_mutex_lock(&cacheLock);
+  if (server->connection == reader.connection)
+    dropConnection(reader.server);
+  pthread_mutex_unlock(&cacheLock);
+  close(reader.fd);
+  return NULL;
+}
+
+// Open a watch connection to a server, with a thread to read it. Returns 0,
+// or -1 if it can't be.
+static int openConnection(int slot) {
+  Server *server = &servers[slot];
+  int fd = openCachedClientfd(server->host, server->port);
+  if (fd < 0)
+    return -1;
+
+  Reader *reader = (Reader *)malloc(sizeof(Reader));
+  pthread_t tid;
+  pthread_attr_t attr;
+  int started = 0;
+  if (reader != NULL) {
+    reader->server = slot;
+    reader->fd = fd;
+    reader->connection = server->connection;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&tid, &attr, readerThread, reader) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  if (!started) {
+    free(reader);
+    close(fd);
+    return -1;
+  }
+  server->fd = fd;
+  return 0;
+}
+
+// Send a watch of `name` on a server's connection. Returns its entry, or
+// NULL if it couldn't be sent.
+static Watched *sendWatch(Server *server, const char *name) {
+  ClientWatch message = {{server->secretKey, SSERVER_MSG_WATCH, {0, 0}}, {0}};
+  strcpy(message.varName, name);
+  char encoded[MAX_REQUEST_SIZE];
+  size_t length = encodeClientWatch(&message, encoded, sizeof(encoded));
+  Watched *watched = (Watched *)calloc(1, sizeof(Watched));
+  if (length == 0 || watched == NULL ||
+      sendAll(server->fd, encoded, length) != 0) {
+    free(watched);
+    // The reader finds out it's gone, and cleans up.
+    shutdown(server->fd, SHUT_RDWR);
+    return NULL;
+  }
+
+  strcpy(watched->name, name);
+  watched->ticket = ++server->watchesSent;
+  Watched **bucket =
+      &server->watched[hashName(name) % NEAR_CACHE_WATCH_BUCKETS];
+  watched->next = *bucket;
+  *bucket = watched;
+  server->watchCount++;
+  if (server->pendingTail != NULL)
+    server->pendingTail->nextPending = watched;
+  else
+    server->pendingHead = watched;
+  server->pendingTail = watched;
+  return watched;
+}
+
+//=============
+// Public API.
+//=============
+
+int nearCacheGet(const char *machineName, int port, int secretKey,
+                 const char *name, char *value, int *length) {
+  int hit = 0;
+  pthread_mutex_lock(&cacheLock);
+  int slot = enabled ? findServer(machineName, port, secretKey, 0) : -1;
+  Entry *entry = slot >= 0 ? findEntry(slot, name, hashName(name)) : NULL;
+  if (entry != NULL && maxAgeMs > 0 && nowMs() - entry->filledMs > maxAgeMs) {
+    removeEntry(entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    if (value != NULL)
+      memcpy(value, entry->value, entry->length);
+    if (length != NULL)
+      *length = entry->length;
+    unlinkLru(entry);
+    pushLru(entry);
+    hit = 1;
+    hits++;
+  } else if (enabled) {
+    misses++;
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return hit;
+}
+
+int nearCacheBeginFill(const char *machineName, int port, int secretKey,
+                       const char *name, NearCacheTicket *ticket) {
+  if (!cacheable(machineName))
+    return -1;
+  pthread_mutex_lock(&cacheLock);
+  int slot = enabled ? findServer(machineName, port, secretKey, 1) : -1;
+  Server *server = slot >= 0 ? &servers[slot] : NULL;
+  if (server == NULL || server->refused ||
+      (server->fd < 0 && openConnection(slot) != 0)) {
+    pthread_mutex_unlock(&cacheLock);
+    return -1;
+  }
+
+  Watched *watched = findWatched(server, name);
+  if (watched == NULL) {
+    size_t limit = NEAR_CACHE_WATCHES_PER_ENTRY *
+                   (maxEntries > 0 ? maxEntries : bucketCount);
+    if (server->watchCount >= limit) {
+      // Start again with a connection watching nothing.
+      shutdown(server->fd, SHUT_RDWR);
+      pthread_mutex_unlock(&cacheLock);
+      return -1;
+    }
+    watched = sendWatch(server, name);
+  }
+
+  // Wait for the watch to be taken, or for the connection to go.
+  int ready = 0;
+  if (watched != NULL) {
+    unsigned long long connection = server->connection;
+    unsigned long long waitFor = watched->ticket;
+    while (server->connection == connection &&
+           server->watchesAnswered < waitFor)
+      pthread_cond_wait(&watchAnswered, &cacheLock);
+    ready = server->connection == connection &&
+            (watched = findWatched(server, name)) != NULL && watched->active;
+  }
+
+  if (ready) {
+    ticket->server = slot;
+    ticket->connection = server->connection;
+    ticket->generation =
+        server->generations[hashName(name) % NEAR_CACHE_GENERATIONS];
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return ready ? 0 : -1;
+}
+
+void nearCacheFill(const NearCacheTicket *ticket, const char *name,
+                   const char *value, int length) {
+  unsigned int hash = hashName(name);
+  Entry *fresh = (Entry *)malloc(sizeof(Entry) + length);
+  if (fresh == NULL)
+    return;
+  fresh->server = ticket->server;
+  fresh->hash = hash;
+  fresh->filledMs = nowMs();
+  strcpy(fresh->name, name);
+  fresh->length = length;
+  memcpy(fresh->value, value, length);
+
+  pthread_mutex_lock(&cacheLock);
+  Server *server = &servers[ticket->server];
+  if (!enabled || server->connection != ticket->connection ||
+      server->generations[hash % NEAR_CACHE_GENERATIONS] !=
+          ticket->generation ||
+      (maxBytes > 0 && entrySize(fresh) > maxBytes)) {
+    pthread_mutex_unlock(&cacheLock);
+    free(fresh);
+    return;
+  }
+
+  Entry *old = findEntry(ticket->server, name, hash);
+  if (old != NULL)
+    removeEntry(old);
+  Entry **bucket = bucketFor(ticket->server, hash);
+  fresh->next = *bucket;
+  *bucket = fresh;
+  pushLru(fresh);
+  entryCount++;
+  byteCount += entrySize(fresh);
+
+  // Make room by dropping the least recently read.
+  while ((maxEntries > 0 && entryCount > maxEntries) ||
+         (maxBytes > 0 && byteCount > maxBytes))
+    removeEntry(oldest);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void nearCacheInvalidate(const char *machineName, int port, int secretKey,
+                         const char *name) {
+  pthread_mutex_lock(&cacheLock);
+  int slot = findServer(machineName, port, secretKey, 0);
+  if (slot >= 0)
+    invalidate(slot, name);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+int smallCacheEnable(int entries, long bytes, int ageMs) {
+  if (entries < 0 || bytes < 0 || ageMs < 0 || (entries == 0 && bytes == 0))
+    return -1;
+
+  // Size the table for about one copy per bucket, guessing at the size of a
+  // copy if only the bytes are limited.
+  size_t expected = entries > 0 ? (size_t)entries
+                                : (size_t)bytes / (sizeof(Entry) + 16);
+  size_t count = NEAR_CACHE_MIN_BUCKETS;
+  while (count < expected && count < NEAR_CACHE_MAX_BUCKETS)
+    count *= 2;
+  Entry **table = (Entry **)calloc(count, sizeof(Entry *));
+  if (table == NULL)
+    return -1;
+
+  pthread_mutex_lock(&cacheLock);
+  if (enabled)
+    dropEntries(-1);
+  free(buckets);
+  buckets = table;
+  bucketCount = count;
+  maxEntries = entries;
+  maxBytes = bytes;
+  maxAgeMs = ageMs;
+  enabled = 1;
+  pthread_mutex_unlock(&cacheLock);
+  return 0;
+}
+
+void smallCacheDisable(void) {
+  pthread_mutex_lock(&cacheLock);
+  if (enabled) {
+    dropEntries(-1);
+    // Close the watch connections; their readers clean up after them.
+    for (int i = 0; i < NEAR_CACHE_SERVERS; i++) {
+      if (servers[i].used && servers[i].fd >= 0)
+        shutdown(servers[i].fd, SHUT_RDWR);
+    }
+    enabled = 0;
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void smallCacheStats(unsigned long long *hitCount,
+                     unsigned long long *missCount) {
+  pthread_mutex_lock(&cacheLock);
+  *hitCount = hits;
+  *missCount = misses;
+  pthread_mutex_unlock(&cacheLock);
+}
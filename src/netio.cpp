@@ -0,0 +1,523 @@
+#include "netio.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "admission.h"
+#include "compute.h"
+#include "deadlines.h"
+#include "log.h"
+#include "stats.h"
+#include "watch.h"
+
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+static const char *backendNames[] = {"blocking", "epoll", "io_uring"};
+
+bool parseIoBackend(const string &name, IoBackend &backend) {
+  for (int i = IO_BLOCKING; i <= IO_URING; i++) {
+    if (name == backendNames[i]) {
+      backend = (IoBackend)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *ioBackendName(IoBackend backend) { return backendNames[backend]; }
+
+//============
+// Listeners.
+//============
+
+int openReusePortListener(int port) {
+  int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenfd < 0)
+    return -1;
+
+  int on = 1;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons((unsigned short)port);
+  if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+      bind(listenfd, (sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listenfd, SOMAXCONN) < 0) {
+    int error = errno;
+    close(listenfd);
+    errno = error;
+    return -1;
+  }
+  return listenfd;
+}
+
+int openUnixListener(const string &path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenfd < 0)
+    return -1;
+
+  // A socket file outlives the server that made it. If nothing answers on
+  // it, it's stale, and can go.
+  struct stat existing;
+  if (stat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 &&
+                connect(probe, (sockaddr *)&address, sizeof(address)) == 0;
+    if (probe >= 0)
+      close(probe);
+    if (!live)
+      unlink(path.c_str());
+  }
+
+  if (bind(listenfd, (sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listenfd, SOMAXCONN) < 0) {
+    int error = errno;
+    close(listenfd);
+    errno = error;
+    return -1;
+  }
+  return listenfd;
+}
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+//=====================
+// Request processing.
+//=====================
+
+int handleBuffered(Connection &conn, RequestHandler handler,
+                   Clock::time_point received) {
+  Request request;
+  int status;
+  while ((status = conn.nextRequest(request)) > 0) {
+    conn.startRequest(request);
+    if (!handler(conn, request, received))
+      return 0;
+  }
+  return status < 0 ? -1 : 1;
+}
+
+int handleReceived(Connection &conn, const char *data, size_t length,
+                   RequestHandler handler, Clock::time_point received) {
+  while (length > 0) {
+    // Finish off a request split across receives first. It gets copied into
+    // the connection's buffer a piece at a time, taking no more than it needs,
+    // so the requests after it can still be decoded where they lie.
+    int wanted = conn.bytesWanted();
+    if (wanted < 0)
+      return -1;
+    if (wanted > 0) {
+      size_t space;
+      char *into = conn.receiveSpace(space);
+      size_t taken = (size_t)wanted < length ? wanted : length;
+      memcpy(into, data, taken);
+      conn.received(taken);
+      data += taken;
+      length -= taken;
+      int status = handleBuffered(conn, handler, received);
+      if (status <= 0)
+        return status;
+      continue;
+    }
+
+    Request request;
+    int used = decodeRequest(data, length, request);
+    if (used < 0)
+      return -1;
+    if (used == 0) {
+      // The start of a request; keep it for next time.
+      size_t space;
+      memcpy(conn.receiveSpace(space), data, length);
+      conn.received(length);
+      break;
+    }
+    conn.startRequest(request);
+    if (!handler(conn, request, received))
+      return 0;
+    data += used;
+    length -= used;
+  }
+  return 1;
+}
+
+// Wait until `fd` has `events`, or until `deadline`, if it isn't the epoch.
+// Returns false if the deadline passed first.
+static bool waitUntil(int fd, short events, Clock::time_point deadline) {
+  while (true) {
+    int timeout = -1;
+    if (deadline != Clock::time_point()) {
+      timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - Clock::now())
+                    .count();
+      if (timeout < 0)
+        return false;
+    }
+    pollfd polled = {fd, events, 0};
+    int ready = poll(&polled, 1, timeout);
+    if (ready > 0)
+      return true;
+    if (ready == 0)
+      return false;
+    if (errno != EINTR)
+      return true;
+  }
+}
+
+// When a deadline of kind `kind` starting now would pass, or the epoch if
+// there's no limit.
+static Clock::time_point deadlineFromNow(DeadlineKind kind) {
+  int length = deadlineLength(kind);
+  return length == 0 ? Clock::time_point()
+                     : Clock::now() + std::chrono::milliseconds(length);
+}
+
+// Write all of `length` bytes to `fd`. Returns false if the client's gone, or
+// if it stops taking them for longer than a write deadline.
+static bool sendAll(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!waitUntil(fd, POLLOUT, deadlineFromNow(DEADLINE_WRITE))) {
+        logMessage(LOG_INFO, "closing connection on fd %d: write deadline "
+                             "passed", fd);
+        threadStats().connectionsTimedOut.add();
+        return false;
+      }
+      continue;
+    }
+    if (sent <= 0)
+      return false;
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+//===================
+// Blocking backend.
+//===================
+
+// Serve requests from a client until it hangs up. Each read takes whatever
+// the socket has, up to the free space in the receive buffer; every complete
+// request in the buffer is then handled in place, and their responses sent
+// together. This thread serves nobody else meanwhile, so instead of timers, it
+// waits for each read no longer than the connection's deadline: an idle one
+// between requests, or a read one while a request is partway in.
+static void serveConnection(int connfd, RequestHandler handler) {
+  ThreadStats &stats = threadStats();
+  Connection conn(connfd);
+
+  while (true) {
+    DeadlineKind kind = deadlineFor(conn, false);
+    if (!waitUntil(connfd, POLLIN, deadlineFromNow(kind))) {
+      logMessage(LOG_INFO, "closing connection on fd %d: %s deadline passed",
+                 connfd, deadlineKindName(kind));
+      stats.connectionsTimedOut.add();
+      return;
+    }
+    size_t space;
+    char *into = conn.receiveSpace(space);
+    ssize_t got = recv(connfd, into, space, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (conn.hasPartialRequest())
+        logMessage(LOG_WARN, "client hung up partway through a request");
+      return;
+    }
+    conn.received(got);
+    stats.bytesIn.add(got);
+
+    int status = handleBuffered(conn, handler, Clock::now());
+
+    if (!conn.output.empty()) {
+      if (!sendAll(connfd, &conn.output[0], conn.output.size()))
+        return;
+      stats.bytesOut.add(conn.output.size());
+      conn.output.clear();
+    }
+
+    if (status < 0)
+      logMessage(LOG_WARN, "malformed request; closing connection");
+    if (status <= 0)
+      return;
+  }
+}
+
+// With more than one listener, wait until one of them has a connection, and
+// take it without blocking, since another thread sharing the listener may get
+// there first.
+void serveBlocking(const vector<int> &listenfds, RequestHandler handler) {
+  bool several = listenfds.size() > 1;
+  vector<pollfd> polled;
+  for (int listenfd : listenfds) {
+    polled.push_back(pollfd{listenfd, POLLIN, 0});
+    if (several)
+      setNonBlocking(listenfd);
+  }
+
+  while (true) {
+    if (several && poll(&polled[0], polled.size(), -1) < 0)
+      continue;
+    for (const pollfd &listener : polled) {
+      if (several && !(listener.revents & POLLIN))
+        continue;
+      int connfd = accept(listener.fd, nullptr, nullptr);
+      if (connfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          logMessage(LOG_WARN, "accept failed: %s", strerror(errno));
+        continue;
+      }
+      logMessage(LOG_DEBUG, "accepted connection on fd %d", connfd);
+      if (!admitConnection(connfd))
+        continue;
+
+      serveConnection(connfd, handler);
+
+      close(connfd);
+      releaseConnection();
+    }
+  }
+}
+
+//================
+// epoll backend.
+//================
+
+// The most events to take from one epoll_wait().
+const int EPOLL_BATCH = 64;
+
+// A connection being served by the epoll loop.
+struct EpollConnection {
+  explicit EpollConnection(int fd) : conn(fd) {}
+  Connection conn;
+  // Set once we've stopped reading, and the connection should close as soon
+  // as all its responses are sent.
+  bool closing = false;
+  // The events epoll is waiting for on it, or 0 if it's been taken out of
+  // epoll.
+  uint32_t watching = EPOLLIN;
+};
+
+// Send as much queued output as the socket will take. Returns false if the
+// client's gone.
+static bool flushOutput(Connection &conn) {
+  size_t sent = 0;
+  while (sent < conn.output.size()) {
+    ssize_t n = send(conn.fd, &conn.output[sent], conn.output.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  threadStats().bytesOut.add(sent);
+  conn.output.erase(conn.output.begin(), conn.output.begin() + sent);
+  return true;
+}
+
+void serveEpoll(const vector<int> &listenfds, RequestHandler handler,
+                const EpollSource *source) {
+  ThreadStats &stats = threadStats();
+  unordered_map<int, unique_ptr<EpollConnection>> conns;
+
+  // A listener shared with other threads only wakes one of them for each
+  // connection.
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  for (int listenfd : listenfds) {
+    setNonBlocking(listenfd);
+    epoll_event listenEvent = {};
+    listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+    listenEvent.data.fd = listenfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &listenEvent);
+  }
+  if (source != nullptr) {
+    epoll_event sourceEvent = {};
+    sourceEvent.events = EPOLLIN;
+    sourceEvent.data.fd = source->fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, source->fd, &sourceEvent);
+  }
+  int watchfd = openWatchMailbox();
+  epoll_event watchEvent = {};
+  watchEvent.events = EPOLLIN;
+  watchEvent.data.fd = watchfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, watchfd, &watchEvent);
+  int computefd = openComputeMailbox();
+  epoll_event computeEvent = {};
+  computeEvent.events = EPOLLIN;
+  computeEvent.data.fd = computefd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, computefd, &computeEvent);
+
+  DeadlineTimers timers;
+  Clock::time_point now = Clock::now();
+
+  auto closeConnection = [&](int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    conns.erase(fd);
+    releaseConnection();
+  };
+
+  // Send what output we can, then close the connection if it's done with, or
+  // else wait for whatever it needs next: to write while there's output
+  // backed up, to read while there isn't, and nothing at all while it's only
+  // waiting on deferred responses. Then it's taken out of epoll, which would
+  // otherwise report a hang-up or error whatever it was asked for, on every
+  // wait until the responses came. `progressed` says whether its socket just
+  // had an event, which pushes its deadline back.
+  auto settle = [&](EpollConnection &ec, bool progressed) {
+    if (!flushOutput(ec.conn) ||
+        (ec.closing && ec.conn.output.empty() &&
+         !ec.conn.awaitingResponses())) {
+      closeConnection(ec.conn.fd);
+      return;
+    }
+    uint32_t wanted = !ec.conn.output.empty() ? EPOLLOUT
+                      : ec.closing            ? 0
+                                              : EPOLLIN;
+    if (wanted != ec.watching) {
+      epoll_event event = {};
+      event.events = wanted;
+      event.data.fd = ec.conn.fd;
+      int op = wanted == 0        ? EPOLL_CTL_DEL
+               : ec.watching == 0 ? EPOLL_CTL_ADD
+                                  : EPOLL_CTL_MOD;
+      epoll_ctl(epfd, op, ec.conn.fd, &event);
+      ec.watching = wanted;
+    }
+    timers.update(ec.conn, !ec.conn.output.empty(), progressed, now);
+  };
+
+  // Settle the connections something other than their own socket gave
+  // output to.
+  auto settleTouched = [&](const vector<Connection *> &touched) {
+    for (Connection *conn : touched) {
+      auto found = conns.find(conn->fd);
+      if (found != conns.end())
+        settle(*found->second, false);
+    }
+  };
+
+  epoll_event events[EPOLL_BATCH];
+  vector<Connection *> touched;
+  int timeout = -1;
+  while (true) {
+    int deadlineTimeout = timers.timeout();
+    if (timeout < 0 || (deadlineTimeout >= 0 && deadlineTimeout < timeout))
+      timeout = deadlineTimeout;
+    int ready = epoll_wait(epfd, events, EPOLL_BATCH, timeout);
+    if (ready < 0)
+      ready = 0;
+    now = Clock::now();
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+
+      if (std::find(listenfds.begin(), listenfds.end(), fd) !=
+          listenfds.end()) {
+        int connfd;
+        while ((connfd = accept4(fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          logMessage(LOG_DEBUG, "accepted connection on fd %d", connfd);
+          if (!admitConnection(connfd))
+            continue;
+          EpollConnection *accepted = new EpollConnection(connfd);
+          conns[connfd].reset(accepted);
+          epoll_event event = {};
+          event.events = EPOLLIN;
+          event.data.fd = connfd;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &event);
+          timers.update(accepted->conn, false, true, now);
+        }
+        continue;
+      }
+
+      if (source != nullptr && fd == source->fd) {
+        touched.clear();
+        source->ready(touched);
+        settleTouched(touched);
+        continue;
+      }
+
+      if (fd == watchfd) {
+        touched.clear();
+        deliverWatchEvents(touched);
+        settleTouched(touched);
+        continue;
+      }
+
+      if (fd == computefd) {
+        touched.clear();
+        deliverComputed(touched);
+        settleTouched(touched);
+        continue;
+      }
+
+      auto found = conns.find(fd);
+      if (found == conns.end())
+        continue;
+      EpollConnection &ec = *found->second;
+
+      if (ec.watching == EPOLLIN) {
+        size_t space;
+        char *into = ec.conn.receiveSpace(space);
+        ssize_t got = recv(fd, into, space, 0);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+          continue;
+        if (got <= 0) {
+          if (ec.conn.hasPartialRequest())
+            logMessage(LOG_WARN, "client hung up partway through a request");
+          ec.closing = true;
+        } else {
+          ec.conn.received(got);
+          stats.bytesIn.add(got);
+
+          int status = handleBuffered(ec.conn, handler, now);
+          if (status < 0)
+            logMessage(LOG_WARN, "malformed request; closing connection");
+          ec.closing = status <= 0;
+        }
+      }
+
+      settle(ec, true);
+    }
+
+    timers.expire(now, [&](Connection &conn, DeadlineKind kind) {
+      logMessage(LOG_INFO, "closing connection on fd %d: %s deadline passed",
+                 conn.fd, deadlineKindName(kind));
+      stats.connectionsTimedOut.add();
+      closeConnection(conn.fd);
+    });
+
+    timeout = source != nullptr ? source->batchDone() : -1;
+  }
+}
@@ -0,0 +1,295 @@
+#include "protocol.h"
+#include "wire.h"
+
+using wire::Bytes;
+
+RequestClass requestClass(MessageType type) {
+  return type == SSERVER_MSG_DIGEST || type == SSERVER_MSG_RUN
+             ? REQUEST_EXPENSIVE
+             : REQUEST_CHEAP;
+}
+
+const char *requestClassName(RequestClass cls) {
+  return cls == REQUEST_EXPENSIVE ? "expensive" : "cheap";
+}
+
+ClientPreamble readPreamble(const char clientRequest[]) {
+  ClientPreamble preamble{0, 0, {0, 0}};
+  wire::PreambleCodec::Fields::get(clientRequest, preamble.secretKey,
+                                   preamble.msgType);
+  return preamble;
+}
+
+//==========================
+// Per-type request codecs.
+//==========================
+
+// Each decoder fills in the parts of the request its type has, given a
+// complete frame. The preamble's already been read.
+
+static void decodeSet(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes name, value;
+  wire::SetCodec::Fields::get(buf, key, type, name, value);
+  request.name = name.data;
+  request.nameLength = name.length;
+  request.value = value.data;
+  request.valueLength = value.length;
+}
+
+static void decodeSetTtl(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes name, value;
+  uint32_t ttlMs;
+  wire::SetTtlCodec::Fields::get(buf, key, type, name, ttlMs, value);
+  request.name = name.data;
+  request.nameLength = name.length;
+  request.ttlMs = ttlMs;
+  request.value = value.data;
+  request.valueLength = value.length;
+}
+
+static void decodeGet(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes name;
+  wire::GetCodec::Fields::get(buf, key, type, name);
+  request.name = name.data;
+  request.nameLength = name.length;
+}
+
+static void decodeIncr(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes name;
+  int64_t delta;
+  wire::IncrCodec::Fields::get(buf, key, type, name, delta);
+  request.name = name.data;
+  request.nameLength = name.length;
+  request.delta = delta;
+}
+
+// A cas frame is only well formed if both of its values fit in a variable.
+static int casFrameLength(const char *buf, size_t len) {
+  int total = wire::CasCodec::frameLength(buf, len);
+  if (total < 0 || len < wire::CasCodec::fixedSize)
+    return total;
+  uint32_t key;
+  uint16_t type;
+  Bytes name, values;
+  uint16_t expectedLength;
+  wire::CasCodec::Fields::get(buf, key, type, name, expectedLength, values);
+  if (expectedLength > MAX_VALUE_LENGTH || expectedLength > values.length ||
+      values.length - expectedLength > MAX_VALUE_LENGTH)
+    return -1;
+  return total;
+}
+
+static void decodeCas(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes name, values;
+  uint16_t expectedLength;
+  wire::CasCodec::Fields::get(buf, key, type, name, expectedLength, values);
+  request.name = name.data;
+  request.nameLength = name.length;
+  request.expected = values.data;
+  request.expectedLength = expectedLength;
+  request.value = values.data + expectedLength;
+  request.valueLength = values.length - expectedLength;
+}
+
+static void decodeScan(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes prefix, cursor;
+  uint16_t count;
+  wire::ScanCodec::Fields::get(buf, key, type, prefix, cursor, count);
+  request.name = prefix.data;
+  request.nameLength = prefix.length;
+  request.cursor = cursor.data;
+  request.cursorLength = cursor.length;
+  request.count = count == 0 || count > MAX_SCAN_COUNT ? MAX_SCAN_COUNT : count;
+}
+
+static void decodeDigest(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes value;
+  wire::DigestCodec::Fields::get(buf, key, type, value);
+  request.value = value.data;
+  request.valueLength = value.length;
+}
+
+static void decodeRun(const char *buf, Request &request) {
+  uint32_t key;
+  uint16_t type;
+  Bytes value;
+  wire::RunCodec::Fields::get(buf, key, type, value);
+  request.value = value.data;
+  request.valueLength = value.length;
+}
+
+static void decodeNothing(const char *, Request &) {}
+
+struct RequestFormat {
+  int (*frameLength)(const char *buf, size_t len);
+  void (*decode)(const char *buf, Request &request);
+};
+
+// Indexed by MessageType.
+static constexpr RequestFormat requestFormats[] = {
+    {wire::SetCodec::frameLength, decodeSet},
+    {wire::GetCodec::frameLength, decodeGet},
+    {wire::DigestCodec::frameLength, decodeDigest},
+    {wire::RunCodec::frameLength, decodeRun},
+    {wire::StatsCodec::frameLength, decodeNothing},
+    {wire::SetTtlCodec::frameLength, decodeSetTtl},
+    {wire::IncrCodec::frameLength, decodeIncr},
+    {casFrameLength, decodeCas},
+    {wire::ScanCodec::frameLength, decodeScan},
+    {wire::WatchCodec::frameLength, decodeGet},
+};
+static_assert(sizeof(requestFormats) / sizeof(requestFormats[0]) ==
+                  MESSAGE_TYPE_COUNT,
+              "every message type needs a request format");
+
+// We don't know what the rest of an unknown request looks like, so treat it
+// as just a preamble.
+static const RequestFormat &requestFormat(unsigned int type) {
+  static constexpr RequestFormat unknown = {wire::PreambleCodec::frameLength,
+                                            decodeNothing};
+  return type < MESSAGE_TYPE_COUNT ? requestFormats[type] : unknown;
+}
+
+//===================
+// Version 2 frames.
+//===================
+
+// A version 2 frame's body is laid out just as a version 1 request's is after
+// its preamble, and the 8 bytes before the body are its request ID and length,
+// so the per-type codecs can read the body as a version 1 frame starting 8
+// bytes in. They never look at the preamble itself.
+static const size_t V2_BODY_OFFSET =
+    FRAME_V2_HEADER_SIZE - CLIENT_PREAMBLE_SIZE;
+
+// Whether the request starting at `buf`, of which at least the preamble has
+// arrived, is a version 2 frame.
+static bool isV2(const char *buf) {
+  uint8_t version;
+  wire::Field<wire::Uint8>::get(&buf[CLIENT_PREAMBLE_SIZE - 2], version);
+  return version == FRAME_VERSION_2;
+}
+
+static int v2FrameLength(const char *buf, size_t len) {
+  if (len < FRAME_V2_HEADER_SIZE)
+    return FRAME_V2_HEADER_SIZE;
+  uint32_t key, requestId, bodyLength;
+  uint16_t type;
+  uint8_t version;
+  wire::FrameV2Codec::Fields::get(buf, key, type, version, requestId,
+                                  bodyLength);
+  if (bodyLength > MAX_REQUEST_SIZE - CLIENT_PREAMBLE_SIZE)
+    return -1;
+  return FRAME_V2_HEADER_SIZE + bodyLength;
+}
+
+//=======================
+// Frames and responses.
+//=======================
+
+int frameLength(const char *buf, size_t len) {
+  if (len < CLIENT_PREAMBLE_SIZE)
+    return CLIENT_PREAMBLE_SIZE;
+  if (isV2(buf))
+    return v2FrameLength(buf, len);
+  return requestFormat(readPreamble(buf).msgType).frameLength(buf, len);
+}
+
+int decodeRequest(const char *buf, size_t len, Request &request) {
+  int total = frameLength(buf, len);
+  if (total < 0)
+    return -1;
+  if (len < (size_t)total)
+    return 0;
+
+  ClientPreamble preamble = readPreamble(buf);
+  const char *frame = buf;
+  request.version = 1;
+  request.requestId = 0;
+  if (isV2(buf)) {
+    // The body has to be exactly what the request's type says it is.
+    frame = &buf[V2_BODY_OFFSET];
+    size_t frameSize = total - V2_BODY_OFFSET;
+    if (requestFormat(preamble.msgType).frameLength(frame, frameSize) !=
+        (int)frameSize)
+      return -1;
+    uint32_t key, bodyLength;
+    uint16_t type;
+    uint8_t version;
+    wire::FrameV2Codec::Fields::get(buf, key, type, version,
+                                    request.requestId, bodyLength);
+    request.version = FRAME_VERSION_2;
+  }
+  request.secretKey = preamble.secretKey;
+  request.type = (MessageType)preamble.msgType;
+  request.name = nullptr;
+  request.nameLength = 0;
+  request.value = nullptr;
+  request.valueLength = 0;
+  request.ttlMs = 0;
+  request.delta = 0;
+  request.expected = nullptr;
+  request.expectedLength = 0;
+  request.cursor = nullptr;
+  request.cursorLength = 0;
+  request.count = 0;
+  requestFormat(preamble.msgType).decode(frame, request);
+
+  return total;
+}
+
+size_t encodeResponse(char status, bool withData, const char *data,
+                      size_t dataLength, char *out) {
+  size_t capacity = SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + dataLength;
+  if (!withData)
+    return wire::StatusCodec::encode(out, capacity, status);
+  return wire::ResponseCodec::encode(out, capacity, status,
+                                     Bytes{data, dataLength});
+}
+
+size_t encodeResponseV2(uint32_t requestId, char status, bool withData,
+                        const char *data, size_t dataLength, char *out) {
+  if (!withData)
+    dataLength = 0;
+  size_t header = wire::ResponseV2Codec::encode(
+      out, FRAME_V2_RESPONSE_HEADER_SIZE, status, (uint8_t)FRAME_VERSION_2,
+      requestId, (uint32_t)dataLength);
+  if (dataLength > 0)
+    memcpy(&out[header], data, dataLength);
+  return header + dataLength;
+}
+
+std::string encodeScanPage(const std::vector<std::string> &names,
+                           size_t count) {
+  std::string data;
+  if (names.size() > count)
+    data = names[count - 1];
+  data += '\0';
+  for (size_t i = 0; i < names.size() && i < count; i++) {
+    data += names[i];
+    data += '\0';
+  }
+  return data;
+}
+
+std::string encodePush(const std::string &name, uint64_t version,
+                       const char *value, size_t length) {
+  std::string frame(wire::PushCodec::maxSize, '\0');
+  frame.resize(wire::PushCodec::encode(
+      &frame[0], frame.size(), (signed char)SERVER_PUSH_STATUS,
+      Bytes{name.data(), name.size()}, (int64_t)version, Bytes{value, length}));
+  return frame;
+}
@@ -0,0 +1,306 @@
+#include "resolver.h"
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// The longest host name we'll cache. Anything longer just skips the cache.
+#define RESOLVER_HOST_LENGTH 256
+
+// How long to wait, in seconds, before retrying a background refresh that
+// failed. Until then the stale addresses keep being used.
+#define RESOLVER_RETRY_SECONDS 5
+
+// One cached host. The addresses are copied out of the addrinfo list so that
+// readers never hold on to memory a refresh might free.
+typedef struct {
+  int used;
+  char host[RESOLVER_HOST_LENGTH];
+  int port;
+  time_t expires;
+  int refreshing;
+  int addrCount;
+  // Index of the address that most recently accepted a connection. We try it
+  // first next time.
+  int preferred;
+  struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+  socklen_t addrLengths[RESOLVER_MAX_ADDRS];
+} CacheEntry;
+
+static CacheEntry cache[RESOLVER_CACHE_SLOTS];
+static pthread_rwlock_t cacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Arguments handed to a background refresh thread.
+typedef struct {
+  char host[RESOLVER_HOST_LENGTH];
+  int port;
+} RefreshRequest;
+
+static time_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// FNV-1a over the host name, mixed with the port.
+static unsigned int hashHost(const char *host, int port) {
+  unsigned int hash = 2166136261u;
+  for (const char *c = host; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 16777619u;
+  }
+  hash ^= (unsigned int)port;
+  hash *= 16777619u;
+  return hash;
+}
+
+// Find the slot holding host:port. Returns its index, or -1 if it isn't
+// cached. The caller must hold cacheLock.
+static int findSlot(const char *host, int port) {
+  unsigned int home = hashHost(host, port) % RESOLVER_CACHE_SLOTS;
+  for (int i = 0; i < RESOLVER_CACHE_SLOTS; i++) {
+    CacheEntry *entry = &cache[(home + i) % RESOLVER_CACHE_SLOTS];
+    if (!entry->used)
+      return -1;
+    if (entry->port == port && strcmp(entry->host, host) == 0)
+      return (home + i) % RESOLVER_CACHE_SLOTS;
+  }
+  return -1;
+}
+
+// Pick the slot a new entry for host:port should go in: the first free slot
+// along its probe sequence, or its home slot if the table is full. The caller
+// must hold cacheLock for writing.
+static int claimSlot(const char *host, int port) {
+  int existing = findSlot(host, port);
+  if (existing >= 0)
+    return existing;
+
+  unsigned int home = hashHost(host, port) % RESOLVER_CACHE_SLOTS;
+  for (int i = 0; i < RESOLVER_CACHE_SLOTS; i++) {
+    int slot = (home + i) % RESOLVER_CACHE_SLOTS;
+    if (!cache[slot].used)
+      return slot;
+  }
+  return home;
+}
+
+// Resolve host:port with getaddrinfo(), copying up to RESOLVER_MAX_ADDRS
+// addresses into `entry`. Returns 0 on success or -2 on a resolver error.
+static int resolve(const char *host, int port, CacheEntry *entry) {
+  char service[8];
+  snprintf(service, sizeof(service), "%d", port);
+
+  struct addrinfo hints, *list;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+  if (getaddrinfo(host, service, &hints, &list) != 0)
+    return -2;
+
+  entry->addrCount = 0;
+  for (struct addrinfo *ai = list;
+       ai != NULL && entry->addrCount < RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+    memcpy(&entry->addrs[entry->addrCount], ai->ai_addr, ai->ai_addrlen);
+    entry->addrLengths[entry->addrCount] = ai->ai_addrlen;
+    entry->addrCount++;
+  }
+  freeaddrinfo(list);
+
+  return entry->addrCount > 0 ? 0 : -2;
+}
+
+// Publish freshly resolved addresses for host:port.
+static void storeEntry(const char *host, int port, const CacheEntry *fresh) {
+  pthread_rwlock_wrlock(&cacheLock);
+  CacheEntry *entry = &cache[claimSlot(host, port)];
+  *entry = *fresh;
+  entry->used = 1;
+  snprintf(entry->host, sizeof(entry->host), "%s", host);
+  entry->port = port;
+  entry->expires = now() + RESOLVER_TTL_SECONDS;
+  entry->refreshing = 0;
+  entry->preferred = 0;
+  pthread_rwlock_unlock(&cacheLock);
+}
+
+// Re-resolve a stale entry off the caller's path.
+static void *refreshThread(void *arg) {
+  RefreshRequest *request = (RefreshRequest *)arg;
+  CacheEntry fresh;
+  memset(&fresh, 0, sizeof(fresh));
+
+  if (resolve(request->host, request->port, &fresh) == 0) {
+    storeEntry(request->host, request->port, &fresh);
+  } else {
+    // Keep serving the old addresses, but try again in a little while.
+    pthread_rwlock_wrlock(&cacheLock);
+    int slot = findSlot(request->host, request->port);
+    if (slot >= 0) {
+      cache[slot].refreshing = 0;
+      cache[slot].expires = now() + RESOLVER_RETRY_SECONDS;
+    }
+    pthread_rwlock_unlock(&cacheLock);
+  }
+
+  free(request);
+  return NULL;
+}
+
+// Start a background refresh of host:port unless one is already running.
+static void startRefresh(const char *host, int port) {
+  pthread_rwlock_wrlock(&cacheLock);
+  int slot = findSlot(host, port);
+  int shouldStart = slot >= 0 && !cache[slot].refreshing;
+  if (shouldStart)
+    cache[slot].refreshing = 1;
+  pthread_rwlock_unlock(&cacheLock);
+
+  if (!shouldStart)
+    return;
+
+  RefreshRequest *request = (RefreshRequest *)malloc(sizeof(RefreshRequest));
+  pthread_t tid;
+  pthread_attr_t attr;
+  int started = 0;
+  if (request != NULL) {
+    snprintf(request->host, sizeof(request->host), "%s", host);
+    request->port = port;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&tid, &attr, refreshThread, request) == 0;
+    pthread_attr_destroy(&attr);
+  }
+
+  // If we couldn't start the thread, let the next caller try again.
+  if (!started) {
+    free(request);
+    pthread_rwlock_wrlock(&cacheLock);
+    slot = findSlot(host, port);
+    if (slot >= 0)
+      cache[slot].refreshing = 0;
+    pthread_rwlock_unlock(&cacheLock);
+  }
+}
+
+// Try each address in `entry`, starting from the preferred one. Returns the
+// connected descriptor and stores the index that worked in `usedIndex`, or
+// returns -1 if none of them accepted the connection.
+static int connectAny(const CacheEntry *entry, int *usedIndex) {
+  for (int i = 0; i < entry->addrCount; i++) {
+    int index = (entry->preferred + i) % entry->addrCount;
+    const struct sockaddr *addr = (const struct sockaddr *)&entry->addrs[index];
+
+    int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (fd < 0)
+      continue;
+    if (connect(fd, addr, entry->addrLengths[index]) == 0) {
+      *usedIndex = index;
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+// Remember which address worked so the next connection tries it first.
+static void notePreferred(const char *host, int port, int index) {
+  pthread_rwlock_wrlock(&cacheLock);
+  int slot = findSlot(host, port);
+  if (slot >= 0 && index < cache[slot].addrCount)
+    cache[slot].preferred = index;
+  pthread_rwlock_unlock(&cacheLock);
+}
+
+// Connect to the Unix domain socket at `path`. There's nothing to resolve.
+static int openUnixClientfd(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int openCachedClientfd(char *MachineName, int port) {
+  CacheEntry entry;
+  int cached = 0, stale = 0;
+
+  if (strncmp(MachineName, UNIX_ADDRESS_PREFIX,
+              strlen(UNIX_ADDRESS_PREFIX)) == 0)
+    return openUnixClientfd(&MachineName[strlen(UNIX_ADDRESS_PREFIX)]);
+
+  // Host names too long to cache still work; they just always hit the
+  // resolver.
+  int cacheable = strlen(MachineName) < RESOLVER_HOST_LENGTH;
+
+  // Copy the cached addresses out under the read lock. This is the hot path:
+  // no resolver, no allocation.
+  if (cacheable) {
+    pthread_rwlock_rdlock(&cacheLock);
+    int slot = findSlot(MachineName, port);
+    if (slot >= 0) {
+      entry = cache[slot];
+      cached = 1;
+      stale = entry.expires <= now();
+    }
+    pthread_rwlock_unlock(&cacheLock);
+  }
+
+  if (!cached) {
+    memset(&entry, 0, sizeof(entry));
+    if (resolve(MachineName, port, &entry) != 0)
+      return -2;
+    if (cacheable)
+      storeEntry(MachineName, port, &entry);
+  } else if (stale) {
+    startRefresh(MachineName, port);
+  }
+
+  int usedIndex;
+  int fd = connectAny(&entry, &usedIndex);
+  if (fd >= 0) {
+    if (cacheable && usedIndex != entry.preferred)
+      notePreferred(MachineName, port, usedIndex);
+    return fd;
+  }
+
+  // Every cached address refused us. The host may have moved, so resolve it
+  // once more before giving up.
+  if (cached) {
+    memset(&entry, 0, sizeof(entry));
+    if (resolve(MachineName, port, &entry) != 0)
+      return -2;
+    storeEntry(MachineName, port, &entry);
+    fd = connectAny(&entry, &usedIndex);
+    if (fd >= 0) {
+      if (usedIndex != 0)
+        notePreferred(MachineName, port, usedIndex);
+      return fd;
+    }
+  }
+
+  return -1;
+}
+
+void resolverCacheFlush(void) {
+  pthread_rwlock_wrlock(&cacheLock);
+  memset(cache, 0, sizeof(cache));
+  pthread_rwlock_unlock(&cacheLock);
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include "shmclient.h"
+#include "common.h"
+#include "shm.h"
+#include "wire.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long to sleep waiting for a response before checking the server's still
+// there.
+#define SHM_CLIENT_WAIT_MS 100
+
+// How long a session can go unused before we check the server hasn't closed
+// it, idle, before using it again.
+#define SHM_CLIENT_RECHECK_MS 1000
+
+// A thread's session with one server. The rings only have one producer and
+// one consumer each, so sessions can't be shared between threads.
+typedef struct {
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int sockfd;
+  ShmSegment *segment;
+  // When the session was last used, in milliseconds.
+  long long lastUsedMs;
+} ShmSession;
+
+static __thread ShmSession *session;
+
+// The session is closed when its thread exits, through this key's destructor.
+static pthread_key_t sessionKey;
+static pthread_once_t sessionKeyOnce = PTHREAD_ONCE_INIT;
+
+static void closeSession(void *arg) {
+  ShmSession *closing = arg;
+  munmap(closing->segment, sizeof(ShmSegment));
+  close(closing->sockfd);
+  free(closing);
+}
+
+static void makeSessionKey(void) {
+  pthread_key_create(&sessionKey, closeSession);
+}
+
+// Hand `fd` to the server at the other end of `sockfd`.
+static int sendFd(int sockfd, int fd) {
+  char byte = 0;
+  struct iovec data = {&byte, 1};
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = &control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+  return sendmsg(sockfd, &message, MSG_NOSIGNAL) == 1;
+}
+
+// Make a segment, and have the server at `path` attach to it. If it's too
+// busy to, `*busy` is set.
+static ShmSession *openSession(const char *path, int *busy) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+    return NULL;
+  strcpy(address.sun_path, path);
+
+  // The segment starts out zeroed, so both rings start out empty.
+  int memfd = memfd_create("smalld-shm", MFD_CLOEXEC);
+  if (memfd < 0)
+    return NULL;
+  ShmSegment *segment = MAP_FAILED;
+  if (ftruncate(memfd, sizeof(ShmSegment)) == 0)
+    segment = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, memfd, 0);
+  int sockfd = -1;
+  if (segment != MAP_FAILED) {
+    segment->magic = SHM_MAGIC;
+    segment->version = SHM_VERSION;
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  }
+  // A server with as many sessions as it'll take answers busy instead, and
+  // may hang up before we've even sent the segment.
+  char status = -1;
+  if (sockfd >= 0 &&
+      connect(sockfd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+    int sent = sendFd(sockfd, memfd);
+    if (recv(sockfd, &status, 1, 0) != 1 || (!sent && status == 0))
+      status = -1;
+  }
+  if (sockfd >= 0 && status != 0) {
+    *busy = status == SERVER_BUSY_STATUS;
+    close(sockfd);
+    sockfd = -1;
+  }
+  close(memfd);
+  if (sockfd < 0) {
+    if (segment != MAP_FAILED)
+      munmap(segment, sizeof(ShmSegment));
+    return NULL;
+  }
+
+  ShmSession *opened = malloc(sizeof(ShmSession));
+  strcpy(opened->path, path);
+  opened->sockfd = sockfd;
+  opened->segment = segment;
+  opened->lastUsedMs = 0;
+  return opened;
+}
+
+static void setSession(ShmSession *to) {
+  if (session != NULL)
+    closeSession(session);
+  session = to;
+  pthread_once(&sessionKeyOnce, makeSessionKey);
+  pthread_setspecific(sessionKey, session);
+}
+
+static long long nowMs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Whether the server's closed its end of the session's socket.
+static int serverGone(ShmSession *s) {
+  struct pollfd hangup = {s->sockfd, POLLIN, 0};
+  return poll(&hangup, 1, 0) != 0;
+}
+
+int shmExchange(const char *path, const char *request, size_t requestLength,
+                int expectData, char *response, int capacity) {
+  long long now = nowMs();
+  if (session != NULL && now - session->lastUsedMs > SHM_CLIENT_RECHECK_MS &&
+      serverGone(session))
+    setSession(NULL);
+  if (session == NULL || strcmp(session->path, path) != 0) {
+    int busy = 0;
+    setSession(openSession(path, &busy));
+    if (session == NULL && busy && capacity >= SERVER_PREAMBLE_SIZE) {
+      memset(response, 0, SERVER_PREAMBLE_SIZE);
+      response[0] = SERVER_BUSY_STATUS;
+      return SERVER_PREAMBLE_SIZE;
+    }
+    if (session == NULL)
+      return -1;
+  }
+  ShmSegment *segment = session->segment;
+  session->lastUsedMs = now;
+
+  // Every earlier request has been answered, so the server's read them all,
+  // and the request ring is empty.
+  if (shmRingWrite(&segment->requests, request, requestLength) !=
+      requestLength) {
+    setSession(NULL);
+    return -1;
+  }
+
+  // Read exactly the one response, a piece at a time as
+  // responseFrameLength() asks for it.
+  int responseLength = 0;
+  int needed;
+  while ((needed = responseFrameLength(response, responseLength,
+                                       expectData)) > responseLength) {
+    if (needed > capacity)
+      break;
+    responseLength += shmRingRead(&segment->responses,
+                                  &response[responseLength],
+                                  needed - responseLength);
+    if (responseLength < needed &&
+        !shmRingWait(&segment->responses, SHM_CLIENT_WAIT_MS) &&
+        serverGone(session)) {
+      setSession(NULL);
+      return -1;
+    }
+  }
+  if (needed < 0 || needed > capacity) {
+    // We can't tell where the next response would start.
+    setSession(NULL);
+    return -1;
+  }
+  return responseLength;
+}
@@ -0,0 +1,158 @@
+#include "netio.h"
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "admission.h"
+#include "deadlines.h"
+#include "log.h"
+#include "shm.h"
+#include "stats.h"
+
+// The server side of the shared-memory transport. Each session gets a thread
+// of its own, which polls its request ring, and sleeps on it once it's been
+// idle for a while.
+
+// How long an idle session sleeps before checking its client is still there.
+const int SHM_IDLE_WAIT_MS = 100;
+
+// Take the segment's file descriptor off a newly accepted connection and map
+// the segment. Returns nullptr if the client didn't send a usable one.
+static ShmSegment *attach(int sockfd) {
+  char byte;
+  iovec data = {&byte, 1};
+  union {
+    cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = &control;
+  message.msg_controllen = sizeof(control);
+  if (recvmsg(sockfd, &message, MSG_CMSG_CLOEXEC) != 1)
+    return nullptr;
+  cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (header == nullptr || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS ||
+      header->cmsg_len != CMSG_LEN(sizeof(int)))
+    return nullptr;
+  int memfd;
+  memcpy(&memfd, CMSG_DATA(header), sizeof(memfd));
+
+  struct stat info;
+  void *mapped = MAP_FAILED;
+  if (fstat(memfd, &info) == 0 && (size_t)info.st_size >= sizeof(ShmSegment))
+    mapped = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (mapped == MAP_FAILED)
+    return nullptr;
+
+  ShmSegment *segment = (ShmSegment *)mapped;
+  if (segment->magic != SHM_MAGIC || segment->version != SHM_VERSION) {
+    munmap(mapped, sizeof(ShmSegment));
+    return nullptr;
+  }
+  return segment;
+}
+
+// Serve a session's requests until the client hangs up, or misses a deadline
+// (see deadlines.h), which the thread checks whenever it wakes up with nothing
+// to do. Requests are copied out of the ring before they're decoded, so the
+// client can't change them underneath us; responses are copied in as the ring
+// has room.
+static void serveSession(int sockfd, ShmSegment *segment,
+                         RequestHandler handler) {
+  ThreadStats &stats = threadStats();
+  Connection conn(sockfd);
+  char chunk[RECEIVE_BUFFER_SIZE];
+  Clock::time_point lastProgress = Clock::now();
+
+  while (true) {
+    size_t got = shmRingRead(&segment->requests, chunk, sizeof(chunk));
+    if (got > 0) {
+      lastProgress = Clock::now();
+      stats.bytesIn.add(got);
+      int status = handleReceived(conn, chunk, got, handler, Clock::now());
+      if (status < 0)
+        logMessage(LOG_WARN, "malformed request; closing connection");
+      if (status <= 0)
+        return;
+    }
+
+    if (!conn.output.empty()) {
+      size_t put = shmRingWrite(&segment->responses, &conn.output[0],
+                                conn.output.size());
+      stats.bytesOut.add(put);
+      conn.output.erase(conn.output.begin(), conn.output.begin() + put);
+      if (put > 0)
+        lastProgress = Clock::now();
+    }
+    if (got > 0)
+      continue;
+
+    // Responses that don't fit yet are retried soon, since the client
+    // reading them doesn't wake us.
+    if (shmRingWait(&segment->requests,
+                    conn.output.empty() ? SHM_IDLE_WAIT_MS : 1))
+      continue;
+
+    // The client never sends anything more on the socket, so if it's
+    // readable, the client's gone.
+    pollfd hangup = {sockfd, POLLIN, 0};
+    if (poll(&hangup, 1, 0) != 0) {
+      if (conn.hasPartialRequest())
+        logMessage(LOG_WARN, "client hung up partway through a request");
+      return;
+    }
+
+    // A request may have come in since we last looked.
+    DeadlineKind kind = deadlineFor(conn, !conn.output.empty());
+    int length = deadlineLength(kind);
+    if (length > 0 &&
+        Clock::now() - lastProgress > std::chrono::milliseconds(length) &&
+        !shmRingReady(&segment->requests)) {
+      logMessage(LOG_INFO,
+                 "closing shared-memory session on fd %d: %s deadline passed",
+                 sockfd, deadlineKindName(kind));
+      stats.connectionsTimedOut.add();
+      return;
+    }
+  }
+}
+
+static void runSession(int sockfd, RequestHandler handler) {
+  ShmSegment *segment = attach(sockfd);
+  if (segment == nullptr)
+    logMessage(LOG_WARN, "client sent no usable shared-memory segment");
+
+  // Tell the client whether it's attached.
+  char status = segment != nullptr ? 0 : -1;
+  if (send(sockfd, &status, 1, MSG_NOSIGNAL) == 1 && segment != nullptr) {
+    serveSession(sockfd, segment, handler);
+    releaseConnection();
+  }
+
+  if (segment != nullptr)
+    munmap(segment, sizeof(ShmSegment));
+  close(sockfd);
+}
+
+void serveShm(int listenfd, RequestHandler handler) {
+  while (true) {
+    int sockfd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sockfd < 0) {
+      logMessage(LOG_WARN, "accept failed: %s", strerror(errno));
+      continue;
+    }
+    logMessage(LOG_DEBUG, "accepted shared-memory session on fd %d", sockfd);
+    if (!admitConnection(sockfd))
+      continue;
+    std::thread(runSession, sockfd, handler).detach();
+  }
+}
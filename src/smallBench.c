@@ -0,0 +1,462 @@
+#include "common.h"
+#include "histogram.h"
+#include "sserver.h"
+#include "wire.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Amount of extra space to use for the response buffer. Just in case we get
+// more data than we're expecting.
+#define FUDGE_AMOUNT 10
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// Everything the workers need to know about the run.
+typedef struct {
+  char *machineName;
+  int port;
+  int secretKey;
+  int connections;
+  double seconds;
+  // Requests per second across all connections. Zero means closed-loop.
+  double rate;
+  // Relative weights of each message type in the mix, indexed by MessageType.
+  int mix[MESSAGE_TYPE_COUNT];
+  int mixTotal;
+  int keys;
+  int valueBytes;
+  // Requests each connection keeps in flight, with version 2 framing, or 0
+  // for one request per connection.
+  int depth;
+} BenchConfig;
+
+// Per-connection results. Each connection gets its own thread and its own
+// histograms, so nothing is shared until the report at the end.
+typedef struct {
+  int id;
+  pthread_t thread;
+  unsigned int seed;
+  Histogram latency[MESSAGE_TYPE_COUNT];
+  unsigned long long counts[MESSAGE_TYPE_COUNT];
+  unsigned long long errors[MESSAGE_TYPE_COUNT];
+  // Requests the server turned away as too busy. They count as errors too.
+  unsigned long long busy[MESSAGE_TYPE_COUNT];
+  // Open-loop requests that couldn't start on schedule because the previous
+  // one was still outstanding.
+  unsigned long long lateStarts;
+} Worker;
+
+static BenchConfig config;
+static unsigned long long benchStart, benchEnd;
+
+static unsigned long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleepUntil(unsigned long long when) {
+  struct timespec ts;
+  ts.tv_sec = when / NSEC_PER_SEC;
+  ts.tv_nsec = when % NSEC_PER_SEC;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    ;
+}
+
+// Pick the next message type according to the configured mix.
+static MessageType pickType(Worker *w) {
+  int roll = rand_r(&w->seed) % config.mixTotal;
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+    if (roll < config.mix[type])
+      return (MessageType)type;
+    roll -= config.mix[type];
+  }
+  return SSERVER_MSG_GET;
+}
+
+// Issue one request of the given type. Returns the library's status code.
+static int issue(Worker *w, MessageType type, char *value) {
+  static char *runRequests[] = {"inet", "hosts", "service"};
+  char name[MAX_VARNAME_LENGTH + 1];
+  char result[MAX_RESPONSE_SIZE + FUDGE_AMOUNT];
+  int resultLength;
+
+  snprintf(name, sizeof(name), "k%d", rand_r(&w->seed) % config.keys);
+
+  switch (type) {
+  case SSERVER_MSG_SET:
+    return smallSet(config.machineName, config.port, config.secretKey, name,
+                    value, config.valueBytes);
+  case SSERVER_MSG_GET:
+    return smallGet(config.machineName, config.port, config.secretKey, name,
+                    result, &resultLength);
+  case SSERVER_MSG_DIGEST:
+    return smallDigest(config.machineName, config.port, config.secretKey,
+                       value, config.valueBytes, result, &resultLength);
+  case SSERVER_MSG_RUN:
+    return smallRun(config.machineName, config.port, config.secretKey,
+                    runRequests[rand_r(&w->seed) % 3], result, &resultLength);
+  default:
+    break;
+  }
+  return -1;
+}
+
+// Encode a request of the given type for the pipelined mode into `out`, which
+// has room for `capacity` bytes. Returns its length, or 0 if it can't be.
+static size_t encodeRequest(Worker *w, MessageType type, char *value,
+                            char *out, size_t capacity) {
+  static char *runRequests[] = {"inet", "hosts", "service"};
+  char name[MAX_VARNAME_LENGTH + 1];
+  snprintf(name, sizeof(name), "k%d", rand_r(&w->seed) % config.keys);
+  ClientPreamble pre = {config.secretKey, type, {0, 0}};
+
+  switch (type) {
+  case SSERVER_MSG_SET: {
+    ClientSet message = {pre, {0}, config.valueBytes, {0}};
+    strcpy(message.varName, name);
+    memcpy(message.value, value, config.valueBytes);
+    return encodeClientSet(&message, out, capacity);
+  }
+  case SSERVER_MSG_GET: {
+    ClientGet message = {pre, {0}};
+    strcpy(message.varName, name);
+    return encodeClientGet(&message, out, capacity);
+  }
+  case SSERVER_MSG_DIGEST: {
+    ClientDigest message = {pre, config.valueBytes, {0}};
+    memcpy(message.value, value, config.valueBytes);
+    return encodeClientDigest(&message, out, capacity);
+  }
+  case SSERVER_MSG_RUN: {
+    ClientRun message = {pre, {0}};
+    strcpy(message.request, runRequests[rand_r(&w->seed) % 3]);
+    return encodeClientRun(&message, out, capacity);
+  }
+  default:
+    break;
+  }
+  return 0;
+}
+
+// Send a new request from `slot` on the pipelined connection `fd`. Returns
+// 0 if it was sent.
+static int sendSlot(Worker *w, int fd, int slot, char *value,
+                    MessageType *types, unsigned long long *started) {
+  char request[MAX_REQUEST_SIZE];
+  types[slot] = pickType(w);
+  size_t length =
+      encodeRequest(w, types[slot], value, request, sizeof(request));
+  started[slot] = nowNs();
+  return smallSend(fd, slot, request, length);
+}
+
+// Drive one pipelined connection until the run is over, keeping
+// `config.depth` requests in flight. Each slot's index is its request's ID, so
+// a response finds its start time and type however early or late it comes
+// back.
+static void runPipelined(Worker *w, char *value) {
+  MessageType types[config.depth];
+  unsigned long long started[config.depth];
+  char pending[config.depth];
+  int inFlight = 0;
+  memset(pending, 0, sizeof(pending));
+
+  int fd = smallConnect(config.machineName, config.port);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Couldn't connect to the server.\n");
+    return;
+  }
+
+  for (int slot = 0; slot < config.depth; slot++) {
+    if (sendSlot(w, fd, slot, value, types, started) != 0)
+      goto done;
+    pending[slot] = 1;
+    inFlight++;
+  }
+
+  while (inFlight > 0) {
+    unsigned int slot;
+    int status;
+    char result[MAX_STATS_LENGTH];
+    if (smallReceive(fd, &slot, &status, result, NULL, sizeof(result)) != 0)
+      goto done;
+    unsigned long long now = nowNs();
+    if (status == SERVER_PUSH_STATUS)
+      continue;
+    if (slot >= (unsigned int)config.depth || !pending[slot])
+      goto done;
+
+    MessageType type = types[slot];
+    histogramRecord(&w->latency[type], now - started[slot]);
+    w->counts[type]++;
+    if (status != 0)
+      w->errors[type]++;
+    if (status == SERVER_BUSY_STATUS)
+      w->busy[type]++;
+
+    if (now < benchEnd && sendSlot(w, fd, slot, value, types, started) == 0)
+      continue;
+    pending[slot] = 0;
+    inFlight--;
+  }
+
+done:
+  // Requests lost with the connection count as errors.
+  for (int slot = 0; slot < config.depth; slot++) {
+    if (pending[slot])
+      w->errors[types[slot]]++;
+  }
+  close(fd);
+}
+
+// Drive one connection until the run is over.
+//
+// In closed-loop mode each request is sent as soon as the last one finished,
+// and its latency is simply how long it took. In open-loop mode requests are
+// scheduled at a fixed rate; if the server falls behind, latency is measured
+// from when the request *should* have been sent rather than when it actually
+// was, so a stall shows up in every request it delayed instead of just one
+// (the "coordinated omission" correction).
+static void *runWorker(void *arg) {
+  Worker *w = (Worker *)arg;
+
+  char value[MAX_VALUE_LENGTH];
+  memset(value, 'a' + w->id % 26, config.valueBytes);
+  value[config.valueBytes - 1] = '\0';
+
+  if (config.depth > 0) {
+    runPipelined(w, value);
+    return NULL;
+  }
+
+  unsigned long long interval = 0, next = benchStart;
+  if (config.rate > 0) {
+    interval = (unsigned long long)(config.connections * NSEC_PER_SEC /
+                                    config.rate);
+    // Stagger the connections so they don't all fire at once.
+    next += interval * w->id / config.connections;
+  }
+
+  while (1) {
+    unsigned long long intended;
+    if (config.rate > 0) {
+      if (next >= benchEnd)
+        break;
+      unsigned long long now = nowNs();
+      if (now < next)
+        sleepUntil(next);
+      else if (now > next)
+        w->lateStarts++;
+      intended = next;
+      next += interval;
+    } else {
+      intended = nowNs();
+      if (intended >= benchEnd)
+        break;
+    }
+
+    MessageType type = pickType(w);
+    int status = issue(w, type, value);
+    unsigned long long done = nowNs();
+
+    histogramRecord(&w->latency[type], done - intended);
+    w->counts[type]++;
+    if (status != 0)
+      w->errors[type]++;
+    if (status == SERVER_BUSY_STATUS)
+      w->busy[type]++;
+  }
+
+  return NULL;
+}
+
+// Parse a mix like "10:80:5:5" (set:get:digest:run). Returns 0 on success.
+static int parseMix(const char *text) {
+  int *m = config.mix;
+  if (sscanf(text, "%d:%d:%d:%d", &m[0], &m[1], &m[2], &m[3]) != 4)
+    return -1;
+  config.mixTotal = 0;
+  for (int i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+    if (m[i] < 0)
+      return -1;
+    config.mixTotal += m[i];
+  }
+  return config.mixTotal > 0 ? 0 : -1;
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-c connections] [-d seconds] [-r rate] "
+          "[-m set:get:digest:run] [-k keys] [-v value bytes] "
+          "[-p depth] <machine name> <port> <secret key>\n"
+          "  -r 0 (the default) runs closed-loop; any other rate runs "
+          "open-loop at that many requests per second.\n"
+          "  -p keeps depth requests in flight on each connection, which "
+          "stays open,\n  with responses matched up by request ID. It "
+          "runs closed-loop.\n",
+          prog);
+  exit(1);
+}
+
+static void printRow(const char *name, Histogram *h, unsigned long long count,
+                     unsigned long long errors, unsigned long long busy,
+                     double elapsed) {
+  printf("%-8s %10llu %8llu %8llu %12.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+         count, errors, busy, count / elapsed,
+         histogramPercentile(h, 50.0) / 1000.0,
+         histogramPercentile(h, 99.0) / 1000.0,
+         histogramPercentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+  config.connections = 4;
+  config.seconds = 10;
+  config.rate = 0;
+  config.keys = 1000;
+  config.valueBytes = 32;
+  parseMix("10:80:10:0");
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:r:m:k:v:p:")) != -1) {
+    switch (opt) {
+    case 'c':
+      config.connections = atoi(optarg);
+      break;
+    case 'd':
+      config.seconds = atof(optarg);
+      break;
+    case 'r':
+      config.rate = atof(optarg);
+      break;
+    case 'm':
+      if (parseMix(optarg) != 0) {
+        fprintf(stderr, "Error: Mix must look like set:get:digest:run.\n");
+        exit(1);
+      }
+      break;
+    case 'k':
+      config.keys = atoi(optarg);
+      break;
+    case 'v':
+      config.valueBytes = atoi(optarg);
+      break;
+    case 'p':
+      config.depth = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 3)
+    usage(argv[0]);
+
+  config.machineName = argv[optind];
+  config.port = parseIntWithError(argv[optind + 1],
+                                  "Error: Port must be a number.\n");
+  config.secretKey = parseIntWithError(argv[optind + 2],
+                                       "Error: Secret key must be a number.\n");
+
+  if (config.connections < 1 || config.keys < 1 || config.seconds <= 0 ||
+      config.rate < 0 || config.valueBytes < 1 ||
+      config.valueBytes > MAX_VALUE_LENGTH ||
+      config.valueBytes > MAX_DIGEST_LENGTH) {
+    fprintf(stderr, "Error: Connections, keys, duration and value size must "
+                    "be positive, and values at most %d bytes.\n",
+            MAX_VALUE_LENGTH);
+    exit(1);
+  }
+  if (config.depth < 0 || (config.depth > 0 && config.rate > 0)) {
+    fprintf(stderr, "Error: Pipeline depth must be positive, and can't be "
+                    "combined with a rate.\n");
+    exit(1);
+  }
+
+  // A server hanging up on us mid-write should count as an error, not kill
+  // the benchmark.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Load every key first so GETs measure hits rather than misses.
+  char value[MAX_VALUE_LENGTH];
+  memset(value, 'v', config.valueBytes);
+  value[config.valueBytes - 1] = '\0';
+  for (int i = 0; i < config.keys; i++) {
+    char name[MAX_VARNAME_LENGTH + 1];
+    snprintf(name, sizeof(name), "k%d", i);
+    if (smallSet(config.machineName, config.port, config.secretKey, name,
+                 value, config.valueBytes) != 0) {
+      fprintf(stderr, "Error: Couldn't preload key %s.\n", name);
+      exit(1);
+    }
+  }
+
+  Worker *workers = (Worker *)calloc(config.connections, sizeof(Worker));
+  benchStart = nowNs();
+  benchEnd = benchStart + (unsigned long long)(config.seconds * NSEC_PER_SEC);
+
+  for (int i = 0; i < config.connections; i++) {
+    workers[i].id = i;
+    workers[i].seed = (unsigned int)(benchStart + i);
+    for (int type = 0; type < MESSAGE_TYPE_COUNT; type++)
+      histogramInit(&workers[i].latency[type]);
+    pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+  }
+
+  // Gather everyone's results into one set of histograms.
+  Histogram latency[MESSAGE_TYPE_COUNT], overall;
+  unsigned long long counts[MESSAGE_TYPE_COUNT] = {0};
+  unsigned long long errors[MESSAGE_TYPE_COUNT] = {0};
+  unsigned long long busy[MESSAGE_TYPE_COUNT] = {0};
+  unsigned long long totalCount = 0, totalErrors = 0, totalBusy = 0;
+  unsigned long long lateStarts = 0;
+  histogramInit(&overall);
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++)
+    histogramInit(&latency[type]);
+
+  for (int i = 0; i < config.connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+    lateStarts += workers[i].lateStarts;
+    for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+      histogramMerge(&latency[type], &workers[i].latency[type]);
+      histogramMerge(&overall, &workers[i].latency[type]);
+      counts[type] += workers[i].counts[type];
+      errors[type] += workers[i].errors[type];
+      busy[type] += workers[i].busy[type];
+    }
+  }
+  double elapsed = (nowNs() - benchStart) / (double)NSEC_PER_SEC;
+
+  if (config.rate > 0)
+    printf("open-loop at %.1f req/s, %d connections, %.1f s, %llu late "
+           "starts\n",
+           config.rate, config.connections, elapsed, lateStarts);
+  else if (config.depth > 0)
+    printf("closed-loop, %d connections pipelined %d deep, %.1f s\n",
+           config.connections, config.depth, elapsed);
+  else
+    printf("closed-loop, %d connections, %.1f s\n", config.connections,
+           elapsed);
+
+  printf("%-8s %10s %8s %8s %12s %10s %10s %10s %10s\n", "type", "count",
+         "errors", "busy", "req/s", "p50(us)", "p99(us)", "p99.9(us)",
+         "max(us)");
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+    if (counts[type] == 0)
+      continue;
+    printRow(requestTypeNames[type], &latency[type], counts[type],
+             errors[type], busy[type], elapsed);
+    totalCount += counts[type];
+    totalErrors += errors[type];
+    totalBusy += busy[type];
+  }
+  printRow("total", &overall, totalCount, totalErrors, totalBusy, elapsed);
+
+  free(workers);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include "common.h"
+#include "sserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  // Need 6 arguments: The program name, machine name, port, secret key, the
+  // variable to set, the value it has to hold now, and the value to set it to.
+  if (argc != 7) {
+    fprintf(stderr,
+            "Usage: %s <machine name> <port> <secret key> <variable name> "
+            "<expected value> <new value>\n",
+            argv[0]);
+    exit(1);
+  }
+
+  // Parse the arguments and handle any errors that come up.
+  char *MachineName = argv[1], *varName = argv[4], *expected = argv[5],
+       *value = argv[6];
+  int port;
+  int SecretKey;
+
+  port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+  SecretKey =
+      parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+
+  if (strlen(varName) > MAX_VARNAME_LENGTH) {
+    fprintf(stderr, "Error: Variable name must be at most %d characters.\n",
+            MAX_VARNAME_LENGTH);
+    exit(1);
+  }
+
+  // Like smallSet, treat both values as strings, terminating null included.
+  if (strlen(expected) >= MAX_VALUE_LENGTH || strlen(value) >= MAX_VALUE_LENGTH) {
+    fprintf(stderr, "Error: Values must be at most %u bytes, "
+                    "including terminating null.\n",
+            MAX_VALUE_LENGTH);
+    exit(1);
+  }
+
+  int success = smallCas(MachineName, port, SecretKey, varName, expected,
+                         strlen(expected) + 1, value, strlen(value) + 1);
+
+  if (success != 0)
+    fprintf(stderr, "%s\n", failureMessage(success));
+}
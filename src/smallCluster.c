@@ -0,0 +1,111 @@
+#include "cluster.h"
+#include "common.h"
+#include "sserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s <host:port[=weight],...> <secret key> route|get "
+          "<variable name>...\n"
+          "       %s <host:port[=weight],...> <secret key> set "
+          "<variable name> <value> [<variable name> <value>]...\n",
+          prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 5)
+    usage(argv[0]);
+
+  // Split the node list on commas.
+  char *nodes[CLUSTER_MAX_NODES];
+  int nodeCount = 0;
+  for (char *node = strtok(argv[1], ","); node != NULL;
+       node = strtok(NULL, ",")) {
+    if (nodeCount == CLUSTER_MAX_NODES) {
+      fprintf(stderr, "Error: At most %d nodes.\n", CLUSTER_MAX_NODES);
+      exit(1);
+    }
+    nodes[nodeCount++] = node;
+  }
+  SmallCluster *cluster = smallClusterOpen(nodes, nodeCount);
+  if (cluster == NULL) {
+    fprintf(stderr, "Error: Nodes must look like host:port or "
+                    "host:port=weight.\n");
+    exit(1);
+  }
+  int SecretKey =
+      parseIntWithError(argv[2], "Error: Secret key must be a number.\n");
+  char *command = argv[3];
+  char **args = &argv[4];
+  int count = argc - 4;
+
+  for (int i = 0; i < count; i += strcmp(command, "set") == 0 ? 2 : 1) {
+    if (strlen(args[i]) > MAX_VARNAME_LENGTH) {
+      fprintf(stderr, "Error: Variable name must be at most %d characters.\n",
+              MAX_VARNAME_LENGTH);
+      exit(1);
+    }
+  }
+
+  // Every variable's node, one per line.
+  if (strcmp(command, "route") == 0) {
+    for (int i = 0; i < count; i++) {
+      int node = smallClusterNode(cluster, args[i]);
+      printf("%s %s:%d\n", args[i], smallClusterHost(cluster, node),
+             smallClusterPort(cluster, node));
+    }
+    smallClusterClose(cluster);
+    return 0;
+  }
+
+  int *statuses = (int *)malloc(count * sizeof(int));
+  int failed;
+  if (strcmp(command, "get") == 0) {
+    // Each value on a line of its own, in order.
+    char **values = (char **)malloc(count * sizeof(char *));
+    int *lengths = (int *)malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++)
+      values[i] = (char *)malloc(MAX_VALUE_LENGTH + 1);
+    failed = smallClusterGetMany(cluster, SecretKey, args, count, values,
+                                 lengths, statuses) != 0;
+    for (int i = 0; i < count; i++) {
+      if (statuses[i] != 0) {
+        fprintf(stderr, "%s: %s\n", args[i], failureMessage(statuses[i]));
+        printf("\n");
+        continue;
+      }
+      // Values are arbitrary bytes, but this client treats them as strings.
+      values[i][lengths[i]] = '\0';
+      printf("%s\n", values[i]);
+    }
+  } else if (strcmp(command, "set") == 0 && count % 2 == 0) {
+    int pairs = count / 2;
+    char **names = (char **)malloc(pairs * sizeof(char *));
+    char **values = (char **)malloc(pairs * sizeof(char *));
+    short *lengths = (short *)malloc(pairs * sizeof(short));
+    for (int i = 0; i < pairs; i++) {
+      names[i] = args[2 * i];
+      values[i] = args[2 * i + 1];
+      if (strlen(values[i]) > MAX_VALUE_LENGTH) {
+        fprintf(stderr, "Error: Value must be at most %d characters.\n",
+                MAX_VALUE_LENGTH);
+        exit(1);
+      }
+      lengths[i] = strlen(values[i]);
+    }
+    failed = smallClusterSetMany(cluster, SecretKey, names, values, lengths,
+                                 pairs, statuses) != 0;
+    for (int i = 0; i < pairs; i++) {
+      if (statuses[i] != 0)
+        fprintf(stderr, "%s: %s\n", names[i], failureMessage(statuses[i]));
+    }
+  } else {
+    usage(argv[0]);
+  }
+
+  smallClusterClose(cluster);
+  return failed ? 1 : 0;
+}
@@ -1,21 +1,91 @@
+#include "batch.h"
 #include "common.h"
 #include "sserver.h"
+#include "wire.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Amount of extra space to use for the response buffer. Just in case we get
 // more data than we're expecting.
 #define FUDGE_AMOUNT 10
 
+static void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s <machine name> <port> <secret key> <value>\n"
+          "       %s -b|-f <file> <machine name> <port> <secret key>\n",
+          prog, prog);
+  exit(1);
+}
+
+// In batch mode, each line is a value to digest.
+static size_t encodeLine(const char *line, int SecretKey, char *out,
+                         size_t capacity, const char **error, void *context) {
+  (void)context;
+  // The value goes with its terminating null, as it does from the command
+  // line.
+  size_t length = strlen(line) + 1;
+  if (length > MAX_DIGEST_LENGTH) {
+    *error = "Value is too long";
+    return 0;
+  }
+  ClientDigest message = {
+      {SecretKey, SSERVER_MSG_DIGEST, {0, 0}}, (unsigned short)length, {0}};
+  memcpy(message.value, line, length);
+  return encodeClientDigest(&message, out, capacity);
+}
+
+// One line per value: its digest, or an empty line if it couldn't be worked
+// out, with why on stderr.
+static void printLine(int line, int status, const char *data, int length) {
+  if (status != 0) {
+    fprintf(stderr, "Line %d: %s\n", line, failureMessage(status));
+    printf("\n");
+    return;
+  }
+  printf("%.*s\n", length, data);
+}
+
 int main(int argc, char *argv[]) {
-  // Need 5 arguments: The program name, machine name, port, secret key, and
-  // the value to digest.
-  if (argc != 5) {
-    fprintf(stderr, "Usage: %s <machine name> <port> <secret key> <value>\n",
-            argv[0]);
-    exit(1);
+  // Whether to read the values to digest from stdin (-b) or a file (-f).
+  char *prog = argv[0];
+  int opt;
+  int batch = 0;
+  char *batchFile = NULL;
+  while ((opt = getopt(argc, argv, "bf:")) != -1) {
+    if (opt == 'b' || opt == 'f') {
+      batch = 1;
+      batchFile = opt == 'f' ? optarg : NULL;
+      continue;
+    }
+    usage(prog);
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (batch) {
+    if (argc != 4)
+      usage(prog);
+    int port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+    int SecretKey =
+        parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+    int input = batchFile == NULL ? STDIN_FILENO : open(batchFile, O_RDONLY);
+    if (input < 0) {
+      perror(batchFile);
+      exit(1);
+    }
+    return runBatch(argv[1], port, SecretKey, input, encodeLine, NULL,
+                    printLine) == 0
+               ? 0
+               : 1;
+  }
+
+  // Otherwise need 5 arguments: The program name, machine name, port, secret
+  // key, and the value to digest.
+  if (argc != 5)
+    usage(prog);
 
   // Parse the arguments and handle any errors that come up.
   char *MachineName = argv[1], *value = argv[4];
@@ -28,11 +98,12 @@ int main(int argc, char *argv[]) {
       parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
 
   char resultBuf[MAX_RESPONSE_SIZE + FUDGE_AMOUNT];
+  int resultLen;
   int success = smallDigest(MachineName, port, SecretKey, value,
-                            strlen(value) + 1, resultBuf, NULL);
+                            strlen(value) + 1, resultBuf, &resultLen);
 
   if (success != 0)
-    fprintf(stderr, "failed\n");
- // else
-   // printf("%s\n", resultBuf);
+    fprintf(stderr, "%s\n", failureMessage(success));
+  else
+    printf("%.*s\n", resultLen, resultBuf);
 }
@@ -1,22 +1,92 @@
+#include "batch.h"
 #include "common.h"
 #include "sserver.h"
+#include "wire.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Amount of extra space to use for the response buffer. Just in case we get
 // more data than we're expecting.
 #define FUDGE_AMOUNT 50
 
+static void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s <machine name> <port> <secret key> <variable name>\n"
+          "       %s -b|-f <file> <machine name> <port> <secret key>\n",
+          prog, prog);
+  exit(1);
+}
+
+// In batch mode, each line is a variable name.
+static size_t encodeLine(const char *line, int SecretKey, char *out,
+                         size_t capacity, const char **error, void *context) {
+  (void)context;
+  if (line[0] == '\0') {
+    *error = "Expected a variable name";
+    return 0;
+  }
+  if (strlen(line) > MAX_VARNAME_LENGTH) {
+    *error = "Variable name is too long";
+    return 0;
+  }
+  ClientGet message = {{SecretKey, SSERVER_MSG_GET, {0, 0}}, {0}};
+  strcpy(message.varName, line);
+  return encodeClientGet(&message, out, capacity);
+}
+
+// One line per variable: its value, or an empty line if it couldn't be read,
+// with why on stderr.
+static void printLine(int line, int status, const char *data, int length) {
+  if (status != 0) {
+    fprintf(stderr, "Line %d: %s\n", line, failureMessage(status));
+    printf("\n");
+    return;
+  }
+  // Values are arbitrary bytes, but this client treats them as strings.
+  printf("%.*s\n", (int)strnlen(data, length), data);
+}
+
 int main(int argc, char *argv[]) {
-  // Need 5 arguments: The program name, machine name, port, secret key, and
-  // the variable to look up.
-  if (argc != 5) {
-    fprintf(stderr,
-            "Usage: %s <machine name> <port> <secret key> <variable name>\n>",
-            argv[0]);
-    exit(1);
+  // Whether to read the variables to look up from stdin (-b) or a file (-f).
+  char *prog = argv[0];
+  int opt;
+  int batch = 0;
+  char *batchFile = NULL;
+  while ((opt = getopt(argc, argv, "bf:")) != -1) {
+    if (opt == 'b' || opt == 'f') {
+      batch = 1;
+      batchFile = opt == 'f' ? optarg : NULL;
+      continue;
+    }
+    usage(prog);
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (batch) {
+    if (argc != 4)
+      usage(prog);
+    int port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+    int SecretKey =
+        parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+    int input = batchFile == NULL ? STDIN_FILENO : open(batchFile, O_RDONLY);
+    if (input < 0) {
+      perror(batchFile);
+      exit(1);
+    }
+    return runBatch(argv[1], port, SecretKey, input, encodeLine, NULL,
+                    printLine) == 0
+               ? 0
+               : 1;
+  }
+
+  // Otherwise need 5 arguments: The program name, machine name, port, secret
+  // key, and the variable to look up.
+  if (argc != 5)
+    usage(prog);
 
   // Parse the arguments and handle any errors that come up.
   char *MachineName = argv[1], *varName = argv[4];
@@ -41,7 +111,10 @@ int main(int argc, char *argv[]) {
       smallGet(MachineName, port, SecretKey, varName, resultBuf, &resultLen);
 
   if (success != 0)
-    fprintf(stderr, "failed\n");
-  //else
-    //printf("%s\n", resultBuf);
+    fprintf(stderr, "%s\n", failureMessage(success));
+  else {
+    // Values are arbitrary bytes, but this client treats them as strings.
+    resultBuf[resultLen] = '\0';
+    printf("%s\n", resultBuf);
+  }
 }
@@ -0,0 +1,54 @@
+#include "common.h"
+#include "sserver.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  // Need 5 or 6 arguments: The program name, machine name, port, secret key,
+  // the variable to add to, and optionally the amount to add (1 if not
+  // given). A negative amount decrements.
+  if (argc != 5 && argc != 6) {
+    fprintf(stderr,
+            "Usage: %s <machine name> <port> <secret key> <variable name> "
+            "[amount]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  // Parse the arguments and handle any errors that come up.
+  char *MachineName = argv[1], *varName = argv[4];
+  int port;
+  int SecretKey;
+
+  port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+  SecretKey =
+      parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+
+  if (strlen(varName) > MAX_VARNAME_LENGTH) {
+    fprintf(stderr, "Error: Variable name must be at most %d characters.\n",
+            MAX_VARNAME_LENGTH);
+    exit(1);
+  }
+
+  long long delta = 1;
+  if (argc == 6) {
+    char *end;
+    errno = 0;
+    delta = strtoll(argv[5], &end, 10);
+    if (errno != 0 || end == argv[5] || *end != '\0') {
+      fputs("Error: Amount must be a number.\n", stderr);
+      exit(1);
+    }
+  }
+
+  long long result;
+  int success =
+      smallIncr(MachineName, port, SecretKey, varName, delta, &result);
+
+  if (success != 0)
+    fprintf(stderr, "%s\n", failureMessage(success));
+  else
+    printf("%lld\n", result);
+}
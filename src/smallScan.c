@@ -0,0 +1,46 @@
+#include "common.h"
+#include "sserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  // Need 4 or 5 arguments: The program name, machine name, port, secret key,
+  // and optionally the prefix the names should start with (all names if it's
+  // not given).
+  if (argc != 4 && argc != 5) {
+    fprintf(stderr, "Usage: %s <machine name> <port> <secret key> [prefix]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  // Parse the arguments and handle any errors that come up.
+  char *MachineName = argv[1], *prefix = argc == 5 ? argv[4] : "";
+  int port;
+  int SecretKey;
+
+  port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+  SecretKey =
+      parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+
+  if (strlen(prefix) > MAX_VARNAME_LENGTH) {
+    fprintf(stderr, "Error: Prefix must be at most %d characters.\n",
+            MAX_VARNAME_LENGTH);
+    exit(1);
+  }
+
+  // Page through the names, one line each, until the cursor comes back empty.
+  char cursor[MAX_VARNAME_LENGTH + 1] = "";
+  do {
+    static char names[MAX_SCAN_LENGTH];
+    int namesLength;
+    int status = smallScan(MachineName, port, SecretKey, prefix, cursor,
+                           MAX_SCAN_COUNT, names, &namesLength, cursor);
+    if (status != 0) {
+      fprintf(stderr, "%s\n", failureMessage(status));
+      exit(1);
+    }
+    for (int i = 0; i < namesLength; i += strlen(&names[i]) + 1)
+      printf("%s\n", &names[i]);
+  } while (cursor[0] != '\0');
+}
@@ -1,24 +1,116 @@
+#include "batch.h"
 #include "common.h"
 #include "sserver.h"
+#include "wire.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Amount of extra space to use for the response buffer. Just in case we get
 // more data than we're expecting.
 #define FUDGE_AMOUNT 10
 
+static void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-t ttl in ms] <machine name> <port> <secret key> "
+          "<variable name> <value>\n"
+          "       %s [-t ttl in ms] -b|-f <file> <machine name> <port> "
+          "<secret key>\n",
+          prog, prog);
+  exit(1);
+}
+
+// In batch mode, each line is a variable name, then a space or tab, then the
+// rest of the line is the value.
+static size_t encodeLine(const char *line, int SecretKey, char *out,
+                         size_t capacity, const char **error, void *context) {
+  unsigned int ttlMs = *(unsigned int *)context;
+  size_t nameLength = strcspn(line, " \t");
+  const char *value = line[nameLength] == '\0' ? NULL : &line[nameLength + 1];
+  if (nameLength == 0 || value == NULL) {
+    *error = "Expected a variable name and a value";
+    return 0;
+  }
+  if (nameLength > MAX_VARNAME_LENGTH) {
+    *error = "Variable name is too long";
+    return 0;
+  }
+  // The value goes with its terminating null, as it does from the command
+  // line.
+  size_t length = strlen(value) + 1;
+  if (length > MAX_VALUE_LENGTH) {
+    *error = "Value is too long";
+    return 0;
+  }
+  if (ttlMs == 0) {
+    ClientSet message = {
+        {SecretKey, SSERVER_MSG_SET, {0, 0}}, {0}, (unsigned short)length};
+    memcpy(message.varName, line, nameLength);
+    memcpy(message.value, value, length);
+    return encodeClientSet(&message, out, capacity);
+  }
+  ClientSetTtl message = {{SecretKey, SSERVER_MSG_SET_TTL, {0, 0}},
+                          {0},
+                          ttlMs,
+                          (unsigned short)length};
+  memcpy(message.varName, line, nameLength);
+  memcpy(message.value, value, length);
+  return encodeClientSetTtl(&message, out, capacity);
+}
+
+// One line per set: "ok", or why it failed.
+static void printLine(int line, int status, const char *data, int length) {
+  (void)line, (void)data, (void)length;
+  printf("%s\n", status == 0 ? "ok" : failureMessage(status));
+}
+
 int main(int argc, char *argv[]) {
-  // Need 6 arguments: The program name, machine name, port, secret key, the
-  // variable name, and the value to associate with the variable name.
-  if (argc != 6) {
-    fprintf(stderr, "Usage: %s <machine name> <port> <secret key> <variable "
-                    "name> <value>\n",
-            argv[0]);
-    exit(1);
+  // An optional time to live comes first, and whether to read the variables
+  // to set from stdin (-b) or a file (-f).
+  int opt;
+  unsigned int ttlMs = 0;
+  int batch = 0;
+  char *batchFile = NULL;
+  while ((opt = getopt(argc, argv, "t:bf:")) != -1) {
+    if (opt == 't') {
+      ttlMs = parseIntWithError(optarg, "Error: TTL must be a number.\n");
+      continue;
+    }
+    if (opt == 'b' || opt == 'f') {
+      batch = 1;
+      batchFile = opt == 'f' ? optarg : NULL;
+      continue;
+    }
+    usage(argv[0]);
   }
 
+  if (batch) {
+    if (argc - optind != 3)
+      usage(argv[0]);
+    argv += optind - 1;
+    int port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+    int SecretKey =
+        parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+    int input = batchFile == NULL ? STDIN_FILENO : open(batchFile, O_RDONLY);
+    if (input < 0) {
+      perror(batchFile);
+      exit(1);
+    }
+    return runBatch(argv[1], port, SecretKey, input, encodeLine, &ttlMs,
+                    printLine) == 0
+               ? 0
+               : 1;
+  }
+
+  // Then 5 arguments: the machine name, port, secret key, the variable name,
+  // and the value to associate with the variable name.
+  if (argc - optind != 5)
+    usage(argv[0]);
+
   // Parse the arguments and handle any errors that come up.
+  argv += optind - 1;
   char *MachineName = argv[1], *varName = argv[4], *value = argv[5];
   int port;
   int SecretKey;
@@ -42,8 +134,11 @@ int main(int argc, char *argv[]) {
   }
 
   int success =
-      smallSet(MachineName, port, SecretKey, varName, value, strlen(value) + 1);
+      ttlMs == 0 ? smallSet(MachineName, port, SecretKey, varName, value,
+                            strlen(value) + 1)
+                 : smallSetTtl(MachineName, port, SecretKey, varName, value,
+                               strlen(value) + 1, ttlMs);
 
   if (success != 0)
-    fprintf(stderr, "failed\n");
+    fprintf(stderr, "%s\n", failureMessage(success));
 }
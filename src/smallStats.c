@@ -0,0 +1,31 @@
+#include "common.h"
+#include "sserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+  // Need 4 arguments: The program name, machine name, port, and secret key.
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <machine name> <port> <secret key>\n",
+            argv[0]);
+    exit(1);
+  }
+
+  // Parse the arguments and handle any errors that come up.
+  char *MachineName = argv[1];
+  int port;
+  int SecretKey;
+
+  port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+  SecretKey =
+      parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+
+  static char result[MAX_STATS_LENGTH];
+  int resultLen;
+  int success = smallStats(MachineName, port, SecretKey, result, &resultLen);
+
+  if (success != 0)
+    fprintf(stderr, "%s\n", failureMessage(success));
+  else
+    fwrite(result, 1, resultLen, stdout);
+}
@@ -0,0 +1,50 @@
+#include "common.h"
+#include "sserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Print a change as a line: the name, the version, and the value.
+static int printChange(const char *variableName, const char *value,
+                       int dataLength, unsigned long long version,
+                       void *context) {
+  // Values are arbitrary bytes, but this client treats them as strings.
+  printf("%s %llu %.*s\n", variableName, version,
+         (int)strnlen(value, dataLength), value);
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // Need at least 5 arguments: The program name, machine name, port, secret
+  // key, and the variables to watch.
+  if (argc < 5) {
+    fprintf(stderr,
+            "Usage: %s <machine name> <port> <secret key> <variable name>...\n",
+            argv[0]);
+    exit(1);
+  }
+
+  // Parse the arguments and handle any errors that come up.
+  char *MachineName = argv[1];
+  int port;
+  int SecretKey;
+
+  port = parseIntWithError(argv[2], "Error: Port must be a number.\n");
+  SecretKey =
+      parseIntWithError(argv[3], "Error: Secret key must be a number.\n");
+
+  for (int i = 4; i < argc; i++) {
+    if (strlen(argv[i]) > MAX_VARNAME_LENGTH) {
+      fprintf(stderr, "Error: Variable name must be at most %d characters.\n",
+              MAX_VARNAME_LENGTH);
+      exit(1);
+    }
+  }
+
+  // Print every change until the server goes away.
+  int status = smallWatch(MachineName, port, SecretKey, &argv[4], argc - 4,
+                          printChange, NULL);
+  fprintf(stderr, "%s\n", failureMessage(status));
+  exit(1);
+}
@@ -1,93 +1,41 @@
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
-#include <functional>
 #include <iostream>
-#include <map>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 extern "C" {
 #include "common.h"
 #include "csapp.h"
 }
+#include "admission.h"
+#include "compute.h"
+#include "cores.h"
+#include "deadlines.h"
+#include "digest.h"
+#include "log.h"
+#include "netio.h"
+#include "protocol.h"
+#include "stats.h"
+#include "store.h"
+#include "tenants.h"
+#include "watch.h"
 
-using std::map;
 using std::string;
-using std::cout;
 using std::cerr;
 using std::endl;
-
-// The size of a connection buffer, used to hold the server's response when
-// responding to a client's request.
-const size_t CONN_BUFFER_SIZE = 200;
+using std::thread;
+using std::vector;
 
 //===================
 // Helper functions.
 //===================
 
-// Read the preamble of a client's request into a struct.
-ClientPreamble readPreamble(char clientRequest[]) {
-  // Read the preamble from the bytes. Don't bother swapping them to host
-  // order; we'll do that later.
-  ClientPreamble preamble{0, 0};
-  // because sizeof int == 4, this reads exactly what we want
-  preamble.secretKey = *(unsigned int *)&clientRequest[0];
-
-  preamble.msgType =
-      *(unsigned short *)&clientRequest[4];
-  return preamble;
-}
-
-// Get the digest value of the value using /bin/sha256sum.
-const char * digest(int valueLength, const char *value) {
-  string command = string("echo ") + value + " | /bin/sha256sum";
-	FILE *f = popen(command.c_str(), "r");
-char buf[100];
-while (fgets(buf, sizeof(buf), f) != 0) {
-}
-pclose(f);
-char *fin = (char *)malloc(100);
-memcpy(buf, fin, 100);
-return fin;
-/*  // Set up pipes.
-  int stdoutCopy = dup(STDOUT_FILENO);
-
-  // Make two pipes: One (`childIn`) we'll use to send `value` to sha256sum;
-  // another (`childOut`) that we'll use to read the digest.
-  //
-  // NOTE: According to man 2 pipe2, [0] is the read end, [1] is write end.
-  int childOut[2];
-  pipe(childOut);
-
-  // Overwrite stdin and stdout with pipes.
-  dup2(STDOUT_FILENO, childOut[1]);
-
-  int status = system(command.c_str());
-
-  if (status != 0)
-	printf("WARNING: sha2457sum did not exit with status 0.");
-
-  // Restore stdin and stdout, then close the pipes we don't need: the read
-  // pipe for childIn, the write pipe for childOut.
-  dup2(STDOUT_FILENO, stdoutCopy);
-  close(childOut[1]);
-
-  // Send the value to be digested.
-
-  // Read the digest and close the read pipe.
-  const int FUDGE_AMT = 20;
-  char digestBuf[MAX_DIGEST_LENGTH + 1 + FUDGE_AMT];
-  digestBuf[MAX_DIGEST_LENGTH] = '\0';
-
-  read(childOut[0], digestBuf, MAX_DIGEST_LENGTH);
-  close(childOut[0]);
-
-  // Return the digest result. Remove thetrailing newline if there is one.
-  string out = digestBuf;
-  if (out.size() > 0 && *(out.end() - 1) == '\n')
-    out.pop_back();
-  return out;*/
-}
-
 // Run a child program, capturing and returning its stdout.
 /*
 string run(const string &exe, const vector<string> &args) {
@@ -115,221 +63,161 @@ string run(const string &exe, const vector<string> &args) {
 // Variable storage.
 //====================
 
-map<string, string> storedVars;
+// The default tenant's variables.
+VarStore storedVars;
+
+// The store a request on this thread uses: in the shared-nothing mode, its
+// core's own, and otherwise the one its tenant's threads share. Only requests
+// with a tenant's key get this far.
+VarStore &localStore(const Request &request) {
+  int core = currentCore();
+  return core < 0 ? *findTenant(request.secretKey)->store : coreStore(core);
+}
+
+// How DIGEST requests are computed. Chosen with -D on the command line.
+DigestBackend digestBackend = DIGEST_BUILTIN;
 
 //====================
 // Response handlers.
 //====================
 
-// Our response functions. A response function is intended to take the client's
-// file descriptor, the number of bytes in the client's request, the bytes of
-// the request (not including the preamble), and a reference to the "detail"
-// string), and return whether or not it succeeded in responding to the client.
-using ResponseFunction = std::function<bool(int, int, char[], string &)>;
-map<MessageType, ResponseFunction> responseFunctions;
-void initHandlers();
-
-// Handler for a set response. Should set the variable and respond to the
-// client appropriately.
-bool setResponse(int clientfd, int requestLen, char clientRequest[],
-                 string &detail) {
-  char connBuffer[CONN_BUFFER_SIZE];
-  rio_t rio;
- Rio_readinitb(&rio, clientfd);
-
-  char *name = (char*)malloc(15);
-  cout << "trying to get name: " << endl;
-  int nameLen = (int)Rio_readnb(&rio, name, 15);
-  cout << "deteccted name: " << name << " " << nameLen << endl;
-
-  // Read in the variable name, the value length, and the value.
-  string varName(&clientRequest[0]);
-  int varNameLength = varName.length();
-  // TODO: Not sure how to handle this. This is the case where the var name is
-  if (varNameLength >= (requestLen - LENGTH_SPECIFIER_SIZE))
-    return -1;
-  if (varNameLength >= requestLen)
-    return -1;
-
-  detail = varName;
-  detail += ": ";
-
-  unsigned short valueLength;
-  valueLength = ((unsigned short)clientRequest[varNameLength + 1]) << 8;
-  valueLength |= (unsigned short)clientRequest[varNameLength + 2];
-
-  // Check the value's length.
-  if (valueLength > MAX_VALUE_LENGTH) {
-    detail += "(value length field too large, at ";
-    detail += valueLength;
-    detail += +" bytes)";
-    return -1;
-  }
-
-  char *value = (char *)malloc(valueLength + 1);
-  std::copy(&clientRequest[varNameLength + LENGTH_SPECIFIER_SIZE +
-                           1], // +1 for the trailing null
-            &clientRequest[varNameLength + LENGTH_SPECIFIER_SIZE +
-                           valueLength], // do I need a +1 here?
-            value);
+// A response handler takes a decoded request and fills in the response.
+using Handler = void (*)(const Request &, Response &);
 
-  detail += value;
-
-  storedVars[varName] = value;
-
-  cout << "stored " << value <<  " as " << varName << endl;
+void setResponse(const Request &request, Response &) {
+  localStore(request).set(string(request.name, request.nameLength),
+                          request.value, request.valueLength);
+}
 
-  // TODO: Handle response. Somehow.
+void setTtlResponse(const Request &request, Response &) {
+  localStore(request).set(string(request.name, request.nameLength),
+                          request.value, request.valueLength, request.ttlMs);
+}
 
-  return 0;
+void getResponse(const Request &request, Response &response) {
+  response.success = response.withData = localStore(request).get(
+      string(request.name, request.nameLength), response.data);
 }
 
-// Handler for a get response. Should get the variable and return it to the
-// client appropriately.
-bool getResponse(int clientfd, int requestLen, char clientRequest[],
-                 string &detail) {
-  char connBuffer[CONN_BUFFER_SIZE];
-  rio_t rio;
+// Send the sum back as the variable now holds it: as text, with a terminating
+// null.
+void incrResponse(const Request &request, Response &response) {
+  int64_t sum;
+  response.success = response.withData = localStore(request).increment(
+      string(request.name, request.nameLength), request.delta, sum);
+  if (response.success)
+    response.data = std::to_string(sum) + '\0';
+}
 
-  string varName(&clientRequest[0]);
-  int varNameLength = varName.length();
-  detail = varName;
-  if (varNameLength >= requestLen)
-    return -1;
+void casResponse(const Request &request, Response &response) {
+  response.success = localStore(request).compareAndSet(
+      string(request.name, request.nameLength), request.expected,
+      request.expectedLength, request.value, request.valueLength);
+}
 
-  // TODO: Lookup var, return it if it exists, else return -1.
+// List a page of the names with the prefix, from the cursor on. One more than
+// the page is asked for, to tell if there's another page after it.
+void scanResponse(const Request &request, Response &response) {
+  vector<string> names;
+  localStore(request).scan(string(request.name, request.nameLength),
+                           string(request.cursor, request.cursorLength),
+                           request.count + 1, names);
+  response.data = encodeScanPage(names, request.count);
+  response.withData = true;
+}
 
-  return 0;
+// Send the digest back with its terminating null, as a string.
+void digestResponse(const Request &request, Response &response) {
+  bool cached;
+  response.data = digest(digestBackend, request.value, request.valueLength,
+                         &cached);
+  response.data += '\0';
+  response.withData = true;
+  ThreadStats &stats = threadStats();
+  (cached ? stats.digestCacheHits : stats.digestCacheMisses).add();
 }
 
-// Digest response handler. Should process the input appropriately and return
-// the digest to the client.
-bool digestResponse(int clientfd, int requestLen, char clientRequest[],
-                    string &detail) {
-  int result = 0;
+// Run requests are accepted but don't run anything yet.
+void runResponse(const Request &, Response &) {}
 
-  // Read in the value length in network order.
-  unsigned short valueLength;
-  valueLength = ((unsigned short)clientRequest[0]) << 8;
-  valueLength |= (unsigned short)clientRequest[1];
+// Add a store's figures to the stats.
+void addStore(StatsExtras &extras, const VarStore &store) {
+  extras.keys += store.size();
+  extras.storeBytes += store.memoryUsed();
+  extras.keysExpired += store.expired();
+  extras.keysEvicted += store.evicted();
+  extras.storeLimit += store.memoryLimit();
+}
 
-  // If the value's length is out of range,
-  if (valueLength > MAX_VARNAME_LENGTH) {
-    result = -1;
+// The default tenant is shown the whole server, and every other tenant; any
+// other tenant is shown its own store and itself. The counters and latencies
+// are the whole server's either way.
+void statsResponse(const Request &request, Response &response) {
+  const Tenant *asking = findTenant(request.secretKey);
+  bool everything = asking->keyspace == 0;
+  StatsExtras extras = {};
+  extras.computeThreads = computeThreads();
+  extras.computeQueued = computeQueued();
+  if (everything) {
+    addStore(extras, storedVars);
+    for (int core = 0; core < coreCount(); core++)
+      addStore(extras, coreStore(core));
   }
 
-  // Make sure we actually got the expected number of bytes.
-  if (valueLength >= (requestLen - LENGTH_SPECIFIER_SIZE))
-    result = -1;
-
-  // Grab the value and copy it into the detail string.
-  char *value = &clientRequest[LENGTH_SPECIFIER_SIZE];
-  detail = value;
-
-  // Maximum length of a command.
-  /*
-  const int MAX_COMMAND_LENGTH = 60 + MAX_VALUE_LENGTH;
-  // NOTE: Is snprintf a security vulnerability here?
-  char command[MAX_COMMAND_LENGTH];
-  snprintf(command, MAX_COMMAND_LENGTH, "/bin/echo '%100s' | /bin/sha256sum",
-  value);
-
-  // Copy the value.
-  //
-  // TODO: I might not need this.
-  char *value = (char *)malloc(valueLength + 1);
-  std::copy(&clientRequest[LENGTH_SPECIFIER_SIZE],
-            &clientRequest[LENGTH_SPECIFIER_SIZE + valueLength - 1],
-            value);
-  */
-
-  // Get the digest.
-  string out = digest(valueLength, value);
-
-  char connBuffer[CONN_BUFFER_SIZE];
-  connBuffer[0] = (char)result;
-
-  // The length of out, including the final null.
-  int outLengthNull = out.length() + 1;
-  std::copy(out.begin(),
-            out.begin() + (outLengthNull > MAX_DIGEST_LENGTH ? MAX_DIGEST_LENGTH
-                                                             : outLengthNull),
-            &connBuffer[SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE]);
-  connBuffer[SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + outLengthNull] =
-      '\0';
-
-  // Write out the response.
-  Rio_writen(clientfd, connBuffer, outLengthNull);
-
-  return 0;
+  for (const std::unique_ptr<Tenant> &tenant : allTenants()) {
+    if (tenant->keyspace == 0 || (!everything && tenant.get() != asking))
+      continue;
+    addStore(extras, *tenant->store);
+    string prefix = "tenant_" + tenant->name + "_";
+    extras.lines += prefix + "keys " + std::to_string(tenant->store->size()) +
+                    "\n" + prefix + "store_bytes " +
+                    std::to_string(tenant->store->memoryUsed()) + "\n" +
+                    prefix + "requests_throttled " +
+                    std::to_string(tenant->throttled.load()) + "\n";
+  }
+  response.data = formatStats(extras);
+  response.withData = true;
 }
 
-// Handler for a run response. Should check that the request is valid, and if
-// so, run the appropriate program and return the result to the client.
-bool runResponse(int clientfd, int requestLen, char clientRequest[],
-                 string &detail) {
-  char connBuffer[CONN_BUFFER_SIZE];
-  rio_t rio;
-
-  string varName(&clientRequest[0]);
-  int varNameLength = varName.length();
-  detail = varName;
-  if (varNameLength >= requestLen)
-    return -1;
-
-  // TODO: Handle.
+// Watches belong to the connection they came in on, so handleRequest() takes
+// care of them; this is only here to fill the table.
+void watchResponse(const Request &, Response &response) {
+  response.success = false;
+}
 
-  return 0;
+void unknownResponse(const Request &request, Response &response) {
+  logMessage(LOG_WARN, "no handler for message of type %d", request.type);
+  response.success = false;
 }
 
-// Setup the handlers table.
-void initHandlers() {
-  responseFunctions[SSERVER_MSG_SET] = setResponse;
-  responseFunctions[SSERVER_MSG_GET] = getResponse;
-  responseFunctions[SSERVER_MSG_DIGEST] = digestResponse;
-  responseFunctions[SSERVER_MSG_RUN] = runResponse;
-  cout << SSERVER_MSG_SET << "sserver get" << endl;
-};
+// The handlers table, indexed by MessageType.
+constexpr Handler responseHandlers[] = {
+    setResponse,   getResponse,    digestResponse, runResponse,
+    statsResponse, setTtlResponse, incrResponse,   casResponse,
+    scanResponse,  watchResponse};
+static_assert(sizeof(responseHandlers) / sizeof(responseHandlers[0]) ==
+                  MESSAGE_TYPE_COUNT,
+              "every message type needs a handler");
 
 // Lookup a handler in the handlers table.
-ResponseFunction lookupHandler(MessageType type) {
-  auto it = responseFunctions.find(type);
-
-  if (it != responseFunctions.end())
-    return it->second;
-
-  return [=](int _clientfd, int _len, char _request[],
-                                 string &detail) -> bool {
-    detail = "error";
-    cerr << "Error: No appropriate handler for message of type `" << type
-         << "`." << endl;
-
-    return false;
-  };
+Handler lookupHandler(MessageType type) {
+  return (unsigned int)type < MESSAGE_TYPE_COUNT ? responseHandlers[type]
+                                                 : unknownResponse;
 }
 
 //=====================
 // Request type names.
 //=====================
 
-map<MessageType, string> requestTypeNames;
-
-// Set up the request type names.
-void initRequestTypeNames() {
-  requestTypeNames[SSERVER_MSG_SET] = "set";
-  requestTypeNames[SSERVER_MSG_GET] = "get";
-  requestTypeNames[SSERVER_MSG_DIGEST] = "digest";
-  requestTypeNames[SSERVER_MSG_RUN] = "run";
-}
-
-// Get the name of a request type.
+// Get the name of a request type. The names themselves live in common.c so
+// that the clients can use them too.
 const string &getRequestTypeName(MessageType request) {
+  static const vector<string> names(requestTypeNames,
+                                    requestTypeNames + MESSAGE_TYPE_COUNT);
   static const string empty;
-  auto it = requestTypeNames.find(request);
-  string out;
-  if (it != requestTypeNames.end())
-    out = it->second;
-  return (out.size() == 0) ? empty : it->second;
+  if (request < 0 || request >= MESSAGE_TYPE_COUNT)
+    return empty;
+  return names[request];
 }
 
 //==============================
@@ -338,165 +226,380 @@ const string &getRequestTypeName(MessageType request) {
 
 int _port;
 
-void handleClient(int connfd, unsigned int secretKey) {
-  // Read in the client's request and parse it.
-  char clientRequest[MAX_REQUEST_SIZE];
-  rio_t rio;
-  Rio_readinitb(&rio, connfd);
-  cout << "reading..." << endl;
-  // only read preamble -- rest will be handled later
-  // as it has variable length
-  int requestLen = (int)Rio_readnb(&rio, clientRequest, 8);
-  //Close(connfd);
-  cout << "done reading (" << requestLen << ")" << endl;
-
-  for (int i = 0; i < 8; ++i) cout << (int) clientRequest[i] << endl;
-  // TODO: Handle the case where we got a too-short request.
-  if (requestLen < CLIENT_PREAMBLE_SIZE)
-    cout << "WARNING: request too short: " << requestLen << endl;
-
-  // Read the preamble and process the info to get the host-order information
-  // we need.
-  ClientPreamble preamble = readPreamble(clientRequest);
-  unsigned int theirKey = ntohl(preamble.secretKey);
-  MessageType rqType = (MessageType)ntohs(preamble.msgType);
-
-  bool responseSuccess = true;
-  int responselen = 0;
-  char *response = "";
-  if (theirKey != secretKey) {
-	  cout << "Incorrect Key; Access denied." << endl;
-	  Close(connfd);
+// The default tenant's key, from the command line.
+unsigned int secretKey;
+
+// Record a handled request in this thread's stats, and audit it. `received`
+// is when the read that completed the request returned.
+void recordRequest(const Request &request, Clock::time_point received,
+                   const Response &response) {
+  threadStats().recordRequest(
+      request.type, response.success,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                           received)
+          .count());
+
+  // The detail is whatever identifies what the request was about: the name
+  // for sets and gets, the data for digests, and the program for runs.
+  const char *detail = request.name;
+  size_t detailLength = request.nameLength;
+  if (request.type == SSERVER_MSG_DIGEST || request.type == SSERVER_MSG_RUN) {
+    detail = request.value;
+    detailLength = request.valueLength;
+  }
+  logAudit(request.secretKey, request.type, detail, detailLength,
+           response.success);
+}
+
+// Run a request against this thread's store, then record it.
+void runRequest(const Request &request, Clock::time_point received,
+                Response &response) {
+  lookupHandler(request.type)(request, response);
+  recordRequest(request, received, response);
+}
+
+// Handle one decoded request, queueing the response on `conn`. Returns false
+// if the connection should be closed instead.
+bool handleRequest(Connection &conn, const Request &request,
+                   Clock::time_point received) {
+  Tenant *tenant = findTenant(request.secretKey);
+  if (tenant == nullptr) {
+    logMessage(LOG_WARN, "incorrect key %u for %s request; access denied",
+               request.secretKey, getRequestTypeName(request.type).c_str());
+    return false;
+  }
+
+  // Under overload, a request that's been kept waiting gets a quick no rather
+  // than a late answer, and so does one over its tenant's rate. Stats are
+  // always answered, so an overloaded server can still be looked at.
+  if (request.type != SSERVER_MSG_STATS) {
+    if (waitedTooLong(received)) {
+      answerBusy(conn);
+      return true;
+    }
+    uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         received.time_since_epoch())
+                         .count();
+    if (!tenant->rate.admit(nowNs)) {
+      tenant->throttled.fetch_add(1, std::memory_order_relaxed);
+      answerBusy(conn);
+      return true;
+    }
+  }
+
+  Response response;
+  if (request.type == SSERVER_MSG_WATCH) {
+    // The watch is kept by this thread, wherever the variable lives, since
+    // this is where the connection is.
+    response.success = watchVariable(conn, tenant->keyspace,
+                                     string(request.name, request.nameLength));
+    recordRequest(request, received, response);
+    conn.queueResponse(response.success ? 0 : -1, false, nullptr, 0);
+    return true;
   }
 
-  // Handle the actual request.
-	
-
-	else if (rqType == 0) //set response
-	{
-		char *name = (char*)malloc(15);
-		int l = (int)Rio_readnb(&rio, name, 15);
-		printf(name);
-		printf("\n");
-
-		short len;
-		Rio_readnb(&rio, (void *)&len, 2);
-		printf("len: %d\n", len);
-
-		char *val = (char *)malloc(len);
-		Rio_readnb(&rio, (void *)val, len);
-		
-		printf("val:");printf(val);
-
-		storedVars[name] = val;
-	} else if (rqType == 1) // get response
-	{
-		char *name = (char *)malloc(15);
-		Rio_readnb(&rio, name, 15);
-		cout << "name: " << name << endl;
-		
-		if (storedVars.find(name) == storedVars.end())
-			responseSuccess = false;
-		else
-		{
-			response = const_cast<char *>(storedVars[name].c_str());
-			responselen = storedVars[name].length();
-		}
-
-	}
-	else if (rqType == 2) //digest type
-	{
-		short n;
-		Rio_readnb(&rio, (void*)&n, 2);
-		cout << "n: " << n << endl;
-
-		if (n > 100)
-		{
-			cerr << "message cannot be >100 chars long" << endl;
-			responseSuccess = false;
-		}
-		else
-		{
-			char *str = (char *)malloc(n);
-			cout << "reading..." << endl;
-			Rio_readnb(&rio, str, n);
-			cout << "read " << str << endl;
-			response = const_cast<char*>(digest(n, str));
-			responselen = 100;
-			cout << str << " -> " << response << endl;
-		}
-	}
-
-	cout << "response: " << response << endl;
-
-	char returnCode = responseSuccess ? 0 : -1;
-	Rio_writen(connfd, (void*)&returnCode, 1);
-	Rio_writen(connfd, const_cast<char *>("01"), 3); //padding ?? why??
-	
-	if (responselen > 0)
-	{
-		Rio_writen(connfd, &responselen, 2);
-		Rio_writen(connfd, response, responselen);
-	}
-
-
-	return;
-  ResponseFunction handler = lookupHandler(rqType);
-
-  string detail;
-  cout << "CALLING AHANDLER" << endl;
-  bool status = handler(connfd, requestLen - CLIENT_PREAMBLE_SIZE,
-                        &clientRequest[CLIENT_PREAMBLE_SIZE], detail);
-  string statusGloss = status ? "success" : "failure";
-
-  // Log request information. Could possibly be extracted into another function
-  // to make this one shorter, but it's not used anywhere else, so I'm not sure
-  // if it's worth it.
-  cerr << "Secret key = " << ntohl(preamble.secretKey) << endl
-       << "Request type = " << getRequestTypeName(rqType) << endl
-       << "Detail = " << detail << endl
-       << "Completion = " << statusGloss << endl
-       << "--------------------------" << endl;
+  // Expensive requests are run on the compute pool, so the cheap ones behind
+  // them don't wait.
+  if (requestClass(request.type) == REQUEST_EXPENSIVE &&
+      computeRequest(conn, request, received))
+    return true;
+
+  // In the shared-nothing mode, another core's variables are its business.
+  if (forwardRequest(conn, request, received))
+    return true;
+
+  runRequest(request, received, response);
+  conn.queueResponse(response.success ? 0 : -1, response.withData,
+                     response.data.data(), response.data.size());
+  return true;
+}
+
+// Expire the shared stores' variables in the background, a little at a time,
+// so they go even if nothing looks them up. In the shared-nothing mode each
+// core does this for its own store between events.
+void expireForever() {
+  while (true) {
+    for (const std::unique_ptr<Tenant> &tenant : allTenants())
+      tenant->store->expire();
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(STORE_EXPIRY_INTERVAL_MS));
+  }
+}
+
+// Serve connections on `listenfds` forever with `backend`.
+void serve(IoBackend backend, vector<int> listenfds) {
+  // The backends only return if they can't run at all.
+  switch (backend) {
+  case IO_URING:
+    if (serveUring(listenfds, handleRequest))
+      break;
+    logMessage(LOG_WARN, "io_uring isn't available; falling back to epoll");
+    // fall through
+  case IO_EPOLL:
+    serveEpoll(listenfds, handleRequest);
+    break;
+  case IO_BLOCKING:
+    serveBlocking(listenfds, handleRequest);
+    break;
+  }
+}
+
+// Parse a whole number of 0 or more, a count or a time in milliseconds, that
+// fills `text`.
+bool parseNonNegative(const char *text, int &value) {
+  char *end;
+  errno = 0;
+  long parsed = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || parsed < 0 ||
+      parsed > INT_MAX)
+    return false;
+  value = parsed;
+  return true;
+}
+
+// Parse the queue limits: one for each request class, or one for them all.
+bool parseQueueLimits(const char *text, size_t (&limits)[REQUEST_CLASS_COUNT]) {
+  for (int cls = 0; cls < REQUEST_CLASS_COUNT; cls++) {
+    char *end;
+    long limit = strtol(text, &end, 10);
+    if (end == text || limit < 1)
+      return false;
+    limits[cls] = limit;
+    if (*end == '\0') {
+      for (cls++; cls < REQUEST_CLASS_COUNT; cls++)
+        limits[cls] = limit;
+      return true;
+    }
+    if (*end != ',')
+      return false;
+    text = end + 1;
+  }
+  return false;
+}
+
+// Parse the compute pool's size, optionally followed by its niceness.
+bool parseComputeLimits(const char *text, ComputeLimits &limits) {
+  char *end;
+  long threads = strtol(text, &end, 10);
+  if (end == text || threads < 0)
+    return false;
+  limits.threads = threads;
+  if (*end == '\0')
+    return true;
+  if (*end != ',')
+    return false;
+  text = end + 1;
+  long niceness = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || niceness < -20 || niceness > 19)
+    return false;
+  limits.niceness = niceness;
+  return true;
+}
+
+void usage(char *prog) {
+  cerr << "Usage: " << prog
+       << " [-D builtin|sha256sum] [-L debug|info|warn|error]"
+          " [-R log records per second] [-N blocking|epoll|io_uring]"
+          " [-T threads] [-S] [-M memory limit[k|m|g]] [-U socket path]"
+          " [-H shared-memory socket path] [-C max connections]"
+          " [-Q max queued[,max queued expensive]] [-W max wait ms]"
+          " [-O read/write timeout ms] [-I idle timeout ms]"
+          " [-P compute threads[,niceness]] [-K tenants file]"
+          " [port] [secret key]"
+       << endl;
+  exit(1);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    cerr << "Usage: " << argv[0] << " [port] [secret key]" << endl;
+  // Parse the options first; the port and key follow them.
+  int opt;
+  LogLevel logLevel = LOG_INFO;
+  int logRate = LOG_DEFAULT_RATE;
+  IoBackend ioBackend = IO_BLOCKING;
+  int listeners = 0;
+  bool sharedNothing = false;
+  size_t memoryLimit = 0;
+  const char *socketPath = nullptr;
+  const char *shmPath = nullptr;
+  AdmissionLimits admission;
+  int maxConnections;
+  DeadlineLimits deadlines;
+  ComputeLimits compute;
+  const char *tenantsPath = nullptr;
+  while ((opt = getopt(argc, argv, "D:L:R:N:T:SM:U:H:C:Q:W:O:I:P:K:")) !=
+         -1) {
+    if (opt == 'D' && parseDigestBackend(optarg, digestBackend))
+      continue;
+    if (opt == 'L' && parseLogLevel(optarg, logLevel))
+      continue;
+    if (opt == 'R' && (logRate = atoi(optarg)) > 0)
+      continue;
+    if (opt == 'N' && parseIoBackend(optarg, ioBackend))
+      continue;
+    if (opt == 'T' && (listeners = atoi(optarg)) > 0)
+      continue;
+    if (opt == 'S') {
+      sharedNothing = true;
+      continue;
+    }
+    if (opt == 'M' && parseMemorySize(optarg, memoryLimit)) {
+      if (memoryLimit != 0 && memoryLimit < STORE_MIN_MEMORY_LIMIT) {
+        cerr << "Error: The memory limit must be at least "
+             << STORE_MIN_MEMORY_LIMIT << " bytes." << endl;
+        exit(1);
+      }
+      continue;
+    }
+    if (opt == 'U') {
+      socketPath = optarg;
+      continue;
+    }
+    if (opt == 'H') {
+      shmPath = optarg;
+      continue;
+    }
+    if (opt == 'C' && parseNonNegative(optarg, maxConnections)) {
+      admission.maxConnections = maxConnections;
+      continue;
+    }
+    if (opt == 'Q' && parseQueueLimits(optarg, admission.maxQueued))
+      continue;
+    if (opt == 'W' && parseNonNegative(optarg, admission.maxWaitMs))
+      continue;
+    if (opt == 'O' && parseNonNegative(optarg, deadlines.ioMs))
+      continue;
+    if (opt == 'I' && parseNonNegative(optarg, deadlines.idleMs))
+      continue;
+    if (opt == 'P' && parseComputeLimits(optarg, compute))
+      continue;
+    if (opt == 'K') {
+      tenantsPath = optarg;
+      continue;
+    }
+    usage(argv[0]);
+  }
+
+  if (argc - optind < 2)
+    usage(argv[0]);
+
+  // Shared-memory sessions are served on threads of their own, which aren't
+  // any core's, so they'd have nowhere to find the variables.
+  if (sharedNothing && shmPath != nullptr) {
+    cerr << "Error: -H can't be used with -S." << endl;
     exit(1);
   }
 
-  //initialize map of lambdas
-  initHandlers();
+  // The cores split one keyspace between them; they don't have one for each
+  // tenant.
+  if (sharedNothing && tenantsPath != nullptr) {
+    cerr << "Error: -K can't be used with -S." << endl;
+    exit(1);
+  }
 
   // Parse the arguments.
   int port;
-  unsigned int secretKey;
 
   // NOTE: Exits if we encounter an error!
-  port = parseIntWithError(argv[1], "Error: Port must be a number.\n");
-  secretKey =
-      parseIntWithError(argv[2], "Error: Secret key must be a number.\n");
+  port = parseIntWithError(argv[optind], "Error: Port must be a number.\n");
+  secretKey = parseIntWithError(argv[optind + 1],
+                                "Error: Secret key must be a number.\n");
 
-  initRequestTypeNames();
   _port = port;
 
-  // BEGIN SHAMELESSLY COPIED CODE
-  int listenfd, connfd;
-  sockaddr_in clientAddr;
-  listenfd = Open_listenfd(port);
-  socklen_t addrLength = sizeof(clientAddr);
+  addDefaultTenant(secretKey, storedVars);
+  if (tenantsPath != nullptr) {
+    string error;
+    if (!loadTenants(tenantsPath, error)) {
+      cerr << "Error: " << error << endl;
+      exit(1);
+    }
+  }
 
-  while (true) {
-    // clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientAddr, &addrLength);
-    cout << "created connfd: " << connfd << endl;
+  logStart(logLevel, logRate);
+  logInstallSignalHandlers();
+  setAdmissionLimits(admission);
+  setDeadlineLimits(deadlines);
+  startComputePool(compute, runRequest);
+  VarStore::setChangeListener(publishChange);
+  if (allTenants().size() > 1)
+    logMessage(LOG_INFO, "serving %zu tenants", allTenants().size());
+
+  // Clients on this host can connect to the Unix domain socket instead of
+  // the port. Every serving thread accepts from it, alongside its own port
+  // listener.
+  int localfd = -1;
+  if (socketPath != nullptr) {
+    localfd = openUnixListener(socketPath);
+    if (localfd < 0) {
+      cerr << "Error: can't listen on " << socketPath << ": "
+           << strerror(errno) << endl;
+      exit(1);
+    }
+    logMessage(LOG_INFO, "serving on unix socket %s", socketPath);
+  }
+
+  // Each core owns its share of the variables, and serves them with epoll.
+  if (sharedNothing) {
+    logMessage(LOG_INFO, "serving on port %d with the epoll backend", port);
+    serveCores(port, localfd, listeners, memoryLimit, handleRequest,
+               runRequest, recordRequest);
+    cerr << "Error: can't listen on port " << port << ": " << strerror(errno)
+         << endl;
+    exit(1);
+  }
+
+  storedVars.setMemoryLimit(memoryLimit);
+  thread(expireForever).detach();
+
+  // Clients on this host can also hand us a shared-memory segment to send
+  // their requests through.
+  if (shmPath != nullptr) {
+    int shmfd = openUnixListener(shmPath);
+    if (shmfd < 0) {
+      cerr << "Error: can't listen on " << shmPath << ": " << strerror(errno)
+           << endl;
+      exit(1);
+    }
+    logMessage(LOG_INFO, "serving shared-memory sessions on %s", shmPath);
+    thread(serveShm, shmfd, handleRequest).detach();
+  }
+
+  // With one listener, a single thread accepts every connection. With more,
+  // each thread gets its own SO_REUSEPORT socket on the port, and the kernel
+  // hands every incoming connection to one of them, so no two threads ever
+  // contend for an accept queue. They all share the one store.
+  vector<int> listenfds;
+  if (listeners <= 1) {
+    listeners = 1;
+    listenfds.push_back(Open_listenfd(port));
+  } else {
+    for (int i = 0; i < listeners; i++) {
+      int listenfd = openReusePortListener(port);
+      if (listenfd < 0) {
+        cerr << "Error: can't listen on port " << port << ": "
+             << strerror(errno) << endl;
+        exit(1);
+      }
+      listenfds.push_back(listenfd);
+    }
+  }
 
-    /* Determine the domain name and IP address of the client */
-    handleClient(connfd, secretKey);
+  logMessage(LOG_INFO, "serving on port %d with the %s backend on %d %s",
+             port, ioBackendName(ioBackend), listeners,
+             listeners == 1 ? "listener" : "listeners");
 
-    Close(connfd);
+  vector<vector<int>> served;
+  for (int listenfd : listenfds) {
+    served.push_back({listenfd});
+    if (localfd >= 0)
+      served.back().push_back(localfd);
   }
+  vector<thread> threads;
+  for (size_t i = 1; i < served.size(); i++)
+    threads.emplace_back(serve, ioBackend, served[i]);
+  serve(ioBackend, served[0]);
 
-  // END SHAMELESSLY COPIED CODE
+  for (thread &t : threads)
+    t.join();
   return 0;
 }
@@ -1,41 +1,108 @@
 #include "sserver.h"
 #include "common.h"
 #include "csapp.h"
-#include <arpa/inet.h>
+#include "nearcache.h"
+#include "resolver.h"
+#include "shmclient.h"
+#include "wire.h"
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-// The number of characters to read at a time.
-#define REQ_READ_SIZE 200
-
 // For safety, add this amount to the size of any arrays we use.
 #define ARRAY_FUDGE_AMOUNT 10
 
-// Send a message to the host described by `machineName` on port `port`, and
-// read the response into `response`.
-static void sendMessage(char *machineName, int port, void *message,
-                        size_t messageLength, void *response,
-                        size_t maxResponseSize) {
-printf("attempting to send a message of length %d\n", messageLength);
+// Send the `requestLength` bytes in `request` to the server at
+// `machineName`:`port` over a connection of its own, and read its response
+// into `response`, which has room for `capacity` bytes. Returns the length of
+// the response, or -1 if we couldn't talk to the server.
+static int socketExchange(char *machineName, int port, const char *request,
+                          size_t requestLength, int expectData,
+                          char *response, int capacity) {
   int clientfd;
   rio_t rio;
 
-  // Open a connection and set up the Rio type thing. We don't need to check
-  // for errors; Rio does it for us.
-  clientfd = Open_clientfd(machineName, port);
-  Rio_readinitb(&rio, clientfd);
-  printf("got fd of %d\n", clientfd);
-  printf("len %d\n", messageLength);
-
-  // Write our message, get the response, then clean up.
-  messageLength = 8;
-  Rio_writen(clientfd, (void*)message, 8);
-  printf("wrote to server...");
-  //Close(clientfd);
-//Rio_readnb(&rio, response, maxResponseSize);
-  //Close(clientfd);
-printf("successfully sent a message of length %d\n", messageLength);
+  // Open a connection and set up the Rio type thing. The host's addresses come
+  // from the resolver cache, so only the first call for a host does a lookup.
+  clientfd = openCachedClientfd(machineName, port);
+  if (clientfd < 0)
+    return -1;
+  rio_readinitb(&rio, clientfd);
+
+  // Write our message in one go, then read the response. responseFrameLength()
+  // tells us how much more we need as each part of it arrives. We use the
+  // non-exiting Rio calls here: a library shouldn't kill its caller just
+  // because the server hung up.
+  int responseLength = -1;
+  int received = 0;
+  int needed;
+  // We only ever send one request per connection, so say so: the server can
+  // then see we're done as soon as it's read the request, instead of waiting
+  // for us to hang up. A server that's turning us away may hang up without
+  // reading it at all, so even if it can't be sent, there may be a busy
+  // response to read.
+  if (sendAll(clientfd, request, requestLength) == 0)
+    shutdown(clientfd, SHUT_WR);
+  while ((needed = responseFrameLength(response, received, expectData)) >
+         received) {
+    if (needed > capacity)
+      goto done;
+    ssize_t got = rio_readnb(&rio, &response[received], needed - received);
+    if (got <= 0)
+      goto done;
+    received += got;
+  }
+  if (needed >= 0)
+    responseLength = received;
+
+done:
+  close(clientfd);
+  return responseLength;
+}
+
+// Send the `requestLength` bytes in `request` to the host described by
+// `machineName` on port `port`, then read the server's response. If
+// `machineName` starts with SHM_ADDRESS_PREFIX, the request goes through the
+// shared-memory transport instead of a socket. If `expectData` is set and the
+// server reports success, a length-prefixed payload follows the status; it is
+// copied into `result` (if non-null, and if it fits in `maxResultLength`
+// bytes) and its length is written to `resultLength` (if non-null). Returns
+// the server's status code, or -1 if we couldn't talk to the server or
+// `requestLength` is 0 (the request couldn't be encoded).
+static int transact(char *machineName, int port, const char *request,
+                    size_t requestLength, int expectData, char *result,
+                    int *resultLength, int maxResultLength) {
+  if (requestLength == 0)
+    return -1;
+
+  char response[SERVER_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE +
+                MAX_STATS_LENGTH];
+  size_t prefixLength = strlen(SHM_ADDRESS_PREFIX);
+  int responseLength =
+      strncmp(machineName, SHM_ADDRESS_PREFIX, prefixLength) == 0
+          ? shmExchange(&machineName[prefixLength], request, requestLength,
+                        expectData, response, sizeof(response))
+          : socketExchange(machineName, port, request, requestLength,
+                           expectData, response, sizeof(response));
+  if (responseLength < 0)
+    return -1;
+
+  char status;
+  const char *data;
+  size_t dataLength;
+  if (decodeResponse(response, responseLength, expectData, &status, &data,
+                     &dataLength) <= 0 ||
+      dataLength > (size_t)maxResultLength)
+    return -1;
+
+  // Copy out the result. We assume that `result` already points to a valid
+  // chunk of memory at least `maxResultLength` bytes long.
+  if (result != NULL && dataLength > 0)
+    memcpy(result, data, dataLength);
+  if (resultLength != NULL && status >= 0 && expectData)
+    *resultLength = dataLength;
+  return (int)status;
 }
 
 // Set the value of variable `variableName` (a null-terminated string) to value
@@ -43,64 +110,45 @@ printf("successfully sent a message of length %d\n", messageLength);
 // `dataLength`.
 int smallSet(char *MachineName, int port, int SecretKey, char *variableName,
              char *value, short dataLength) {
-  // Set up some variable names ahead of time.
-  int varNameLength = strlen(variableName);
-
   // If we were given bad input -- the variable name is too long, the data is
   // too long, or we got a negative data length -- signal failure.
-  if (varNameLength > MAX_VARNAME_LENGTH || dataLength > MAX_VALUE_LENGTH ||
-      dataLength < 0)
+  if (strlen(variableName) > MAX_VARNAME_LENGTH ||
+      dataLength > MAX_VALUE_LENGTH || dataLength < 0)
     return -1;
 
-  // Set up the message.
-  size_t messageLength = CLIENT_PREAMBLE_SIZE + (MAX_VARNAME_LENGTH + 1) +
-                         LENGTH_SPECIFIER_SIZE + dataLength;
-
-  ClientSet message;
-  message.pre.secretKey = htonl(SecretKey);
-  message.pre.msgType = htons(SSERVER_MSG_SET);
-
-  memcpy(&message.varName, variableName, varNameLength + 1);
-  message.length = htons(dataLength);
-  memcpy(&message.value, value, dataLength);
-
-  // Send our message and get the server's response.
-  ServerResponse response;
+  ClientSet message = {{SecretKey, SSERVER_MSG_SET, {0, 0}}, {0}, dataLength};
+  strcpy(message.varName, variableName);
+  memcpy(message.value, value, dataLength);
+
+  // Send our message and return the server's return code. Whatever it was,
+  // our cached copy may be out of date now.
+  char encoded[MAX_REQUEST_SIZE];
+  int status = transact(MachineName, port, encoded,
+                        encodeClientSet(&message, encoded, sizeof(encoded)), 0,
+                        NULL, NULL, 0);
+  nearCacheInvalidate(MachineName, port, SecretKey, variableName);
+  return status;
+}
 
-  int clientfd;
-  rio_t rio;
+// Set the value of variable `variableName` like smallSet(), but have it expire
+// `ttlMs` milliseconds after it's set.
+int smallSetTtl(char *MachineName, int port, int SecretKey, char *variableName,
+                char *value, short dataLength, unsigned int ttlMs) {
+  if (strlen(variableName) > MAX_VARNAME_LENGTH ||
+      dataLength > MAX_VALUE_LENGTH || dataLength < 0)
+    return -1;
 
-  // Open a connection and set up the Rio type thing. We don't need to check
-  // for errors; Rio does it for us.
-  clientfd = Open_clientfd(MachineName, port);
-  Rio_readinitb(&rio, clientfd);
-
-  // Write our message, get the response, then clean up.
-  Rio_writen(clientfd, &message.pre, 8);
-  //Close(clientfd);
-//Rio_readnb(&rio, response, maxResponseSize);
-  //Close(clientfd);
-//printf("successfully sent a message of length %d\n", messageLength);
-
-  //printf("SENDING PREAMBLE\n");
-  //sendMessage(MachineName, port, &message.pre, 8, &response,
-  //            sizeof(response));
-	
-  //printf("SENDING NAME\n");
-  //sendMessage(MachineName, port, "123456789012345", MAX_VARNAME_LENGTH, &response,
-   //           sizeof(response));
-	Rio_writen(clientfd, message.varName, 15);
-	Rio_writen(clientfd, (void *)&dataLength, 2);
-	Rio_writen(clientfd, (void *)value, dataLength);
-  // Read and return the server's return code.
-  	
-	char rval;
-  	Rio_readnb(&rio, &rval, 1);
-
-	char pad[3];
-	Rio_readnb(&rio, pad, 3);
-	printf("rval: %d\n", rval);
-  return rval;
+  ClientSetTtl message = {
+      {SecretKey, SSERVER_MSG_SET_TTL, {0, 0}}, {0}, ttlMs, dataLength};
+  strcpy(message.varName, variableName);
+  memcpy(message.value, value, dataLength);
+
+  char encoded[MAX_REQUEST_SIZE];
+  int status = transact(MachineName, port, encoded,
+                        encodeClientSetTtl(&message, encoded, sizeof(encoded)),
+                        0, NULL, NULL, 0);
+  nearCacheInvalidate(MachineName, port, SecretKey, variableName);
+  return status;
 }
 
 // Get the value of variable `variableName` (a null-terminated string) on the
@@ -108,82 +156,194 @@ int smallSet(char *MachineName, int port, int SecretKey, char *variableName,
 // length of the result into the int pointed to by `resultLength`.
 int smallGet(char *MachineName, int port, int SecretKey, char *variableName,
              char *value, int *resultLength) {
-  // Set up some variable names ahead of time.
-  int varNameLength = strlen(variableName);
-
   // If the given variable name is too long, signal failure.
-  if (varNameLength > MAX_VARNAME_LENGTH)
+  if (strlen(variableName) > MAX_VARNAME_LENGTH)
     return -1;
 
-  // Set up the message.
-  size_t messageLength = CLIENT_PREAMBLE_SIZE + (MAX_VARNAME_LENGTH + 1);
-
-  ClientGet message;
-  message.pre.secretKey = htonl(SecretKey);
-  message.pre.msgType = htons(SSERVER_MSG_GET);
-  memcpy(&message.varName, variableName, varNameLength + 1);
-
-  // Read the response, copy it, and close the connection.
- int clientfd;
-  rio_t rio;
-
-  // Open a connection and set up the Rio type thing. We don't need to check
-  // for errors; Rio does it for us.
-  clientfd = Open_clientfd(MachineName, port);
-  Rio_readinitb(&rio, clientfd);
-
-  Rio_writen(clientfd, &message.pre, 8);
-	Rio_writen(clientfd, variableName, 15);
-  // Read and return the server's return code.
-
-  // Read and return the server's return code.
-  //int returnCode = (int)response.status;
+  // A hot variable comes straight out of the near cache, if it's on.
+  if (nearCacheGet(MachineName, port, SecretKey, variableName, value,
+                   resultLength))
+    return 0;
+
+  ClientGet message = {{SecretKey, SSERVER_MSG_GET, {0, 0}}, {0}};
+  strcpy(message.varName, variableName);
+
+  char encoded[MAX_REQUEST_SIZE];
+  size_t length = encodeClientGet(&message, encoded, sizeof(encoded));
+  NearCacheTicket ticket;
+  if (nearCacheBeginFill(MachineName, port, SecretKey, variableName,
+                         &ticket) != 0)
+    return transact(MachineName, port, encoded, length, 1, value,
+                    resultLength, MAX_VALUE_LENGTH);
+
+  // Read into a buffer of our own, so there's a copy to cache even if the
+  // caller didn't want one.
+  char got[MAX_VALUE_LENGTH];
+  int gotLength = 0;
+  int status = transact(MachineName, port, encoded, length, 1, got,
+                        &gotLength, MAX_VALUE_LENGTH);
+  if (status == 0) {
+    nearCacheFill(&ticket, variableName, got, gotLength);
+    if (value != NULL)
+      memcpy(value, got, gotLength);
+    if (resultLength != NULL)
+      *resultLength = gotLength;
+  }
+  return status;
+}
 
-  // If we got a failure result, exit early with that result.
-  /*aif (returnCode < 0)
-    return returnCode;
+// Add `delta` to the variable `variableName` on the server at
+// MachineName:port in a single round trip, writing the sum to `result`.
+int smallIncr(char *MachineName, int port, int SecretKey, char *variableName,
+              long long delta, long long *result) {
+  if (strlen(variableName) > MAX_VARNAME_LENGTH)
+    return -1;
 
-  // Get the length specifier.
-  int valueLen = (int)ntohs(response.length);
+  ClientIncr message = {{SecretKey, SSERVER_MSG_INCR, {0, 0}}, {0}, delta};
+  strcpy(message.varName, variableName);
+
+  // The sum comes back as text with its terminating null.
+  char encoded[MAX_REQUEST_SIZE];
+  char sum[MAX_SERVER_DATA_LENGTH + 1];
+  int sumLength = 0;
+  int status = transact(MachineName, port, encoded,
+                        encodeClientIncr(&message, encoded, sizeof(encoded)),
+                        1, sum, &sumLength, MAX_SERVER_DATA_LENGTH);
+  nearCacheInvalidate(MachineName, port, SecretKey, variableName);
+  if (status == 0) {
+    sum[sumLength] = '\0';
+    *result = strtoll(sum, NULL, 10);
+  }
+  return status;
+}
 
-  // If specifier is negative or longer than max, signal an error.
-  if (valueLen < 0 || valueLen > MAX_VALUE_LENGTH)
+// Set the variable `variableName` on the server at MachineName:port to
+// `value` if it holds `expected`, in a single round trip.
+int smallCas(char *MachineName, int port, int SecretKey, char *variableName,
+             char *expected, short expectedLength, char *value,
+             short dataLength) {
+  if (strlen(variableName) > MAX_VARNAME_LENGTH ||
+      expectedLength > MAX_VALUE_LENGTH || expectedLength < 0 ||
+      dataLength > MAX_VALUE_LENGTH || dataLength < 0)
     return -1;
 
-  // If the `value` pointer is non-null, copy the result into that buffer. We
-  // assume that `value` already points to a valid chunk of memory long enough
-  // to hold any value. This might or might not be a good assumption to make...
-  // in any case I think we'd have to take a `char**` parameter if we wanted to
-  // malloc() the space ourselves.
-  if (value != NULL)
-    memcpy(value, &response.data, valueLen);
-
-  // If the `resultLength` pointer is non-null, copy the result's length there.
-  if (resultLength != NULL)
-    *resultLength = valueLen;
+  ClientCas message = {{SecretKey, SSERVER_MSG_CAS, {0, 0}}, {0},
+                       expectedLength, {0}, dataLength};
+  strcpy(message.varName, variableName);
+  memcpy(message.expected, expected, expectedLength);
+  memcpy(message.value, value, dataLength);
+
+  char encoded[MAX_REQUEST_SIZE];
+  int status = transact(MachineName, port, encoded,
+                        encodeClientCas(&message, encoded, sizeof(encoded)), 0,
+                        NULL, NULL, 0);
+  nearCacheInvalidate(MachineName, port, SecretKey, variableName);
+  return status;
+}
 
-  return returnCode;*/
-	char rval;
-  	Rio_readnb(&rio, &rval, 1);
+// List a page of the variable names starting with `prefix` on the server at
+// MachineName:port, after `cursor`.
+int smallScan(char *MachineName, int port, int SecretKey, char *prefix,
+              char *cursor, int count, char *names, int *namesLength,
+              char *nextCursor) {
+  if (strlen(prefix) > MAX_VARNAME_LENGTH ||
+      strlen(cursor) > MAX_VARNAME_LENGTH || count < 1 ||
+      count > MAX_SCAN_COUNT)
+    return -1;
 
-	char pad[3];
-	Rio_readnb(&rio, pad, 3);
+  ClientScan message = {{SecretKey, SSERVER_MSG_SCAN, {0, 0}}, {0}, {0},
+                        count};
+  strcpy(message.prefix, prefix);
+  strcpy(message.cursor, cursor);
+
+  // The response is the next cursor, then the names, each null-terminated.
+  char encoded[MAX_REQUEST_SIZE];
+  char page[MAX_SCAN_LENGTH];
+  int pageLength = 0;
+  int status = transact(MachineName, port, encoded,
+                        encodeClientScan(&message, encoded, sizeof(encoded)),
+                        1, page, &pageLength, MAX_SCAN_LENGTH);
+  if (status != 0)
+    return status;
+  size_t cursorLength = strnlen(page, pageLength);
+  if (cursorLength == (size_t)pageLength || cursorLength > MAX_VARNAME_LENGTH)
+    return -1;
+  memcpy(nextCursor, page, cursorLength + 1);
+  *namesLength = pageLength - cursorLength - 1;
+  memcpy(names, &page[cursorLength + 1], *namesLength);
+  return 0;
+}
 
-	printf("rval: %d\n", rval);
-	
-	short len;
-	Rio_readnb(&rio, &len, 2);
-	printf("len : %d\n", len);
+// Watch variables on the server at MachineName:port, calling `callback` with
+// every change to them, on one connection that stays open until we're done.
+int smallWatch(char *MachineName, int port, int SecretKey,
+               char **variableNames, int count, WatchCallback callback,
+               void *context) {
+  if (count < 1)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    if (strlen(variableNames[i]) > MAX_VARNAME_LENGTH)
+      return -1;
+  }
 
-	char *val = (char*)malloc(len+1);
-	val[len] = 0;
-	Rio_readnb(&rio, val, len);
-	
-	printf(val);
-	printf("X\n");
+  int clientfd = openCachedClientfd(MachineName, port);
+  if (clientfd < 0)
+    return -1;
+  rio_t rio;
+  rio_readinitb(&rio, clientfd);
+
+  // Ask for every watch at once. Unlike the other requests, we don't shut
+  // down our side afterwards: the server stops sending once we do.
+  int returnCode = -1;
+  for (int i = 0; i < count; i++) {
+    ClientWatch message = {{SecretKey, SSERVER_MSG_WATCH, {0, 0}}, {0}};
+    strcpy(message.varName, variableNames[i]);
+    char encoded[MAX_REQUEST_SIZE];
+    size_t length = encodeClientWatch(&message, encoded, sizeof(encoded));
+    if (length == 0 || sendAll(clientfd, encoded, length) != 0)
+      goto done;
+  }
 
+  // The responses to the watches and the pushes come back mixed together, and
+  // are told apart by their status.
+  while (1) {
+    char frame[SERVER_PREAMBLE_SIZE + MAX_VARNAME_LENGTH + 8 +
+               LENGTH_SPECIFIER_SIZE + MAX_VALUE_LENGTH];
+    int frameLength = 0;
+    int needed;
+    while ((needed = watchFrameLength(frame, frameLength)) > frameLength) {
+      ssize_t got =
+          rio_readnb(&rio, &frame[frameLength], needed - frameLength);
+      if (got <= 0)
+        goto done;
+      frameLength += got;
+    }
+    if (needed < 0)
+      goto done;
+
+    if (frame[0] != SERVER_PUSH_STATUS) {
+      if (frame[0] != 0) {
+        returnCode = frame[0];
+        goto done;
+      }
+      continue;
+    }
+    char name[MAX_VARNAME_LENGTH + 1];
+    unsigned long long version;
+    const char *value;
+    size_t valueLength;
+    if (decodePush(frame, frameLength, name, &version, &value,
+                   &valueLength) <= 0)
+      goto done;
+    if (callback(name, value, (int)valueLength, version, context) != 0) {
+      returnCode = 0;
+      goto done;
+    }
+  }
 
-	return rval;
+done:
+  close(clientfd);
+  return returnCode;
 }
 
 // Get the SHA256 checksum of `data` on the server at MachineName:port and
@@ -192,81 +352,16 @@ int smallGet(char *MachineName, int port, int SecretKey, char *variableName,
 int smallDigest(char *MachineName, int port, int SecretKey, char *data,
                 int dataLength, char *result, int *resultLength) {
   // Return -1 if MAX_DIGEST_LENGTH is longer than expected.
-  if (dataLength > MAX_DIGEST_LENGTH)
+  if (dataLength > MAX_DIGEST_LENGTH || dataLength < 0)
     return -1;
 
-  // Set up the message and send it.
-  size_t messageLength =
-      CLIENT_PREAMBLE_SIZE + LENGTH_SPECIFIER_SIZE + dataLength;
-
-  ClientDigest message;
-  message.pre.secretKey = htonl(SecretKey);
-  message.pre.msgType = htons(SSERVER_MSG_DIGEST);
-  message.length = htons(dataLength);
-  memcpy(&message.value, data, dataLength);
-
-  // Read the response, copy it, and close the connection.
-  ServerResponse response;
- int clientfd;
-  rio_t rio;
+  ClientDigest message = {{SecretKey, SSERVER_MSG_DIGEST, {0, 0}}, dataLength};
+  memcpy(message.value, data, dataLength);
 
-  // Open a connection and set up the Rio type thing. We don't need to check
-  // for errors; Rio does it for us.
-  clientfd = Open_clientfd(MachineName, port);
-  Rio_readinitb(&rio, clientfd);
-
-  Rio_writen(clientfd, &message.pre, 8);
-  Rio_writen(clientfd, (void *)&dataLength, 2);
-	Rio_writen(clientfd, data, dataLength);
-
-  // Read and return the server's return code.
-  int returnCode = (int)response.status;
-
-  // If we got a failure result, exit early with that result.
-  if (returnCode < 0)
-    return returnCode;
-
-  // Get the length specifier.
-  int resultLen = (int)ntohs(response.length);
-
-  // If specifier is negative or longer than max, signal an error.
-  if (resultLen < 0 || resultLen > MAX_SERVER_DATA_LENGTH)
-    return -1;
-
-  // If the `result` pointer is non-null, copy the result into that buffer. We
-  // assume that `value` already points to a valid chunk of memory long enough
-  // to hold any value. This might or might not be a good assumption to make...
-  // in any case I think we'd have to take a `char**` parameter if we wanted to
-  // malloc() the space ourselves.
-  if (result != NULL)
-    memcpy(result, &response.data, resultLen);
-
-  // If the `resultLength` pointer is non-null, copy the result's length there.
-  if (resultLength != NULL)
-    *resultLength = resultLen;
-
-	char rval;
-  	Rio_readnb(&rio, &rval, 1);
-
-	char pad[3];
-	Rio_readnb(&rio, pad, 3);
-
-	printf("rval: %d\n", rval);
-	
-	short len;
-	Rio_readnb(&rio, &len, 2);
-	printf("len : %d\n", len);
-
-	char *val = (char*)malloc(len+1);
-	val[len] = 0;
-	Rio_readnb(&rio, val, len);
-	
-	printf(val);
-	printf("X\n");
-
-
-	return rval;
-  return returnCode;
+  char encoded[MAX_REQUEST_SIZE];
+  return transact(MachineName, port, encoded,
+                  encodeClientDigest(&message, encoded, sizeof(encoded)), 1,
+                  result, resultLength, MAX_SERVER_DATA_LENGTH);
 }
 
 // Run the program specified by `request` on the server at MachineName:port and
@@ -279,44 +374,73 @@ int smallRun(char *MachineName, int port, int SecretKey, char *request,
     return -1;
   }
 
-  // Set up the message.
-  size_t messageLength = CLIENT_PREAMBLE_SIZE + MAX_RUNREQ_LENGTH;
-
-  ClientRun message;
-  message.pre.secretKey = htonl(SecretKey);
-  message.pre.msgType = htons(SSERVER_MSG_RUN);
-  memcpy(&message.request, request, strlen(request) + 1);
-
-  // Send the message and get the response.
-  ServerResponse response;
-  sendMessage(MachineName, port, &message, messageLength, &response,
-              sizeof(response));
+  ClientRun message = {{SecretKey, SSERVER_MSG_RUN, {0, 0}}, {0}};
+  strcpy(message.request, request);
 
-  // Read and return the server's return code.
-  int returnCode = (int)response.status;
+  // Send the message and get the response. The server doesn't send anything
+  // back for run requests beyond the status yet.
+  char encoded[MAX_REQUEST_SIZE];
+  return transact(MachineName, port, encoded,
+                  encodeClientRun(&message, encoded, sizeof(encoded)), 0,
+                  result, resultLength, MAX_SERVER_DATA_LENGTH);
+}
 
-  // If we got a failure result, exit early with that result.
-  if (returnCode < 0)
-    return returnCode;
+// Get a snapshot of the server's internal counters from the server at
+// MachineName:port. The text is written to `result`, which must have room for
+// MAX_STATS_LENGTH bytes, and its length is written to `resultLength`.
+int smallStats(char *MachineName, int port, int SecretKey, char *result,
+               int *resultLength) {
+  ClientPreamble message = {SecretKey, SSERVER_MSG_STATS, {0, 0}};
+  char encoded[CLIENT_PREAMBLE_SIZE];
+  return transact(MachineName, port, encoded,
+                  encodeClientPreamble(&message, encoded, sizeof(encoded)), 1,
+                  result, resultLength, MAX_STATS_LENGTH);
+}
 
-  // Get the length specifier.
-  int resultLen = (int)ntohs(response.length);
+int smallConnect(char *MachineName, int port) {
+  return openCachedClientfd(MachineName, port);
+}
 
-  // If specifier is negative or longer than max, signal an error.
-  if (resultLen < 0 || resultLen > MAX_SERVER_DATA_LENGTH)
+int smallSend(int connection, unsigned int requestId, const char *request,
+              int length) {
+  if (length <= 0)
     return -1;
+  char frame[FRAME_V2_HEADER_SIZE + MAX_REQUEST_SIZE];
+  size_t frameLength =
+      encodeFrameV2(requestId, request, length, frame, sizeof(frame));
+  if (frameLength == 0 || sendAll(connection, frame, frameLength) != 0)
+    return -1;
+  return 0;
+}
 
-  // If the `result` pointer is non-null, copy the result into that buffer. We
-  // assume that `value` already points to a valid chunk of memory long enough
-  // to hold any value. This might or might not be a good assumption to make...
-  // in any case I think we'd have to take a `char**` parameter if we wanted to
-  // malloc() the space ourselves.
-  if (result != NULL)
-    memcpy(result, &response.data, resultLen);
+// The responses are read unbuffered, a header and then its data, so nothing
+// of the next one is taken off the socket between calls.
+int smallReceive(int connection, unsigned int *requestId, int *status,
+                 char *result, int *resultLength, int maxResultLength) {
+  char frame[FRAME_V2_RESPONSE_HEADER_SIZE + MAX_STATS_LENGTH];
+  int received = 0;
+  int needed;
+  while ((needed = responseV2FrameLength(frame, received)) > received) {
+    if ((size_t)needed > sizeof(frame))
+      return -1;
+    ssize_t got = rio_readn(connection, &frame[received], needed - received);
+    if (got <= 0)
+      return -1;
+    received += got;
+  }
 
-  // If the `resultLength` pointer is non-null, copy the result's length there.
+  char code;
+  const char *data;
+  size_t dataLength;
+  if (needed < 0 ||
+      decodeResponseV2(frame, received, &code, requestId, &data,
+                       &dataLength) <= 0 ||
+      dataLength > (size_t)maxResultLength)
+    return -1;
+  if (result != NULL && dataLength > 0)
+    memcpy(result, data, dataLength);
   if (resultLength != NULL)
-    *resultLength = resultLen;
-
-  return returnCode;
+    *resultLength = dataLength;
+  *status = code;
+  return 0;
 }
@@ -0,0 +1,181 @@
+#include "stats.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include "protocol.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+// Every ThreadStats ever handed out. They're never freed, so a thread that
+// exits still counts toward the totals.
+static mutex registryLock;
+static vector<ThreadStats *> registry;
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+void ThreadStats::recordRequest(MessageType type, bool success,
+                                uint64_t latencyNs) {
+  if (type < 0 || type >= MESSAGE_TYPE_COUNT)
+    return;
+  requests[type].add();
+  if (!success)
+    errors[type].add();
+  latencyBuckets[type][histogramBucket(latencyNs)].add();
+  latencySum[type].add(latencyNs);
+  latencyMax[type].raiseTo(latencyNs);
+}
+
+ThreadStats &threadStats() {
+  static thread_local ThreadStats *mine = nullptr;
+  if (mine == nullptr) {
+    mine = new ThreadStats();
+    lock_guard<mutex> guard(registryLock);
+    registry.push_back(mine);
+  }
+  return *mine;
+}
+
+// Append a `name value` line.
+static void line(string &out, const string &name, double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %.15g\n", value);
+  out += name;
+  out += buf;
+}
+
+// Append the latency lines for the requests `h` counts.
+static void latencyLines(string &out, const string &name, const Histogram &h) {
+  line(out, name + "_latency_mean_us", histogramMean(&h) / 1000.0);
+  line(out, name + "_latency_p50_us", histogramPercentile(&h, 50.0) / 1000.0);
+  line(out, name + "_latency_p99_us", histogramPercentile(&h, 99.0) / 1000.0);
+  line(out, name + "_latency_p999_us", histogramPercentile(&h, 99.9) / 1000.0);
+  line(out, name + "_latency_max_us", h.max / 1000.0);
+}
+
+string formatStats(const StatsExtras &extras) {
+  uint64_t requests[MESSAGE_TYPE_COUNT] = {0};
+  uint64_t errors[MESSAGE_TYPE_COUNT] = {0};
+  uint64_t opened = 0, closed = 0, bytesIn = 0, bytesOut = 0;
+  uint64_t cacheHits = 0, cacheMisses = 0;
+  uint64_t pushes = 0, pushesDropped = 0;
+  uint64_t rejected = 0, timedOut = 0, busy = 0;
+
+  // Histograms are big; keep them off the stack.
+  vector<Histogram> latency(MESSAGE_TYPE_COUNT);
+  for (Histogram &h : latency)
+    histogramInit(&h);
+
+  {
+    lock_guard<mutex> guard(registryLock);
+    for (ThreadStats *stats : registry) {
+      for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+        requests[type] += stats->requests[type].get();
+        errors[type] += stats->errors[type].get();
+        Histogram &h = latency[type];
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+          uint64_t count = stats->latencyBuckets[type][i].get();
+          h.counts[i] += count;
+          h.total += count;
+        }
+        h.sum += stats->latencySum[type].get();
+        uint64_t max = stats->latencyMax[type].get();
+        if (max > h.max)
+          h.max = max;
+      }
+      opened += stats->connectionsOpened.get();
+      closed += stats->connectionsClosed.get();
+      rejected += stats->connectionsRejected.get();
+      timedOut += stats->connectionsTimedOut.get();
+      bytesIn += stats->bytesIn.get();
+      bytesOut += stats->bytesOut.get();
+      cacheHits += stats->digestCacheHits.get();
+      cacheMisses += stats->digestCacheMisses.get();
+      pushes += stats->watchPushes.get();
+      pushesDropped += stats->watchPushesDropped.get();
+      busy += stats->requestsBusy.get();
+    }
+  }
+
+  string out;
+  double uptime = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - startTime)
+                      .count();
+  line(out, "uptime_seconds", uptime);
+  line(out, "connections_current", opened - closed);
+  line(out, "connections_total", opened);
+  line(out, "connections_rejected", rejected);
+  line(out, "connections_timed_out", timedOut);
+  line(out, "bytes_in", bytesIn);
+  line(out, "bytes_out", bytesOut);
+  line(out, "keys", extras.keys);
+  line(out, "store_bytes", extras.storeBytes);
+  line(out, "store_limit_bytes", extras.storeLimit);
+  line(out, "keys_expired", extras.keysExpired);
+  line(out, "keys_evicted", extras.keysEvicted);
+  line(out, "digest_cache_hits", cacheHits);
+  line(out, "digest_cache_misses", cacheMisses);
+  line(out, "digest_cache_hit_rate",
+       cacheHits + cacheMisses == 0
+           ? 0.0
+           : (double)cacheHits / (cacheHits + cacheMisses));
+  line(out, "watch_pushes", pushes);
+  line(out, "watch_pushes_dropped", pushesDropped);
+  line(out, "requests_busy", busy);
+  line(out, "compute_threads", extras.computeThreads);
+  line(out, "compute_queued", extras.computeQueued);
+
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+    string name = requestTypeNames[type];
+    line(out, name + "_count", requests[type]);
+    line(out, name + "_errors", errors[type]);
+    latencyLines(out, name, latency[type]);
+  }
+
+  // Each class's latency is its types' histograms added together.
+  vector<Histogram> classLatency(REQUEST_CLASS_COUNT);
+  uint64_t classRequests[REQUEST_CLASS_COUNT] = {0};
+  for (Histogram &h : classLatency)
+    histogramInit(&h);
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+    RequestClass cls = requestClass((MessageType)type);
+    classRequests[cls] += requests[type];
+    histogramMerge(&classLatency[cls], &latency[type]);
+  }
+  for (int cls = 0; cls < REQUEST_CLASS_COUNT; cls++) {
+    string name = requestClassName((RequestClass)cls);
+    line(out, name + "_count", classRequests[cls]);
+    latencyLines(out, name, classLatency[cls]);
+  }
+
+  if (out.size() + extras.lines.size() <= MAX_STATS_LENGTH)
+    out += extras.lines;
+
+  // The full histograms go last, and are dropped if they'd make the response
+  // too long for the wire.
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+    const Histogram &h = latency[type];
+    if (h.total == 0)
+      continue;
+
+    string hist = string(requestTypeNames[type]) + "_latency_histogram_ns";
+    char pair[48];
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      if (h.counts[i] == 0)
+        continue;
+      snprintf(pair, sizeof(pair), " %llu:%llu",
+               (unsigned long long)histogramBucketValue(i),
+               (unsigned long long)h.counts[i]);
+      hist += pair;
+    }
+    hist += '\n';
+
+    if (out.size() + hist.size() <= MAX_STATS_LENGTH)
+      out += hist;
+  }
+
+  return out;
+}
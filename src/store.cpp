@@ -0,0 +1,400 @@
+#include "store.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+using std::memory_order_relaxed;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+// Coarse clocks are a few nanoseconds to read, and plenty for this.
+static uint64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Add `delta`, which may be negative, to a counter only one thread changes.
+static void adjust(std::atomic<size_t> &counter, size_t delta) {
+  counter.store(counter.load(memory_order_relaxed) + delta,
+                memory_order_relaxed);
+}
+
+bool parseMemorySize(const char *text, size_t &bytes) {
+  char *end;
+  unsigned long long size = strtoull(text, &end, 10);
+  if (end == text || text[0] == '-')
+    return false;
+  switch (tolower(*end)) {
+  case 'g':
+    size *= 1024;
+    // Fall through.
+  case 'm':
+    size *= 1024;
+    // Fall through.
+  case 'k':
+    size *= 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0')
+    return false;
+  bytes = size;
+  return true;
+}
+
+VarStore::ChangeListener VarStore::changeListener = nullptr;
+
+void VarStore::setChangeListener(ChangeListener listener) {
+  changeListener = listener;
+}
+
+VarStore::VarStore(size_t shardCount, bool locked)
+    : shardCount(shardCount ? shardCount : 1), locked(locked),
+      shards(new Shard[this->shardCount]) {}
+
+VarStore::Shard &VarStore::shardFor(const string &name) const {
+  return shards[std::hash<string>()(name) % shardCount];
+}
+
+unique_lock<mutex> VarStore::lockShard(Shard &shard) const {
+  return locked ? unique_lock<mutex>(shard.lock) : unique_lock<mutex>();
+}
+
+void VarStore::setMemoryLimit(size_t bytes) {
+  shardLimit = bytes / shardCount;
+  if (bytes != 0 && shardLimit == 0)
+    shardLimit = 1;
+}
+
+void VarStore::remove(Shard &shard, Iterator it) {
+  // Take it off the clock, moving the last variable on it into its place.
+  Node *last = shard.clock.back();
+  last->second.clockSlot = it->second.clockSlot;
+  shard.clock[it->second.clockSlot] = last;
+  shard.clock.pop_back();
+  if (shard.hand >= shard.clock.size())
+    shard.hand = 0;
+  shard.names.remove(it->first);
+
+  // Its timer's left to fire, but it's no longer charged for.
+  if (it->second.timerAt != 0)
+    adjust(shard.bytes, -(STORE_TIMER_OVERHEAD + it->first.size()));
+  adjust(shard.bytes, -(STORE_ENTRY_OVERHEAD + it->first.size() +
+                        it->second.value.size()));
+  shard.vars.erase(it);
+  shard.count.store(shard.vars.size(), memory_order_relaxed);
+}
+
+void VarStore::expireDue(Shard &shard, uint64_t now, size_t budget) {
+  shard.timers.advance(now, budget, [&](uint64_t when, string &name) {
+    // The variable may have been removed since, or given another timer.
+    auto it = shard.vars.find(name);
+    if (it == shard.vars.end() || it->second.timerAt != when)
+      return;
+    Entry &stored = it->second;
+    if (stored.expiresAt != 0 && stored.expiresAt <= when) {
+      remove(shard, it);
+      adjust(shard.expired, 1);
+    } else if (stored.expiresAt != 0) {
+      // Set again since, to expire later.
+      stored.timerAt = stored.expiresAt;
+      shard.timers.schedule(stored.timerAt, name);
+    } else {
+      // Set again since, to never expire.
+      stored.timerAt = 0;
+      adjust(shard.bytes, -(STORE_TIMER_OVERHEAD + name.size()));
+    }
+  });
+}
+
+// Sweep the clock hand until the shard fits in its share of the limit.
+// Variables used since the hand last passed get another chance; the first
+// without one is evicted. `keep` is never evicted.
+//
+// New variables start unreferenced, so one that's set and never read is
+// evicted ahead of those that are read.
+void VarStore::evict(Shard &shard, const Node *keep) {
+  while (shard.bytes.load(memory_order_relaxed) > shardLimit &&
+         shard.clock.size() > 1) {
+    Node *node = shard.clock[shard.hand];
+    if (node == keep || node->second.referenced) {
+      node->second.referenced = false;
+      shard.hand = (shard.hand + 1) % shard.clock.size();
+      continue;
+    }
+    size_t slot = shard.hand;
+    remove(shard, shard.vars.find(node->first));
+    adjust(shard.evicted, 1);
+    // The last variable on the clock, usually one of the newest, was moved
+    // into the evicted one's slot; let it wait for the hand's next time round.
+    shard.hand = slot + 1 < shard.clock.size() ? slot + 1 : 0;
+  }
+}
+
+// Expire a few of the shard's due variables on the way past, and return the
+// time. A variable only has an expiry time while its timer's pending, so
+// without timers there's nothing to do, and unless `needTime` is set the clock
+// isn't even read; 0 is returned instead.
+uint64_t VarStore::expireSome(Shard &shard, bool needTime) {
+  if (shard.timers.size() == 0 && !needTime)
+    return 0;
+  uint64_t now = monotonicMs();
+  expireDue(shard, now, STORE_EXPIRE_PER_ACCESS);
+  return now;
+}
+
+// Find `name`, unless it's expired. One whose timer just hasn't fired yet is
+// removed on the spot.
+VarStore::Iterator VarStore::findLive(Shard &shard, const string &name,
+                                      uint64_t now) {
+  auto it = shard.vars.find(name);
+  if (it != shard.vars.end() && it->second.expiresAt != 0 &&
+      it->second.expiresAt <= now) {
+    remove(shard, it);
+    adjust(shard.expired, 1);
+    return shard.vars.end();
+  }
+  return it;
+}
+
+// Give a variable that's just been set its new version, and pass the change
+// on.
+void VarStore::changed(Shard &shard, Node &node) {
+  Entry &stored = node.second;
+  stored.version = ++shard.versions;
+  if (changeListener != nullptr)
+    changeListener(keyspace, node.first, stored.version, stored.value.data(),
+                   stored.value.size());
+}
+
+void VarStore::insert(Shard &shard, const string &name, const char *value,
+                      size_t length, uint32_t ttlMs, uint64_t now) {
+  auto inserted = shard.vars.emplace(name, Entry());
+  Entry &stored = inserted.first->second;
+  size_t bytes = shard.bytes.load(memory_order_relaxed);
+  if (inserted.second) {
+    shard.count.store(shard.vars.size(), memory_order_relaxed);
+    bytes += STORE_ENTRY_OVERHEAD + name.size();
+    stored.clockSlot = shard.clock.size();
+    shard.clock.push_back(&*inserted.first);
+    shard.names.insert(&*inserted.first);
+  }
+  shard.bytes.store(bytes + length - stored.value.size(), memory_order_relaxed);
+  stored.value.assign(value, length);
+  stored.referenced = !inserted.second;
+  changed(shard, *inserted.first);
+
+  // A timer that's due no later than the new expiry time can stay, and set
+  // itself again when it fires, so setting a variable over and over doesn't
+  // pile up timers.
+  stored.expiresAt = ttlMs == 0 ? 0 : now + ttlMs;
+  if (ttlMs != 0 &&
+      (stored.timerAt == 0 || stored.expiresAt < stored.timerAt)) {
+    if (stored.timerAt == 0)
+      adjust(shard.bytes, STORE_TIMER_OVERHEAD + name.size());
+    stored.timerAt = stored.expiresAt;
+    shard.timers.schedule(stored.timerAt, name);
+  }
+
+  if (shardLimit != 0)
+    evict(shard, &*inserted.first);
+}
+
+// Change an existing variable's value in place. Its expiry time stays.
+void VarStore::update(Shard &shard, Node &node, const char *value,
+                      size_t length) {
+  Entry &stored = node.second;
+  adjust(shard.bytes, length - stored.value.size());
+  stored.value.assign(value, length);
+  stored.referenced = true;
+  changed(shard, node);
+  if (shardLimit != 0)
+    evict(shard, &node);
+}
+
+void VarStore::set(const string &name, const char *value, size_t length,
+                   uint32_t ttlMs) {
+  Shard &shard = shardFor(name);
+  unique_lock<mutex> guard = lockShard(shard);
+  uint64_t now = expireSome(shard, ttlMs != 0);
+  insert(shard, name, value, length, ttlMs, now);
+}
+
+bool VarStore::get(const string &name, string &value) {
+  Shard &shard = shardFor(name);
+  unique_lock<mutex> guard = lockShard(shard);
+  auto it = findLive(shard, name, expireSome(shard, false));
+  if (it == shard.vars.end())
+    return false;
+  it->second.referenced = true;
+  value = it->second.value;
+  return true;
+}
+
+// Parse a decimal integer that fills `text`, bar an optional terminating null.
+static bool parseInteger(const string &text, int64_t &value) {
+  size_t length = text.size();
+  if (length > 0 && text[length - 1] == '\0')
+    length--;
+  // Enough for any int64_t, and short enough to copy onto the stack.
+  char digits[24];
+  if (length == 0 || length >= sizeof(digits) ||
+      !(isdigit((unsigned char)text[0]) || text[0] == '-' || text[0] == '+'))
+    return false;
+  memcpy(digits, text.data(), length);
+  digits[length] = '\0';
+  char *end;
+  errno = 0;
+  long long parsed = strtoll(digits, &end, 10);
+  if (errno != 0 || end != &digits[length])
+    return false;
+  value = parsed;
+  return true;
+}
+
+bool VarStore::increment(const string &name, int64_t delta, int64_t &result) {
+  Shard &shard = shardFor(name);
+  unique_lock<mutex> guard = lockShard(shard);
+  uint64_t now = expireSome(shard, false);
+  auto it = findLive(shard, name, now);
+
+  int64_t current = 0;
+  if (it != shard.vars.end() && !parseInteger(it->second.value, current))
+    return false;
+  if (__builtin_add_overflow(current, delta, &result))
+    return false;
+
+  char text[24];
+  int length = snprintf(text, sizeof(text), "%lld", (long long)result) + 1;
+  if (it == shard.vars.end())
+    insert(shard, name, text, length, 0, now);
+  else
+    update(shard, *it, text, length);
+  return true;
+}
+
+bool VarStore::compareAndSet(const string &name, const char *expected,
+                             size_t expectedLength, const char *value,
+                             size_t length) {
+  Shard &shard = shardFor(name);
+  unique_lock<mutex> guard = lockShard(shard);
+  auto it = findLive(shard, name, expireSome(shard, false));
+  if (it == shard.vars.end() || it->second.value.size() != expectedLength ||
+      memcmp(it->second.value.data(), expected, expectedLength) != 0)
+    return false;
+  update(shard, *it, value, length);
+  return true;
+}
+
+// Append up to `limit` of the shard's names, in order, from after `after`.
+void VarStore::scanShard(Shard &shard, const string &prefix,
+                         const string &after, size_t limit,
+                         vector<string> &names) {
+  unique_lock<mutex> guard = lockShard(shard);
+  uint64_t now = shard.timers.size() > 0 ? monotonicMs() : 0;
+  size_t found = 0;
+  shard.names.scan(prefix, after, [&](const Node &node) {
+    // Expired, but its timer hasn't fired yet.
+    if (node.second.expiresAt != 0 && node.second.expiresAt <= now)
+      return true;
+    names.push_back(node.first);
+    return ++found < limit;
+  });
+}
+
+void VarStore::scan(const string &prefix, const string &after, size_t limit,
+                    vector<string> &names) {
+  if (limit == 0)
+    return;
+
+  // Merge the shards' names, which each come out in order. They're read a
+  // few at a time, enough for an even share of the limit, so a shard's lock
+  // is never held long and not much more is read than is used.
+  struct Run {
+    vector<string> names;
+    size_t next = 0;
+    string last;
+    bool more = true;
+  };
+  size_t chunk = limit / shardCount + 2;
+  vector<Run> runs(shardCount);
+  auto refill = [&](size_t i) {
+    Run &run = runs[i];
+    if (run.next < run.names.size())
+      return true;
+    if (!run.more)
+      return false;
+    run.names.clear();
+    run.next = 0;
+    scanShard(shards[i], prefix, run.last.empty() ? after : run.last, chunk,
+              run.names);
+    run.more = run.names.size() == chunk;
+    if (run.names.empty())
+      return false;
+    run.last = run.names.back();
+    return true;
+  };
+  auto later = [&](size_t a, size_t b) {
+    return runs[a].names[runs[a].next] > runs[b].names[runs[b].next];
+  };
+
+  vector<size_t> heap;
+  for (size_t i = 0; i < shardCount; i++) {
+    if (refill(i))
+      heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+  for (size_t taken = 0; taken < limit && !heap.empty(); taken++) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    size_t i = heap.back();
+    names.push_back(std::move(runs[i].names[runs[i].next++]));
+    if (refill(i))
+      std::push_heap(heap.begin(), heap.end(), later);
+    else
+      heap.pop_back();
+  }
+}
+
+void VarStore::expire() {
+  uint64_t now = monotonicMs();
+  for (size_t i = 0; i < shardCount; i++) {
+    unique_lock<mutex> guard = lockShard(shards[i]);
+    expireDue(shards[i], now, STORE_EXPIRE_PER_PASS);
+  }
+}
+
+size_t VarStore::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shardCount; i++)
+    total += shards[i].count.load(memory_order_relaxed);
+  return total;
+}
+
+size_t VarStore::memoryUsed() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shardCount; i++)
+    total += shards[i].bytes.load(memory_order_relaxed);
+  return total;
+}
+
+size_t VarStore::expired() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shardCount; i++)
+    total += shards[i].expired.load(memory_order_relaxed);
+  return total;
+}
+
+size_t VarStore::evicted() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shardCount; i++)
+    total += shards[i].evicted.load(memory_order_relaxed);
+  return total;
+}
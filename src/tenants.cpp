@@ -0,0 +1,135 @@
+#include "tenants.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+static vector<unique_ptr<Tenant>> tenants;
+static unordered_map<unsigned int, Tenant *> byKey;
+
+void RateLimit::setRate(uint64_t rate) {
+  perSecond = rate;
+  intervalNs = rate == 0 ? 0 : 1000000000 / rate;
+}
+
+bool RateLimit::admit(uint64_t nowNs) {
+  if (intervalNs == 0)
+    return true;
+  // A request may come in up to a second, less one interval, ahead of when
+  // it's due.
+  uint64_t tolerance = 1000000000 - intervalNs;
+  uint64_t due = dueNs.load(std::memory_order_relaxed);
+  while (true) {
+    uint64_t from = due > nowNs ? due : nowNs;
+    if (from - nowNs > tolerance)
+      return false;
+    if (dueNs.compare_exchange_weak(due, from + intervalNs,
+                                    std::memory_order_relaxed))
+      return true;
+  }
+}
+
+// Add a tenant, unless its key's taken.
+static bool add(unique_ptr<Tenant> tenant) {
+  if (!byKey.emplace(tenant->secretKey, tenant.get()).second)
+    return false;
+  tenants.push_back(std::move(tenant));
+  return true;
+}
+
+void addDefaultTenant(unsigned int secretKey, VarStore &store) {
+  unique_ptr<Tenant> tenant(new Tenant);
+  tenant->name = "default";
+  tenant->secretKey = secretKey;
+  tenant->keyspace = 0;
+  tenant->store = &store;
+  add(std::move(tenant));
+}
+
+// Parse one of the file's limits: a value, or `-` or nothing for none.
+static bool parseLimit(const string &text, bool memory, uint64_t &limit) {
+  limit = 0;
+  if (text.empty() || text == "-")
+    return true;
+  if (memory) {
+    size_t bytes;
+    if (!parseMemorySize(text.c_str(), bytes))
+      return false;
+    limit = bytes;
+    return true;
+  }
+  char *end;
+  limit = strtoull(text.c_str(), &end, 10);
+  return end != text.c_str() && *end == '\0' && text[0] != '-';
+}
+
+bool loadTenants(const string &path, string &error) {
+  std::ifstream in(path);
+  if (!in) {
+    error = path + ": " + strerror(errno);
+    return false;
+  }
+
+  string text;
+  for (int number = 1; std::getline(in, text); number++) {
+    string where = path + ":" + std::to_string(number) + ": ";
+    text = text.substr(0, text.find('#'));
+    std::istringstream fields(text);
+    string name, key, memory, rate, extra;
+    if (!(fields >> name))
+      continue;
+    fields >> key >> memory >> rate >> extra;
+
+    char *end;
+    unsigned long secretKey = strtoul(key.c_str(), &end, 10);
+    uint64_t memoryLimit, perSecond;
+    if (key.empty() || *end != '\0' || key[0] == '-' ||
+        secretKey > 0xffffffffUL) {
+      error = where + "the key must be a number";
+      return false;
+    }
+    if (!parseLimit(memory, true, memoryLimit) ||
+        (memoryLimit != 0 && memoryLimit < STORE_MIN_MEMORY_LIMIT)) {
+      error = where + "the memory limit must be at least " +
+              std::to_string(STORE_MIN_MEMORY_LIMIT) + " bytes";
+      return false;
+    }
+    if (!parseLimit(rate, false, perSecond)) {
+      error = where + "the rate must be a number of requests per second";
+      return false;
+    }
+    if (!extra.empty()) {
+      error = where + "too many fields";
+      return false;
+    }
+
+    unique_ptr<Tenant> tenant(new Tenant);
+    tenant->name = name;
+    tenant->secretKey = secretKey;
+    tenant->keyspace = tenants.size();
+    tenant->ownStore.reset(new VarStore());
+    tenant->store = tenant->ownStore.get();
+    tenant->store->setKeyspace(tenant->keyspace);
+    tenant->store->setMemoryLimit(memoryLimit);
+    tenant->rate.setRate(perSecond);
+    if (!add(std::move(tenant))) {
+      error = where + "another tenant already has key " + key;
+      return false;
+    }
+  }
+  return true;
+}
+
+Tenant *findTenant(unsigned int secretKey) {
+  auto found = byKey.find(secretKey);
+  return found != byKey.end() ? found->second : nullptr;
+}
+
+const vector<unique_ptr<Tenant>> &allTenants() { return tenants; }
@@ -0,0 +1,518 @@
+#include "netio.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#include "admission.h"
+#include "compute.h"
+#include "deadlines.h"
+#include "log.h"
+#include "stats.h"
+#include "watch.h"
+
+using std::vector;
+
+// The io_uring backend, talking to the kernel directly rather than through
+// liburing.
+//
+// One multishot accept per listener delivers every new connection, and each
+// connection has one multishot receive that fills buffers the kernel picks
+// from a shared ring of them, so a busy server mostly just reaps completions:
+// one io_uring_enter() submits every send queued while handling the last batch
+// and waits for the next. A connection's last send is linked to its close.
+// Reads of the watch and compute mailboxes' eventfds stay armed, so pushes
+// and computed responses come in with everything else, and so does a timeout
+// while any connection has a deadline.
+
+// The number of submission queue entries. The completion queue gets twice as
+// many.
+const unsigned URING_ENTRIES = 256;
+
+// The provided receive buffers: how many (a power of two), how big, and the
+// group they're registered as.
+const unsigned URING_BUFFERS = 256;
+const size_t URING_BUFFER_SIZE = RECEIVE_BUFFER_SIZE;
+const uint16_t URING_BUFFER_GROUP = 0;
+
+// What a completion is for. It's kept in the low bits of the user data, and
+// the connection it's for, if any, in the rest; or for an accept, the
+// listener.
+enum UringOp : uint64_t {
+  OP_IGNORE = 0,
+  OP_ACCEPT = 1,
+  OP_RECV = 2,
+  OP_SEND = 3,
+  OP_CLOSE = 4,
+  OP_WATCH = 5,
+  OP_TIMER = 6,
+  OP_COMPUTED = 7,
+};
+const uint64_t OP_MASK = 7;
+
+// A connection being served by the io_uring loop.
+struct UringConnection {
+  explicit UringConnection(int fd) : conn(fd) {}
+  Connection conn;
+  // The output being sent. Responses queued meanwhile wait in conn.output,
+  // since this has to stay put until the kernel's done with it.
+  vector<char> sending;
+  size_t sent = 0;
+  bool receiving = false;
+  bool sendInFlight = false;
+  bool closeInFlight = false;
+  // Set once we've stopped reading, and the connection should close as soon
+  // as its output is sent.
+  bool closing = false;
+  // Set if a send failed, so the rest of the output should be dropped.
+  bool broken = false;
+  bool closed = false;
+};
+static_assert(alignof(UringConnection) > OP_MASK,
+              "connection pointers need their low bits free for the op");
+
+static uint64_t userData(UringConnection *uc, UringOp op) {
+  return (uint64_t)(uintptr_t)uc | op;
+}
+
+//==========
+// The ring.
+//==========
+
+class Uring {
+public:
+  ~Uring();
+
+  // Set up the queues and the provided buffers. Returns false if the kernel
+  // can't do everything we need.
+  bool setup();
+
+  // Get a zeroed submission queue entry to fill in.
+  io_uring_sqe *nextSqe();
+
+  // Submit everything queued and wait for at least `waitFor` completions.
+  void submit(unsigned waitFor);
+
+  // Call `f` with each completion that's arrived, then release them.
+  template <typename F> void reap(F f);
+
+  // A provided buffer, by ID, and handing it back to the kernel once done.
+  const char *buffer(unsigned id) { return &buffers[id * URING_BUFFER_SIZE]; }
+  void recycleBuffer(unsigned id);
+
+private:
+  int fd = -1;
+  void *ring = MAP_FAILED;
+  size_t ringSize = 0;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  size_t sqesSize = 0;
+
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+  unsigned sqLocalTail = 0;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_cqe *cqes;
+
+  io_uring_buf_ring *bufferRing = (io_uring_buf_ring *)MAP_FAILED;
+  size_t bufferRingSize = 0;
+  uint16_t bufferTail = 0;
+  vector<char> buffers;
+};
+
+Uring::~Uring() {
+  if (bufferRing != MAP_FAILED)
+    munmap(bufferRing, bufferRingSize);
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqesSize);
+  if (ring != MAP_FAILED)
+    munmap(ring, ringSize);
+  if (fd >= 0)
+    close(fd);
+}
+
+bool Uring::setup() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    return false;
+
+  // Both queues' rings share one mapping; the entries have their own.
+  ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (cqSize > ringSize)
+    ringSize = cqSize;
+  ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED || sqes == MAP_FAILED)
+    return false;
+
+  char *base = (char *)ring;
+  sqHead = (unsigned *)(base + params.sq_off.head);
+  sqTail = (unsigned *)(base + params.sq_off.tail);
+  sqMask = (unsigned *)(base + params.sq_off.ring_mask);
+  sqArray = (unsigned *)(base + params.sq_off.array);
+  sqEntries = params.sq_entries;
+  sqLocalTail = *sqTail;
+  cqHead = (unsigned *)(base + params.cq_off.head);
+  cqTail = (unsigned *)(base + params.cq_off.tail);
+  cqMask = (unsigned *)(base + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+  // Register the ring of provided buffers (Linux 5.19 and later).
+  bufferRingSize = URING_BUFFERS * sizeof(io_uring_buf);
+  bufferRing = (io_uring_buf_ring *)mmap(nullptr, bufferRingSize,
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufferRing == MAP_FAILED)
+    return false;
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+      0)
+    return false;
+
+  buffers.resize(URING_BUFFERS * URING_BUFFER_SIZE);
+  for (unsigned id = 0; id < URING_BUFFERS; id++)
+    recycleBuffer(id);
+  return true;
+}
+
+io_uring_sqe *Uring::nextSqe() {
+  // The kernel takes everything we submit straight away, so if the queue's
+  // full, submitting empties it.
+  if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+    submit(0);
+  unsigned index = sqLocalTail & *sqMask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  sqLocalTail++;
+  return sqe;
+}
+
+void Uring::submit(unsigned waitFor) {
+  __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+  while (true) {
+    unsigned pending = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    int result = syscall(__NR_io_uring_enter, fd, pending, waitFor,
+                         waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (result >= 0 || errno != EINTR)
+      return;
+    // Interrupted; anything not yet submitted is still pending.
+  }
+}
+
+template <typename F> void Uring::reap(F f) {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    f(cqes[head & *cqMask]);
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void Uring::recycleBuffer(unsigned id) {
+  // The entries start at the beginning of the ring, overlapping its tail. We
+  // don't use the header's `bufs` for them, since the way it's declared puts
+  // it 8 bytes further in when compiled as C++.
+  io_uring_buf *bufs = (io_uring_buf *)bufferRing;
+  io_uring_buf *buf = &bufs[bufferTail & (URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)buffer(id);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = id;
+  bufferTail++;
+  __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
+
+//===========
+// Serving.
+//===========
+
+static void armAccept(Uring &ring, int listenfd) {
+  io_uring_sqe *sqe = ring.nextSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = (uint64_t)listenfd * (OP_MASK + 1) | OP_ACCEPT;
+}
+
+static void armRecv(Uring &ring, UringConnection *uc) {
+  io_uring_sqe *sqe = ring.nextSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->conn.fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = userData(uc, OP_RECV);
+  uc->receiving = true;
+}
+
+// Wait for one of the thread's mailboxes to have something in it; `op` says
+// which. The read takes the eventfd's count into `count`, which has to stay
+// put until it completes.
+static void armMailbox(Uring &ring, int mailboxfd, uint64_t *count,
+                       UringOp op) {
+  io_uring_sqe *sqe = ring.nextSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = mailboxfd;
+  sqe->addr = (uint64_t)(uintptr_t)count;
+  sqe->len = sizeof(*count);
+  sqe->user_data = op;
+}
+
+// Wake the loop after `ms` milliseconds, even if nothing else happens. The
+// kernel copies `timeout` when it's submitted.
+static void armTimer(Uring &ring, int ms) {
+  __kernel_timespec timeout = {ms / 1000, (long long)(ms % 1000) * 1000000};
+  io_uring_sqe *sqe = ring.nextSqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&timeout;
+  sqe->len = 1;
+  sqe->user_data = OP_TIMER;
+  ring.submit(0);
+}
+
+// Stop a connection's receive, or its send, so it can be closed.
+static void cancel(Uring &ring, UringConnection *uc, UringOp op) {
+  io_uring_sqe *sqe = ring.nextSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = userData(uc, op);
+  sqe->user_data = OP_IGNORE;
+}
+
+// Move a connection along after anything happens to it: send whatever output
+// is ready if nothing's being sent, and once a closing connection has nothing
+// left in flight or still to come, close it and then forget it.
+static void progress(Uring &ring, UringConnection *uc) {
+  if (uc->broken)
+    uc->conn.output.clear();
+  bool awaiting = uc->conn.awaitingResponses() && !uc->broken;
+
+  if (!uc->sendInFlight && !uc->conn.output.empty()) {
+    uc->sending.swap(uc->conn.output);
+    uc->conn.output.clear();
+    uc->sent = 0;
+  }
+
+  if (!uc->sendInFlight && uc->sent < uc->sending.size()) {
+    io_uring_sqe *sqe = ring.nextSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->conn.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uc->sending[uc->sent];
+    sqe->len = uc->sending.size() - uc->sent;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = userData(uc, OP_SEND);
+    uc->sendInFlight = true;
+
+    // If this is the last thing the connection will send, close it as soon
+    // as the send completes, without another trip through this loop. The
+    // close is skipped if the send comes up short, and we try again after.
+    if (uc->closing && !uc->receiving && !awaiting && !uc->closeInFlight) {
+      sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe *close = ring.nextSqe();
+      close->opcode = IORING_OP_CLOSE;
+      close->fd = uc->conn.fd;
+      close->user_data = userData(uc, OP_CLOSE);
+      uc->closeInFlight = true;
+    }
+    return;
+  }
+
+  if (!uc->closing || uc->receiving || awaiting || uc->sendInFlight ||
+      uc->closeInFlight)
+    return;
+
+  if (!uc->closed) {
+    io_uring_sqe *close = ring.nextSqe();
+    close->opcode = IORING_OP_CLOSE;
+    close->fd = uc->conn.fd;
+    close->user_data = userData(uc, OP_CLOSE);
+    uc->closeInFlight = true;
+    return;
+  }
+
+  if (uc->conn.hasPartialRequest())
+    logMessage(LOG_WARN, "client hung up partway through a request");
+  releaseConnection();
+  delete uc;
+}
+
+// Stop reading from a connection, and close it once its output is sent.
+static void startClosing(Uring &ring, UringConnection *uc) {
+  if (uc->closing)
+    return;
+  uc->closing = true;
+  if (uc->receiving)
+    cancel(ring, uc, OP_RECV);
+}
+
+bool serveUring(const vector<int> &listenfds, RequestHandler handler) {
+  Uring ring;
+  if (!ring.setup())
+    return false;
+
+  ThreadStats &stats = threadStats();
+  for (int listenfd : listenfds)
+    armAccept(ring, listenfd);
+  int watchfd = openWatchMailbox();
+  uint64_t watchCount;
+  armMailbox(ring, watchfd, &watchCount, OP_WATCH);
+  int computefd = openComputeMailbox();
+  uint64_t computeCount;
+  armMailbox(ring, computefd, &computeCount, OP_COMPUTED);
+  vector<Connection *> touched;
+  DeadlineTimers timers;
+  bool timerArmed = false;
+
+  // Everything waiting to go out on a connection, whether it's being sent or
+  // not.
+  auto backedUp = [](UringConnection *uc) {
+    return uc->sendInFlight || uc->sent < uc->sending.size() ||
+           !uc->conn.output.empty();
+  };
+
+  while (true) {
+    ring.submit(1);
+    Clock::time_point now = Clock::now();
+
+    ring.reap([&](const io_uring_cqe &cqe) {
+      UringConnection *uc =
+          (UringConnection *)(uintptr_t)(cqe.user_data & ~OP_MASK);
+      bool more = cqe.flags & IORING_CQE_F_MORE;
+
+      switch (cqe.user_data & OP_MASK) {
+      case OP_ACCEPT:
+        if (cqe.res >= 0 && admitConnection(cqe.res)) {
+          logMessage(LOG_DEBUG, "accepted connection on fd %d", cqe.res);
+          UringConnection *accepted = new UringConnection(cqe.res);
+          accepted->conn.owner = accepted;
+          armRecv(ring, accepted);
+          timers.update(accepted->conn, false, true, now);
+        } else if (cqe.res < 0) {
+          logMessage(LOG_WARN, "accept failed: %s", strerror(-cqe.res));
+        }
+        if (!more)
+          armAccept(ring, (int)(cqe.user_data / (OP_MASK + 1)));
+        return;
+
+      case OP_WATCH:
+      case OP_COMPUTED:
+        touched.clear();
+        if ((cqe.user_data & OP_MASK) == OP_WATCH) {
+          deliverWatchEvents(touched);
+          armMailbox(ring, watchfd, &watchCount, OP_WATCH);
+        } else {
+          deliverComputed(touched);
+          armMailbox(ring, computefd, &computeCount, OP_COMPUTED);
+        }
+        for (Connection *conn : touched) {
+          UringConnection *given = (UringConnection *)conn->owner;
+          if (!given->broken)
+            timers.update(*conn, backedUp(given), false, now);
+          progress(ring, given);
+        }
+        return;
+
+      case OP_TIMER:
+        timerArmed = false;
+        return;
+
+      case OP_RECV:
+        if (!more)
+          uc->receiving = false;
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+          unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+          stats.bytesIn.add(cqe.res);
+          if (!uc->closing) {
+            int status = handleReceived(uc->conn, ring.buffer(id), cqe.res,
+                                        handler, now);
+            if (status < 0)
+              logMessage(LOG_WARN, "malformed request; closing connection");
+            if (status <= 0)
+              startClosing(ring, uc);
+          }
+          ring.recycleBuffer(id);
+          if (!uc->receiving && !uc->closing)
+            armRecv(ring, uc);
+        } else if (cqe.res == -ENOBUFS) {
+          // We ran out of buffers, but handing them back is the first thing
+          // we do with them, so there are more now.
+          if (!uc->receiving && !uc->closing)
+            armRecv(ring, uc);
+        } else {
+          // The client hung up, the receive was cancelled, or it failed.
+          startClosing(ring, uc);
+        }
+        break;
+
+      case OP_SEND:
+        uc->sendInFlight = false;
+        if (cqe.res < 0) {
+          uc->broken = true;
+          startClosing(ring, uc);
+        } else {
+          stats.bytesOut.add(cqe.res);
+          uc->sent += cqe.res;
+          if (uc->sent >= uc->sending.size()) {
+            uc->sending.clear();
+            uc->sent = 0;
+          }
+        }
+        break;
+
+      case OP_CLOSE:
+        // A close linked to a send that failed or came up short is cancelled,
+        // and tried again once the send's sorted out.
+        uc->closeInFlight = false;
+        if (cqe.res != -ECANCELED)
+          uc->closed = true;
+        break;
+
+      default:
+        return;
+      }
+
+      // Anything but a failure is progress, except that while output's
+      // backed up, only sending it is: receives carry on meanwhile. The
+      // connection's deadline is set before it's moved along, since that may
+      // be the end of it. A broken connection is only being torn down.
+      bool backlog = backedUp(uc);
+      if (!uc->broken)
+        timers.update(uc->conn, backlog,
+                      cqe.res > 0 &&
+                          (!backlog || (cqe.user_data & OP_MASK) == OP_SEND),
+                      now);
+      progress(ring, uc);
+    });
+
+    // A stalled send is cancelled, which fails it, and the rest of the
+    // output with it.
+    timers.expire(now, [&](Connection &conn, DeadlineKind kind) {
+      UringConnection *uc = (UringConnection *)conn.owner;
+      logMessage(LOG_INFO, "closing connection on fd %d: %s deadline passed",
+                 conn.fd, deadlineKindName(kind));
+      stats.connectionsTimedOut.add();
+      uc->broken = true;
+      if (uc->sendInFlight)
+        cancel(ring, uc, OP_SEND);
+      startClosing(ring, uc);
+      progress(ring, uc);
+    });
+
+    int timeout = timers.timeout();
+    if (timeout >= 0 && !timerArmed) {
+      armTimer(ring, timeout);
+      timerArmed = true;
+    }
+  }
+}
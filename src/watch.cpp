@@ -0,0 +1,178 @@
+#include "watch.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "log.h"
+#include "mailbox.h"
+#include "protocol.h"
+#include "stats.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+// A change, encoded as the push its watchers are sent.
+struct WatchEvent {
+  string key;
+  string push;
+};
+
+// One thread's watches. They last as long as the process, like the threads
+// that own them.
+struct ThreadWatches {
+  Mailbox<shared_ptr<const WatchEvent>> events{"watch"};
+
+  // Only the owning thread touches these: the ids of the connections watching
+  // each variable, and the variables each connection's watching, by key.
+  unordered_map<string, vector<uint64_t>> watchers;
+  unordered_map<uint64_t, vector<string>> watching;
+};
+
+// A shard of the registry: the threads with a watcher of each variable, by
+// key.
+struct RegistryShard {
+  mutex lock;
+  unordered_map<string, vector<ThreadWatches *>> threads;
+};
+
+const size_t REGISTRY_SHARDS = 16;
+static RegistryShard registry[REGISTRY_SHARDS];
+
+// The number of variables in the registry. While it's 0, changes aren't even
+// looked up.
+static std::atomic<size_t> watchedNames{0};
+
+static thread_local ThreadWatches *local = nullptr;
+
+// What a variable's watches are kept under: its keyspace's four bytes, then
+// its name.
+static string watchKey(uint32_t keyspace, const string &name) {
+  string key((const char *)&keyspace, sizeof(keyspace));
+  key += name;
+  return key;
+}
+
+static RegistryShard &shardFor(const string &key) {
+  return registry[std::hash<string>()(key) % REGISTRY_SHARDS];
+}
+
+int openWatchMailbox() {
+  if (local == nullptr)
+    local = new ThreadWatches;
+  return local->events.fd;
+}
+
+bool watchVariable(Connection &conn, uint32_t keyspace, const string &name) {
+  if (local == nullptr)
+    return false;
+  string key = watchKey(keyspace, name);
+  vector<string> &keys = local->watching[conn.id];
+  if (std::find(keys.begin(), keys.end(), key) != keys.end())
+    return true;
+  keys.push_back(key);
+
+  // Only the thread's first watcher of a variable puts the thread on the
+  // list.
+  vector<uint64_t> &ids = local->watchers[key];
+  ids.push_back(conn.id);
+  if (ids.size() == 1) {
+    RegistryShard &shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    vector<ThreadWatches *> &threads = shard.threads[key];
+    if (threads.empty())
+      watchedNames.fetch_add(1);
+    threads.push_back(local);
+  }
+  return true;
+}
+
+bool hasWatches(uint64_t id) {
+  return local != nullptr && local->watching.count(id) != 0;
+}
+
+void forgetWatches(uint64_t id) {
+  if (local == nullptr)
+    return;
+  auto found = local->watching.find(id);
+  if (found == local->watching.end())
+    return;
+
+  for (const string &key : found->second) {
+    auto watchers = local->watchers.find(key);
+    vector<uint64_t> &ids = watchers->second;
+    *std::find(ids.begin(), ids.end(), id) = ids.back();
+    ids.pop_back();
+    if (!ids.empty())
+      continue;
+
+    // That was the thread's last watcher of the variable.
+    local->watchers.erase(watchers);
+    RegistryShard &shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto listed = shard.threads.find(key);
+    vector<ThreadWatches *> &threads = listed->second;
+    *std::find(threads.begin(), threads.end(), local) = threads.back();
+    threads.pop_back();
+    if (threads.empty()) {
+      shard.threads.erase(listed);
+      watchedNames.fetch_sub(1);
+    }
+  }
+  local->watching.erase(found);
+}
+
+void deliverWatchEvents(vector<Connection *> &touched) {
+  if (local == nullptr)
+    return;
+  vector<shared_ptr<const WatchEvent>> events = local->events.take();
+
+  ThreadStats &stats = threadStats();
+  size_t first = touched.size();
+  for (const shared_ptr<const WatchEvent> &event : events) {
+    // Its last watcher here may have gone since it was posted.
+    auto found = local->watchers.find(event->key);
+    if (found == local->watchers.end())
+      continue;
+    const string &push = event->push;
+    for (uint64_t id : found->second) {
+      Connection *conn = Connection::find(id);
+      if (conn == nullptr)
+        continue;
+      if (conn->output.size() > WATCH_MAX_BACKLOG) {
+        stats.watchPushesDropped.add();
+        continue;
+      }
+      conn->queuePush(push);
+      stats.watchPushes.add();
+      touched.push_back(conn);
+    }
+  }
+
+  // A connection watching several of the variables that changed was added
+  // once for each.
+  std::sort(touched.begin() + first, touched.end());
+  touched.erase(std::unique(touched.begin() + first, touched.end()),
+                touched.end());
+}
+
+void publishChange(uint32_t keyspace, const string &name, uint64_t version,
+                   const char *value, size_t length) {
+  if (watchedNames.load(std::memory_order_relaxed) == 0)
+    return;
+  string key = watchKey(keyspace, name);
+  RegistryShard &shard = shardFor(key);
+  lock_guard<mutex> guard(shard.lock);
+  auto found = shard.threads.find(key);
+  if (found == shard.threads.end())
+    return;
+  shared_ptr<const WatchEvent> event(
+      new WatchEvent{key, encodePush(name, version, value, length)});
+  for (ThreadWatches *watches : found->second)
+    watches->events.post(event);
+}
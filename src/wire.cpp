@@ -0,0 +1,204 @@
+#include "wire.h"
+
+using wire::Bytes;
+using wire::text;
+
+size_t encodeClientSet(const ClientSet *message, char *out, size_t capacity) {
+  return wire::SetCodec::encode(out, capacity, message->pre.secretKey,
+                                message->pre.msgType, text(message->varName),
+                                Bytes{message->value, message->length});
+}
+
+size_t encodeClientSetTtl(const ClientSetTtl *message, char *out,
+                          size_t capacity) {
+  return wire::SetTtlCodec::encode(out, capacity, message->pre.secretKey,
+                                   message->pre.msgType, text(message->varName),
+                                   message->ttlMs,
+                                   Bytes{message->value, message->length});
+}
+
+size_t encodeClientGet(const ClientGet *message, char *out, size_t capacity) {
+  return wire::GetCodec::encode(out, capacity, message->pre.secretKey,
+                                message->pre.msgType, text(message->varName));
+}
+
+size_t encodeClientIncr(const ClientIncr *message, char *out,
+                        size_t capacity) {
+  return wire::IncrCodec::encode(out, capacity, message->pre.secretKey,
+                                 message->pre.msgType, text(message->varName),
+                                 (int64_t)message->delta);
+}
+
+size_t encodeClientCas(const ClientCas *message, char *out, size_t capacity) {
+  if (message->expectedLength > MAX_VALUE_LENGTH ||
+      message->length > MAX_VALUE_LENGTH)
+    return 0;
+  char values[2 * MAX_VALUE_LENGTH];
+  memcpy(values, message->expected, message->expectedLength);
+  memcpy(&values[message->expectedLength], message->value, message->length);
+  return wire::CasCodec::encode(
+      out, capacity, message->pre.secretKey, message->pre.msgType,
+      text(message->varName), message->expectedLength,
+      Bytes{values, (size_t)message->expectedLength + message->length});
+}
+
+size_t encodeClientScan(const ClientScan *message, char *out,
+                        size_t capacity) {
+  return wire::ScanCodec::encode(out, capacity, message->pre.secretKey,
+                                 message->pre.msgType, text(message->prefix),
+                                 text(message->cursor), message->count);
+}
+
+size_t encodeClientWatch(const ClientWatch *message, char *out,
+                         size_t capacity) {
+  return wire::WatchCodec::encode(out, capacity, message->pre.secretKey,
+                                  message->pre.msgType, text(message->varName));
+}
+
+size_t encodeClientDigest(const ClientDigest *message, char *out,
+                          size_t capacity) {
+  return wire::DigestCodec::encode(out, capacity, message->pre.secretKey,
+                                   message->pre.msgType,
+                                   Bytes{message->value, message->length});
+}
+
+size_t encodeClientRun(const ClientRun *message, char *out, size_t capacity) {
+  return wire::RunCodec::encode(out, capacity, message->pre.secretKey,
+                                message->pre.msgType, text(message->request));
+}
+
+size_t encodeClientPreamble(const ClientPreamble *message, char *out,
+                            size_t capacity) {
+  return wire::PreambleCodec::encode(out, capacity, message->secretKey,
+                                     message->msgType);
+}
+
+// Failed responses never carry data, so whether there's more to a response
+// than its status depends on the status.
+static bool hasData(const char *buf, int withData) {
+  signed char status;
+  wire::Field<wire::Int8>::get(buf, status);
+  return withData && status >= 0;
+}
+
+int responseFrameLength(const char *buf, size_t len, int withData) {
+  if (len < wire::StatusCodec::fixedSize || !hasData(buf, withData))
+    return wire::StatusCodec::frameLength(buf, len);
+  return wire::ResponseCodec::frameLength(buf, len);
+}
+
+int decodeResponse(const char *buf, size_t len, int withData, char *status,
+                   const char **data, size_t *dataLength) {
+  signed char code;
+  Bytes payload{nullptr, 0};
+  int total;
+  if (len < wire::StatusCodec::fixedSize || !hasData(buf, withData))
+    total = wire::StatusCodec::decode(buf, len, code);
+  else
+    total = wire::ResponseCodec::decode(buf, len, code, payload);
+
+  if (total > 0) {
+    *status = code;
+    *data = payload.data;
+    *dataLength = payload.length;
+  }
+  return total;
+}
+
+int watchFrameLength(const char *buf, size_t len) {
+  signed char status;
+  if (len < wire::StatusCodec::fixedSize)
+    return wire::StatusCodec::frameLength(buf, len);
+  wire::Field<wire::Int8>::get(buf, status);
+  if (status == SERVER_PUSH_STATUS)
+    return wire::PushCodec::frameLength(buf, len);
+  return wire::StatusCodec::frameLength(buf, len);
+}
+
+int decodePush(const char *buf, size_t len, char *name,
+               unsigned long long *version, const char **value,
+               size_t *valueLength) {
+  signed char status;
+  Bytes varName, payload;
+  int64_t pushed;
+  int total = wire::PushCodec::decode(buf, len, status, varName, pushed,
+                                      payload);
+  if (total <= 0)
+    return total;
+  if (status != SERVER_PUSH_STATUS)
+    return -1;
+  memcpy(name, varName.data, varName.length);
+  name[varName.length] = '\0';
+  *version = (unsigned long long)pushed;
+  *value = payload.data;
+  *valueLength = payload.length;
+  return total;
+}
+
+size_t encodeFrameV2(unsigned int requestId, const char *request,
+                     size_t length, char *out, size_t capacity) {
+  uint32_t key;
+  uint16_t type;
+  if (length < CLIENT_PREAMBLE_SIZE ||
+      wire::PreambleCodec::decode(request, length, key, type) <= 0)
+    return 0;
+  size_t bodyLength = length - CLIENT_PREAMBLE_SIZE;
+  size_t header = wire::FrameV2Codec::encode(
+      out, capacity, key, type, (uint8_t)FRAME_VERSION_2, requestId,
+      (uint32_t)bodyLength);
+  if (header == 0 || capacity - header < bodyLength)
+    return 0;
+  memcpy(&out[header], &request[CLIENT_PREAMBLE_SIZE], bodyLength);
+  return header + bodyLength;
+}
+
+// Whether the frame at `buf`, of which at least the status and version have
+// arrived, is a version 2 one.
+static bool isV2(const char *buf) {
+  uint8_t version;
+  wire::Field<wire::Uint8>::get(&buf[1], version);
+  return version == FRAME_VERSION_2;
+}
+
+int responseV2FrameLength(const char *buf, size_t len) {
+  if (len < wire::StatusCodec::fixedSize || !isV2(buf))
+    return wire::StatusCodec::frameLength(buf, len);
+  if (len < wire::ResponseV2Codec::fixedSize)
+    return wire::ResponseV2Codec::fixedSize;
+  signed char status;
+  uint8_t version;
+  uint32_t requestId, dataLength;
+  wire::ResponseV2Codec::Fields::get(buf, status, version, requestId,
+                                     dataLength);
+  if (dataLength > MAX_STATS_LENGTH)
+    return -1;
+  return wire::ResponseV2Codec::fixedSize + dataLength;
+}
+
+int decodeResponseV2(const char *buf, size_t len, char *status,
+                     unsigned int *requestId, const char **data,
+                     size_t *dataLength) {
+  int total = responseV2FrameLength(buf, len);
+  if (total < 0)
+    return -1;
+  if (len < (size_t)total)
+    return 0;
+
+  signed char code;
+  if (!isV2(buf)) {
+    wire::StatusCodec::decode(buf, len, code);
+    *status = code;
+    *requestId = 0;
+    *data = nullptr;
+    *dataLength = 0;
+    return total;
+  }
+  uint8_t version;
+  uint32_t id, length;
+  wire::ResponseV2Codec::Fields::get(buf, code, version, id, length);
+  *status = code;
+  *requestId = id;
+  *data = &buf[wire::ResponseV2Codec::fixedSize];
+  *dataLength = length;
+  return total;
+}